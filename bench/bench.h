@@ -0,0 +1,246 @@
+/*
+    Benchmark drivers
+
+    Each driver #includes this file, which brings in cs1550.c (and through
+    it every module), and calls the FUSE handlers directly, the way libfuse
+    would. A driver that defines BENCH_LOWLEVEL first gets cs1550ll.c as
+    well, and mounts through its handlers (it still gets cs1550.c's
+    handlers by path, to set up what it measures). A driver makes its own images
+    with cs1550mkfs in the current directory (run.sh runs each one in a
+    scratch directory).
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                     /* FALLOC_FL_*, as in cs1550disk.c */
+#endif
+
+#ifdef BENCH_LOWLEVEL
+#define CS1550_PATH_HANDLERS            /* which cs1550ll.c would leave out */
+#define main cs1550ll_main              /* cs1550ll.c brings its own main() */
+#include "cs1550ll.c"
+#else
+#define main cs1550_main                /* cs1550.c brings its own main() */
+#include "cs1550.c"
+#endif
+#undef main
+
+#include <stdarg.h>
+#include <sys/wait.h>
+
+#ifndef MKFS
+#define MKFS "../src/cs1550mkfs"        /* set to an absolute path by the Makefile */
+#endif
+
+
+/*
+    Seconds since some fixed point, for timing.
+*/
+static inline double bench_now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+    Makes a fresh '.disk' in the current directory, passing the printf
+    style arguments to cs1550mkfs (e.g. "-s 64M -b 4096 -f extents").
+    Exits if it can not.
+*/
+static inline void bench_mkfs(const char *format, ...) {
+
+    char args[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(args, sizeof(args), format, ap);
+    va_end(ap);
+
+    char command[PATH_MAX + 300];
+    snprintf(command, sizeof(command), "rm -f " DISK " && %s %s " DISK " >/dev/null", MKFS, args);
+    int status = system(command);
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "bench: %s failed\n", command);
+        exit(1);
+    }
+}
+
+
+/*
+    Mounts '.disk' as cs1550 (or cs1550ll) would: init, with whatever was
+    set in options.
+*/
+static inline void bench_mount(void) {
+
+#ifdef BENCH_LOWLEVEL
+    ll_init(NULL, NULL);
+#else
+    cs1550_init(NULL);
+#endif
+}
+
+
+/*
+    Unmounts '.disk', and forgets the maps and the bitmap so that the next
+    bench_mount() reads everything from the image again.
+*/
+static inline void bench_unmount(void) {
+
+#ifdef BENCH_LOWLEVEL
+    ll_destroy(NULL);
+#else
+    cs1550_destroy(NULL);
+#endif
+
+    int i;
+    for (i = 0; i < BLOCK_MAP_BUCKETS; i++) { block_maps[i] = NULL; }
+    free(map);
+    map = NULL;
+}
+
+
+/*
+    readdir filler that only counts the names, in the long buf points at.
+*/
+static inline int bench_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+
+    (void) name;
+    (void) stbuf;
+    (void) off;
+
+    if (buf != NULL) { (*(long*)buf)++; }
+
+    return 0;
+}
+
+
+/*
+    Sorts n samples, for bench_percentile().
+*/
+static inline int bench_compare(const void *a, const void *b) {
+
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static inline void bench_sort(double *v, long n) {
+
+    qsort(v, n, sizeof(double), bench_compare);
+}
+
+
+/*
+    Returns the p'th percentile (0 to 100) of the n samples in v, which
+    bench_sort() has sorted.
+*/
+static inline double bench_percentile(const double *v, long n, double p) {
+
+    return v[(long)(p / 100.0 * (n - 1) + 0.5)];
+}
+
+
+#ifdef BENCH_LOWLEVEL
+
+// What a low-level handler replied: the fuse_reply_*() below stand in for libfuse's
+struct fuse_req
+{
+    int err;                                // the error replied, 0 for anything else
+    struct fuse_entry_param e;              // fuse_reply_entry()
+    struct stat attr;                       // fuse_reply_attr()
+    double timeout;                         // and for how long it holds
+    struct fuse_file_info fi;               // fuse_reply_open()
+    const char *buf;                        // fuse_reply_buf(), valid until the next request
+    size_t size;                            // bytes of fuse_reply_buf() or fuse_reply_data()
+};
+
+// The kernel's directory entry, as fuse_add_direntry() lays it out
+struct bench_dirent
+{
+    uint64_t ino;
+    uint64_t off;
+    uint32_t namelen;
+    uint32_t type;
+    char name[];
+};
+
+static struct fuse_req bench_req;       /* the request being answered */
+static long bench_requests = 0;         /* requests made with bench_new_req() */
+
+int fuse_reply_err(fuse_req_t req, int err) { req->err = err; return 0; }
+void fuse_reply_none(fuse_req_t req) { req->err = 0; }
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) { req->e = *e; return 0; }
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double timeout) {
+    req->attr = *attr;
+    req->timeout = timeout;
+    return 0;
+}
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) { req->fi = *fi; return 0; }
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) { req->buf = buf; req->size = size; return 0; }
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags) {
+    (void) flags;
+    req->size = fuse_buf_size(bufv);        // the data itself is dropped
+    return 0;
+}
+
+
+/*
+    Starts a new request, and counts it.
+*/
+static inline fuse_req_t bench_new_req(void) {
+
+    memset(&bench_req, 0, sizeof(bench_req));
+    bench_requests++;
+
+    return &bench_req;
+}
+
+
+/*
+    Lists directory dir through the low-level handlers, as the kernel
+    does: opendir, readdir a page at a time, releasedir. Calls each with
+    every name but . and .. as it goes.
+
+    RETURNS:    the number of names, or -1 if dir could not be opened
+*/
+static inline long bench_list(fuse_ino_t dir, void (*each)(fuse_ino_t dir, const char *name)) {
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    ll_opendir(bench_new_req(), dir, &fi);
+    if (bench_req.err != 0) { return -1; }
+    fi = bench_req.fi;
+
+    long names = 0;
+    off_t off = 0;
+    for (;;) {
+        ll_readdir(bench_new_req(), dir, 4096, off, &fi);
+        if (bench_req.size == 0) { break; }
+
+        // the page is only valid until the next request: keep it
+        static char page[4096];
+        size_t size = bench_req.size, pos = 0;
+        memcpy(page, bench_req.buf, size);
+        while (pos + sizeof(struct bench_dirent) <= size) {
+            struct bench_dirent *d = (struct bench_dirent*)(page + pos);
+            size_t length = (sizeof(struct bench_dirent) + d->namelen + 7) & ~(size_t)7;
+            if (pos + length > size) { break; }     // cut off: asked for again from the last whole one
+
+            char name[MAX_LENGTH];
+            snprintf(name, sizeof(name), "%.*s", (int)d->namelen, d->name);
+            off = d->off;
+            pos += length;
+
+            if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) { continue; }
+            each(dir, name);
+            names++;
+        }
+    }
+
+    ll_releasedir(bench_new_req(), dir, &fi);
+
+    return names;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+    Block allocation throughput at different fill levels (user-004)
+
+    Fills the bitmap of a 1 GB image with 512-byte blocks (two million
+    bits) from the front to 10%, 50%, 90% and 99% USED, as an image that
+    has been written front to back is, then allocates blocks with
+    find_free_block() in batches of BATCH. After each batch (untimed) as
+    many USED blocks picked at random are freed, so that the fill stays
+    put. It prints the time per allocation, and the same for the scan
+    find_free_block() used to make: get_bit() on one block after another,
+    from the first every time.
+*/
+#include "bench.h"
+
+#define BATCH       100                 /* allocations timed at once */
+#define SECONDS     0.5                 /* time spent at each fill level and scan */
+
+
+/*
+    find_free_block() as it was: get_bit() on one block after another.
+*/
+static int bit_at_a_time(void) {
+
+    int index;
+    for (index = map_first; index < map_end; index++) {
+        if (!get_bit(index)) {
+            set_bit(index);
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+    Runs allocate with the bitmap fill (0 to 1) USED.
+
+    RETURNS:    nanoseconds per allocation
+*/
+static double run(double fill, int (*allocate)(void)) {
+
+    int index;
+    int filled = map_first + (int)(fill * (map_end - map_first));
+    for (index = map_first; index < map_end; index++) {
+        int used = get_bit(index);
+        if (used && (index >= filled)) { clear_bit(index); }
+        if (!used && (index < filled)) { set_bit(index); }
+    }
+    alloc_cursor = filled;
+
+    long allocations = 0;
+    double spent = 0;
+    while (spent < SECONDS) {
+        double start = bench_now();
+        int i;
+        for (i = 0; i < BATCH; i++) {
+            if (allocate() < 0) { break; }
+        }
+        spent += bench_now() - start;
+        allocations += i;
+
+        // give back as many, anywhere, to keep the fill where it was
+        for (; i > 0; i--) {
+            do { index = map_first + rand() % (map_end - map_first); } while (!get_bit(index));
+            clear_bit(index);
+        }
+    }
+
+    return spent * 1e9 / allocations;
+}
+
+
+int main(void)
+{
+    double fills[] = { 0.10, 0.50, 0.90, 0.99 };
+    int k;
+
+    bench_mkfs("-s 1G -b 512 -j 0");
+    options.cache_blocks = 0;
+    bench_mount();
+    srand(1);
+
+    printf("%d blocks\n", map_end - map_first);
+    printf("fill    word scan       bit scan\n");
+    for (k = 0; k < 4; k++) {
+        double words = run(fills[k], find_free_block);
+        double bits = run(fills[k], bit_at_a_time);
+        printf("%3.0f%%  %8.1f ns  %11.1f ns\n", fills[k] * 100, words, bits);
+    }
+
+    return 0;                           // the image, USED bits and all, is thrown away
+}
@@ -0,0 +1,77 @@
+/*
+    Sequential throughput against block size (user-012)
+
+    For blocks of 512 bytes, 4K and 64K, writes a 64 MB file to a fresh
+    image in 128K requests and fsyncs it, then remounts and reads it back
+    in 128K requests. It prints the rate of each, with the default block
+    cache, in both layouts. Bigger blocks mean fewer blocks to allocate,
+    map and transfer per megabyte; that counts most in the chain layout,
+    which moves every block on its own.
+*/
+#include "bench.h"
+
+#define FILE_SIZE   (64L * 1024 * 1024) /* bytes in the file */
+#define REQUEST     (128 * 1024)        /* bytes in each read and write */
+
+
+/*
+    Writes and reads back the file on an image of the given layout with
+    block_size blocks.
+*/
+static void run(const char *format, long block_size) {
+
+    static char buf[REQUEST];
+    struct fuse_file_info fi;
+    long off;
+
+    bench_mkfs("-s 256M -b %ld -f %s", block_size, format);
+    options.cache_blocks = -1;
+    bench_mount();
+    cs1550_mkdir("/d", 0755);
+    cs1550_mknod("/d/f", S_IFREG | 0644, 0);
+
+    memset(buf, 'x', sizeof(buf));
+    double start = bench_now();
+    memset(&fi, 0, sizeof(fi));
+    cs1550_open("/d/f", &fi);
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        if (cs1550_write("/d/f", buf, REQUEST, off, &fi) != REQUEST) {
+            fprintf(stderr, "blocksize: write at %ld failed\n", off);
+            exit(1);
+        }
+    }
+    cs1550_fsync("/d/f", 0, &fi);
+    cs1550_release("/d/f", &fi);
+    double written = bench_now() - start;
+    bench_unmount();
+
+    bench_mount();
+    start = bench_now();
+    memset(&fi, 0, sizeof(fi));
+    cs1550_open("/d/f", &fi);
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        if (cs1550_read("/d/f", buf, REQUEST, off, &fi) != REQUEST) {
+            fprintf(stderr, "blocksize: read at %ld failed\n", off);
+            exit(1);
+        }
+    }
+    cs1550_release("/d/f", &fi);
+    double read = bench_now() - start;
+    bench_unmount();
+
+    printf("%-8s %6ld   write %7.1f MB/s   read %7.1f MB/s\n", format, block_size,
+        FILE_SIZE / 1048576.0 / written, FILE_SIZE / 1048576.0 / read);
+}
+
+
+int main(void)
+{
+    run("chain", 512);
+    run("chain", 4096);
+    run("chain", 65536);
+    run("extents", 512);
+    run("extents", 4096);
+    run("extents", 65536);
+
+    return 0;
+}
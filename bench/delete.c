@@ -0,0 +1,102 @@
+/*
+    Delete latency for 1 MB and 1 GB files (user-024)
+
+    On a fresh 2 GB image with 4K blocks, in both layouts, writes a file
+    in 128K requests and fsyncs it, then times
+
+        unlink      cs1550_unlink() of the file;
+        truncate    cs1550_truncate() of the file to 0 bytes;
+
+    and, after each, how long it then takes until the file's blocks are
+    FREE again: reclaim_space() frees whatever the background thread has
+    not yet, and commits. The request returns as soon as the file is
+    put on the orphan list, so its time does not grow with the file's size;
+    the reclaim does. 1 MB files are timed ROUNDS times and averaged.
+*/
+#include "bench.h"
+
+#define REQUEST     (128 * 1024)        /* bytes in each write */
+#define ROUNDS      10                  /* deletes of the 1 MB file, averaged */
+
+
+/*
+    Makes /d/f, size bytes long, and fsyncs it.
+*/
+static void make(long size) {
+
+    static char buf[REQUEST];
+    struct fuse_file_info fi;
+    long off;
+
+    memset(buf, 'x', sizeof(buf));
+    cs1550_mknod("/d/f", S_IFREG | 0644, 0);
+    memset(&fi, 0, sizeof(fi));
+    cs1550_open("/d/f", &fi);
+    for (off = 0; off < size; off += REQUEST) {
+        if (cs1550_write("/d/f", buf, REQUEST, off, &fi) != REQUEST) {
+            fprintf(stderr, "delete: write at %ld failed\n", off);
+            exit(1);
+        }
+    }
+    cs1550_fsync("/d/f", 0, &fi);
+    cs1550_release("/d/f", &fi);
+}
+
+
+/*
+    Times deleting (unlink) or emptying (truncate) a file of size bytes,
+    rounds times, and prints the averages.
+*/
+static void run(const char *format, long size, int rounds) {
+
+    double unlinked = 0, unlink_freed = 0, truncated = 0, truncate_freed = 0;
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        make(size);
+        double start = bench_now();
+        if (cs1550_unlink("/d/f") != 0) {
+            fprintf(stderr, "delete: unlink failed\n");
+            exit(1);
+        }
+        unlinked += bench_now() - start;
+        start = bench_now();
+        reclaim_space(super.nBlocks);
+        unlink_freed += bench_now() - start;
+
+        make(size);
+        start = bench_now();
+        if (cs1550_truncate("/d/f", 0) != 0) {
+            fprintf(stderr, "delete: truncate failed\n");
+            exit(1);
+        }
+        truncated += bench_now() - start;
+        start = bench_now();
+        reclaim_space(super.nBlocks);
+        truncate_freed += bench_now() - start;
+        cs1550_unlink("/d/f");
+        reclaim_space(super.nBlocks);
+    }
+
+    printf("%-8s %5ldM   unlink %7.3f ms  reclaim %8.2f ms   truncate %7.3f ms  reclaim %8.2f ms\n",
+        format, size / (1024 * 1024), unlinked * 1e3 / rounds, unlink_freed * 1e3 / rounds,
+        truncated * 1e3 / rounds, truncate_freed * 1e3 / rounds);
+}
+
+
+int main(void)
+{
+    const char *formats[] = { "chain", "extents" };
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        bench_mkfs("-s 2G -b 4096 -f %s", formats[k]);
+        bench_mount();
+        cs1550_mkdir("/d", 0755);
+        run(formats[k], 1024L * 1024, ROUNDS);
+        run(formats[k], 1024L * 1024 * 1024, 1);
+        bench_unmount();
+    }
+
+    return 0;
+}
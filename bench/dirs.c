@@ -0,0 +1,96 @@
+/*
+    Creating and finding 100,000 directories (user-014)
+
+    Makes 100,000 directories in the root of a fresh image, timing each
+    mkdir, then looks every one up again in a random order, both through
+    find_directory() and through getattr, and prints the percentiles of
+    each. It also times a readdir of "/" and a remount, which builds the
+    name index from the root blocks. Lookups through the index take the
+    same time however many directories there are.
+*/
+#include "bench.h"
+
+#define NDIRS       100000              /* directories made */
+
+
+/*
+    Sorts the n times in seconds and prints their percentiles in
+    microseconds.
+*/
+static void report(const char *label, double *times, long n) {
+
+    bench_sort(times, n);
+    printf("%-14s p50 %6.2f us   p90 %6.2f us   p99 %6.2f us   p99.9 %7.2f us   max %8.2f us\n",
+        label, bench_percentile(times, n, 50) * 1e6, bench_percentile(times, n, 90) * 1e6,
+        bench_percentile(times, n, 99) * 1e6, bench_percentile(times, n, 99.9) * 1e6,
+        times[n - 1] * 1e6);
+}
+
+
+int main(void)
+{
+    static double times[NDIRS];
+    static int order[NDIRS];
+    char path[64];
+    struct stat st;
+    int i;
+
+    bench_mkfs("-s 256M -b 512");
+    bench_mount();
+
+    for (i = 0; i < NDIRS; i++) {
+        snprintf(path, sizeof(path), "/d%d", i);
+        double start = bench_now();
+        int res = cs1550_mkdir(path, 0755);
+        times[i] = bench_now() - start;
+        if (res != 0) {
+            fprintf(stderr, "dirs: mkdir %s failed (%d)\n", path, res);
+            return 1;
+        }
+    }
+    report("mkdir", times, NDIRS);
+
+    // a random order, so that lookups do not follow the order of creation
+    srand(1);
+    for (i = 0; i < NDIRS; i++) { order[i] = i; }
+    for (i = NDIRS - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    for (i = 0; i < NDIRS; i++) {
+        char name[MAX_FILENAME + 1];
+        snprintf(name, sizeof(name), "d%d", order[i]);
+        double start = bench_now();
+        long block = find_directory(name);
+        times[i] = bench_now() - start;
+        if (block <= 0) {
+            fprintf(stderr, "dirs: %s not found\n", name);
+            return 1;
+        }
+    }
+    report("find_directory", times, NDIRS);
+
+    for (i = 0; i < NDIRS; i++) {
+        snprintf(path, sizeof(path), "/d%d", order[i]);
+        double start = bench_now();
+        cs1550_getattr(path, &st);
+        times[i] = bench_now() - start;
+    }
+    report("getattr", times, NDIRS);
+
+    long names = 0;
+    double start = bench_now();
+    cs1550_readdir("/", &names, bench_fill, 0, NULL);
+    printf("readdir /      %ld names in %.1f ms\n", names, (bench_now() - start) * 1e3);
+    bench_unmount();
+
+    start = bench_now();
+    bench_mount();
+    printf("mount          %.1f ms\n", (bench_now() - start) * 1e3);
+    bench_unmount();
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+    Requests that reach the filesystem with kernel caching (user-022)
+
+    Runs four workloads through a model of the kernel's caches in front of
+    the low-level handlers, and counts the requests that get through, with
+    cache_timeout 0, 1 and 10:
+
+        stat        100 files stat'ed 100 times over, one every millisecond;
+        miss        the same with 100 names that do not exist;
+        ls -l       a directory of 1000 files listed with ls -l 20 times,
+                    0.3 seconds apart;
+        cat         a 1 MB file read through 50 times, 10 ms apart.
+
+    The model keeps what the kernel keeps: names (and, with a timeout,
+    "no such name" answers) for entry_timeout, attributes for attr_timeout,
+    and a file's pages from one open to the next when it is opened with
+    keep_cache and its size has not changed. Time is simulated, so the
+    counts do not depend on the machine.
+*/
+#define BENCH_LOWLEVEL
+#include "bench.h"
+
+#define SLOTS       4096                /* names (and inodes) the model can keep */
+#define READ_SIZE   (128 * 1024)        /* bytes the kernel asks for in each read */
+
+// A name the kernel knows
+struct kernel_entry
+{
+    int used;
+    fuse_ino_t parent;
+    char name[MAX_LENGTH];
+    fuse_ino_t ino;                         // 0: there is no such name
+    double expires;
+};
+
+// What the kernel knows of an inode
+struct kernel_inode
+{
+    int used;
+    fuse_ino_t ino;
+    double expires;                         // of the attributes
+    off_t size;
+    int cached;                             // are the file's pages in the page cache?
+};
+
+static struct kernel_entry entries[SLOTS];
+static struct kernel_inode inodes[SLOTS];
+static double clock_now = 0;            /* simulated time, in seconds */
+
+
+/*
+    Finds the slot of parent/name (or the empty one it would go in).
+*/
+static struct kernel_entry *find_entry(fuse_ino_t parent, const char *name) {
+
+    unsigned long h = parent * 2654435761UL;
+    const char *c;
+    for (c = name; *c != '\0'; c++) { h = (h ^ (unsigned char)*c) * 16777619UL; }
+
+    struct kernel_entry *e = &entries[h % SLOTS];
+    while (e->used && ((e->parent != parent) || (strcmp(e->name, name) != 0))) {
+        e = (e == &entries[SLOTS - 1]) ? entries : e + 1;
+    }
+
+    return e;
+}
+
+
+/*
+    Finds the slot of ino, claiming an empty one if it has none yet.
+*/
+static struct kernel_inode *find_inode(fuse_ino_t ino) {
+
+    struct kernel_inode *n = &inodes[(ino * 2654435761UL) % SLOTS];
+    while (n->used && (n->ino != ino)) {
+        n = (n == &inodes[SLOTS - 1]) ? inodes : n + 1;
+    }
+    if (!n->used) {
+        n->used = 1;
+        n->ino = ino;
+    }
+
+    return n;
+}
+
+
+/*
+    Takes in a file's attributes, valid for timeout seconds; the kernel
+    drops its pages when the size changes.
+*/
+static void take_attr(fuse_ino_t ino, const struct stat *attr, double timeout) {
+
+    struct kernel_inode *n = find_inode(ino);
+    n->expires = clock_now + timeout;
+    if (n->size != attr->st_size) { n->cached = 0; }
+    n->size = attr->st_size;
+}
+
+
+/*
+    stat() of name in parent, asking only for what the kernel does not
+    have.
+
+    RETURNS:    the inode number, 0 if there is no such name
+*/
+static fuse_ino_t kernel_stat(fuse_ino_t parent, const char *name) {
+
+    struct kernel_entry *e = find_entry(parent, name);
+    if (!e->used || (e->expires <= clock_now)) {
+        ll_lookup(bench_new_req(), parent, name);
+        e->used = 1;
+        e->parent = parent;
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        e->ino = (bench_req.err != 0) ? 0 : bench_req.e.ino;
+        e->expires = clock_now + ((bench_req.err != 0) ? 0 : bench_req.e.entry_timeout);
+        if (e->ino != 0) { take_attr(e->ino, &bench_req.e.attr, bench_req.e.attr_timeout); }
+    }
+    if (e->ino == 0) { return 0; }
+
+    if (find_inode(e->ino)->expires <= clock_now) {
+        ll_getattr(bench_new_req(), e->ino, NULL);
+        take_attr(e->ino, &bench_req.attr, bench_req.timeout);
+    }
+
+    return e->ino;
+}
+
+
+/*
+    ls -l's stat of each name, 0.2 ms apart.
+*/
+static void stat_one(fuse_ino_t dir, const char *name) {
+
+    clock_now += 0.0002;
+    kernel_stat(dir, name);
+}
+
+
+/*
+    cat of name in dir: open, read whatever is not in the page cache,
+    flush and release.
+*/
+static void kernel_cat(fuse_ino_t dir, const char *name) {
+
+    fuse_ino_t ino = kernel_stat(dir, name);
+    struct kernel_inode *n = find_inode(ino);
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    ll_open(bench_new_req(), ino, &fi);
+    fi = bench_req.fi;
+    if (!fi.keep_cache) { n->cached = 0; }
+
+    if (!n->cached) {
+        off_t off;
+        for (off = 0; off < n->size; off += READ_SIZE) { ll_read(bench_new_req(), ino, READ_SIZE, off, &fi); }
+        n->cached = 1;
+    }
+
+    ll_flush(bench_new_req(), ino, &fi);
+    ll_release(bench_new_req(), ino, &fi);
+}
+
+
+/*
+    Runs the workloads with the given cache_timeout on a fresh image.
+*/
+static void run(double timeout) {
+
+    static char data[1024 * 1024];
+    char name[MAX_LENGTH];
+    long counts[4];
+    int i, k;
+
+    bench_mkfs("-s 64M -b 4096");
+    options.cache_timeout = timeout;
+    bench_mount();
+
+    cs1550_mkdir("/d", 0755);
+    for (i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        cs1550_mknod(name, S_IFREG | 0644, 0);
+    }
+    cs1550_write("/d/f0", data, sizeof(data), 0, NULL);
+    flush_all_pending();
+
+    memset(entries, 0, sizeof(entries));
+    memset(inodes, 0, sizeof(inodes));
+    clock_now = 0;
+    fuse_ino_t dir = kernel_stat(FUSE_ROOT_ID, "d");
+
+    bench_requests = 0;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < 100; i++) {
+            clock_now += 0.001;
+            snprintf(name, sizeof(name), "f%d", i);
+            kernel_stat(dir, name);
+        }
+    }
+    counts[0] = bench_requests;
+
+    bench_requests = 0;
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < 100; i++) {
+            clock_now += 0.001;
+            snprintf(name, sizeof(name), "x%d", i);
+            kernel_stat(dir, name);
+        }
+    }
+    counts[1] = bench_requests;
+
+    bench_requests = 0;
+    for (k = 0; k < 20; k++) {
+        clock_now += 0.3;
+        kernel_stat(FUSE_ROOT_ID, "d");
+        bench_list(dir, stat_one);
+    }
+    counts[2] = bench_requests;
+
+    bench_requests = 0;
+    for (k = 0; k < 50; k++) {
+        clock_now += 0.01;
+        kernel_cat(dir, "f0");
+    }
+    counts[3] = bench_requests;
+
+    bench_unmount();
+
+    printf("%5g s    %7ld   %7ld   %7ld   %7ld\n", timeout, counts[0], counts[1], counts[2], counts[3]);
+}
+
+
+int main(void)
+{
+    printf("timeout     stat      miss     ls -l       cat\n");
+    run(0);
+    run(1);
+    run(10);
+
+    return 0;
+}
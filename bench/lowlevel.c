@@ -0,0 +1,113 @@
+/*
+    stat and ls -l through the two front ends (user-021)
+
+    Makes a directory of NFILES files on a fresh image, then times the
+    requests the kernel sends for them through cs1550 (paths) and cs1550ll
+    (inode numbers), with cache_timeout=0 so that none are answered by the
+    kernel:
+
+        stat        one getattr: of the path, or of the inode number the
+                    file was looked up as;
+        ls -l       a listing of the directory, then one lookup for each
+                    name in it (which the path front end answers with a
+                    getattr of the path).
+
+    The replies of the low-level handlers are caught by the fuse_reply_*()
+    of bench.h, which stand in for libfuse's.
+*/
+#define BENCH_LOWLEVEL
+#include "bench.h"
+
+#define NFILES      2000                /* files in the directory */
+#define ROUNDS      20                  /* runs of each, averaged */
+
+
+/*
+    readdir filler that stats each name it is given, as ls -l does
+    through the path front end; buf is the directory's path.
+*/
+static int stat_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+
+    (void) stbuf;
+    (void) off;
+
+    if (name[0] == '.') { return 0; }               // . and ..
+
+    char path[MAX_LENGTH + 2];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", (const char*)buf, name);
+    if (cs1550_getattr(path, &st) != 0) { exit(1); }
+
+    return 0;
+}
+
+
+/*
+    What ls -l does with each name through the low-level front end: a
+    lookup (and, later, a forget).
+*/
+static void lookup_one(fuse_ino_t dir, const char *name) {
+
+    ll_lookup(bench_new_req(), dir, name);
+    if (bench_req.err != 0) { exit(1); }
+    ll_forget(bench_new_req(), bench_req.e.ino, 1);
+}
+
+
+int main(void)
+{
+    static fuse_ino_t inos[NFILES];
+    char path[64];
+    struct stat st;
+    int i, r;
+
+    bench_mkfs("-s 64M -b 4096");
+    options.cache_timeout = 0;
+    bench_mount();
+
+    cs1550_mkdir("/bd", 0755);
+    for (i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof(path), "/bd/f%d.txt", i);
+        cs1550_mknod(path, S_IFREG | 0644, 0);
+    }
+    ll_lookup(bench_new_req(), FUSE_ROOT_ID, "bd");
+    fuse_ino_t dir = bench_req.e.ino;
+    for (i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof(path), "f%d.txt", i);
+        ll_lookup(bench_new_req(), dir, path);
+        if (bench_req.err != 0) { return 1; }
+        inos[i] = bench_req.e.ino;
+    }
+
+    double start = bench_now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < NFILES; i++) {
+            snprintf(path, sizeof(path), "/bd/f%d.txt", i);
+            cs1550_getattr(path, &st);
+        }
+    }
+    double paths = (bench_now() - start) / ROUNDS / NFILES;
+
+    start = bench_now();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < NFILES; i++) { ll_getattr(bench_new_req(), inos[i], NULL); }
+    }
+    double inodes = (bench_now() - start) / ROUNDS / NFILES;
+    printf("stat    path %7.0f ns   inode %7.0f ns   (%.1fx)\n", paths * 1e9, inodes * 1e9, paths / inodes);
+
+    start = bench_now();
+    for (r = 0; r < ROUNDS; r++) { cs1550_readdir("/bd", "/bd", stat_fill, 0, NULL); }
+    paths = (bench_now() - start) / ROUNDS;
+
+    start = bench_now();
+    for (r = 0; r < ROUNDS; r++) {
+        if (bench_list(dir, lookup_one) != NFILES) { return 1; }
+    }
+    inodes = (bench_now() - start) / ROUNDS;
+    printf("ls -l   path %7.2f ms   inode %7.2f ms   (%.1fx, %d files)\n", paths * 1e3, inodes * 1e3,
+        paths / inodes, NFILES);
+
+    bench_unmount();
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Runs the named benchmark drivers (built by `make`), each in a scratch
+# directory of its own so that the images they make are thrown away.
+cd "$(dirname "$0")" || exit 1
+bench=$(pwd)
+status=0
+for name in "$@"; do
+    work=$(mktemp -d)
+    echo "== $name"
+    (cd "$work" && "$bench/$name") || status=1
+    rm -rf "$work"
+done
+
+exit $status
@@ -0,0 +1,69 @@
+/*
+    Sequential read time against file size (user-003)
+
+    Writes files of 64K to 8M on a fresh image with 512-byte blocks, then
+    reads each from start to end in 4K requests, as cat would, and prints
+    the time per read and per megabyte. Offsets are found through the
+    file's block map, so the time per megabyte stays flat as files grow:
+    reading is linear in file size. Walking the chain from the first
+    block for every request made it quadratic.
+
+    Both layouts are run, with the block cache off so that each block
+    read is a pread() of '.disk'.
+*/
+#include "bench.h"
+
+#define REQUEST     4096                /* bytes in each read (and write) */
+#define ROUNDS      3                   /* reads of each file, averaged */
+
+
+/*
+    Writes then reads back files of growing size in one layout.
+*/
+static void run(const char *format) {
+
+    static char buf[REQUEST];
+    char path[64];
+    long size;
+
+    bench_mkfs("-s 64M -b 512 -f %s", format);
+    options.cache_blocks = 0;
+    bench_mount();
+    cs1550_mkdir("/d", 0755);
+
+    printf("%s\n", format);
+    for (size = 64 * 1024; size <= 8 * 1024 * 1024; size *= 2) {
+        snprintf(path, sizeof(path), "/d/f%ld", size);
+        cs1550_mknod(path, S_IFREG | 0644, 0);
+
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        cs1550_open(path, &fi);
+        long off;
+        memset(buf, 'x', sizeof(buf));
+        for (off = 0; off < size; off += REQUEST) { cs1550_write(path, buf, REQUEST, off, &fi); }
+        cs1550_release(path, &fi);
+
+        double start = bench_now();
+        int r;
+        for (r = 0; r < ROUNDS; r++) {
+            cs1550_open(path, &fi);
+            for (off = 0; off < size; off += REQUEST) { cs1550_read(path, buf, REQUEST, off, &fi); }
+            cs1550_release(path, &fi);
+        }
+        double seconds = (bench_now() - start) / ROUNDS;
+
+        printf("  %6ldK   %9.3f ms   %7.3f ms/MB\n", size / 1024, seconds * 1e3,
+            seconds * 1e3 / (size / 1048576.0));
+    }
+    bench_unmount();
+}
+
+
+int main(void)
+{
+    run("chain");
+    run("extents");
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+    Splicing file data against copying it (user-018)
+
+    Writes a 64 MB file to a fresh extents image with 4K blocks, then
+    moves it in 128K requests between the filesystem and a pipe, which
+    stands in for '/dev/fuse', both ways:
+
+        copy        what libfuse does without read_buf and write_buf: a
+                    read() of the pipe into memory and cs1550_write(), or
+                    cs1550_read() into memory and a write() to the pipe;
+        splice      what it does with them: cs1550_write_buf() and
+                    cs1550_read_buf() with the pipe as the buffer, moved
+                    to or from '.disk' by fuse_buf_copy() with
+                    FUSE_BUF_SPLICE_MOVE.
+
+    The pipe is drained into (or fed from) '/dev/null' with splice(), so
+    that only the filesystem's side is copied or not. It prints the rate
+    of each, best of ROUNDS.
+*/
+#include "bench.h"
+
+#define FILE_SIZE   (64L * 1024 * 1024) /* bytes in the file */
+#define REQUEST     (128 * 1024)        /* bytes in each request */
+#define ROUNDS      3                   /* runs of each, the best counted */
+
+static int pipe_fds[2];                 /* the stand-in for '/dev/fuse' */
+static int null_fd;                     /* '/dev/null' */
+
+
+/*
+    Empties the pipe into '/dev/null'.
+*/
+static void drain(size_t size) {
+
+    while (size > 0) {
+        ssize_t moved = splice(pipe_fds[0], NULL, null_fd, NULL, size, 0);
+        if (moved <= 0) { break; }
+        size -= moved;
+    }
+}
+
+
+/*
+    Puts size bytes (zeros) into the pipe from '/dev/zero'.
+*/
+static void fill(int zero_fd, size_t size) {
+
+    while (size > 0) {
+        ssize_t moved = splice(zero_fd, NULL, pipe_fds[1], NULL, size, 0);
+        if (moved <= 0) { break; }
+        size -= moved;
+    }
+}
+
+
+/*
+    Reads the file through memory.
+*/
+static void read_copy(struct fuse_file_info *fi) {
+
+    static char buf[REQUEST];
+    long off;
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        int got = cs1550_read("/d/f", buf, REQUEST, off, fi);
+        if ((got <= 0) || (write(pipe_fds[1], buf, got) != got)) { exit(1); }
+        drain(got);
+    }
+}
+
+
+/*
+    Reads the file with read_buf, splicing from '.disk' into the pipe.
+*/
+static void read_splice(struct fuse_file_info *fi) {
+
+    long off;
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        struct fuse_bufvec *src = NULL;
+        if (cs1550_read_buf("/d/f", &src, REQUEST, off, fi) != 0) { exit(1); }
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(REQUEST);
+        dst.buf[0].flags = FUSE_BUF_IS_FD;
+        dst.buf[0].fd = pipe_fds[1];
+        size_t left = fuse_buf_size(src);
+        while (left > 0) {
+            ssize_t moved = fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_MOVE);
+            if (moved <= 0) { exit(1); }
+            drain(moved);
+            left -= moved;
+            dst.idx = 0;
+            dst.off = 0;
+        }
+
+        size_t i;
+        for (i = 0; i < src->count; i++) { free(src->buf[i].mem); }
+        free(src);
+    }
+}
+
+
+/*
+    Writes the file through memory.
+*/
+static void write_copy(int zero_fd, struct fuse_file_info *fi) {
+
+    static char buf[REQUEST];
+    long off;
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        fill(zero_fd, REQUEST);
+        size_t got = 0;
+        while (got < REQUEST) {
+            ssize_t res = read(pipe_fds[0], buf + got, REQUEST - got);
+            if (res <= 0) { exit(1); }
+            got += res;
+        }
+        if (cs1550_write("/d/f", buf, REQUEST, off, fi) != REQUEST) { exit(1); }
+    }
+}
+
+
+/*
+    Writes the file with write_buf, splicing from the pipe into '.disk'.
+*/
+static void write_splice(int zero_fd, struct fuse_file_info *fi) {
+
+    long off;
+    for (off = 0; off < FILE_SIZE; off += REQUEST) {
+        fill(zero_fd, REQUEST);
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(REQUEST);
+        src.buf[0].flags = FUSE_BUF_IS_FD;
+        src.buf[0].fd = pipe_fds[0];
+        if (cs1550_write_buf("/d/f", &src, off, fi) != REQUEST) { exit(1); }
+    }
+}
+
+
+int main(void)
+{
+    bench_mkfs("-s 256M -b 4096 -f extents");
+    bench_mount();
+    cs1550_mkdir("/d", 0755);
+    cs1550_mknod("/d/f", S_IFREG | 0644, 0);
+
+    int zero_fd = open("/dev/zero", O_RDONLY);
+    null_fd = open("/dev/null", O_WRONLY);
+    if ((zero_fd < 0) || (null_fd < 0) || (pipe(pipe_fds) != 0)) {
+        perror("splice");
+        return 1;
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, REQUEST);
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    cs1550_open("/d/f", &fi);
+
+    double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+    int r;
+    for (r = 0; r < ROUNDS; r++) {
+        double start = bench_now();
+        write_copy(zero_fd, &fi);
+        cs1550_fsync("/d/f", 0, &fi);
+        double t = bench_now() - start;
+        if (t < best[0]) { best[0] = t; }
+
+        start = bench_now();
+        write_splice(zero_fd, &fi);
+        cs1550_fsync("/d/f", 0, &fi);
+        t = bench_now() - start;
+        if (t < best[1]) { best[1] = t; }
+
+        start = bench_now();
+        read_copy(&fi);
+        t = bench_now() - start;
+        if (t < best[2]) { best[2] = t; }
+
+        start = bench_now();
+        read_splice(&fi);
+        t = bench_now() - start;
+        if (t < best[3]) { best[3] = t; }
+    }
+    cs1550_release("/d/f", &fi);
+    bench_unmount();
+
+    double mb = FILE_SIZE / 1048576.0;
+    printf("write   copy %7.1f MB/s   splice %7.1f MB/s\n", mb / best[0], mb / best[1]);
+    printf("read    copy %7.1f MB/s   splice %7.1f MB/s\n", mb / best[2], mb / best[3]);
+
+    return 0;
+}
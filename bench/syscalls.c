@@ -0,0 +1,114 @@
+/*
+    System calls made for metadata work (user-001)
+
+    20 mkdir, 200 mknod, 200 getattr and 20 readdir on a fresh 5 MB image,
+    counting from before the mount to after the unmount:
+
+        opens       open() calls on '.disk'
+        reads       read-type system calls (syscr in /proc/self/io)
+        writes      write-type system calls (syscw in /proc/self/io)
+        syncs       fdatasync()s and msync()s (disk_syncs)
+
+    once with the block cache off (cache_blocks=0), where every block
+    transfer is a system call, and once with the default cache (512K).
+
+    Before the disk layer kept '.disk' open, the same work took 1061 opens
+    (each with a close), 1440 reads and 280 writes.
+*/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+static long opens = 0;                  /* open()s seen */
+
+/*
+    open() that counts itself; cs1550disk.c calls it through the macro below.
+*/
+static int counted_open(const char *path, int flags) {
+
+    opens++;
+
+    return open(path, flags);
+}
+#define open(path, flags) counted_open(path, flags)
+
+#include "bench.h"
+
+
+/*
+    Reads the counts of read- and write-type system calls made so far.
+*/
+static void io_counts(long *reads, long *writes) {
+
+    *reads = *writes = 0;
+
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == NULL) { return; }
+
+    char key[64];
+    long value;
+    while (fscanf(io, "%63s %ld", key, &value) == 2) {
+        if (strcmp(key, "syscr:") == 0) { *reads = value; }
+        if (strcmp(key, "syscw:") == 0) { *writes = value; }
+    }
+    fclose(io);
+}
+
+
+/*
+    Runs the workload on a fresh image and prints what it cost.
+*/
+static void run(const char *label, long cache_blocks) {
+
+    char path[64];
+    struct stat st;
+    long names = 0;
+    int d, f;
+
+    bench_mkfs("-s 5M");
+    options.cache_blocks = cache_blocks;
+
+    long reads0, writes0, reads1, writes1;
+    unsigned long syncs = __atomic_load_n(&disk_syncs, __ATOMIC_RELAXED);
+    opens = 0;
+    io_counts(&reads0, &writes0);
+
+    bench_mount();
+    for (d = 0; d < 20; d++) {
+        snprintf(path, sizeof(path), "/d%d", d);
+        cs1550_mkdir(path, 0755);
+    }
+    for (d = 0; d < 20; d++) {
+        for (f = 0; f < 10; f++) {
+            snprintf(path, sizeof(path), "/d%d/f%d.txt", d, f);
+            cs1550_mknod(path, S_IFREG | 0644, 0);
+        }
+    }
+    for (d = 0; d < 20; d++) {
+        for (f = 0; f < 10; f++) {
+            snprintf(path, sizeof(path), "/d%d/f%d.txt", d, f);
+            cs1550_getattr(path, &st);
+        }
+    }
+    for (d = 0; d < 20; d++) {
+        snprintf(path, sizeof(path), "/d%d", d);
+        cs1550_readdir(path, &names, bench_fill, 0, NULL);
+    }
+    bench_unmount();
+
+    io_counts(&reads1, &writes1);
+    syncs = __atomic_load_n(&disk_syncs, __ATOMIC_RELAXED) - syncs;
+
+    printf("%-14s opens %3ld   reads %5ld   writes %5ld   syncs %3lu   (%ld names listed)\n",
+        label, opens, reads1 - reads0, writes1 - writes0, syncs, names);
+}
+
+
+int main(void)
+{
+    run("no cache", 0);
+    run("default cache", -1);
+
+    return 0;
+}
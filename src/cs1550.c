@@ -14,30 +14,48 @@
 
     If a block is not completely full, then pad it with ZERO
 */
+#include    "cs1550disk.c"
+#include    "cs1550super.c"
+#include    "cs1550cache.c"
 #include    "cs1550bitmap.c"
+#include    "cs1550journal.c"
+#include    "cs1550blockmap.c"
+#include    "cs1550reclaim.c"
+#include    "cs1550readahead.c"
+#include    "cs1550dirindex.c"
 
 #define     FUSE_USE_VERSION 26
 
+#if !defined(CS1550_LOWLEVEL) && !defined(CS1550_PATH_HANDLERS)
+#define     CS1550_PATH_HANDLERS        // the handlers by path, for hello_oper (cs1550ll.c has its own, by inode)
+#endif
+
 #include    <errno.h>
 #include    <fcntl.h>
 #include    <fuse.h>
+#include    <pthread.h>
+#include    <stddef.h>
+#include    <stdint.h>
 #include    <stdio.h>
 #include    <stdlib.h>
 #include    <string.h>
+#include    <time.h>
 
-#define     BLOCK_SIZE      512         // disk's block size
 #define     DISK            ".disk"     // keep reference to our .disk file
 #define     MAX_FILENAME    8           // 8.3 filenames
 #define     MAX_EXTENSION   3           // 8.3 filenames
 #define     MAX_LENGTH      MAX_FILENAME * 2 + MAX_EXTENSION + 1  // length of dir + filename + extension + NULL
 
-// How many files can there be in one directory?
-#define     MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+// How many files can there be in one block of a directory? (block_size comes from the
+// superblock; the last long of the block is DIR_NEXT, so it is left out)
+#define     MAX_FILES_IN_DIR ((block_size - sizeof(int) - sizeof(long)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long)))
 
-// The attribute packed means to not align these things
+// The attribute packed means to not align these things. Each of these
+// structs fills exactly one block: the rest of the block past the array
+// is padding. Don't use it for anything.
 struct cs1550_directory_entry
 {
-    int nFiles;     //  How many files are in this directory.
+    int nFiles;     //  How many files are in this block of the directory.
                     //  Needs to be less than MAX_FILES_IN_DIR
 
     struct cs1550_file_directory
@@ -46,36 +64,47 @@ struct cs1550_directory_entry
         char fext[MAX_EXTENSION + 1];                   // extension (plus space for nul)
         size_t fsize;                                   // file size
         long nStartBlock;                               // where the first block is on disk
-    } __attribute__((packed)) files[MAX_FILES_IN_DIR];  // There is an array of these
-
-    // This is some space to get this to be exactly the size of the disk block.
-    // Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+    } __attribute__((packed)) files[];                  // There is an array of MAX_FILES_IN_DIR of these
 };
 
+// The next block of the directory's list of files, kept in the last long of
+// each directory block; 0 in the last one (and in every directory made
+// before directories could grow, where those bytes were padding)
+#define DIR_NEXT_AT   (block_size - sizeof(long))
+#define DIR_NEXT(dir) (*(long*)((char*)(dir) + DIR_NEXT_AT))
 
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+
+// How many directories fit in one block of the root? The block ends with
+// ROOT_NEXT and the last int, nFormat (see ROOT_FORMAT), so those are left out
+#define MAX_DIRS_IN_ROOT ((block_size - 2 * sizeof(int) - sizeof(long)) / ((MAX_FILENAME + 1) + sizeof(long)))
 
 struct cs1550_root_directory
 {
-    int nDirectories;   // How many subdirectories are in the root (needs to be less than MAX_DIRS_IN_ROOT)
+    int nDirectories;   // How many subdirectories are in this block of the root (needs to be less than MAX_DIRS_IN_ROOT)
 
     struct cs1550_directory
     {
         char dname[MAX_FILENAME + 1];                           // directory name (plus space for nul)
         long nStartBlock;                                       // where the directory block is on disk
-    } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];    // There is an array of these
-
-    // This is some space to get this to be exactly the size of the disk block.
-    // Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+    } __attribute__((packed)) directories[];                    // There is an array of MAX_DIRS_IN_ROOT of these
 };
 
+// Images without a superblock: on-disk layout of the files (CS1550_FORMAT_*),
+// kept in the last int of the root block; 0 on images from before it existed
+#define ROOT_FORMAT(root) (*(int*)((char*)(root) + block_size - sizeof(int)))
 
+// The next block of the root's list of directories, kept just before
+// ROOT_FORMAT (so not 8-byte aligned); 0 in the last one (and in roots made
+// before the root could grow)
+struct cs1550_root_link { long nNextBlock; } __attribute__((packed));
+#define ROOT_NEXT_AT    (block_size - sizeof(int) - sizeof(long))
+#define ROOT_NEXT(root) (((struct cs1550_root_link*)((char*)(root) + ROOT_NEXT_AT))->nNextBlock)
 
-// How much data can one block hold?
-#define    MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long))
+
+
+// How much data can one block hold? (CHAIN layout; EXTENTS blocks hold a full block_size)
+#define    MAX_DATA_IN_BLOCK (block_size - sizeof(long))
 
 struct cs1550_disk_block
 {
@@ -83,9 +112,9 @@ struct cs1550_disk_block
     // allocation list
     long nNextBlock;
 
-    // And all the rest of the space in the block can be used for actual data
-    // storage.
-    char data[MAX_DATA_IN_BLOCK];
+    // And all the rest of the space in the block (MAX_DATA_IN_BLOCK bytes) can
+    // be used for actual data storage.
+    char data[];
 };
 
 typedef struct cs1550_root_directory cs1550_root_directory;
@@ -93,168 +122,754 @@ typedef struct cs1550_directory_entry cs1550_directory_entry;
 typedef struct cs1550_file_directory cs1550_file_directory;
 typedef struct cs1550_disk_block cs1550_disk_block;
 
+static int disk_format = CS1550_FORMAT_CHAIN;   // layout of the mounted image, read from the superblock (or root) at mount
+
+// What cs1550_open hands to read and write through fi->fh
+struct cs1550_handle
+{
+    struct cs1550_block_map *bmap;      // the file's block map, shared by every open of the file
+    struct cs1550_readahead ra;         // how this open of the file is being read
+};
+
+
+// Options that can be given at mount time with '-o'
+struct cs1550_options
+{
+    int use_mmap;           // -o mmap: map the whole .disk and use the on-disk structs in place
+    long cache_blocks;      // -o cache_blocks=N: size of the block cache, in blocks (0 turns it off, -1 sizes it from CACHE_DEFAULT_BYTES)
+    long flush_interval;    // -o flush_interval=N: seconds between background write-backs (0 turns them off)
+    double cache_timeout;   // -o cache_timeout=N: seconds the kernel may keep names and attributes (0: not at all, nor file data across opens)
+    int upgrade;            // -o upgrade: rewrite an older superblock in this version (see super_upgrade)
+};
+
+static struct cs1550_options options = { 0, -1, 5, 1.0, 0 };
+
+#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_options, p), v }
+
+static struct fuse_opt cs1550_opts[] = {
+    CS1550_OPT("mmap", use_mmap, 1),
+    CS1550_OPT("cache_blocks=%ld", cache_blocks, 0),
+    CS1550_OPT("flush_interval=%ld", flush_interval, 0),
+    CS1550_OPT("cache_timeout=%lf", cache_timeout, 0),
+    CS1550_OPT("upgrade", upgrade, 1),
+    FUSE_OPT_END
+};
+
+#define CS1550_STATS_XATTR  "user.cs1550.stats"     // read-only attribute of "/" holding the counters
+
+
+/*
+    FUSE runs requests on several threads at once. Locks are always taken
+    in this order (and released before returning):
+
+        journal             (journal_begin())        requests that change metadata join the running transaction first
+        file data lock      (cs1550_block_map.lock)  shared to read, exclusive to write
+        directory lock      (dir_lock)               shared to look up, exclusive to change the directory block
+        root lock           (root_lock)              shared to list, exclusive to add or remove a directory
+        directory index     (cs1550dirindex.c)
+        block map table     (cs1550blockmap.c)
+        orphan lists        (cs1550reclaim.c)
+        allocator           (cs1550bitmap.c)
+        block cache         (cs1550cache.c)
+
+    Subdirectories share DIR_LOCK_STRIPES locks, picked by the directory's
+    block number, so operations on different directories rarely meet.
+*/
+#define DIR_LOCK_STRIPES    64
+
+static pthread_rwlock_t root_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES];
+static pthread_once_t dir_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_dir_locks(void) {
+    int i;
+    for (i = 0; i < DIR_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&dir_locks[i], NULL);
+    }
+}
+
+/*
+    Returns the lock guarding the directory held at the given block.
+*/
+static pthread_rwlock_t *dir_lock(long index) {
+    pthread_once(&dir_locks_once, init_dir_locks);
+
+    return &dir_locks[index % DIR_LOCK_STRIPES];
+}
+
+
+/*
+    Gives back a block obtained from get_root(), get_directory() or
+    get_disk_block(). Blocks that point into the mapped disk are left alone;
+    copies are freed.
+*/
+static void put_block(void *block) {
+    if ((block != NULL) && !disk_owns(block)) {
+        free(block);
+    }
+}
+
+
+/*
+    Returns the cs1550_root_directory structure held in the given block of
+    the root's list. When the disk is mapped this is the on-disk struct
+    itself, otherwise a copy. Either way it must be given back with
+    put_block().
+
+    RETURNS:    cs1550_root_directory*      the root struct
+                NULL                        the root could not be read (or out of memory)
+*/
+static cs1550_root_directory *get_root_block(long index) {
+    cs1550_root_directory *root = disk_block_ptr(index);                // zero-copy view when the disk is mapped
+
+    if (root == NULL) {
+        root = (cs1550_root_directory*)calloc(1, block_size);
+        if ((root != NULL) && (cache_read_block(index, root) != 0)) {   // get the root struct
+            free(root);
+            root = NULL;
+        }
+    }
+
+    return root;
+}
+
+
+/*
+    Returns the first block of the root, the one the superblock points at
+    (block 0 on images without one). Give it back with put_block().
+
+    RETURNS:    cs1550_root_directory*      the root struct
+                NULL                        the root could not be read
+*/
+static cs1550_root_directory *get_root(void) {
+    return get_root_block(super.nRootBlock);
+}
+
+
+/*
+    Loads the disk geometry from the superblock and makes sure this build
+    knows how to mount the image. Images without a superblock keep their
+    layout tag in the root: images from before the tag existed read back
+    0, which is the CHAIN layout they were written in. A freshly dd'ed
+    image (no superblock, no directories yet) holds nothing, so it is
+    formatted here the way cs1550mkfs would, sized to the file.
+
+    Must run before the block cache is set up: formatting writes straight
+    to the disk.
+
+    RETURNS:    0                   SUCCESS; super and disk_format are set
+                -EIO                the image could not be read (or is corrupt)
+                -EINVAL             a fresh image too small to format
+                -EPROTONOSUPPORT    the image uses a layout this build does not know
+*/
+static int check_format(void) {
+    int status = super_load();
+    if (status != 0) { return status; }                             // ERROR: unreadable or unknown superblock
+
+    if (super.nMagic == CS1550_MAGIC) {
+        disk_format = super.nFormat;                                // layout is in the superblock
+        return 0;
+    }
+
+    cs1550_root_directory *root = get_root();                       // no superblock: block 0 is the root
+
+    if (root == NULL) { return -EIO; }                              // ERROR: could not read the root
+
+    if (root->nDirectories == 0) {
+        put_block(root);                                            // empty image, nothing to keep
+
+        status = super_format(disk_size() / BLOCK_SIZE, BLOCK_SIZE, CS1550_FORMAT_CURRENT, -1);
+        if (status == 0) { status = super_load(); }
+        if (status == 0) { disk_format = super.nFormat; }
+
+        return status;
+    }
+
+    if ((ROOT_FORMAT(root) < CS1550_FORMAT_CHAIN) || (ROOT_FORMAT(root) > CS1550_FORMAT_CURRENT)) {
+        status = -EPROTONOSUPPORT;                                  // ERROR: written by a newer (or broken) build
+
+    } else {
+        disk_format = ROOT_FORMAT(root);
+    }
+
+    put_block(root);
+
+    return status;
+}
+
 
 /*
-    Searches the root structure for the given directory name, and
-    returns the starting block in the file for the directory.
+    Looks the given directory name up in the directory index, and
+    returns the starting block in the file for the directory. The root
+    is not read.
 
     RETURNS:    0+  SUCCESS. The start block offset of the given directory
                 -1  The directory does not exist
 */
 static long find_directory(char *dir_name) {
-    long index = -1;                        // assume directory does not exist
+    return dir_index_find(DIR_INDEX_ROOT, dir_name, "", NULL, NULL);
+}
 
-    // open the disk file
-    FILE *disk = fopen(DISK, "rb");         // open with respect to binary mode
 
-    // make sure could open the disk file
-    if (disk == NULL) {
-        // ERROR
+/*
+    Given an offset to a disk block, will return the cs1550_directory_entry structure.
+    When the disk is mapped this is the on-disk struct itself, otherwise a copy.
+    Either way it must be given back with put_block().
 
-    } else {
-        cs1550_root_directory root;                                 // pointer to root of disk file
-        fread(&root, sizeof(cs1550_root_directory), 1, disk);       // root struct is in first block of disk
+    RETURNS:    cs1550_directory_entry*     the directory struct
+                NULL                        the block could not be read (or out of memory)
+*/
+static cs1550_directory_entry *get_directory(long index) {
+    cs1550_directory_entry *dir = disk_block_ptr(index);                // zero-copy view when the disk is mapped
 
-        // search for the directory within the list of valid directories
-        int i;
-        for (i=0; i < root.nDirectories; i++) {                     // loop through valid directories
-            if (strcmp(root.directories[i].dname, dir_name) == 0) {
-                index = root.directories[i].nStartBlock;            // found the directory
-                break;
-            }
+    if (dir == NULL) {
+        dir = (cs1550_directory_entry*)calloc(1, block_size);
+        if ((dir != NULL) && (cache_read_block(index, dir) != 0)) {     // get the directory at this start block
+            free(dir);
+            dir = NULL;
         }
+    }
+
+    return dir;
+}
 
-        fclose(disk);                                               // close the disk
+
+/*
+    Adds a new, empty block to the end of the list of names of parent
+    (the root, or a directory), once its last block (last_block, held in
+    last) is full. The new block is written out before the old one is
+    linked to it through the long next_at bytes into last. The caller
+    holds the root's or the directory's lock exclusively.
+
+    RETURNS:    1+          SUCCESS; the new last block
+                -ENOSPC     no space left on disk
+                -ENOMEM     out of memory
+*/
+static long grow_list(long parent, long last_block, void *last, size_t next_at) {
+    long new_block = find_free_block();
+    if (new_block == -1) { return -ENOSPC; }                    // ERROR: no space left on disk
+
+    char *empty = (char*)calloc(1, block_size);
+    if (empty == NULL) {
+        release_block(new_block);
+        return -ENOMEM;                                         // ERROR: out of memory
     }
+    cache_write_meta_block(new_block, empty);                   // empty, and the end of the list
+    free(empty);
+
+    memcpy((char*)last + next_at, &new_block, sizeof(long));    // link it onto the end of the list
+    cache_write_meta_block(last_block, last);
+    dir_index_set_last(parent, new_block);
 
-    return index;
+    return new_block;
 }
 
 
 /*
-    Given an offset to a disk block, will return the cs1550_directory_entry structure.
+    grow_list() for the directory starting at dir_block. On success
+    *last_block and *dir are the new block.
+
+    RETURNS:    0           SUCCESS
+                -ENOSPC     no space left on disk
+                -ENOMEM     out of memory
+                -EIO        the new block could not be read back
 */
-static cs1550_directory_entry *get_directory(long index) {
-    cs1550_directory_entry *dir;                                // assume dir entry does not exist
-    dir = (cs1550_directory_entry*)calloc(1, sizeof(cs1550_directory_entry));
+static int grow_directory(long dir_block, long *last_block, cs1550_directory_entry **dir) {
+    long new_block = grow_list(dir_block, *last_block, *dir, DIR_NEXT_AT);
+    if (new_block < 0) { return new_block; }                    // ERROR: no space, or out of memory
+
+    put_block(*dir);
+    *last_block = new_block;
+    *dir = get_directory(new_block);
+
+    return (*dir != NULL) ? 0 : -EIO;
+}
+
+
+/*
+    grow_list() for the root. On success *last_block and *root are the
+    new block.
+
+    RETURNS:    0           SUCCESS
+                -ENOSPC     no space left on disk
+                -ENOMEM     out of memory
+                -EIO        the new block could not be read back
+*/
+static int grow_root(long *last_block, cs1550_root_directory **root) {
+    long new_block = grow_list(DIR_INDEX_ROOT, *last_block, *root, ROOT_NEXT_AT);
+    if (new_block < 0) { return new_block; }                    // ERROR: no space, or out of memory
+
+    put_block(*root);
+    *last_block = new_block;
+    *root = get_root_block(new_block);
+
+    return (*root != NULL) ? 0 : -EIO;
+}
+
+
+/*
+    Takes the entry in the given slot of block home out of the list of
+    names of parent (the root, or a directory) whose first block is first,
+    keeping the list packed: the last entry of the list moves into the
+    hole (and is copied to moved, entry_size bytes), and a last block left
+    empty is unlinked from the one before it and freed. Entries are
+    entry_size bytes each, from entry_at into the block; the link to the
+    next block is next_at bytes in. The block gaining the moved entry is
+    written before the one losing it, so without a journal a crash in
+    between leaves the entry twice rather than not at all. The caller
+    holds the root's or the directory's lock exclusively, and a journal
+    handle.
+
+    RETURNS:    1           SUCCESS; an entry moved into home/slot
+                0           SUCCESS; nothing had to move
+                -EIO        a block of the list could not be read
+*/
+static int shrink_list(long parent, long first, long home, int slot, size_t entry_at, size_t entry_size,
+    size_t next_at, void *moved)
+{
+    long last_block = dir_index_last(parent);
+    if (last_block < 0) { last_block = first; }
+
+    char *block = (char*)get_root_block(home);                  // the block the entry goes from
+    char *last = (last_block != home) ? (char*)get_root_block(last_block) : block;
+    if ((block == NULL) || (last == NULL)) {
+        put_block(block);
+        if (last != block) { put_block(last); }
+        return -EIO;                                            // ERROR: could not read the list
+    }
 
-    // open the disk file
-    FILE *disk = fopen(DISK, "rb");                             // open with respect to binary mode
+    int *count = (int*)block;                                   // nFiles / nDirectories
+    int *last_count = (int*)last;
+    if (*last_count == 0) {                                     // an empty last block (it could not be freed before):
+        put_block(last);                                        // ... fill the hole from the home block instead
+        last = block;
+        last_count = count;
+    }
+    long from = (last != block) ? last_block : home;            // the block that loses an entry
 
-    // make sure could open the disk file
-    if (disk == NULL) {
-        // ERROR
+    (*last_count)--;                                            // the entry that fills the hole
+    int moves = (last != block) || (slot < *count);
+    if (moves) {
+        memcpy(moved, last + entry_at + *last_count * entry_size, entry_size);
+        memcpy(block + entry_at + slot * entry_size, moved, entry_size);
+    }
+    if (last != block) { cache_write_meta_block(home, block); }
 
+    long before = -1;
+    if ((*last_count == 0) && (from == last_block) && (from != first)) {
+        before = dir_index_drop_last(parent);                   // an emptied last block goes
+    }
+    if (before >= 0) {
+        long end = 0;
+        cache_write_meta(&end, sizeof(long), (off_t)before * block_size + next_at);    // the one before ends the list now
+        release_run(from, 1);
     } else {
-        fseek(disk, index * BLOCK_SIZE, SEEK_SET);              // seek to the starting block of dir struct
-        fread(dir, sizeof(cs1550_directory_entry), 1, disk);    // get the directory at this start block
-        fclose(disk);                                           // close the disk
+        cache_write_meta_block(from, last);
     }
 
-    return dir;
+    if (last != block) { put_block(last); }
+    put_block(block);
+
+    return moves;
 }
 
 
 /*
-    Searches through the given directory entry's file list and returns
-    the index of where the file directory is located within the directory structure.
+    Looks the file up in the directory index and returns which block of
+    the directory starting at dir_block holds its file directory, and
+    where in that block (*slot), without scanning the list of files.
 
-    RETURNS:    0+          SUCCESS; location of the file in the dir struct
+    RETURNS:    0+          SUCCESS; the directory block holding the file
                 -1          not found
 */
-static int find_file(cs1550_directory_entry *dir, char *file_name, char *ext_name) {
-    int index = -1;
+static long find_file(long dir_block, char *file_name, char *ext_name, int *slot) {
+    long home = -1;
 
-    int i;
-    cs1550_file_directory file_dir;
-    for (i=0; i < dir->nFiles; i++) {                   // loop through valid files
-        file_dir = dir->files[i];
-        if (strcmp(file_dir.fname, file_name) == 0) {
-            if (strcmp(file_dir.fext, ext_name) == 0) {
-                index = i;                              // found the file struct
-                break;
-            }
-        }
+    if (dir_index_find(dir_block, file_name, ext_name, &home, slot) < 0) {
+        home = -1;                                      // not in the index
+    }
+
+    return home;
+}
+
+
+/*
+    Finds the file directory with the given filename and extension in
+    the directory starting at block dir_block. *file is set to it, and
+    *dir to the block of the directory holding it (and *home to where that
+    block is, if home is not NULL); give *dir back with put_block() when
+    done.
+
+    RETURNS:    0           SUCCESS; *file points into *dir
+                -ENOENT     the filename/extension was not found (*file and *dir are NULL)
+                -EIO        the directory block could not be read (or out of memory)
+*/
+static int get_file(long dir_block, char *file_name, char *ext_name,
+    cs1550_directory_entry **dir, long *home, cs1550_file_directory **file) {
+
+    *file = NULL;                                       // assume file does not exist
+    *dir = NULL;
+
+    int slot;
+    long block = find_file(dir_block, file_name, ext_name, &slot);
+    if (block < 0) { return -ENOENT; }                  // ERROR: not in the index
+
+    cs1550_directory_entry *entry = get_directory(block);
+    if (entry == NULL) { return -EIO; }                 // ERROR: could not read the directory
+
+    if ((slot >= entry->nFiles) ||                      // make sure the slot still holds this file
+        (strcmp(entry->files[slot].fname, file_name) != 0) ||
+        (strcmp(entry->files[slot].fext, ext_name) != 0))
+    {
+        put_block(entry);
+        return -ENOENT;                                 // ERROR: it is gone
     }
 
-    return index;
+    *file = &entry->files[slot];                        // found the file struct
+    *dir = entry;
+    if (home != NULL) { *home = block; }
+
+    return 0;
 }
 
 
 /*
-    Searches through the given directory entry's file list and returns
-    the file directory with the given filename and extension; 
+    Given a starting disk block index on the disk, will traverse the given
+    block_num nodes and return the disk block at this location. When the
+    disk is mapped this is the on-disk struct itself, otherwise a copy.
+    Either way it must be given back with put_block().
 
-    RETURNS:    cs1550_file_directory*      the file struct of the given filename/extension
-                NULL                        the filename/extension was not found
+    RETURNS:    cs1550_disk_block*      the disk block
+                NULL                    out of memory (or off the end of a mapped chain)
 */
-static cs1550_file_directory *get_file(cs1550_directory_entry *dir, char *file_name, char *ext_name) {
-    cs1550_file_directory *disk_file = NULL;            // assume file does not exist
+static cs1550_disk_block *get_disk_block(long index, int block_num) {
+    cs1550_disk_block *disk_block = disk_block_ptr(index);          // zero-copy view when the disk is mapped
 
+    if (disk_block != NULL) {
+        // traverse the given number of nodes inside the mapping
+        int i;
+        for (i = 0; (i < block_num) && (disk_block != NULL); i++) {
+            disk_block = disk_block_ptr(disk_block->nNextBlock);    // follow the next pointer in place
+        }
+        return disk_block;
+    }
+
+    disk_block = (cs1550_disk_block*)calloc(1, block_size);
+    if (disk_block == NULL) { return NULL; }                        // ERROR: out of memory
 
+    // traverse the given number of nodes
     int i;
-    cs1550_file_directory file_dir;
-    for (i=0; i < dir->nFiles; i++) {                   // loop through valid files
-        file_dir = dir->files[i];
-        if (strcmp(file_dir.fname, file_name) == 0) {
-            if (strcmp(file_dir.fext, ext_name) == 0) {
-                disk_file = &file_dir;                  // found the file struct
-                break;
+    for (i = 0; i <= block_num; i++) {
+        if (cache_read_block(index, disk_block) != 0) { break; }    // get the disk block at this start block
+        index = disk_block->nNextBlock;                             // get the disk location of the next block associated with this file
+    }
+
+    return disk_block;
+}
+
+
+// Most data moved by a single pread/pwrite when a file's blocks are contiguous on disk
+#define     MAX_RUN_BYTES   1048576
+#define     MAX_RUN_BLOCKS  (MAX_RUN_BYTES / block_size)
+
+/*
+    Returns how many bytes of file data one block holds in the mounted
+    image's layout.
+*/
+static long block_payload(void) {
+    return (disk_format == CS1550_FORMAT_EXTENTS) ? block_size : (long)MAX_DATA_IN_BLOCK;
+}
+
+
+/*
+    Can files of the mounted image have holes (see block_map_replace)?
+    Only EXTENTS images with a superblock can: a CHAIN needs every block
+    to link on to the next, and a build from before holes, which would
+    read block 0 for one, refuses images with this superblock version.
+*/
+static int sparse_files(void) {
+    return (disk_format == CS1550_FORMAT_EXTENTS) && (super.nMagic == CS1550_MAGIC);
+}
+
+
+/*
+    Returns block i of a run of blocks (as returned by get_disk_run).
+*/
+static cs1550_disk_block *run_block(void *run, long i) {
+    return (cs1550_disk_block*)((char*)run + i * block_size);
+}
+
+
+/*
+    Returns where the file data of block i of a run (as returned by
+    get_disk_run) starts.
+*/
+static char *block_data(void *run, long i) {
+    if (disk_format == CS1550_FORMAT_EXTENTS) {
+        return (char*)run_block(run, i);                            // the whole block is data
+    }
+
+    return run_block(run, i)->data;                                 // data follows nNextBlock
+}
+
+
+/*
+    Returns the disk index of the given (0-based) block of a file, using the
+    file's block map instead of walking the chain on disk. If extend is set,
+    the file is grown (and the map with it) whenever it ends before
+    block_num is reached. The new blocks are reserved as contiguous runs.
+    In the CHAIN layout each run is chained block to block, zero'ed with a
+    single write, and linked onto the end of the chain; in the EXTENTS
+    layout the run is simply recorded in the file's index block.
+
+    RETURNS:    1+          SUCCESS; disk index of the block
+                -1          file ended early (or no space left to extend it)
+*/
+static long file_block(struct cs1550_block_map *bmap, long block_num, int extend) {
+    while (extend && (bmap->nBlocks <= block_num)) {
+        long want = block_num + 1 - bmap->nBlocks;                  // blocks still missing
+        if (want > MAX_RUN_BLOCKS) { want = MAX_RUN_BLOCKS; }
+
+        if (!bmap->isExtents && (bmap->nBlocks == 0)) { break; }    // ERROR: a chain always has its start block
+
+        int got;
+        long start = find_free_run(want, &got);                     // grow the file by a run of blocks
+        if (start < 0) { break; }                                   // ERROR: no space left
+
+        if (!bmap->isExtents) {
+            // new blocks start out zero'ed, each pointing at the next one in the run
+            cs1550_disk_block *run = (cs1550_disk_block*)calloc(got, block_size);
+            long last = block_map_lookup(bmap, bmap->nBlocks - 1);  // current end of the chain
+            cs1550_disk_block *disk_block = get_disk_block(last, 0);
+            if ((run == NULL) || (disk_block == NULL)) {
+                free(run);
+                put_block(disk_block);
+                release_run(start, got);
+                break;                                              // ERROR: out of memory
+            }
+
+            int i;
+            for (i = 0; i < got - 1; i++) {
+                run_block(run, i)->nNextBlock = start + i + 1;
             }
+            cache_write(run, got * block_size, (off_t)start * block_size);
+            free(run);
+
+            disk_block->nNextBlock = start;                         // link the run onto the end of the chain
+            cache_write_meta_block(last, disk_block);               // the link commits with the new blocks and size
+            put_block(disk_block);
+        }
+
+        if (block_map_append(bmap, start, got) != 0) { break; }    // ERROR: out of memory
+
+        if (bmap->isExtents && (block_map_save(bmap, bmap->nExtents - 1) != 0)) {
+            break;                                                  // ERROR: could not record the run
         }
     }
 
-    return disk_file;
+    return block_map_lookup(bmap, block_num);
 }
 
 
 /*
-    Given a starting disk block index on the disk, will traverse the given
-    block_num nodes and return the disk block at this location.
+    Files with holes only (see sparse_files): backs block block_num of the
+    file, which is in a hole or past the end of its map, with newly
+    allocated disk blocks, as many of them next to each other as are free,
+    up to max and no further than the hole goes. A gap between the end of
+    the map and block_num becomes a hole. The new blocks hold whatever
+    they held before. The caller holds the file's data lock exclusively
+    and a journal handle.
+
+    RETURNS:    1+          SUCCESS; disk index of the block, *fresh is set to how many were allocated
+                -1          no space left (or out of memory)
 */
-static cs1550_disk_block *get_disk_block(long index, int block_num) {
-    cs1550_disk_block *disk_block;
-    disk_block = (cs1550_disk_block*)calloc(1, sizeof(cs1550_disk_block));
+static long fill_hole(struct cs1550_block_map *bmap, long block_num, long max, long *fresh) {
+    long want = (max < MAX_RUN_BLOCKS) ? max : MAX_RUN_BLOCKS;
+    if (block_num < bmap->nBlocks) {
+        long hole = block_map_run(bmap, block_num);
+        if (want > hole) { want = hole; }
+    }
 
-    // open the disk file
-    FILE *disk = fopen(DISK, "rb");                                 // open with respect to binary mode
+    int got;
+    long start = find_free_run(want, &got);
+    if (start < 0) { return -1; }                                   // ERROR: no space left
 
-    // make sure could open the disk file
-    if (disk == NULL) {
-        // ERROR
+    int status = 0;
+    if (block_num < bmap->nBlocks) {
+        struct cs1550_extent_map *dropped;
+        long count;
+        status = block_map_replace(bmap, block_num, got, start, &dropped, &count);
+        if (dropped != NULL) {                                      // the map changed, even if it was not written
+            reclaim_runs(dropped, count);                           // only index blocks, if the runs merged
+            free(dropped);
+        }
 
     } else {
-        // traverse the given number of nodes
-        int i;
-        for (i = 0; i <= block_num; i++) {
-            fseek(disk, index * BLOCK_SIZE, SEEK_SET);              // seek to the position of the next disk block for this file
-            fread(disk_block, sizeof(cs1550_disk_block), 1, disk);  // get the disk block at this start block
-            index = disk_block->nNextBlock;                         // get the disk location of the next block associated with this file
+        long changed = (bmap->nExtents > 0) ? bmap->nExtents - 1 : 0;  // the first run that may change
+        if (block_num > bmap->nBlocks) {
+            status = block_map_append(bmap, BLOCK_MAP_HOLE, block_num - bmap->nBlocks);
+        }
+        if (status == 0) { status = block_map_append(bmap, start, got); }
+        if (status == 0) { status = block_map_save(bmap, changed); }
+        if ((status == 0) && (changed / MAX_EXTENTS_IN_BLOCK != (bmap->nExtents - 1) / MAX_EXTENTS_IN_BLOCK)) {
+            status = block_map_save(bmap, bmap->nExtents - 1);     // the new runs went on into another index block
         }
+    }
 
-        fclose(disk);                                               // close the disk file
+    if ((status != 0) && (block_map_lookup(bmap, block_num) != start)) {
+        release_run(start, got);
+        return -1;                                                  // ERROR: could not record the run
     }
 
-    return disk_block;
+    *fresh = got;
+
+    return start;
 }
 
 
 /*
-    Given a disk block, will write it out to disk at the given location.
+    Returns how many blocks, starting at block block_num of the file and
+    going no further than max blocks, sit next to each other on disk.
 */
-static void write_block_to_disk(cs1550_disk_block *block, long index) {
-    // open the disk file
-    FILE *disk = fopen(DISK, "r+b");                        // open read/write binary mode
+static long file_run(struct cs1550_block_map *bmap, long block_num, long max) {
+    long run = block_map_run(bmap, block_num);
 
-    // make sure could open the disk file
-    if (disk == NULL) {
-        // ERROR
+    if (max > MAX_RUN_BLOCKS) { max = MAX_RUN_BLOCKS; }
 
-    } else {
-        fseek(disk, index * BLOCK_SIZE, SEEK_SET);          // seek to the starting block of file block struct
-        fwrite(block, sizeof(cs1550_disk_block), 1, disk);  // get the file block at this start block
-        fclose(disk);                                       // close the disk
+    return (run < max) ? run : max;
+}
+
+
+/*
+    Returns count contiguous disk blocks starting at index with a single
+    transfer. When the disk is mapped this points straight into the
+    mapping, otherwise it is a copy. Either way it must be given back with
+    put_block().
+*/
+static cs1550_disk_block *get_disk_run(long index, long count) {
+    cs1550_disk_block *run = disk_block_ptr(index);                 // zero-copy view when the disk is mapped
+
+    if (run == NULL) {
+        run = (cs1550_disk_block*)malloc(count * block_size);
+        if ((run != NULL) && (cache_read(run, count * block_size, (off_t)index * block_size) != 0)) {
+            free(run);
+            run = NULL;
+        }
+    }
+
+    return run;
+}
+
+
+/*
+    Looks up dir/filename.ext and copies its file entry out, so that it
+    can be used after the directory lock is dropped.
+
+    RETURNS:    0+          SUCCESS; the block holding the file's directory
+                -ENOENT     no such file
+                -EIO        its directory could not be read
+*/
+static long lookup_file(char *dir, char *filename, char *ext, cs1550_file_directory *file) {
+    long dir_block = find_directory(dir);                           // get block offset to where this dir entry is held
+    if (dir_block < 0) { return -ENOENT; }                          // ERROR: directory not found
+
+    pthread_rwlock_rdlock(dir_lock(dir_block));
+    cs1550_directory_entry *dir_entry;
+    cs1550_file_directory *file_entry;
+    int status = get_file(dir_block, filename, ext, &dir_entry, NULL, &file_entry);
+    if (status == 0) {
+        *file = *file_entry;
+    }
+    put_block(dir_entry);
+    pthread_rwlock_unlock(dir_lock(dir_block));
+
+    return (status == 0) ? dir_block : status;
+}
+
+
+/*
+    Is the directory entry found by lookup_file() that of the file whose
+    map bmap is? Not once that file has been deleted, even if a new file
+    has been given its name since. The caller holds the map's lock.
+*/
+static int same_file(struct cs1550_block_map *bmap, cs1550_file_directory *file) {
+    return !__atomic_load_n(&bmap->dead, __ATOMIC_ACQUIRE) && (file->nStartBlock == bmap->nStartBlock);
+}
+
+
+/*
+    Returns the handle cs1550_open stashed in fi->fh, or NULL when called
+    without one.
+*/
+static struct cs1550_handle *file_handle(struct fuse_file_info *fi) {
+    return (fi != NULL) ? (struct cs1550_handle*)(uintptr_t)fi->fh : NULL;
+}
+
+
+/*
+    Finds the block map of the file dir/filename.ext: the one in the
+    handle cs1550_open stashed in fi->fh, or (when called without an open
+    handle) the one found through the file's directory entry. Either way
+    the caller holds it until put_block_map().
+
+    RETURNS:    0           SUCCESS; *bmap is set
+                -ENOENT     no such file
+                -EIO        its directory could not be read
+                -ENOMEM     the map could not be built
+*/
+static int get_file_map(char *dir, char *filename, char *ext, struct fuse_file_info *fi,
+    struct cs1550_block_map **bmap)
+{
+    if (file_handle(fi) != NULL) {
+        *bmap = file_handle(fi)->bmap;
+        block_map_hold(*bmap);
+        return 0;
+    }
+
+    long dir_block = find_directory(dir);
+    if (dir_block < 0) { return -ENOENT; }                                  // ERROR: directory not found
+
+    // built under the directory lock, so never from the blocks of a file being deleted
+    pthread_rwlock_rdlock(dir_lock(dir_block));
+    cs1550_directory_entry *dir_entry;
+    cs1550_file_directory *file_entry;
+    int status = get_file(dir_block, filename, ext, &dir_entry, NULL, &file_entry);
+    *bmap = NULL;
+    if (status == 0) {
+        *bmap = get_block_map(file_entry->nStartBlock, disk_format == CS1550_FORMAT_EXTENTS);
+    }
+    put_block(dir_entry);
+    pthread_rwlock_unlock(dir_lock(dir_block));
+
+    if (status != 0) { return status; }                                     // ERROR: file not found, or unreadable
+
+    return (*bmap != NULL) ? 0 : -ENOMEM;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+    Breaks the path of a file, "/dir/filename.ext" or "/dir/filename", up
+    into its parts; dir, filename and ext must have room for MAX_LENGTH
+    characters. ext is left empty when the name has none.
+
+    RETURNS:    0           SUCCESS
+                -EISDIR     the path is the root or a directory
+                -ENOENT     no file can have that path
+*/
+static int split_file_path(const char *path, char *dir, char *filename, char *ext)
+{
+    if (strlen(path) >= MAX_LENGTH) { return -ENOENT; }                 // ERROR: path name too long
+
+    int scan_result = sscanf(path, "/%[^/]/%[^.].%s", dir, filename, ext);
+    if (scan_result == 2) { ext[0] = '\0'; }                            // make extension NULL if blank
+    if (scan_result < 2) { return -EISDIR; }                            // ERROR: not a file
+
+    if ((strlen(dir) > MAX_FILENAME) || (strlen(filename) > MAX_FILENAME) || (strlen(ext) > MAX_EXTENSION)) {
+        return -ENOENT;                                                 // ERROR: no file can have that name
     }
+
+    return 0;
 }
 
 
@@ -282,6 +897,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 
     // initialize to hold dir/file info
     memset(stbuf, 0, sizeof(struct stat));
+    dir[0] = filename[0] = ext[0] = '\0';  // parts the path doesn't have stay empty
     
     // is path the root dir?
     if (strcmp(path, "/") == 0) {           // path is the root dir
@@ -324,32 +940,35 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
                     status = 0;                             // SUCCESS
 
                 } else {                                    // RETURN FILE INFO
-                    // get the dir entry struct
-                    cs1550_directory_entry *dir_entry;      // holds the directory entry
-                    dir_entry = get_directory(dir_block);   // gets the directory entry
+                    pthread_rwlock_rdlock(dir_lock(dir_block));
+                    cs1550_directory_entry *dir_entry;      // holds the directory block with the file
 
 
                     if (scan_result == 2) { ext[0] = '\0';} // make extension NULL if blank
 
                     // find the filename (if it exists)
                     cs1550_file_directory *file;
-                    file = get_file(dir_entry, filename, ext);
+                    int found = get_file(dir_block, filename, ext, &dir_entry, NULL, &file);
 
-                    if (file == NULL) {
-                        // FILE NOT FOUND
+                    if (found != 0) {
+                        status = found;                     // FILE NOT FOUND (or unreadable)
 
                     } else {
                         // found the file
                         stbuf->st_mode = S_IFREG | 0666;    // file type and mode
                         stbuf->st_nlink = 1;                // number of hard links
                         stbuf->st_size = file->fsize;       // total file size, in bytes
+
+                        // ... counting the appends held back (see write_file)
+                        size_t pending_end = block_map_pending_end(file->nStartBlock);
+                        if (pending_end > file->fsize) { stbuf->st_size = pending_end; }
                         
                         status = 0;                         // SUCCESS
                     }
 
                     // cleanup pointers
-                    //free(dir_entry);
-                    //free(file);
+                    put_block(dir_entry);
+                    pthread_rwlock_unlock(dir_lock(dir_block));
                 }
             }
         }
@@ -357,25 +976,133 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 
     return status;
 }
+#endif
 
 
 /*
-    looks up the input path, ensuring that it is a directory, and then
-        lists the contents of that path. Uses include 'stat', 'ls -a',
-        or even TAB completion from terminal.
+    Called by list_directory() for each name it lists, with the first
+    block of the directory or file it names.
+*/
+typedef void (*cs1550_lister)(void *ctx, const char *name, long start);
 
-    NOTE: The output is emulated within FUSE by using the filler() method
 
-    RETURNS:    0           SUCCESS
-                -ENOENT     directory is not valid, or not found
+/*
+    Lists the directories in the root (dir_name NULL) or the files in the
+    directory dir_name, every block of it, handing each name to fill.
 
-    REFERENCE: man -s 2 readdir
+    RETURNS:    0           SUCCESS
+                -ENOENT     the directory was not found
+                -EIO        the root, or a block of the directory, could not be read
 */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi)
+static int list_directory(char *dir_name, cs1550_lister fill, void *ctx)
 {
-    // Since we're building with -Wall (all warnings reported) we need
-    // to "use" every parameter, so let's just cast them to void to
+    int status = 0;                                 // default to good
+    int num;                                        // used to iterate through entries
+
+    if (dir_name == NULL) {
+        // get reference to the root struct
+        pthread_rwlock_rdlock(&root_lock);
+        cs1550_root_directory *root = get_root();   // pointer to root of disk file
+        if (root == NULL) { status = -EIO; }        // ERROR: could not read disk
+
+        // list contents of root directory (directories only), every block of it
+        cs1550_root_directory *list = root;
+        long block = super.nRootBlock;
+        long steps = 0;                                                     // guards against a corrupt (looping) list
+        while (list != NULL) {
+            for (num=0; (num < list->nDirectories) && (num < (int)MAX_DIRS_IN_ROOT); num++) {
+                fill(ctx, list->directories[num].dname, list->directories[num].nStartBlock);  // add this directory to the output
+            }
+
+            block = ROOT_NEXT(list);                                        // on to the next block of the list
+            if (list != root) { put_block(list); }
+            list = ((block > 0) && (steps++ < super.nBlocks)) ? get_root_block(block) : NULL;
+        }
+
+        put_block(root);
+        pthread_rwlock_unlock(&root_lock);
+
+    } else {
+        // list contents of subdirectory (filenames only)
+
+        // get the subdirectory's location that was referenced
+        long offset = find_directory(dir_name);
+
+        if (offset < 0) {
+            status = -ENOENT;                                               // ERROR: directory not found
+
+        } else {
+            // get reference to subdirectory's contents using offset
+            pthread_rwlock_rdlock(dir_lock(offset));
+
+            // output the filename and extension of every block of the directory
+            char filename[MAX_LENGTH];
+            long block = offset;
+            long steps = 0;                                                 // guards against a corrupt (looping) list
+            while ((block > 0) && (steps++ < super.nBlocks)) {
+                cs1550_directory_entry *dir_entry = get_directory(block);   // read in subdir struct
+                if (dir_entry == NULL) {
+                    status = -EIO;                                          // ERROR: could not read disk
+                    break;
+                }
+
+                for (num=0; (num < dir_entry->nFiles) && (num < (int)MAX_FILES_IN_DIR); num++) {
+                    // see if file has extension
+                    strcpy(filename, dir_entry->files[num].fname);
+                    if (strlen(dir_entry->files[num].fext) > 0) {
+                        strcat(filename, ".");
+                        strcat(filename, dir_entry->files[num].fext);
+                    }
+                    fill(ctx, filename, dir_entry->files[num].nStartBlock); // add this file to the output
+                }
+
+                long next = DIR_NEXT(dir_entry);                            // on to the next block of the list
+                put_block(dir_entry);
+                block = next;
+            }
+
+            pthread_rwlock_unlock(dir_lock(offset));
+        }
+    }
+
+    return status;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+// What cs1550_readdir hands list_directory() to fill with
+struct cs1550_fill
+{
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static void fill_dir(void *ctx, const char *name, long start)
+{
+    (void) start;
+
+    struct cs1550_fill *fill = (struct cs1550_fill*)ctx;
+    fill->filler(fill->buf, name, NULL, 0);
+}
+
+
+/*
+    looks up the input path, ensuring that it is a directory, and then
+        lists the contents of that path. Uses include 'stat', 'ls -a',
+        or even TAB completion from terminal.
+
+    NOTE: The output is emulated within FUSE by using the filler() method
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     directory is not valid, or not found
+
+    REFERENCE: man -s 2 readdir
+*/
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi)
+{
+    // Since we're building with -Wall (all warnings reported) we need
+    // to "use" every parameter, so let's just cast them to void to
     // satisfy the compiler
     (void) offset;
     (void) fi;
@@ -384,7 +1111,6 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     char dir_name[MAX_LENGTH];                      // holds directory name
     char filename[MAX_LENGTH];                      // holds filename
-    int num;                                        // used to iterate through entries
 
 
     if (strlen(path) > MAX_LENGTH) {
@@ -404,183 +1130,361 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             status = -ENOENT;                       // ERROR: given a path that is not a subdir within root
 
         } else {
-            // open the disk file
-            FILE *disk = fopen(DISK, "rb");         // open with respect to binary mode
-
-            if (disk == NULL) {
-                // ERROR: could not open disk
-
-            } else {
-
-                // the filler function allows us to add entries to the listing
-                filler(buf, ".", NULL, 0);                                              // default output
-                filler(buf, "..", NULL, 0);                                             // default output
-
-                // get reference to the root struct
-                cs1550_root_directory root;                                             // pointer to root of disk file
-                fread(&root, sizeof(cs1550_root_directory), 1, disk);                   // put first 512bytes into root struct
-
-                if (scan_result <= 0) {
-
-                    // list contents of root directory (directories only)
-                    for (num=0; num < root.nDirectories; num++) {
-                        filler(buf, root.directories[num].dname, NULL, 0);              // add this directory to the output
-                    }
-                    
-                } else {
-                    // list contents of subdirectory (filenames only)
-
-                    // get the subdirectory's location that was referenced
-                    long offset = 0;
-                    for (num=0; num < root.nDirectories; num++) {
-                        if (strcmp(root.directories[num].dname, dir_name) == 0) {
-                            offset = root.directories[num].nStartBlock * BLOCK_SIZE;    // found the reference
-                        }
-                    }
-
-                    // get reference to subdirectory's contents using offset
-                    cs1550_directory_entry dir_entry;
-                    fseek(disk, offset, SEEK_SET);                                      // goto subdir's location on disk
-                    fread(&dir_entry, sizeof(cs1550_directory_entry), 1, disk);         // read in subdir struct
-
-                    // output the filename, extension, and filesize
-                    char filename[MAX_LENGTH];
-                    for (num=0; num < dir_entry.nFiles; num++) {
-                        // see if file has extension
-                        strcpy(filename, dir_entry.files[num].fname);
-                        if (strlen(dir_entry.files[num].fext) > 0) {
-                            strcat(filename, ".");
-                            strcat(filename, dir_entry.files[num].fext);
-                        }
-                        filler(buf, filename, NULL, 0);                                 // add this file to the output
-                    }
-                }
+            // the filler function allows us to add entries to the listing
+            filler(buf, ".", NULL, 0);                                              // default output
+            filler(buf, "..", NULL, 0);                                             // default output
 
-                fclose(disk);                                                           // close the disk file
-            }
+            struct cs1550_fill fill = { buf, filler };
+            status = list_directory((scan_result <= 0) ? NULL : dir_name, fill_dir, &fill);
+            if (status == -EIO) { status = 0; }     // could not read disk: an empty listing, as always
         }
     }
 
    return status;
 }
+#endif
 
 
 /*
-    Adds the new directory to the root level ONLY, and updates
+    Adds the new directory dir_name to the root level ONLY, and updates
         the .disk file appropriately by adding an entry in the 
         root's list of directories and pointing to an entry for
         the new directory within block on disk.
 
     RETURNS:    0               SUCCESS
                 -ENAMETOOLONG   directory name too long
-                -EPERM          directory is not within the root directory
                 -EEXIST         directory already exists
                 -ENOSPC         no space left on disk to create
                 -ENOENT         disk file could not be opened
+                -ENOMEM         out of memory
 */
-static int cs1550_mkdir(const char *path, mode_t mode)
+static int make_directory(char *dir_name)
 {
-    (void) mode;
-
     int status = 0;
     long free_block;
-    char dir_name[MAX_LENGTH];
-    char file[MAX_LENGTH];
-    FILE *disk;
-
-    // if the path contains a slash within the string then
-    //      it's not within the root directory
-    int scan_result = sscanf(path, "/%[^/]/%[^.]", dir_name, file);
 
+    reclaim_space(2);                                           // a block for it, maybe one for the root
+    journal_begin();                                            // the new directory, root and bitmap commit together
+    pthread_rwlock_wrlock(&root_lock);                          // one directory added at a time
 
-    if (scan_result != 1) {
-        status = -EPERM;                                        // ERROR: can ONLY create dir within '/' root
 
-    } else if (strlen(dir_name) > MAX_FILENAME) {
+    if (strlen(dir_name) > MAX_FILENAME) {
         status = -ENAMETOOLONG;                                 // ERROR: directory name too long
 
+    } else if (find_directory(dir_name) >= 0) {
+        status = -EEXIST;                                       // ERROR: directory already exists
+
     } else if ((free_block = find_free_block()) == -1) {
         status = -ENOSPC;                                       // ERROR: no space left on disk
 
     } else {
         /* TRY TO CREATE THE DIRECTORY */
 
-        // open the disk file
-        disk = fopen(DISK, "r+b");                              // open for reading + writing (binary)
+        // get the last block of the root within the disk file; new directories go there
+        long last_block = dir_index_last(DIR_INDEX_ROOT);
+        if (last_block < 0) { last_block = super.nRootBlock; }
+        cs1550_root_directory *root = get_root_block(last_block);           // pointer to root of disk file
 
-        if (disk == NULL) {
-            status = -ENOENT;                                   // ERROR: file not opened successfully
+        if (root == NULL) {
+            release_block(free_block);
+            status = -ENOENT;                                               // ERROR: disk not read successfully
 
         } else {
-            // get the root within the disk file
-            cs1550_root_directory root;                                         // pointer to root of disk file
-            fread(&root, sizeof(cs1550_root_directory), 1, disk);               // root in disk exists within first 512bytes
-
-            // make sure the root can hold another directory listing
-            if (root.nDirectories >= MAX_DIRS_IN_ROOT) {
-                status = -ENOSPC;                                               // ERROR: not enough space
+            // make sure the root can hold another directory listing, or chain on another block
+            if ((root->nDirectories >= (int)MAX_DIRS_IN_ROOT) &&
+                ((status = grow_root(&last_block, &root)) != 0)) {
+                release_block(free_block);                                      // ERROR: no room for another block of the root
 
             } else {
                 // create directory inside the free block
                 cs1550_directory_entry *new_dir;                                // create a new directory struct to put in free block
-                new_dir = (struct cs1550_directory_entry*)calloc(1, sizeof(struct cs1550_directory_entry));
-                new_dir->nFiles = 0;                                            // no files exist at first
-
-                fseek(disk, free_block * BLOCK_SIZE, SEEK_SET);                 // goto free block
-                fwrite(new_dir, sizeof(cs1550_directory_entry), 1, disk);       // write new dir entry to disk
+                new_dir = (struct cs1550_directory_entry*)calloc(1, block_size);
 
                 // create root dir struct
                 struct cs1550_directory *new_dir_entry;                         // create a new directory stub
                 new_dir_entry = (struct cs1550_directory*)calloc(1, sizeof(struct cs1550_directory));
 
-                strcpy(new_dir_entry->dname, dir_name);                         // name of the actual directory
+                if ((new_dir == NULL) || (new_dir_entry == NULL) ||
+                    (dir_index_insert(DIR_INDEX_ROOT, dir_name, "", free_block, last_block, root->nDirectories) != 0)) {
+                    release_block(free_block);
+                    status = -ENOMEM;                                           // ERROR: out of memory
 
-                new_dir_entry->nStartBlock = free_block;                        // make the start block the beginning of the free block found
+                } else {
+                    new_dir->nFiles = 0;                                        // no files exist at first
+
+                    cache_write_meta_block(free_block, new_dir);                // write new dir entry to disk
 
-                root.directories[root.nDirectories] = *new_dir_entry;           // add directory to list of valid directories
-                root.nDirectories++;
+                    strcpy(new_dir_entry->dname, dir_name);                     // name of the actual directory
 
-                // write out the root to disk
-                fseek(disk, 0, SEEK_SET);     // goto free block
-                fwrite(&root, sizeof(struct cs1550_root_directory), 1, disk);   // write root to disk
+                    new_dir_entry->nStartBlock = free_block;                    // make the start block the beginning of the free block found
 
+                    root->directories[root->nDirectories] = *new_dir_entry;     // add directory to list of valid directories
+                    root->nDirectories++;
+                    dir_index_set_last(free_block, free_block);                 // its only block, for now
+
+                    // write out the root to disk
+                    cache_write_meta_block(last_block, root);                   // write root to disk
+                }
 
                 // free up space
                 free(new_dir);
                 free(new_dir_entry);
             }
+
+            put_block(root);
         }
     }
-    
+
+    pthread_rwlock_unlock(&root_lock);
+    journal_end();
+
+    return status;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+    Creates the directory named by path, which must be in the root (see
+    make_directory).
+*/
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+    (void) mode;
+
+    char dir_name[MAX_LENGTH];
+    char file[MAX_LENGTH];
+
+    if (strlen(path) >= MAX_LENGTH) {
+        return -ENAMETOOLONG;                                   // ERROR: directory name too long
+    }
+
+    // if the path contains a slash within the string then
+    //      it's not within the root directory
+    int scan_result = sscanf(path, "/%[^/]/%[^.]", dir_name, file);
+    if (scan_result != 1) {
+        return -EPERM;                                          // ERROR: can ONLY create dir within '/' root
+    }
+
+    return make_directory(dir_name);
+}
+#endif
+
+
+/*
+    Removes the directory dir_name from the root, once it holds no files:
+    the last directory of the root moves into its place (see shrink_list)
+    and every block of its list is freed. *start is set to the first block
+    it had.
+
+    RETURNS:    0               SUCCESS
+                -ENOENT         no such directory
+                -ENOTEMPTY      it still holds files
+                -EIO            the root, or a block of the directory, could not be read
+*/
+static int remove_directory(char *dir_name, long *start)
+{
+    long dir_block = find_directory(dir_name);
+    if (dir_block < 0) { return -ENOENT; }                      // ERROR: directory not found
+
+    journal_begin();                                            // the root, the index and the bitmap commit together
+    pthread_rwlock_wrlock(dir_lock(dir_block));                 // nothing is added to it meanwhile
+    pthread_rwlock_wrlock(&root_lock);                          // one directory added or removed at a time
+
+    int status = 0;
+    long home;
+    int slot;
+    if (dir_index_find(DIR_INDEX_ROOT, dir_name, "", &home, &slot) != dir_block) {
+        status = -ENOENT;                                       // ERROR: removed (or replaced) meanwhile
+
+    } else {
+        long block = dir_block;                                 // make sure every block of it is empty
+        long steps = 0;                                         // guards against a corrupt (looping) list
+        while ((block > 0) && (steps++ < super.nBlocks) && (status == 0)) {
+            cs1550_directory_entry *dir_entry = get_directory(block);
+            if (dir_entry == NULL) { status = -EIO; break; }    // ERROR: could not read disk
+            if (dir_entry->nFiles > 0) { status = -ENOTEMPTY; } // ERROR: still holds files
+            block = DIR_NEXT(dir_entry);
+            put_block(dir_entry);
+        }
+    }
+
     if (status == 0) {
-        fclose(disk);           // close the disk
-        write_bitmap();         // update the bitmap on disk   
+        struct cs1550_directory moved;                          // the directory that takes its place in the root
+        int moves = shrink_list(DIR_INDEX_ROOT, super.nRootBlock, home, slot,
+            offsetof(cs1550_root_directory, directories), sizeof(struct cs1550_directory), ROOT_NEXT_AT, &moved);
+
+        if (moves < 0) {
+            status = moves;                                     // ERROR: could not read the root
+
+        } else {
+            if (moves) { dir_index_insert(DIR_INDEX_ROOT, moved.dname, "", moved.nStartBlock, home, slot); }
+            dir_index_remove(DIR_INDEX_ROOT, dir_name, "");
+            dir_index_remove(dir_block, "", "");                // ... and the record of its list
+
+            // free every block of its list
+            long block = dir_block;
+            long steps = 0;
+            while ((block > 0) && (steps++ < super.nBlocks)) {
+                cs1550_directory_entry *dir_entry = get_directory(block);
+                if (dir_entry == NULL) { break; }               // ERROR: could not read disk; the rest stay USED
+                long next = DIR_NEXT(dir_entry);
+                put_block(dir_entry);
+                release_run(block, 1);
+                block = next;
+            }
+            *start = dir_block;
+        }
     }
 
+    pthread_rwlock_unlock(&root_lock);
+    pthread_rwlock_unlock(dir_lock(dir_block));
+    journal_end();
+
     return status;
 }
 
 
+#ifdef CS1550_PATH_HANDLERS
 /* 
- * Removes a directory.
+ * Removes a directory, which must be in the root and hold no files (see
+ * remove_directory).
  */
 static int cs1550_rmdir(const char *path)
 {
-    (void) path;
-    return 0;
+    char dir_name[MAX_LENGTH];
+    char file[MAX_LENGTH];
+
+    if (strcmp(path, "/") == 0) {
+        return -EBUSY;                                          // ERROR: the root stays
+    }
+    if (strlen(path) >= MAX_LENGTH) {
+        return -ENOENT;                                         // ERROR: too long to name a directory
+    }
+
+    int scan_result = sscanf(path, "/%[^/]/%[^.]", dir_name, file);
+    if (scan_result != 1) {
+        return -ENOTDIR;                                        // ERROR: directories are only in the root
+    }
+    if (strlen(dir_name) > MAX_FILENAME) {
+        return -ENOENT;                                         // ERROR: too long to name a directory
+    }
+
+    long start;
+    return remove_directory(dir_name, &start);
 }
+#endif
 
 
 /*
-    Does the actual creation of a file. Mode and dev can be ignored.
-
-    Adds a new file to a subdirectory, and updates the .disk file
+    Does the actual creation of a file. Adds the new file filename.ext
+    (ext may be empty) to the directory dir, and updates the .disk file
     appropriately with the modified directory entry structure.
 
     root->directories[dir_num].nStartBlock
     directory_entry
     file_directory
 
+    RETURNS:    0               SUCCESS
+                -ENOENT         the directory does not exist
+                -EEXIST         file already exists
+                -ENOSPC         no space left on disk
+                -ENOMEM         out of memory
+                -EIO            the directory could not be read
+*/
+static int make_file(char *dir, char *filename, char *ext)
+{
+    int status = 0;                             // assume SUCCESS
+
+    // make sure the filename/ext has not already been created
+
+    // get the directory location
+    long dir_block = find_directory(dir);               // returns the starting block of the directory entry
+    if (dir_block < 0) {
+        return -ENOENT;                                 // ERROR: directory not found
+    }
+
+    reclaim_space(2);                                   // a block for it, maybe one for the directory
+    journal_begin();                                    // the file, its directory and the bitmap commit together
+    pthread_rwlock_wrlock(dir_lock(dir_block));         // nobody else adds to (or reads) the directory meanwhile
+
+    if (find_directory(dir) != dir_block) {             // removed meanwhile
+        pthread_rwlock_unlock(dir_lock(dir_block));
+        journal_end();
+        return -ENOENT;                                 // ERROR: directory not found
+    }
+
+    // new files go into the last block of the directory
+    long last_block = dir_index_last(dir_block);
+    if (last_block < 0) { last_block = dir_block; }
+    cs1550_directory_entry *dir_entry;
+    dir_entry = get_directory(last_block);              // gets the actual dir entry struct
+
+    if (dir_entry == NULL) {
+        status = -EIO;                                  // ERROR: could not read disk
+
+    } else if (find_file(dir_block, filename, ext, NULL) >= 0) {
+        status = -EEXIST;                               // ERROR: file already exists
+
+    } else {
+        // check if space exists
+        long free_block;
+        if ((free_block = find_free_block()) == -1) {
+            status = -ENOSPC;                           // ERROR: no space left on disk
+
+        } else if ((dir_entry->nFiles >= (int)MAX_FILES_IN_DIR) &&
+                   ((status = grow_directory(dir_block, &last_block, &dir_entry)) != 0)) {
+            release_block(free_block);                  // ERROR: no room for another block of the directory
+
+        } else {
+            // create the file
+            cs1550_file_directory *new_file;            // create a new file dir struct
+            new_file = (cs1550_file_directory*)calloc(1, sizeof(cs1550_file_directory));
+            cs1550_disk_block *start = (cs1550_disk_block*)calloc(1, block_size);
+
+            if ((new_file == NULL) || (start == NULL) ||
+                (dir_index_insert(dir_block, filename, ext, free_block, last_block, dir_entry->nFiles) != 0)) {
+                release_block(free_block);
+                status = -ENOMEM;                       // ERROR: out of memory
+
+            } else {
+                strcpy(new_file->fname, filename);      // file name
+                strcpy(new_file->fext, ext);            // extension name
+                new_file->nStartBlock = free_block;     // offset on disk of starting block
+                new_file->fsize = 0;                    // default size
+
+                // start out with an empty data block (CHAIN) or an empty index block (EXTENTS)
+                cache_write_meta_block(free_block, start);
+                put_block_map(block_map_drop(free_block));  // a map some late reader built of a file deleted from here
+
+
+                // add to directory entry
+                dir_entry->files[dir_entry->nFiles] = *new_file;    // add this file to the list of files in the directory
+                dir_entry->nFiles++;                                // increment number of valid files in this directory
+
+
+                // write out the directory to disk
+                cache_write_meta_block(last_block, dir_entry);                  // write directory to disk
+            }
+
+            free(start);
+            free(new_file);
+        }
+    }
+
+    // cleanup pointers
+    put_block(dir_entry);
+    pthread_rwlock_unlock(dir_lock(dir_block));
+    journal_end();
+
+    return status;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+    Creates the file named by path (see make_file). Mode and dev can be
+    ignored.
+
     RETURNS:    0               SUCCESS
                 -ENAMETOOLONG   file name is beyond 8.3 characters
                 -EPERM          file is trying to be created in root dir
@@ -615,6 +1519,7 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
             In the case of an input failure before any data could be successfully read, 
             EOF is returned.
         */
+        dir[0] = filename[0] = ext[0] = '\0';      // parts the path doesn't have stay empty
         int scan_result = sscanf(path, "/%[^/]/%[^.].%s", dir, filename, ext);
 
         if (scan_result == 2) { ext[0] = '\0';}     // make extension NULL if blank
@@ -630,303 +1535,2075 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
             status = -EPERM;                        // ERROR: cannot create file in root
 
         } else {
-            // make sure the filename/ext has not already been created
+            status = make_file(dir, filename, ext);
+        }
+    }
 
-            // get the directory location
-            long dir_block = find_directory(dir);               // returns the starting block of the directory entry
+    return status;
+}
+#endif
 
-            cs1550_directory_entry *dir_entry;
-            dir_entry = get_directory(dir_block);               // gets the actual dir entry struct
 
-            if (dir_block < 0) {
-                status = -ENOENT;                               // ERROR: directory not found
+static void drop_pending(struct cs1550_block_map *bmap);       /* forgets the appends held back for a file (see write_file) */
 
-            } else if (dir_entry->nFiles >= MAX_FILES_IN_DIR) {
-                status = -ENOSPC;                               // ERROR: max number of files created in this directory
 
-            } else {
-                // get the list of files for this directory
-                cs1550_file_directory *file = get_file(dir_entry, filename, ext);
+/*
+    Takes the file filename.ext out of the directory dir (the last file of
+    the directory moves into its place, see shrink_list) and puts its
+    blocks on the list of blocks to free (see cs1550reclaim.c), all in one
+    transaction, so that this takes the same time however big the file is.
+    Requests still working on the file (or holding it open) find it gone
+    once they get its data lock. *start is set to the first block it had.
 
-                if (file == NULL) {
-                    // check if space exists
-                    long free_block;
-                    if ((free_block = find_free_block()) == -1) {
-                        status = -ENOSPC;                           // ERROR: no space left on disk
+    RETURNS:    0           SUCCESS
+                -ENOENT     no such file
+                -EIO        the directory could not be read
+*/
+static int remove_file(char *dir, char *filename, char *ext, long *start)
+{
+    cs1550_file_directory file;
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if (dir_block < 0) { return (int)dir_block; }               // ERROR: file not found, or unreadable
+
+    journal_begin();                                            // the directory, the index and the orphan list commit together
+    struct cs1550_block_map *bmap = block_map_peek(file.nStartBlock);
+    if (bmap != NULL) { pthread_rwlock_wrlock(&bmap->lock); }   // whoever is reading or writing it finishes first
+
+    pthread_rwlock_wrlock(dir_lock(dir_block));
+
+    int status = -ENOENT;
+    int slot;
+    long home = find_file(dir_block, filename, ext, &slot);
+    if (home >= 0) {
+        cs1550_directory_entry *dir_entry = get_directory(home);
+        if (dir_entry == NULL) {
+            status = -EIO;                                      // ERROR: could not read the directory
+        } else if ((slot < dir_entry->nFiles) && (dir_entry->files[slot].nStartBlock == file.nStartBlock)) {
+            status = 0;                                         // still the file looked up (not removed, nor replaced)
+        }
+        put_block(dir_entry);
+    }
 
-                    } else {
-                        // create the file
-                        cs1550_file_directory *new_file;            // create a new file dir struct
-                        new_file = (cs1550_file_directory*)calloc(1, sizeof(cs1550_file_directory));
+    if (status == 0) {
+        cs1550_file_directory moved;                            // the file that takes its place in the directory
+        int moves = shrink_list(dir_block, dir_block, home, slot,
+            offsetof(cs1550_directory_entry, files), sizeof(cs1550_file_directory), DIR_NEXT_AT, &moved);
 
-                        strcpy(new_file->fname, filename);          // file name
-                        strcpy(new_file->fext, ext);                // extension name
-                        new_file->nStartBlock = find_free_block();  // offset on disk of starting block
-                        new_file->fsize = 0;                        // default size
+        if (moves < 0) {
+            status = moves;                                     // ERROR: could not read the directory
 
+        } else {
+            if (moves) { dir_index_insert(dir_block, moved.fname, moved.fext, moved.nStartBlock, home, slot); }
+            dir_index_remove(dir_block, filename, ext);
+        }
+    }
 
-                        // add to directory entry
-                        dir_entry->files[dir_entry->nFiles] = *new_file;    // add this file to the list of files in the directory
-                        dir_entry->nFiles++;                                // increment number of valid files in this directory
+    pthread_rwlock_unlock(dir_lock(dir_block));
 
+    if (status == 0) {
+        // nothing finds its map now; one built since the peek above is waited for too
+        struct cs1550_block_map *dropped = block_map_drop(file.nStartBlock);
+        if ((dropped != NULL) && (dropped != bmap)) { pthread_rwlock_wrlock(&dropped->lock); }
+        struct cs1550_block_map *known = (bmap != NULL) ? bmap : dropped;
 
-                        // write out the root to disk
-                        FILE *disk = fopen(DISK, "r+b");                                    // open read/write binary mode
-                        fseek(disk, dir_block * BLOCK_SIZE, SEEK_SET);                      // goto free block
-                        fwrite(dir_entry, sizeof(struct cs1550_directory_entry), 1, disk);  // write root to disk
-                        fclose(disk);
-                    }
-                } else {
-                    status = -EEXIST;                                       // ERROR: file already exists
-                }
+        if (known != NULL) { drop_pending(known); }             // appends held back go nowhere
 
-                // cleanup pointers
-                //free(file);
+        if (disk_format == CS1550_FORMAT_EXTENTS) {
+            long last = file.nStartBlock;                       // its last index block, which the list links on from
+            if ((known != NULL) && (known->nIndexBlocks > 0)) {
+                last = known->index_blocks[known->nIndexBlocks - 1];
             }
-
-            // cleanup pointers
-            //free(dir_entry);
+            long next, steps = 0;
+            while ((cache_read(&next, sizeof(long), (off_t)last * block_size) == 0) && (next > 0) &&
+                   (steps++ < super.nBlocks)) {
+                last = next;
+            }
+            reclaim_index(file.nStartBlock, last);
+        } else {
+            reclaim_chain(file.nStartBlock);
         }
+
+        if ((dropped != NULL) && (dropped != bmap)) { pthread_rwlock_unlock(&dropped->lock); }
+        put_block_map(dropped);
+        *start = file.nStartBlock;
     }
 
+    if (bmap != NULL) { pthread_rwlock_unlock(&bmap->lock); }
+    put_block_map(bmap);
+    journal_end();
+
     return status;
 }
 
 
+#ifdef CS1550_PATH_HANDLERS
 /*
- * Deletes a file
+ * Deletes a file (see remove_file). Its blocks are freed in the background.
  */
 static int cs1550_unlink(const char *path)
 {
-    (void) path;
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
 
-    return 0;
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                 // ERROR: a directory, or no such file
+
+    long start;
+    return remove_file(dir, filename, ext, &start);
+}
+#endif
+
+
+static int flush_pending(struct cs1550_block_map *bmap);       /* writes out the appends held back for a file (see write_file) */
+
+
+/*
+    Called before a request that may write size bytes of new data: frees
+    blocks of deleted files first if the disk is too full for them (see
+    reclaim_space). The caller holds no lock, nor a journal handle.
+*/
+static void make_room(size_t size) {
+    reclaim_space((long)(size / block_payload()) + 2);                              // the data, a block it straddles, an index block
 }
 
 
 /* 
- * Read size bytes from file into buf starting from offset
+ * Read size bytes from the file dir/filename.ext into buf starting from offset
  *
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+static int read_file(char *dir, char *filename, char *ext, char *buf, size_t size, off_t offset,
    struct fuse_file_info *fi)
 {
-    (void) fi;
-
     // check to make sure path exists
     // check that size is > 0
     // check that offset is <= to the file size
     // read in data
     // set size and return, or error
 
-    char dir[MAX_LENGTH];           // directory
-    char filename[MAX_LENGTH];      // filename
-    char ext[MAX_LENGTH];           // extension
+    // find where each block of the file is on disk
+    struct cs1550_block_map *bmap;
+    int status = get_file_map(dir, filename, ext, fi, &bmap);
+    if (status != 0) { return status; }                                             // ERROR: file not found, or out of memory
 
-    // break path up into directory, filename, and extension
-    int scan_result = sscanf(path, "/%[^/]/%[^.].%s", dir, filename, ext);
+    status = flush_pending(bmap);                                                   // appends held back go to the blocks first
+    if (status != 0) {
+        put_block_map(bmap);
+        return status;                                                              // ERROR: they could not
+    }
+
+    pthread_rwlock_rdlock(&bmap->lock);                                             // no writer may change the file meanwhile
+
+    // check to make sure path (file) still exists, and get its size
+    cs1550_file_directory file;
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if ((dir_block < 0) || !same_file(bmap, &file)) {
+        pthread_rwlock_unlock(&bmap->lock);
+        put_block_map(bmap);
+        return (dir_block < 0) ? (int)dir_block : -ENOENT;                          // ERROR: file not found (or unreadable), or deleted
+    }
+
+    size_t fsize = file.fsize;                                                      // current size of the file
 
     // make sure size and offset are valid
-    if ((size == 0) ||
-        (offset > size)) {
-        return -EFBIG;                                                              // ERROR: offset is beyond file size
+    if ((size == 0) || (offset >= (off_t)fsize)) {
+        pthread_rwlock_unlock(&bmap->lock);
+        put_block_map(bmap);
+        return 0;                                                                   // nothing to read (EOF)
+    }
+    if (size > fsize - offset) {
+        size = fsize - offset;                                                      // never read past EOF
+    }
 
-    } else if (scan_result < 2) {
-        return -EISDIR;                                                             // ERROR: trying to read out a directory
+    // find the block holding the starting offset
+    long payload = block_payload();                                                 // bytes of file data per block
+    long block_num = offset / payload;                                              // the block to start reading from
+    long data_offset = offset % payload;                                            // specific offset within starting block
+    long last_block = (offset + size - 1) / payload;                                // the block holding the last byte
+    long block_loc = file_block(bmap, block_num, 0);                                // store location, on disk, of block
+    size_t bytes_read = 0;                                                          // number of bytes read so far
 
-    } else {
-        // check to make sure path (file) exists by getting the file
-        long dir_block = find_directory(dir);                                       // get block offset to where this dir entry is held
-        cs1550_directory_entry *dir_entry = get_directory(dir_block);               // get the actual dir entry struct
-        cs1550_file_directory *file_entry = get_file(dir_entry, filename, ext);     // get the filename struct
-        long block_loc = file_entry->nStartBlock;                                   // store location, on disk, of block
-
-        // determine how many blocks will be needed to traverse
-        long num_blocks_needed = (1 + (((size - 1) / MAX_DATA_IN_BLOCK)));          // get ceiling value of blocks needed
-        long start_block = offset / MAX_DATA_IN_BLOCK;                              // the block to start writing/appending to
-        long start_offset = offset % MAX_DATA_IN_BLOCK;                             // specific offset within starting block
-        size_t bytes_read = 0;                                                      // number of bytes written so far
-        
-        // read data into buf from disk
-        cs1550_disk_block *disk_block = get_disk_block(block_loc, start_block);     // get data block
-        long block_num, data_offset=0;
-        size_t bytes_left;                                                          // amount of bytes left to write out
-        for (block_num = 0; block_num < num_blocks_needed; block_num++) {
-            bytes_left = size - bytes_read;                                         // calculate amount of bytes left to write
-            data_offset = ((block_num == 0) ? start_offset : 0);                    // if first block, start at proper offset
-
-            // copy over # bytes_left or MAX_DATA_IN_BLOCK to this block
-            strncpy((buf + bytes_read), (disk_block->data + data_offset), ((bytes_left < MAX_DATA_IN_BLOCK) ? bytes_left : MAX_DATA_IN_BLOCK));
-            bytes_read += ((bytes_left < MAX_DATA_IN_BLOCK) ? bytes_left : MAX_DATA_IN_BLOCK);
-
-            // grab another free block if needed
-            if (block_num != (num_blocks_needed - 1)) {                             // -1 to check against 0-based
-                block_loc = find_free_block();                                      // get free block for next write
-                if (block_loc < 0) { return -ENOSPC; }                              // ERROR: no space left
-                disk_block->nNextBlock = block_loc;                                 // store location to next block
-            } else {
-                disk_block->nNextBlock = 0;                                         // store location to next block   
-            }
+    if (file_handle(fi) != NULL) {                                                  // fetch what comes next, if read in order
+        readahead_read(&file_handle(fi)->ra, bmap, offset, size, fsize, payload, !options.use_mmap);
+    }
+
+    // read data into buf from disk, one contiguous run of blocks (or one hole) at a time
+    while (bytes_read < size) {
+        long count;
+        void *run = NULL;
+        if (block_loc > 0) {
+            count = file_run(bmap, block_num, last_block - block_num + 1);          // blocks that can come in with one read
+            run = get_disk_run(block_loc, count);                                   // get data blocks
+            if (run == NULL) { break; }                                             // ERROR: could not read disk
+        } else if (sparse_files()) {
+            count = (block_loc == 0) ? file_run(bmap, block_num, last_block - block_num + 1) : last_block - block_num + 1;
+        } else {
+            break;                                                                  // ERROR: file ended early
+        }
+
+        long i;
+        for (i = 0; (i < count) && (bytes_read < size); i++) {
+            size_t bytes_left = size - bytes_read;                                  // amount of bytes left to read
+            size_t chunk = payload - data_offset;                                   // room left in this block
+            if (bytes_left < chunk) { chunk = bytes_left; }
 
-            // switch to the next block
-            if (block_num != (num_blocks_needed - 1)) {
-                disk_block = get_disk_block(block_loc, block_num+1);                // +1 to get NEXT block number
+            if (run != NULL) {
+                memcpy((buf + bytes_read), (block_data(run, i) + data_offset), chunk);
+            } else {
+                memset(buf + bytes_read, 0, chunk);                                 // a hole reads as zeros
             }
+            bytes_read += chunk;
+            data_offset = 0;                                                        // later blocks start at their beginning
         }
+        if (run != NULL) { put_block(run); }
+
+        block_num += count;
+        block_loc = file_block(bmap, block_num, 0);                                 // switch to the next run
     }
 
-    return size;
+    pthread_rwlock_unlock(&bmap->lock);
+    put_block_map(bmap);
+
+    return bytes_read;
 }
 
 
+#ifdef CS1550_PATH_HANDLERS
 /* 
-    Writes the data passed in via buf into the file at path, starting
-    at the given offset within the file block. Each block will be
-    written back to disk upon completion.
+ * Read size bytes from file into buf starting from offset (see read_file)
+ *
  */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-   off_t offset, struct fuse_file_info *fi)
-{
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+   struct fuse_file_info *fi)
+{
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
+
+    // break path up into directory, filename, and extension
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                             // ERROR: a directory, or no such file
+
+    return read_file(dir, filename, ext, buf, size, offset, fi);
+}
+#endif
+
+
+/*
+    Read size bytes from file starting from offset, the same as
+    cs1550_read, but without copying the data: each contiguous run of the
+    file's blocks becomes one buffer of *bufp that names the run's place in
+    '.disk', so libfuse can splice it from there into the reply (a hole
+    becomes a buffer of zeros). Runs the
+    block cache has changed but not written back yet are written back
+    first; one that can not be (pinned, or the write failed) is copied
+    into a buffer of its own instead.
+
+    In the CHAIN layout every block's data is cut short by the next one's
+    nNextBlock, and splicing pieces that small costs more than copying
+    them, so those files are read into one buffer by cs1550_read.
+
+    RETURNS:    0           SUCCESS; *bufp is set (libfuse frees it, and every mem in it)
+                -errno      the same as cs1550_read
+*/
+static int read_file_buf(char *dir, char *filename, char *ext, struct fuse_bufvec **bufp, size_t size, off_t offset,
+   struct fuse_file_info *fi)
+{
+    if (disk_format != CS1550_FORMAT_EXTENTS) {
+        struct fuse_bufvec *bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+        char *mem = (char*)malloc(size);
+        int res = ((bufv != NULL) && (mem != NULL)) ? read_file(dir, filename, ext, mem, size, offset, fi) : -ENOMEM;
+        if (res < 0) {
+            free(bufv);
+            free(mem);
+            return res;                                                             // ERROR: the same as cs1550_read
+        }
+
+        *bufv = FUSE_BUFVEC_INIT(res);
+        bufv->buf[0].mem = mem;
+        *bufp = bufv;
+        return 0;
+    }
+
+    // find where each block of the file is on disk
+    struct cs1550_block_map *bmap;
+    int status = get_file_map(dir, filename, ext, fi, &bmap);
+    if (status != 0) { return status; }                                             // ERROR: file not found, or out of memory
+
+    status = flush_pending(bmap);                                                   // appends held back go to the blocks first
+    if (status != 0) {
+        put_block_map(bmap);
+        return status;                                                              // ERROR: they could not
+    }
+
+    pthread_rwlock_rdlock(&bmap->lock);                                             // no writer may change the file meanwhile
+
+    // check to make sure path (file) still exists, and get its size
+    cs1550_file_directory file;
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if ((dir_block < 0) || !same_file(bmap, &file)) {
+        pthread_rwlock_unlock(&bmap->lock);
+        put_block_map(bmap);
+        return (dir_block < 0) ? (int)dir_block : -ENOENT;                          // ERROR: file not found (or unreadable), or deleted
+    }
+
+    size_t fsize = file.fsize;                                                      // current size of the file
+    if (offset >= (off_t)fsize) { size = 0; }                                       // nothing to read (EOF)
+    if (size > fsize - offset) {
+        size = fsize - offset;                                                      // never read past EOF
+    }
+
+    long block_num = offset / block_size;                                           // the block to start reading from
+    long data_offset = offset % block_size;                                         // specific offset within starting block
+    long last_block = (size > 0) ? (long)((offset + size - 1) / block_size) : block_num;  // the block holding the last byte
+
+    // at most one buffer per run (or per block, when a run has to be copied)
+    long nbufs = last_block - block_num + 1;
+    struct fuse_bufvec *bufv = (struct fuse_bufvec*)calloc(1, sizeof(struct fuse_bufvec) + nbufs * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        pthread_rwlock_unlock(&bmap->lock);
+        put_block_map(bmap);
+        return -ENOMEM;                                                             // ERROR: out of memory
+    }
+
+    long block_loc = file_block(bmap, block_num, 0);                                // store location, on disk, of block
+    size_t bytes_read = 0;                                                          // number of bytes handed out so far
+    int fd = disk_descriptor();
+
+    if (file_handle(fi) != NULL) {                                                  // spliced from '.disk': have the kernel read ahead
+        readahead_read(&file_handle(fi)->ra, bmap, offset, size, fsize, block_size, 0);
+    }
+
+    while ((bytes_read < size) && (status == 0)) {
+        if (block_loc <= 0) {                                                       // a hole, or past the end of the map
+            if (!sparse_files()) { break; }                                         // ERROR: file ended early
+            long count = (block_loc == 0) ? file_run(bmap, block_num, last_block - block_num + 1) : last_block - block_num + 1;
+            size_t chunk = (size_t)count * block_size - data_offset;
+            if (size - bytes_read < chunk) { chunk = size - bytes_read; }
+
+            struct fuse_buf *buf = &bufv->buf[bufv->count++];                       // zeros, in one buffer
+            buf->size = chunk;
+            buf->fd = -1;
+            buf->mem = calloc(1, chunk);
+            if (buf->mem == NULL) { status = -ENOMEM; break; }                      // ERROR: out of memory
+
+            bytes_read += chunk;
+            data_offset = 0;
+            block_num += count;
+            block_loc = file_block(bmap, block_num, 0);
+            continue;
+        }
+
+        long count = file_run(bmap, block_num, last_block - block_num + 1);         // blocks that sit next to each other on disk
+        int on_disk = cache_clean(block_loc, count);                                // current on '.disk'? (written back if need be)
+        char *copy = NULL;
+        if (!on_disk) {
+            copy = (char*)get_disk_run(block_loc, count);                           // no: copy it out, as cs1550_read does
+            if (copy == NULL) { break; }                                            // ERROR: could not read disk
+        }
+
+        long i;
+        for (i = 0; (i < count) && (bytes_read < size); i++) {
+            size_t chunk = block_size - data_offset;                                // room left in this block
+            if (size - bytes_read < chunk) { chunk = size - bytes_read; }
+
+            off_t pos = (off_t)(block_loc + i) * block_size + data_offset;
+            struct fuse_buf *buf = (bufv->count > 0) ? &bufv->buf[bufv->count - 1] : NULL;
+
+            if (on_disk && (buf != NULL) && (buf->flags & FUSE_BUF_IS_FD) &&
+                (buf->pos + (off_t)buf->size == pos)) {
+                buf->size += chunk;                                                 // carries straight on from the last one
+            } else {
+                buf = &bufv->buf[bufv->count++];
+                buf->size = chunk;
+                if (on_disk) {
+                    buf->flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                    buf->fd = fd;
+                    buf->pos = pos;
+                } else {
+                    buf->fd = -1;
+                    buf->mem = malloc(chunk);
+                    if (buf->mem == NULL) { status = -ENOMEM; break; }              // ERROR: out of memory
+                    memcpy(buf->mem, copy + (size_t)i * block_size + data_offset, chunk);
+                }
+            }
+
+            bytes_read += chunk;
+            data_offset = 0;                                                        // later blocks start at their beginning
+        }
+        if (copy != NULL) { put_block(copy); }
+
+        block_num += count;
+        block_loc = file_block(bmap, block_num, 0);                                 // switch to the next run
+    }
+
+    pthread_rwlock_unlock(&bmap->lock);
+    put_block_map(bmap);
+
+    if (status != 0) {
+        size_t i;
+        for (i = 0; i < bufv->count; i++) { free(bufv->buf[i].mem); }
+        free(bufv);
+        return status;                                                              // ERROR: out of memory
+    }
+
+    if (bufv->count == 0) { bufv->count = 1; }                                      // an empty reply (EOF): one empty buffer
+    *bufp = bufv;
+
+    return 0;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+    Read size bytes from file starting from offset into buffers that name
+    where the data sits in '.disk' (see read_file_buf).
+*/
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+   struct fuse_file_info *fi)
+{
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
+
+    // break path up into directory, filename, and extension
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                             // ERROR: a directory, or no such file
+
+    return read_file_buf(dir, filename, ext, bufp, size, offset, fi);
+}
+#endif
+
+
+/*
+    Copies the next size bytes of src (advancing it) to memory at dst. A
+    pipe may hand them over a piece at a time.
+
+    RETURNS:    the number of bytes copied, fewer than size only if src ran
+                out or could not be read
+*/
+static size_t buf_take(char *dst, struct fuse_bufvec *src, size_t size) {
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = dst;
+
+    size_t got = 0;
+    while (got < size) {
+        ssize_t res = fuse_buf_copy(&mem, src, (enum fuse_buf_copy_flags)0);
+        if (res <= 0) { break; }                    // ERROR: src ran out, or failed
+        got += res;
+    }
+
+    return got;
+}
+
+
+/*
+    Copies the next count whole blocks of src (advancing it) straight to
+    disk block index on, without going through memory: libfuse splices
+    them from the request into '.disk'. The cached copies of those blocks
+    are dropped first, as they would only be stale.
+
+    RETURNS:    the number of bytes written, 0 if they must go through the
+                cache instead (one of the blocks is pinned) or src failed
+*/
+static size_t buf_put_blocks(struct fuse_bufvec *src, long index, long count) {
+    if (!cache_discard(index, count)) { return 0; }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)count * block_size);
+    dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd = disk_descriptor();
+    dst.buf[0].pos = (off_t)index * block_size;
+
+    size_t put = 0;
+    while (put < dst.buf[0].size) {
+        ssize_t res = fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+        if (res <= 0) { break; }                    // ERROR: src ran out, or failed
+        put += res;
+    }
+    if (put > 0) { disk_written(); }
+
+    return put;
+}
+
+
+/*
+    Sets the size in the directory entry of the file filename.ext, in the
+    directory whose first block is dir_block. The caller holds a journal
+    handle.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     no such file
+                -EIO        the directory could not be read
+*/
+static int set_file_size(long dir_block, char *filename, char *ext, size_t size) {
+    pthread_rwlock_wrlock(dir_lock(dir_block));                                     // other files of the directory may be changing too
+    cs1550_directory_entry *dir_entry;                                              // the directory block holding the file
+    long home;                                                                      // ... and where it is
+    cs1550_file_directory *file_entry;                                              // the filename struct
+    int status = get_file(dir_block, filename, ext, &dir_entry, &home, &file_entry);
+    if (status == 0) {
+        file_entry->fsize = size;
+        cache_write_meta_block(home, dir_entry);                                    // write directory to disk
+    }
+
+    // cleanup pointers
+    put_block(dir_entry);
+    pthread_rwlock_unlock(dir_lock(dir_block));
+
+    return status;
+}
+
+
+/*
+    Returns 1 if every block of the file from first to last (0-based) is
+    on disk already, 0 if one of them is in a hole or past the end of the
+    map: writing over them then changes the file's data but not its
+    blocks.
+*/
+static int blocks_mapped(struct cs1550_block_map *bmap, long first, long last) {
+    long block_num = first;
+    while (block_num <= last) {
+        long run = block_map_run(bmap, block_num);
+        if ((run == 0) || (block_map_lookup(bmap, block_num) == 0)) { return 0; }
+        block_num += run;
+    }
+
+    return 1;
+}
+
+
+/* 
+    Writes the data in src into the file dir/filename.ext, which is fsize
+    bytes long, starting at the given offset within the file. The caller
+    holds the file's data lock exclusively and a journal handle. Whole
+    blocks of an EXTENTS file that arrive still sitting in a file
+    descriptor (spliced from /dev/fuse) go straight to '.disk' without
+    being copied; everything else goes through the cache. Blocks past the
+    end of an EXTENTS file hold nothing yet, so they are not read first.
+    In a file that can have holes (see sparse_files) blocks are allocated
+    only for the runs written, filling holes on the way.
+
+    RETURNS:    1+          SUCCESS; the number of bytes written
+                -ENOSPC     no space left
+                -errno      the new size could not be recorded (see set_file_size)
+ */
+static int write_blocks(struct cs1550_block_map *bmap, long dir_block, char *filename, char *ext,
+    size_t fsize, struct fuse_bufvec *src, off_t offset)
+{
+    size_t size = fuse_buf_size(src);
+
+    // grow the chain up to the block holding the last byte, so that the
+    // whole write can be laid out in as few contiguous runs as possible
+    long payload = block_payload();                                                 // bytes of file data per block
+    long block_num = offset / payload;                                              // the block to start writing/appending to
+    long data_offset = offset % payload;                                            // specific offset within starting block
+    long last_block = (offset + size - 1) / payload;                                // the block holding the last byte
+    long first_new = (fsize + payload - 1) / payload;                               // the first block holding no data yet
+    int sparse = sparse_files();
+    if (!sparse) { file_block(bmap, last_block, 1); }                               // may stop short if the disk fills up
+    long block_loc = file_block(bmap, block_num, 0);                                // store location, on disk, of block
+    long fresh = 0;                                                                 // blocks from block_num on just allocated
+    size_t bytes_wrote = 0;                                                         // number of bytes written so far
+
+    // write out the data to file's disk blocks, one contiguous run at a time
+    while (bytes_wrote < size) {
+        if (sparse && (block_loc <= 0)) {                                           // a hole, or past the end of the map
+            block_loc = fill_hole(bmap, block_num, last_block - block_num + 1, &fresh);
+        }
+        if (block_loc <= 0) { break; }                                              // ERROR: no space left
+
+        long count = file_run(bmap, block_num, last_block - block_num + 1);         // blocks that can go out with one write
+        if ((fresh > 0) && (count > fresh)) { count = fresh; }                      // the run may have merged with the next one
+
+        long whole = (long)((size - bytes_wrote) / block_size);                     // whole blocks left to write
+        if (whole > count) { whole = count; }
+        if ((whole > 0) && (data_offset == 0) && (disk_format == CS1550_FORMAT_EXTENTS) &&
+            (src->buf[src->idx].flags & FUSE_BUF_IS_FD)) {
+            size_t put = buf_put_blocks(src, block_loc, whole);                     // straight from the request to '.disk'
+            if (put > 0) {
+                bytes_wrote += put;
+                if (put < (size_t)whole * block_size) {                             // ERROR: the request could not be read
+                    if (fresh > 0) {                                                // what was in the new blocks must not show
+                        long done = (long)(put / block_size);
+                        bytes_wrote -= put % block_size;
+                        disk_punch(block_loc + done, fresh - done, 1);
+                    }
+                    break;
+                }
+                block_num += whole;
+                fresh = (fresh > whole) ? fresh - whole : 0;
+                block_loc = file_block(bmap, block_num, 0);
+                continue;
+            }
+        }
+
+        void *run = NULL;
+        int blank = (disk_format == CS1550_FORMAT_EXTENTS) && ((block_num >= first_new) || (fresh > 0));
+        if (blank && (disk_block_ptr(block_loc) == NULL)) {
+            run = calloc(count, block_size);                                        // new blocks: nothing to keep
+        } else {
+            run = get_disk_run(block_loc, count);                                   // get data blocks (keeps any nNextBlock)
+            if ((run != NULL) && (fresh > 0)) { memset(run, 0, count * block_size); }  // just allocated: nothing to keep
+        }
+        if (run == NULL) { break; }                                                 // ERROR: could not read disk
+
+        long i;
+        size_t short_by = 0;                                                        // bytes src failed to deliver
+        for (i = 0; (i < count) && (bytes_wrote < size) && (short_by == 0); i++) {
+            size_t bytes_left = size - bytes_wrote;                                 // amount of bytes left to write out
+            size_t chunk = payload - data_offset;                                   // room left in this block
+            if (bytes_left < chunk) { chunk = bytes_left; }
+
+            size_t got = buf_take(block_data(run, i) + data_offset, src, chunk);
+            short_by = chunk - got;
+            bytes_wrote += got;
+            data_offset = 0;                                                        // later blocks start at their beginning
+        }
+
+        // write the run back to disk at its own location
+        cache_write(run, count * block_size, (off_t)block_loc * block_size);
+        put_block(run);
+        if (short_by > 0) { break; }                                                // ERROR: the request could not be read
+
+        block_num += count;
+        fresh = (fresh > count) ? fresh - count : 0;
+        block_loc = file_block(bmap, block_num, 0);                                 // switch to the next run
+    }
+
+    if (bytes_wrote == 0) {
+        return -ENOSPC;                                                             // ERROR: no space left
+    }
+
+    // update file size within the file struct and write it back to disk
+    if ((size_t)offset + bytes_wrote > fsize) {
+        int status = set_file_size(dir_block, filename, ext, offset + bytes_wrote);
+        if (status != 0) { return status; }                                         // ERROR: the size could not be recorded
+    }
+
+    return bytes_wrote;
+}
+
+
+static int write_pending(struct cs1550_block_map *bmap);       /* writes out the appends held back for a file (see write_file) */
+
+
+/*
+    A request that allocates a lot of blocks (a long truncate or fallocate,
+    or a write far past the end of a file) does it in steps of at most
+    GROW_BATCH blocks, each its own transaction, the way the reclaimer
+    frees them (see cs1550reclaim.c): in one, its allocations, the links
+    or index blocks recording them and the bitmap blocks marking them
+    would be pinned in the cache all together, and could outgrow it and
+    the log. A crash in between leaves the file as long as the steps made it.
+*/
+#define     GROW_BATCH      8192    /* most blocks one step allocates (one transaction) */
+
+
+/*
+    Called between the runs of a request that allocates a lot of blocks,
+    with done the number it allocated since its step began. Once that is
+    GROW_BATCH, or the transaction is full (see journal_full), the step
+    ends: the file's data lock and the journal handle are let go (the next
+    journal_begin may have to commit, and comes before any lock), and
+    taken again for the next step. The file may have been written,
+    truncated or deleted meanwhile: it is looked up again into file, and
+    any appends held back for it written out first.
+
+    RETURNS:    0           SUCCESS; *done is 0 when a new step began
+                -ENOENT     the file was deleted meanwhile
+                -errno      what was held back could not be written
+*/
+static int grow_step(struct cs1550_block_map *bmap, char *dir, char *filename, char *ext,
+    cs1550_file_directory *file, long *done)
+{
+    if ((*done == 0) || ((*done < GROW_BATCH) && !journal_full())) { return 0; }  // the step goes on
+
+    pthread_rwlock_unlock(&bmap->lock);
+    journal_end();
+    journal_begin();                                                                // the next step (committing this one if it is big)
+    pthread_rwlock_wrlock(&bmap->lock);
+    *done = 0;
+
+    int status = write_pending(bmap);                                               // what was held back meanwhile goes first
+    long dir_block = (status == 0) ? lookup_file(dir, filename, ext, file) : 0;
+    if (dir_block < 0) {
+        status = (int)dir_block;                                                    // ERROR: deleted meanwhile, or unreadable
+    } else if ((status == 0) && !same_file(bmap, file)) {
+        status = -ENOENT;                                                           // ERROR: deleted meanwhile
+    }
+
+    return status;
+}
+
+
+/*
+    Makes the file dir/filename.ext, whose directory entry is file, size
+    bytes long, reading as zeros from its current size on. A file that
+    can have holes (see sparse_files) only has the rest of the block
+    holding its last byte zero'ed, if it has that block: any blocks its map
+    has past that hold zeros already, and what it does not have is a hole.
+    Other files are written with zeros, the way write_file would, in steps
+    (see grow_step). The caller holds the file's data lock exclusively and
+    a journal handle. On return file holds the file's entry as it is now.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     the file was deleted part way
+                -ENOSPC     no space left
+                -ENOMEM     out of memory
+*/
+static int grow_file(struct cs1550_block_map *bmap, char *dir, long dir_block, char *filename, char *ext,
+    cs1550_file_directory *file, size_t size)
+{
+    long payload = block_payload();
+    size_t fsize = file->fsize;
+    size_t zero_to = size;                                                          // zeros are written up to here
+    if (sparse_files()) {
+        zero_to = (fsize + payload - 1) / payload * payload;                        // the end of the block holding the last byte
+        if (zero_to > size) { zero_to = size; }
+        if ((fsize % payload == 0) || (file_block(bmap, fsize / payload, 0) <= 0)) {
+            zero_to = fsize;                                                        // no such block, or it is a hole
+        }
+    }
+
+    int status = 0;
+    char *zeros = NULL;
+    if (zero_to > fsize) {
+        zeros = (char*)calloc(1, MAX_RUN_BYTES);
+        if (zeros == NULL) { status = -ENOMEM; }                                    // ERROR: out of memory
+    }
+
+    long done = 0;                                                                  // blocks written in this step
+    while ((status == 0) && (fsize < zero_to)) {
+        status = grow_step(bmap, dir, filename, ext, file, &done);
+        if (status != 0) { break; }                                                 // ERROR: deleted meanwhile
+        fsize = file->fsize;                                                        // (written or truncated meanwhile)
+        if (fsize >= zero_to) { break; }
+
+        size_t chunk = zero_to - fsize;
+        if (chunk > MAX_RUN_BYTES) { chunk = MAX_RUN_BYTES; }
+
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(chunk);
+        src.buf[0].mem = zeros;
+        int res = write_blocks(bmap, dir_block, filename, ext, fsize, &src, fsize);
+        if (res < 0) { status = res; }                                              // ERROR: no space left
+        else if ((size_t)res < chunk) { status = -ENOSPC; }                         // ERROR: ... part way
+        else {
+            fsize += res;
+            file->fsize = fsize;
+            done += (res + payload - 1) / payload;
+        }
+    }
+    free(zeros);
+
+    if ((status == 0) && (file->fsize < size)) {
+        status = set_file_size(dir_block, filename, ext, size);
+        if (status == 0) { file->fsize = size; }
+    }
+
+    return status;
+}
+
+
+/*
+    Small appends to a file are not written to its blocks one by one.
+    They are held back in memory, in its block map, and written out
+    together once WRITE_HOLD_BYTES of them have piled up, or when the file
+    is written elsewhere, read, flushed (closed), fsync'ed, at the
+    flusher's next tick, or at unmount. Only then are blocks allocated for
+    them, as one run, and the file's size in its directory entry updated,
+    once. getattr counts them in the file's size meanwhile.
+*/
+#define     WRITE_HOLD_MAX      65536       // appends up to this size are held back
+#define     WRITE_HOLD_BYTES    MAX_RUN_BYTES   // most held back for one file
+
+struct cs1550_pending
+{
+    char *data;                             // the bytes held back
+    size_t len;                             // how many
+    size_t room;                            // how many data has room for
+    size_t start;                           // where they go in the file: its size in its directory entry
+    char dir[MAX_FILENAME + 1];             // the file's directory ...
+    char filename[MAX_FILENAME + 1];        // ... name ...
+    char ext[MAX_EXTENSION + 1];            // ... and extension, to find its entry again
+};
+
+
+/*
+    Returns how many bytes may be held back for one file: WRITE_HOLD_BYTES,
+    but no more than a quarter of the block cache, which they go through
+    when written out.
+*/
+static size_t hold_limit(void) {
+    size_t limit = WRITE_HOLD_BYTES;
+    if ((cache_capacity > 0) && ((size_t)cache_capacity * block_size / 4 < limit)) {
+        limit = (size_t)cache_capacity * block_size / 4;
+    }
+
+    return (limit < WRITE_HOLD_MAX) ? WRITE_HOLD_MAX : limit;
+}
+
+
+/*
+    Holds back an append of size bytes at offset to the file dir/filename.ext
+    (see struct cs1550_pending). The caller holds the file's data lock
+    exclusively.
+
+    RETURNS:    1+          SUCCESS; the number of bytes held back
+                0           not an append that can be held back: write it out
+                -ENOENT     no such file
+                -ENOMEM     out of memory
+                -EIO        src could not be read
+*/
+static int hold_append(struct cs1550_block_map *bmap, char *dir, char *filename, char *ext,
+    struct fuse_bufvec *src, off_t offset, size_t size)
+{
+    struct cs1550_pending *pending = bmap->pending;
+
+    if (pending == NULL) {
+        cs1550_file_directory file;
+        long dir_block = lookup_file(dir, filename, ext, &file);
+        if ((dir_block < 0) || !same_file(bmap, &file)) {
+            return (dir_block < 0) ? (int)dir_block : -ENOENT;                      // ERROR: file not found (or unreadable), or deleted
+        }
+        if (offset != (off_t)file.fsize) { return 0; }                              // not at the end of the file
+
+        pending = (struct cs1550_pending*)calloc(1, sizeof(struct cs1550_pending));
+        if (pending == NULL) { return -ENOMEM; }                                    // ERROR: out of memory
+        pending->start = file.fsize;
+        strcpy(pending->dir, dir);
+        strcpy(pending->filename, filename);
+        strcpy(pending->ext, ext);
+        bmap->pending = pending;
+
+    } else if ((offset != (off_t)(pending->start + pending->len)) ||                // not at the end of the file
+               (pending->len + size > hold_limit())) {                              // ... or no room left
+        return 0;
+    }
+
+    if (pending->len + size > pending->room) {
+        size_t room = (pending->room == 0) ? WRITE_HOLD_MAX : 2 * pending->room;
+        while (room < pending->len + size) { room *= 2; }
+        if (room > hold_limit()) { room = hold_limit(); }
+
+        char *data = (char*)realloc(pending->data, room);
+        if (data == NULL) { return -ENOMEM; }                                       // ERROR: out of memory
+        pending->data = data;
+        pending->room = room;
+    }
+
+    size_t got = buf_take(pending->data + pending->len, src, size);
+    pending->len += got;
+
+    if (pending->len == 0) {                                                        // nothing held back after all
+        free(pending->data);
+        free(pending);
+        bmap->pending = NULL;
+    } else {
+        __atomic_store_n(&bmap->pending_end, pending->start + pending->len, __ATOMIC_RELEASE);
+    }
+
+    return (got > 0) ? (int)got : -EIO;
+}
+
+
+/*
+    Called (when set) once appends held back for the file starting at
+    start_block are lost: its size goes back to what is in its directory
+    entry, behind the back of a kernel that may have it cached. The caller
+    holds the file's data lock, so this must not wait on a request.
+*/
+static void (*pending_lost)(long start_block) = NULL;
+
+
+/*
+    Writes the appends held back for a file out to its blocks. The caller
+    holds the file's data lock exclusively and a journal handle.
+
+    RETURNS:    0           SUCCESS (or nothing was held back)
+                -errno      they could not be written, and are lost
+*/
+static int write_pending(struct cs1550_block_map *bmap)
+{
+    struct cs1550_pending *pending = bmap->pending;
+    if (pending == NULL) { return 0; }
+
+    int status = -ENOENT;
+    cs1550_file_directory file;
+    long dir_block = lookup_file(pending->dir, pending->filename, pending->ext, &file);
+    if (dir_block < 0) {
+        status = (int)dir_block;                                                    // ERROR: file not found, or unreadable
+    } else if (same_file(bmap, &file)) {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(pending->len);
+        src.buf[0].mem = pending->data;
+
+        int res = write_blocks(bmap, dir_block, pending->filename, pending->ext, file.fsize, &src, pending->start);
+        status = (res < 0) ? res : ((size_t)res < pending->len) ? -ENOSPC : 0;
+    }
+
+    drop_pending(bmap);
+
+    if ((status != 0) && (pending_lost != NULL)) { pending_lost(bmap->nStartBlock); }
+
+    return status;
+}
+
+
+/*
+    Forgets the appends held back for a file, if there are any: they have
+    been written out, or the file is gone. The caller holds the file's
+    data lock exclusively.
+*/
+static void drop_pending(struct cs1550_block_map *bmap)
+{
+    struct cs1550_pending *pending = bmap->pending;
+    if (pending == NULL) { return; }
+
+    bmap->pending = NULL;
+    __atomic_store_n(&bmap->pending_end, 0, __ATOMIC_RELEASE);
+    free(pending->data);
+    free(pending);
+}
+
+
+/*
+    Writes out the appends held back for a file, if there are any.
+
+    RETURNS:    the same as write_pending
+*/
+static int flush_pending(struct cs1550_block_map *bmap)
+{
+    size_t pending_end = __atomic_load_n(&bmap->pending_end, __ATOMIC_ACQUIRE);
+    if (pending_end == 0) { return 0; }                                             // nothing held back
+
+    make_room(pending_end);                                                         // at most this much
+    journal_begin();                                                                // the new blocks and the size commit together
+    pthread_rwlock_wrlock(&bmap->lock);
+    int status = write_pending(bmap);
+    pthread_rwlock_unlock(&bmap->lock);
+    journal_end();
+
+    return status;
+}
+
+
+/*
+    Writes out the appends held back for every file.
+
+    RETURNS:    0           SUCCESS
+                -errno      those of some file could not be written
+*/
+static int flush_all_pending(void)
+{
+    struct cs1550_block_map **maps;
+    long count = block_map_pending(&maps);
+    if (count < 0) { return (int)count; }                                           // ERROR: out of memory
+
+    int status = 0;
+    long i;
+    for (i = 0; i < count; i++) {
+        int result = flush_pending(maps[i]);
+        if (result != 0) { status = result; }
+        put_block_map(maps[i]);
+    }
+    free(maps);
+
+    return status;
+}
+
+
+/* 
+    Writes the data in src into the file dir/filename.ext, starting at the
+    given offset within the file. Small appends are held back (see struct
+    cs1550_pending); anything else first writes out what was held back,
+    then goes to the file's blocks (see write_blocks). A write that starts
+    past the end of the file first grows it to there (see grow_file).
+ */
+static int write_file(char *dir, char *filename, char *ext, struct fuse_bufvec *src, off_t offset,
+    struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(src);
+
+    // find where each block of the file is on disk
+    struct cs1550_block_map *bmap;
+    int status = get_file_map(dir, filename, ext, fi, &bmap);
+    if (status != 0) { return status; }                                             // ERROR: file not found, or out of memory
+
+    if ((size > 0) && (size <= WRITE_HOLD_MAX)) {
+        pthread_rwlock_wrlock(&bmap->lock);                                         // one writer per file, and no readers
+        int held = hold_append(bmap, dir, filename, ext, src, offset, size);
+        if (held > 0) { __atomic_store_n(&bmap->dirty, BLOCK_MAP_ALL_DIRTY, __ATOMIC_RELEASE); }  // for its next fsync
+        pthread_rwlock_unlock(&bmap->lock);
+        if (held != 0) {
+            put_block_map(bmap);
+            return held;                                                            // held back (or failed)
+        }
+    }
+
+    size_t held = __atomic_load_n(&bmap->pending_end, __ATOMIC_ACQUIRE);
+    cs1550_file_directory file;
+    if (!sparse_files() && (lookup_file(dir, filename, ext, &file) >= 0) &&
+        ((size_t)offset > file.fsize) && ((size_t)offset > held)) {
+        make_room(size + held + (offset - (held > file.fsize ? held : file.fsize)));   // ... and the zeros ahead of it
+    } else {
+        make_room(size + held);                                                     // this, and what was held back
+    }
+    journal_begin();                                                                // new blocks, the map and the size commit together
+    pthread_rwlock_wrlock(&bmap->lock);                                             // one writer per file, and no readers
+
+    status = write_pending(bmap);                                                   // what was held back goes first
+    if (status != 0) {
+        pthread_rwlock_unlock(&bmap->lock);
+        journal_end();
+        put_block_map(bmap);
+        return status;                                                              // ERROR: could not write it
+    }
+
+    // check to make sure path (file) still exists, and get its size
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if ((dir_block < 0) || !same_file(bmap, &file)) {
+        pthread_rwlock_unlock(&bmap->lock);
+        journal_end();
+        put_block_map(bmap);
+        return (dir_block < 0) ? (int)dir_block : -ENOENT;                          // ERROR: file not found (or unreadable), or deleted
+    }
+
+    // make sure size and offset are valid
+    if (size == 0) {
+        pthread_rwlock_unlock(&bmap->lock);
+        journal_end();
+        put_block_map(bmap);
+        return 0;                                                                   // nothing to write
+    }
+
+    if (offset > (off_t)file.fsize) {                                               // the gap reads as zeros
+        status = grow_file(bmap, dir, dir_block, filename, ext, &file, offset);
+        if (status != 0) {
+            pthread_rwlock_unlock(&bmap->lock);
+            journal_end();
+            put_block_map(bmap);
+            return status;                                                          // ERROR: no space left for it
+        }
+    }
+
+    // only file data changes when the write is inside the file, over blocks it has
+    long payload = block_payload();
+    int changes = BLOCK_MAP_ALL_DIRTY;
+    if ((offset + (off_t)size <= (off_t)file.fsize) && blocks_mapped(bmap, offset / payload, (offset + size - 1) / payload)) {
+        changes = BLOCK_MAP_DATA_DIRTY;
+    }
+
+    // a small append that did not fit: start holding back again after it
+    int bytes_wrote = 0;
+    if ((size <= WRITE_HOLD_MAX) && (offset == (off_t)file.fsize)) {
+        bytes_wrote = hold_append(bmap, dir, filename, ext, src, offset, size);
+    }
+    if (bytes_wrote == 0) {
+        bytes_wrote = write_blocks(bmap, dir_block, filename, ext, file.fsize, src, offset);
+    }
+
+    if (bytes_wrote > 0) { __atomic_fetch_or(&bmap->dirty, changes, __ATOMIC_RELEASE); }    // for its next fsync
+    pthread_rwlock_unlock(&bmap->lock);
+    journal_end();
+    put_block_map(bmap);
+
+    return bytes_wrote;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+    Writes the data in src into the file at path (see write_file).
+*/
+static int write_path(const char *path, struct fuse_bufvec *src, off_t offset, struct fuse_file_info *fi)
+{
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
+
+    // break path up into directory, filename, and extension
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                             // ERROR: a directory, or no such file
+
+    return write_file(dir, filename, ext, src, offset, fi);
+}
+
+
+/* 
+    Writes the data passed in via buf into the file at path, starting
+    at the given offset within the file block (see write_file).
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+   off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void*)buf;
+
+    return write_path(path, &src, offset, fi);
+}
+
+
+/*
+    Writes the data in buf into the file at path, the same as cs1550_write,
+    but takes it the way libfuse received it: when it was spliced from
+    /dev/fuse into a pipe, whole blocks go on from there to '.disk' without
+    ever being copied into this process (see write_file).
+ */
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+   struct fuse_file_info *fi)
+{
+    return write_path(path, buf, offset, fi);
+}
+#endif
+
+
+/*
+    Sets the size of the file dir/filename.ext. A shorter file gives the
+    blocks past its new end to the list of blocks to free (see
+    cs1550reclaim.c); a longer one reads as zeros past its old end (see
+    grow_file).
+
+    RETURNS:    0           SUCCESS
+                -EINVAL     a negative size
+                -ENOENT     no such file
+                -ENOSPC     no space left to grow it
+                -ENOMEM     out of memory
+*/
+static int truncate_file(char *dir, char *filename, char *ext, off_t size)
+{
+    if (size < 0) { return -EINVAL; }                                               // ERROR: no such size
+
+    cs1550_file_directory file;
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if (dir_block < 0) { return (int)dir_block; }                                   // ERROR: file not found, or unreadable
+    if (((size_t)size > file.fsize) && !sparse_files()) { make_room(size - file.fsize); }
+
+    struct cs1550_block_map *bmap;
+    int status = get_file_map(dir, filename, ext, NULL, &bmap);
+    if (status != 0) { return status; }                                             // ERROR: file not found, or out of memory
+
+    journal_begin();                                                                // the new end, its size and the orphan list commit together
+    pthread_rwlock_wrlock(&bmap->lock);                                             // no reader or writer meanwhile
+
+    status = write_pending(bmap);                                                   // what was held back goes first
+    dir_block = lookup_file(dir, filename, ext, &file);
+    if ((status == 0) && (dir_block < 0)) {
+        status = (int)dir_block;                                                    // ERROR: deleted meanwhile, or unreadable
+    } else if ((status == 0) && !same_file(bmap, &file)) {
+        status = -ENOENT;                                                           // ERROR: deleted meanwhile
+    }
+
+    if ((status == 0) && ((size_t)size < file.fsize)) {
+        long payload = block_payload();
+        long keep = (size + payload - 1) / payload;                                 // blocks still holding data
+        if ((keep < 1) && !bmap->isExtents) { keep = 1; }                           // a chain always has its start block
+
+        long last = 0;
+        cs1550_disk_block *disk_block = NULL;                                       // the chain's new last block, read before the map is cut
+        if (!bmap->isExtents && (keep < bmap->nBlocks)) {
+            last = block_map_lookup(bmap, keep - 1);
+            disk_block = get_disk_block(last, 0);
+            if (disk_block == NULL) { status = -ENOMEM; }                           // ERROR: out of memory
+        }
+
+        struct cs1550_extent_map *dropped;
+        long count = (status == 0) ? block_map_cut(bmap, keep, &dropped) : 0;
+        if (count < 0) {
+            status = (int)count;                                                    // ERROR: out of memory
+
+        } else if (count > 0) {
+            if (bmap->isExtents) {
+                block_map_save(bmap, (bmap->nIndexBlocks - 1) * MAX_EXTENTS_IN_BLOCK);  // the last index block left ends the file
+                status = reclaim_runs(dropped, count);
+            } else {
+                disk_block->nNextBlock = 0;                                         // the chain ends here now
+                cache_write_meta_block(last, disk_block);
+                reclaim_chain(dropped[0].nStartBlock);                              // the rest of it is still chained together
+            }
+            free(dropped);
+        }
+        put_block(disk_block);
+
+        if (status == 0) { status = set_file_size(dir_block, filename, ext, size); }
+
+    } else if ((status == 0) && ((size_t)size > file.fsize)) {
+        status = grow_file(bmap, dir, dir_block, filename, ext, &file, size);
+    }
+
+    __atomic_store_n(&bmap->dirty, BLOCK_MAP_ALL_DIRTY, __ATOMIC_RELEASE);          // for its next fsync
+    pthread_rwlock_unlock(&bmap->lock);
+    journal_end();
+    put_block_map(bmap);
+
+    return status;
+}
+
+
+/*
+    Files with holes only (see sparse_files): makes sure blocks block_num
+    to last_block of the file dir/filename.ext, whose directory entry is
+    file, are there, filling holes (and the map out to last_block) with
+    newly allocated blocks holding zeros, in steps (see grow_step). The
+    caller holds the file's data lock exclusively and a journal handle.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     the file was deleted part way
+                -ENOSPC     no space left (some may have been allocated)
+                -errno      new blocks could not be zero'ed
+*/
+static int fill_blocks(struct cs1550_block_map *bmap, char *dir, char *filename, char *ext,
+    cs1550_file_directory *file, long block_num, long last_block)
+{
+    long done = 0;                                                                  // blocks allocated in this step
+    while (block_num <= last_block) {
+        int status = grow_step(bmap, dir, filename, ext, file, &done);
+        if (status != 0) { return status; }                                         // ERROR: deleted meanwhile
+
+        long block_loc = file_block(bmap, block_num, 0);
+        if (block_loc > 0) {
+            block_num += block_map_run(bmap, block_num);                            // there already
+            continue;
+        }
+
+        long fresh;
+        block_loc = fill_hole(bmap, block_num, last_block - block_num + 1, &fresh);
+        if (block_loc <= 0) { return -ENOSPC; }                                     // ERROR: no space left
+
+        cache_drop(block_loc, fresh);                                               // they go around the cache ...
+        status = disk_punch(block_loc, fresh, 1);                                   // ... and read back as zeros
+        if (status != 0) { return status; }                                         // ERROR: could not zero them
+
+        block_num += fresh;
+        done += fresh;
+    }
+
+    return 0;
+}
+
+
+/*
+    Makes sure the map of the file dir/filename.ext, whose directory entry
+    is file, reaches block last_block, allocating the blocks it is missing
+    up to there (see file_block) in steps (see grow_step). The caller holds
+    the file's data lock exclusively and a journal handle.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     the file was deleted part way
+                -ENOSPC     no space left (some may have been allocated)
+*/
+static int extend_blocks(struct cs1550_block_map *bmap, char *dir, char *filename, char *ext,
+    cs1550_file_directory *file, long last_block)
+{
+    long done = 0;                                                                  // blocks allocated in this step
+    while (bmap->nBlocks <= last_block) {
+        int status = grow_step(bmap, dir, filename, ext, file, &done);
+        if (status != 0) { return status; }                                         // ERROR: deleted meanwhile
+
+        long before = bmap->nBlocks;
+        long block_num = before + MAX_RUN_BLOCKS - 1;                               // a run at a time
+        if (block_num > last_block) { block_num = last_block; }
+        if (file_block(bmap, block_num, 1) <= 0) { return -ENOSPC; }               // ERROR: no space left
+
+        done += bmap->nBlocks - before;
+    }
+
+    return 0;
+}
+
+
+/*
+    Files with holes only (see sparse_files): makes the bytes from offset
+    to end of the file dir/filename.ext, which is fsize bytes long, read as
+    zeros. The blocks wholly inside the range become a hole and go to the
+    list of blocks to free (see cs1550reclaim.c); those it only touches
+    are written with zeros, where they are not in a hole already. The
+    caller holds the file's data lock exclusively and a journal handle.
+
+    RETURNS:    0           SUCCESS
+                -ENOSPC     no space left for an index block the hole splits off
+                -ENOMEM     out of memory
+*/
+static int punch_blocks(struct cs1550_block_map *bmap, long dir_block, char *filename, char *ext,
+    size_t fsize, off_t offset, off_t end)
+{
+    if (end > (off_t)fsize) { end = fsize; }
+    if (offset >= end) { return 0; }                                                // nothing there to punch
+
+    long first = (offset + block_size - 1) / block_size;                            // the first block wholly inside
+    long last = (end == (off_t)fsize) ? (end + block_size - 1) / block_size : end / block_size;  // one past the last (past EOF is a hole)
+    if (first > last) { first = last = end / block_size; }                          // one block, touched in the middle
+
+    // the blocks at the edges, that are only partly inside
+    off_t edges[2][2] = { { offset, (off_t)first * block_size }, { (off_t)last * block_size, end } };
+    char *zeros = NULL;
+    int status = 0, e;
+    for (e = 0; (e < 2) && (status == 0); e++) {
+        off_t from = (edges[e][0] > offset) ? edges[e][0] : offset;
+        off_t to = (edges[e][1] < end) ? edges[e][1] : end;
+        if ((from >= to) || (file_block(bmap, from / block_size, 0) <= 0)) { continue; }   // nothing, or a hole already
+
+        if ((zeros == NULL) && ((zeros = (char*)calloc(1, block_size)) == NULL)) {
+            status = -ENOMEM;                                                       // ERROR: out of memory
+            break;
+        }
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(to - from);
+        src.buf[0].mem = zeros;
+        int res = write_blocks(bmap, dir_block, filename, ext, fsize, &src, from);
+        if (res < 0) { status = res; }                                              // ERROR: could not write them
+    }
+    free(zeros);
+
+    // and the ones in between, that the map has
+    if (last > bmap->nBlocks) { last = bmap->nBlocks; }
+    if ((status == 0) && (first < last)) {
+        struct cs1550_extent_map *dropped;
+        long count;
+        status = block_map_replace(bmap, first, last - first, BLOCK_MAP_HOLE, &dropped, &count);
+        if (dropped != NULL) {                                                      // the map changed, even if it was not written
+            int res = reclaim_runs(dropped, count);                                 // so the runs it dropped are freed either way
+            if (status == 0) { status = res; }
+            free(dropped);
+        }
+    }
+
+    return status;
+}
+
+
+/*
+    Allocates space for length bytes of the file dir/filename.ext from
+    offset on (mode 0), so that writing them can not run out of it, and
+    grows the file to there; with FALLOC_FL_KEEP_SIZE the blocks are only
+    allocated, past the end of the file if need be. New blocks read as
+    zeros. With FALLOC_FL_PUNCH_HOLE (and FALLOC_FL_KEEP_SIZE, as Linux
+    requires) the range is made to read as zeros instead, and the blocks
+    wholly inside it are given back (see punch_blocks).
+
+    RETURNS:    0           SUCCESS
+                -EINVAL     a negative offset, or a length not above 0
+                -EFBIG      offset + length is too large
+                -EOPNOTSUPP any other mode, or a hole in a file that can not have them (see sparse_files)
+                -ENOENT     no such file
+                -ENOSPC     no space left
+                -ENOMEM     out of memory
+*/
+static int fallocate_file(char *dir, char *filename, char *ext, int mode, off_t offset, off_t length)
+{
+    if ((offset < 0) || (length <= 0)) { return -EINVAL; }                         // ERROR: no such range
+    if (offset > INT64_MAX - length) { return -EFBIG; }                            // ERROR: past any file size
+
+    int punch = (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE));
+    if (!punch && (mode != 0) && (mode != FALLOC_FL_KEEP_SIZE)) { return -EOPNOTSUPP; }   // ERROR: collapsing, zeroing, ...
+    if (punch && !sparse_files()) { return -EOPNOTSUPP; }                           // ERROR: no holes in this image
+
+    cs1550_file_directory file;
+    long dir_block = lookup_file(dir, filename, ext, &file);
+    if (dir_block < 0) { return (int)dir_block; }                                   // ERROR: file not found, or unreadable
+    if (!punch && !sparse_files() && (offset > (off_t)file.fsize)) {
+        make_room(offset + length - file.fsize);                                    // zeros from the end of the file on
+    } else if (!punch) {
+        make_room(length);
+    }
+
+    struct cs1550_block_map *bmap;
+    int status = get_file_map(dir, filename, ext, NULL, &bmap);
+    if (status != 0) { return status; }                                             // ERROR: file not found, or out of memory
+
+    journal_begin();                                                                // the new blocks (or the hole), the map and the size commit together
+    pthread_rwlock_wrlock(&bmap->lock);                                             // no reader or writer meanwhile
+
+    status = write_pending(bmap);                                                   // what was held back goes first
+    dir_block = lookup_file(dir, filename, ext, &file);
+    if ((status == 0) && (dir_block < 0)) {
+        status = (int)dir_block;                                                    // ERROR: deleted meanwhile, or unreadable
+    } else if ((status == 0) && !same_file(bmap, &file)) {
+        status = -ENOENT;                                                           // ERROR: deleted meanwhile
+    }
+
+    off_t end = offset + length;
+    long payload = block_payload();
+    if (status != 0) {
+        // nothing to do
+
+    } else if (punch) {
+        status = punch_blocks(bmap, dir_block, filename, ext, file.fsize, offset, end);
+
+    } else if (sparse_files()) {
+        status = fill_blocks(bmap, dir, filename, ext, &file, offset / payload, (end - 1) / payload);
+        if ((status == 0) && (mode == 0) && (end > (off_t)file.fsize)) {
+            status = grow_file(bmap, dir, dir_block, filename, ext, &file, end);
+        }
+
+    } else if ((mode == 0) && (end > (off_t)file.fsize)) {
+        status = grow_file(bmap, dir, dir_block, filename, ext, &file, end);      // every block up to the end is there
+
+    } else {
+        status = extend_blocks(bmap, dir, filename, ext, &file, (end - 1) / payload);   // past the end too
+    }
+
+    __atomic_store_n(&bmap->dirty, BLOCK_MAP_ALL_DIRTY, __ATOMIC_RELEASE);          // for its next fsync
+    pthread_rwlock_unlock(&bmap->lock);
+    journal_end();
+    put_block_map(bmap);
+
+    return status;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter (or longer): see truncate_file.
+ *
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
+
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                 // ERROR: a directory, or no such file
+
+    return truncate_file(dir, filename, ext, size);
+}
+
+
+/*
+    Allocates space for the file at path, or punches a hole in it (see
+    fallocate_file).
+*/
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length,
+    struct fuse_file_info *fi)
+{
+    char dir[MAX_LENGTH];           // directory
+    char filename[MAX_LENGTH];      // filename
+    char ext[MAX_LENGTH];           // extension
+
     (void) fi;
 
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                 // ERROR: a directory, or no such file
+
+    return fallocate_file(dir, filename, ext, mode, offset, length);
+}
+#endif
+
+
+/*
+    Hands the block map of a file being opened, together with the
+    read-ahead state of this open, to read and write through fi->fh.
+
+    Unless cache_timeout is 0, the kernel is told to keep what it has of
+    the file's data in its page cache from one open to the next: every
+    write comes through it, so what it has is current. The exception,
+    appends held back and then lost, shrinks the file, which the kernel
+    notices (FUSE_CAP_AUTO_INVAL_DATA) when its attributes time out, or is
+    told of at once by the low-level front end (see pending_lost).
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+*/
+static int open_handle(struct cs1550_block_map *bmap, struct fuse_file_info *fi)
+{
+    struct cs1550_handle *handle = (struct cs1550_handle*)malloc(sizeof(struct cs1550_handle));
+    if (handle == NULL) { return -ENOMEM; }                             // ERROR: out of memory
+
+    handle->bmap = bmap;
+    readahead_init(&handle->ra);
+    fi->fh = (uintptr_t)handle;                                         // handed back to read and write
+    fi->keep_cache = (options.cache_timeout > 0);                       // nothing changes the data behind the kernel's back
+
+    return 0;
+}
+
+
+#ifdef CS1550_PATH_HANDLERS
+/* 
+ * Called when we open a file. Makes sure the file exists and hands its
+ * block map (built here the first time the file is opened), together
+ * with the read-ahead state of this open, to read and write through fi->fh.
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
     char dir[MAX_LENGTH];           // directory
     char filename[MAX_LENGTH];      // filename
     char ext[MAX_LENGTH];           // extension
 
-    // break path up into directory, filename, and extension
-    sscanf(path, "/%[^/]/%[^.].%s", dir, filename, ext);
+    int status = split_file_path(path, dir, filename, ext);
+    if (status != 0) { return status; }                                 // ERROR: not a file
 
-    // check to make sure path (file) exists by getting the file
-    long dir_block = find_directory(dir);                                           // get block offset to where this dir entry is held
-    cs1550_directory_entry *dir_entry = get_directory(dir_block);                   // get the actual dir entry struct
-    int file_index = find_file(dir_entry, filename, ext);                           // get the index of the file within the dir entry struct
-    cs1550_file_directory *file_entry = get_file(dir_entry, filename, ext);         // get the filename struct
-    long block_loc = file_entry->nStartBlock;                                       // store location, on disk, of block
+    struct cs1550_block_map *bmap;
+    status = get_file_map(dir, filename, ext, NULL, &bmap);             // built the first time the file is opened
+    if (status != 0) {
+        // if we can't find the desired file, return an error
+        return status;
+    }
 
-    // update file size within the file struct
-    file_entry->fsize = size;
-    dir_entry->files[file_index] = *file_entry;
+    /* We're not going to worry about permissions for this project, but 
+       if we were and we don't have them to the file we should return an error
 
-    // write directory entry back to disk with updated size
-    FILE *disk = fopen(DISK, "r+b");                                                // open read/write binary mode
-    fseek(disk, dir_block * BLOCK_SIZE, SEEK_SET);                                  // goto free block
-    fwrite(dir_entry, sizeof(struct cs1550_directory_entry), 1, disk);              // write root to disk
-    fclose(disk);
+        return -EACCES;
+    */
 
-    // make sure size and offset are valid
-    if ((size == 0) ||
-        (offset > size)) {
-        return -EFBIG;                                                              // ERROR: offset is beyond file size
+    status = open_handle(bmap, fi);                                     // the handle holds the map from here on
+    if (status != 0) { put_block_map(bmap); }
 
-    } else {
+    return status;
+}
+#endif
 
-        // determine how many blocks will be needed
-        long num_blocks_needed = (1 + (((size - 1) / MAX_DATA_IN_BLOCK)));          // get ceiling value of blocks needed
-        long start_block = offset / MAX_DATA_IN_BLOCK;                              // the block to start writing/appending to
-        long start_offset = offset % MAX_DATA_IN_BLOCK;                             // specific offset within starting block
-        size_t bytes_wrote = 0;                                                     // number of bytes written so far
-
-        // write out the data to file's disk blocks
-        cs1550_disk_block *disk_block = get_disk_block(block_loc, start_block);     // get data block
-        long block_num, data_offset=0;
-        size_t bytes_left;                                                          // amount of bytes left to write out
-        for (block_num = 0; block_num < num_blocks_needed; block_num++) {
-            bytes_left = size - bytes_wrote;                                        // calculate amount of bytes left to write
-            data_offset = ((block_num == 0) ? start_offset : 0);                    // if first block, start at proper offset
-
-            // copy over # bytes_left or MAX_DATA_IN_BLOCK to this block
-            strncpy((disk_block->data + data_offset), (buf + bytes_wrote), ((bytes_left < MAX_DATA_IN_BLOCK) ? bytes_left : MAX_DATA_IN_BLOCK));
-            bytes_wrote += ((bytes_left < MAX_DATA_IN_BLOCK) ? bytes_left : MAX_DATA_IN_BLOCK);
-
-            // grab another free block if needed
-            if (block_num != (num_blocks_needed - 1)) {                             // -1 to check against 0-based
-                block_loc = find_free_block();                                      // get free block for next write
-                if (block_loc < 0) { return -ENOSPC; }                              // ERROR: no space left
-                disk_block->nNextBlock = block_loc;                                 // store location to next block
-            } else {
-                disk_block->nNextBlock = 0;                                         // store location to next block   
-            }
 
-            // write this block to disk at the given location
-            write_block_to_disk(disk_block, block_loc);                             // write out to disk
+/*
+    Makes everything written so far durable: the appends held back get
+    their blocks, the changed bitmap blocks and the running transaction
+    are committed to the journal, the dirty cached blocks are written
+    back, and '.disk' is msync'ed (when mapped) or fdatasync'ed.
 
-            // switch to the next block
-            if (block_num != (num_blocks_needed - 1)) {
-                disk_block = get_disk_block(block_loc, block_num+1);                // +1 to get NEXT block number
-            }
-        }
-    }
+    RETURNS:    0           SUCCESS
+                -errno      appends held back could not be written, or a
+                            write back or the sync failed
+*/
+static int sync_all(void)
+{
+    int status = flush_all_pending();       // appends held back get their blocks first
 
-    // cleanup pointers
-    //free(dir_entry);
-    //free(file_entry);
-    
-    return size;
+    write_bitmap();
+
+    int result = journal_commit();          // together with whatever else is running
+    if (status == 0) { status = result; }
+    if (status == 0) { status = cache_flush(); }
+    if (status == 0) { status = disk_sync(); }  // free when the commit already synced it all
+
+    return status;
 }
 
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file 
+ * again. The appends held back for the file get their blocks here (so
+ * that running out of space shows up at close), but closing a file
+ * promises nothing about '.disk', so nothing is written back: what was
+ * written stays in the block cache until fsync, the flusher's next tick,
+ * eviction or unmount.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+    (void) path;
+
+    struct cs1550_handle *handle = file_handle(fi);
+
+    return (handle != NULL) ? flush_pending(handle->bmap) : 0;
+}
+
 
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
+ * Called when the last descriptor of an open file is closed. The block
+ * map stays built for the next open, and the file's dirty blocks stay in
+ * the cache (see cs1550_flush); only the handle goes, once anything still
+ * held back for the file has its blocks.
  */
-static int cs1550_truncate(const char *path, off_t size)
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
 {
     (void) path;
-    (void) size;
+
+    struct cs1550_handle *handle = file_handle(fi);
+    if (handle != NULL) {
+        flush_pending(handle->bmap);                    // nobody to tell if it fails: flush already did
+        readahead_destroy(&handle->ra);
+        put_block_map(handle->bmap);                    // freed here if the file was deleted meanwhile
+        free(handle);
+    }
+    fi->fh = 0;
 
     return 0;
 }
 
 
-/* 
- * Called when we open a file
- *
+/*
+ * Called when fsync is called on a file descriptor. Forces everything
+ * written so far out to '.disk' (see sync_all), unless nothing was written
+ * to the file since its last fsync. With datasync (fdatasync), when only
+ * data inside the file was overwritten since, its size and blocks are
+ * already durable: the dirty blocks are written back and '.disk' synced,
+ * but the journal is not committed. The image never changes size, so
+ * '.disk' itself is always fdatasync'ed.
  */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    struct cs1550_block_map *bmap = (file_handle(fi) != NULL) ? file_handle(fi)->bmap : NULL;
+    int dirty = BLOCK_MAP_ALL_DIRTY;        // not knowing the file, sync everything
+    if (bmap != NULL) { dirty = __atomic_exchange_n(&bmap->dirty, 0, __ATOMIC_ACQ_REL); }
+    if (dirty == 0) { return 0; }           // already durable
+
+    int status;
+    if (datasync && !(dirty & BLOCK_MAP_META_DIRTY)) {
+        status = cache_flush();             // just the data: no commit
+        if (status == 0) { status = disk_sync(); }
+    } else {
+        status = sync_all();
+    }
+    if ((status != 0) && (bmap != NULL)) {
+        __atomic_fetch_or(&bmap->dirty, dirty, __ATOMIC_RELEASE);  // ERROR: try again next time
+    }
+
+    return status;
+}
+
+
+/*
+ * Called when fsync is called on a directory. Its entries (and those of
+ * the root) are metadata, so this commits the journal and syncs '.disk'
+ * the same as a file's fsync.
+ */
+static int cs1550_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
     (void) path;
+    (void) datasync;
     (void) fi;
-    /*
-        // if we can't find the desired file, return an error
-        return -ENOENT;
-    */
 
-    // It's not really necessary for this project to anything in open
+    return sync_all();
+}
 
-    /* We're not going to worry about permissions for this project, but 
-       if we were and we don't have them to the file we should return an error
 
-        return -EACCES;
-    */
+/*
+    Writes the filesystem's counters, one "name value" line each, into buf
+    (at most size bytes, always NUL terminated).
 
-    return 0; // success!
+    RETURNS:    the length of the full text, even when it did not fit
+*/
+static int cs1550_stats(char *buf, size_t size)
+{
+    return snprintf(buf, size,
+        "cache_blocks %ld\n"
+        "cache_hits %lu\n"
+        "cache_misses %lu\n"
+        "cache_evictions %lu\n"
+        "cache_writebacks %lu\n"
+        "readahead_windows %lu\n"
+        "readahead_blocks %lu\n"
+        "readahead_dropped %lu\n"
+        "readahead_fetched %lu\n"
+        "readahead_hits %lu\n"
+        "readahead_wasted %lu\n"
+        "bitmap_writes %lu\n"
+        "disk_syncs %lu\n"
+        "disk_punched %lu\n"
+        "journal_requests %lu\n"
+        "journal_commits %lu\n"
+        "journal_blocks %lu\n"
+        "journal_checkpoints %lu\n"
+        "journal_replayed %lu\n"
+        "reclaim_orphans %lu\n"
+        "reclaim_steps %lu\n"
+        "reclaim_blocks %lu\n"
+        "reclaim_held %ld\n",
+        cache_capacity, cache_hits, cache_misses, cache_evictions, cache_writebacks,
+        readahead_windows, readahead_blocks, readahead_dropped, cache_prefetched, cache_prefetch_hits, cache_prefetch_wasted,
+        bitmap_writes, __atomic_load_n(&disk_syncs, __ATOMIC_RELAXED), __atomic_load_n(&disk_punched, __ATOMIC_RELAXED),
+        journal_requests, journal_commits, journal_blocks, journal_checkpoints, journal_replayed,
+        __atomic_load_n(&reclaim_orphans, __ATOMIC_RELAXED), __atomic_load_n(&reclaim_steps, __ATOMIC_RELAXED),
+        __atomic_load_n(&reclaim_blocks, __ATOMIC_RELAXED), bitmap_held());
 }
 
 
 /*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
+ * Called to read an extended attribute. The root directory carries a
+ * read-only CS1550_STATS_XATTR holding the filesystem's counters, e.g.
+ *
+ *      getfattr -n user.cs1550.stats <mountpoint>
+ *
+ * Nothing else has extended attributes.
  */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+static int cs1550_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    if ((strcmp(path, "/") != 0) || (strcmp(name, CS1550_STATS_XATTR) != 0)) {
+        return -ENODATA;                            // ERROR: no such attribute
+    }
+
+    char stats[1024];
+    int length = cs1550_stats(stats, sizeof(stats));
+    if (length >= (int)sizeof(stats)) { length = sizeof(stats) - 1; }
+
+    if (size == 0) { return length; }               // caller only wants the size
+    if (size < (size_t)length) { return -ERANGE; }  // ERROR: buffer too small
+
+    memcpy(value, stats, length);
+
+    return length;
+}
+
+
+/*
+ * Called to list the extended attributes of a path: just the stats on the
+ * root directory.
+ */
+static int cs1550_listxattr(const char *path, char *list, size_t size)
+{
+    if (strcmp(path, "/") != 0) { return 0; }       // no attributes
+
+    size_t length = strlen(CS1550_STATS_XATTR) + 1;
+
+    if (size == 0) { return length; }               // caller only wants the size
+    if (size < length) { return -ERANGE; }          // ERROR: buffer too small
+
+    memcpy(list, CS1550_STATS_XATTR, length);
+
+    return length;
+}
+
+
+/*
+ * Called by statfs() (and so df) on any path of the mount. Every block the
+ * allocator can still hand out is free; the superblock, root, bitmap and
+ * journal count as used. Each new directory or file takes a block, so the
+ * free blocks are also the number of names that can still be added.
+ * Nothing is scanned: the bitmap and the directory index keep the counts.
+ * Appends held back (see write_pending) are not counted until their
+ * blocks are allocated.
+ *
+ * RETURNS:    0               SUCCESS
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
 {
     (void) path;
-    (void) fi;
 
-    return 0; // success!
+    long free_blocks = bitmap_free();
+    long dirs, files;
+    dir_index_count(&dirs, &files);
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = block_size;
+    stbuf->f_frsize = block_size;
+    stbuf->f_blocks = super.nBlocks;                        // the whole image
+    stbuf->f_bfree = free_blocks;
+    stbuf->f_bavail = free_blocks;                          // nothing is kept back for root
+    stbuf->f_files = dirs + files + free_blocks;            // used names, and room for as many more as free blocks
+    stbuf->f_ffree = free_blocks;
+    stbuf->f_favail = free_blocks;
+    stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;    // 8.3
+
+    return 0;
+}
+
+
+/*
+    Fills the directory index with every directory in the root and every
+    file in those directories (following the root's and each directory's
+    list of blocks to its last one). Called once at mount, before any
+    request.
+
+    RETURNS:    0           SUCCESS
+                -EIO        a block of the root or of a directory could not be read
+                            (what it lists, and what comes after it, is left out)
+*/
+static int build_dir_index(void)
+{
+    long root_block = super.nRootBlock;                             // block 0 on images without a superblock
+    long root_steps = 0;                                            // guards against a corrupt (looping) list
+
+    do {
+        cs1550_root_directory *root = get_root_block(root_block);
+        if (root == NULL) { return -EIO; }                          // ERROR: could not read the root
+        dir_index_set_last(DIR_INDEX_ROOT, root_block);
+
+        int d, f;
+        for (d = 0; (d < root->nDirectories) && (d < (int)MAX_DIRS_IN_ROOT); d++) {
+            long dir_block = root->directories[d].nStartBlock;
+            dir_index_insert(DIR_INDEX_ROOT, root->directories[d].dname, "", dir_block, root_block, d);
+
+            long block = dir_block;
+            long steps = 0;                                         // guards against a corrupt (looping) list
+            while ((block > 0) && (steps++ < super.nBlocks)) {
+                cs1550_directory_entry *dir_entry = get_directory(block);
+                if (dir_entry == NULL) {
+                    put_block(root);
+                    return -EIO;                                    // ERROR: could not read the directory
+                }
+                for (f = 0; (f < dir_entry->nFiles) && (f < (int)MAX_FILES_IN_DIR); f++) {
+                    cs1550_file_directory *file = &dir_entry->files[f];
+                    dir_index_insert(dir_block, file->fname, file->fext, file->nStartBlock, block, f);
+                }
+                dir_index_set_last(dir_block, block);
+
+                block = DIR_NEXT(dir_entry);
+                put_block(dir_entry);
+            }
+        }
+
+        root_block = ROOT_NEXT(root);                               // on to the next block of the root
+        put_block(root);
+    } while ((root_block > 0) && (++root_steps < super.nBlocks));
+
+    return 0;
+}
+
+
+/*
+    Marks the given block USED, if it is one of the image's.
+*/
+static void rebuild_mark(long index) {
+    if ((index > 0) && (index < super.nBlocks)) { set_bit(index); }
+}
+
+
+/*
+    Marks every block of the file starting at start_block USED: each block
+    of its chain, or each of its index blocks and the runs they list (but
+    not its holes).
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+                -EIO        a block of the file could not be read
+*/
+static int rebuild_file(long start_block) {
+    long index = start_block;
+    long steps = 0;                                                 // guards against a corrupt (looping) list
+
+    if (disk_format != CS1550_FORMAT_EXTENTS) {
+        while ((index > 0) && (index < super.nBlocks) && (steps++ < super.nBlocks)) {
+            rebuild_mark(index);
+            if (cache_read(&index, sizeof(long), (off_t)index * block_size) != 0) { return -EIO; }
+        }
+        return 0;
+    }
+
+    struct cs1550_extent_block *ext = (struct cs1550_extent_block*)malloc(block_size);
+    if (ext == NULL) { return -ENOMEM; }                            // ERROR: out of memory
+
+    int status = 0;
+    while ((index > 0) && (index < super.nBlocks) && (steps++ < super.nBlocks)) {
+        rebuild_mark(index);
+        if (cache_read_block(index, ext) != 0) {
+            status = -EIO;                                          // ERROR: could not read the index block
+            break;
+        }
+
+        long i, b;
+        for (i = 0; (i < ext->nExtents) && (i < (long)MAX_EXTENTS_IN_BLOCK); i++) {
+            if (ext->extents[i].nStartBlock == BLOCK_MAP_HOLE) { continue; }
+            for (b = 0; (b < ext->extents[i].nBlocks) && (b < super.nBlocks); b++) {
+                rebuild_mark(ext->extents[i].nStartBlock + b);
+            }
+        }
+        index = ext->nNextBlock;
+    }
+    free(ext);
+
+    return status;
+}
+
+
+/*
+    Rebuilds the bitmap from the tree: every block of the root, of each
+    directory and of each file is USED, every other one FREE. Images
+    without a superblock need it at each mount. Builds before the
+    superblock kept the bitmap at the end of the file, but wrote it
+    10240 bytes long from 1536 bytes before the end, so the file grew
+    with every write and the next mount read its bitmap from part way
+    into the last one: what is in those blocks can not be trusted. When
+    the tree can not be read, every block is left USED, so none can be
+    handed out twice.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+                -EIO        a block of the root, a directory or a file could not be read
+*/
+static int rebuild_bitmap(void)
+{
+    long root_block = super.nRootBlock;
+    long root_steps = 0;                                            // guards against a corrupt (looping) list
+    int status = 0;
+
+    bitmap_reset(0);
+
+    do {
+        cs1550_root_directory *root = get_root_block(root_block);
+        if (root == NULL) {
+            status = -EIO;                                          // ERROR: could not read the root
+            break;
+        }
+        rebuild_mark(root_block);
+
+        int d, f;
+        for (d = 0; (status == 0) && (d < root->nDirectories) && (d < (int)MAX_DIRS_IN_ROOT); d++) {
+            long block = root->directories[d].nStartBlock;
+            long steps = 0;                                         // guards against a corrupt (looping) list
+            while ((status == 0) && (block > 0) && (block < super.nBlocks) && (steps++ < super.nBlocks)) {
+                cs1550_directory_entry *dir_entry = get_directory(block);
+                if (dir_entry == NULL) {
+                    status = -EIO;                                  // ERROR: could not read the directory
+                    break;
+                }
+                rebuild_mark(block);
+                for (f = 0; (status == 0) && (f < dir_entry->nFiles) && (f < (int)MAX_FILES_IN_DIR); f++) {
+                    status = rebuild_file(dir_entry->files[f].nStartBlock);
+                }
+
+                block = DIR_NEXT(dir_entry);
+                put_block(dir_entry);
+            }
+        }
+
+        root_block = ROOT_NEXT(root);                               // on to the next block of the root
+        put_block(root);
+    } while ((status == 0) && (root_block > 0) && (++root_steps < super.nBlocks));
+
+    if (status != 0) { bitmap_reset(1); }                           // ERROR: what is FREE is not known
+
+    return status;
+}
+
+
+/*
+    The background flusher: every options.flush_interval seconds it gives
+    the appends held back their blocks, commits the running transaction to
+    the journal (or, without one, writes the changed bitmap blocks) and
+    writes the dirty cached blocks back to '.disk', so that allocations and
+    writes reach the image even when nothing calls fsync for a while.
+*/
+static pthread_t flusher;                                   // the flusher thread, when flusher_running
+static int flusher_running = 0;
+static int flusher_stopping = 0;                            // set by flusher_stop(), under flusher_lock
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+
+static void *flusher_main(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += options.flush_interval;
+
+        if (pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until) != ETIMEDOUT) {
+            continue;                                       // woken early: check whether to stop
+        }
+
+        pthread_mutex_unlock(&flusher_lock);                // never held across the write-back
+        flush_all_pending();                                // appends held back get their blocks
+        write_bitmap();
+        journal_commit();
+        cache_flush();                                      // nothing to do when mapped: the kernel writes the mapping
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    return NULL;
+}
+
+/*
+    Starts the background flusher, unless flush_interval turned it off.
+*/
+static void flusher_start(void)
+{
+    if (options.flush_interval <= 0) { return; }
+
+    flusher_stopping = 0;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0) {
+        flusher_running = 1;
+    } else {
+        fprintf(stderr, "cs1550: could not start the background flusher\n");  // ERROR: only eviction, fsync and unmount write back
+    }
+}
+
+/*
+    Stops the background flusher and waits for it to finish any write-back
+    it is in the middle of.
+*/
+static void flusher_stop(void)
+{
+    if (!flusher_running) { return; }
+
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stopping = 1;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+
+    pthread_join(flusher, NULL);
+    flusher_running = 0;
+}
+
+
+/*
+    Called once when the filesystem is mounted. Opens the disk file for the
+    lifetime of the mount and loads the bitmap, so that no request has to
+    open, seek, and close '.disk' on its own, and asks for file data to be
+    spliced.
+*/
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+    if (conn != NULL) {
+        // let libfuse splice file data between /dev/fuse and '.disk' (see
+        // cs1550_read_buf and cs1550_write_buf), unless -o no_splice_* took it away
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+        // drop the file data kept across opens (see open_handle) once the size is seen to change
+        conn->want |= conn->capable & FUSE_CAP_AUTO_INVAL_DATA;
+    }
+
+    if (disk_open() != 0) {
+        fprintf(stderr, "cs1550: could not open %s\n", disk_path);     // ERROR: every request will fail with EBADF
+    } else {
+        if (options.use_mmap && (disk_map() != 0)) {
+            fprintf(stderr, "cs1550: could not map %s, using pread/pwrite\n", disk_path);
+            options.use_mmap = 0;
+        }
+        check_format();                                                 // already vetted by main()
+        if (journal_replay() != 0) {                                    // before anything reads the metadata
+            fprintf(stderr, "cs1550: could not replay the journal of %s\n", disk_path);
+        }
+        if (!options.use_mmap && (cache_init(options.cache_blocks) != 0)) {
+            fprintf(stderr, "cs1550: could not allocate the block cache, running without it\n");
+        }
+        journal_enable();                                               // needs the cache
+        if (init_bitmap() != 0) {                                       // load the bitmap while we are single threaded
+            fprintf(stderr, "cs1550: could not allocate the bitmap, nothing can be allocated until it is\n");
+        } else if ((super.nMagic != CS1550_MAGIC) && (rebuild_bitmap() != 0)) {    // no superblock: its bitmap can not be trusted
+            fprintf(stderr, "cs1550: could not read every block of %s to rebuild its bitmap, nothing can be allocated\n", disk_path);
+        }
+        if (build_dir_index() != 0) {                                   // every name, so lookups never scan the disk
+            fprintf(stderr, "cs1550: could not read every directory of %s, some names are missing\n", disk_path);
+        }
+        reclaim_start(disk_format == CS1550_FORMAT_EXTENTS);            // carries on freeing what was deleted before
+        flusher_start();
+        readahead_start();                                              // needs the cache
+    }
+
+    return NULL;
+}
+
+
+/*
+    Called once when the filesystem is unmounted. Stops the background
+    threads (see reclaim_stop), gives the appends held back their blocks, writes the bitmap
+    back, commits and empties the journal,
+    flushes the block cache, syncs the disk file and closes it (unmapping
+    it first if mapped).
+*/
+static void cs1550_destroy(void *private_data)
+{
+    (void) private_data;
+
+    flusher_stop();
+    readahead_stop();                       // before the cache it reads into goes
+    reclaim_stop();                         // what it has not freed yet stays listed for the next mount
+    flush_all_pending();                    // appends held back get their blocks
+    if (map != NULL) { write_bitmap(); }    // persist any allocations
+    journal_close();
+    cache_destroy();                        // write back every dirty block
+    disk_sync();                            // and make it all durable
+    disk_close();
+    dir_index_clear();
 }
 
 
+#ifndef CS1550_LOWLEVEL     /* cs1550ll.c registers lowlevel_oper instead */
 // register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
     .getattr    = cs1550_getattr,
@@ -935,16 +3612,91 @@ static struct fuse_operations hello_oper = {
     .rmdir      = cs1550_rmdir,
     .read       = cs1550_read,
     .write      = cs1550_write,
+    .read_buf   = cs1550_read_buf,
+    .write_buf  = cs1550_write_buf,
     .mknod      = cs1550_mknod,
     .unlink     = cs1550_unlink,
     .truncate   = cs1550_truncate,
+    .fallocate  = cs1550_fallocate,
     .flush      = cs1550_flush,
+    .release    = cs1550_release,
+    .fsync      = cs1550_fsync,
+    .fsyncdir   = cs1550_fsyncdir,
+    .getxattr   = cs1550_getxattr,
+    .listxattr  = cs1550_listxattr,
+    .statfs     = cs1550_statfs,
     .open       = cs1550_open,
+    .init       = cs1550_init,
+    .destroy    = cs1550_destroy,
 };
+#endif
+
+
+/*
+    Everything both front ends do before mounting: pulls our own '-o'
+    options out of args (leaving the rest for FUSE), finds '.disk' before
+    FUSE changes directory, and makes sure the image can be mounted,
+    replaying its journal if it was not unmounted.
+
+    RETURNS:    0           SUCCESS
+                -1          the options or the image are no good (already reported)
+*/
+static int cs1550_setup(struct fuse_args *args)
+{
+    // pull out our own '-o' options, leave the rest for FUSE
+    if (fuse_opt_parse(args, &options, cs1550_opts, NULL) == -1) {
+        return -1;
+    }
+
+    disk_resolve_path();    // must happen before fuse_main() changes directory
+
+    // refuse to mount an image we can't read, or whose layout we don't know
+    long version = 0;
+    int status = disk_open();
+    if (status == 0) {
+        status = check_format();
+        if (status == 0) { status = journal_replay(); }    // the last commit, if the image was not unmounted
+        version = super.nVersion;
+        if (status == 0) { status = super_upgrade(options.upgrade); }  // older images learn the lists of blocks to free, and holes
+        disk_close();
+    }
+    if ((status == -EPROTONOSUPPORT) && (version != 0)) {
+        fprintf(stderr, "cs1550: %s has a version %ld superblock; mount it once with -o upgrade to bring it "
+            "to version %d (older builds can not mount it after that)\n", disk_path, version, CS1550_SUPER_VERSION);
+        return -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "cs1550: can not mount %s: %s\n", disk_path, strerror(-status));
+        return -1;
+    }
+    if (super.nVersion != version) {
+        fprintf(stderr, "cs1550: upgraded the superblock of %s from version %ld to %ld\n", disk_path, version, super.nVersion);
+    }
 
+    return 0;
+}
 
-// Don't change this.
+
+#ifndef CS1550_LOWLEVEL     /* cs1550ll.c brings its own */
 int main(int argc, char *argv[])
 {
-    return fuse_main(argc, argv, &hello_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (cs1550_setup(&args) != 0) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    // libfuse answers lookups for us: hand it the timeouts
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,negative_timeout=%g,attr_timeout=%g",
+        options.cache_timeout, options.cache_timeout, options.cache_timeout);
+    fuse_opt_add_arg(&args, timeouts);
+    fuse_opt_add_arg(&args, "-ohard_remove");          // there is no rename to hide an open file behind (see remove_file)
+
+    int result = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+    fuse_opt_free_args(&args);
+
+    return result;
 }
+#endif
@@ -7,80 +7,233 @@
     REFERENCES
     ----------
     BITMAP:                     www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
-    BYTE-TO-BINARY:             http://stackoverflow.com/a/112956
     CEILING INTEGER DIVISION:   http://stackoverflow.com/a/2745086
 */
 
-#include <stdio.h>                  /* FILE SEEK_END prntf() */
-#include <string.h>                 /* strcat() */
-#include <errno.h>                  /* ENOENT */
+#include <stdio.h>                  /* prntf() */
+#include <stdint.h>                 /* uint64_t */
+#include <stdlib.h>                 /* calloc() */
+#include <string.h>                 /* memcpy() memset() */
+#include <errno.h>                  /* ENOENT ENOMEM */
+#include <pthread.h>                /* pthread_mutex_lock() */
 
 typedef unsigned char bitmap;       /* bitmap data structure */
 
-#define DISK        ".disk"         /* keep reference to the physical '.disk' file */
-#define BLOCK_SIZE  512             /* disk's block size, in bytes */
-#define DISK_SIZE   5242880         /* size, in bytes, of disk; assuming disk size is 5M bytes
-                                        (5,242,880bytes AKA 41,943,040bits | [dd bs=1K count=5K if=/dev/zero of=.disk]) */
 #define SIZEOF_BITMAP  8            /* size, in bits, of the data type used for the bitmap. 
                                         (needed because C doesn't have a 'bit' data type) */
-#define MAP_SIZE                    (DISK_SIZE / BLOCK_SIZE)                /* total size, in bytes, needed for the bitmap (==10240) */
-#define MAP_INDICES                 (MAP_SIZE / SIZEOF_BITMAP)              /* total number of indices for the bitmap (==1280) */
-#define MAP_DISK_BLOCKS_NEEDED      (1 + ((MAP_INDICES - 1) / BLOCK_SIZE))  /* how many blocks, on disk, required to hold the bitmap */
 #define GET_BM_INDEX(i)             ((i) / SIZEOF_BITMAP)                   /* given a disk file index, returns an index into the bitmap array */
 #define GET_BIT_OFFSET(i)           ((i) % SIZEOF_BITMAP)                   /* returns a single bit in the index */
+#define BITS_PER_WORD               64                                      /* bits tested at once by the search */
 
-static bitmap *map = NULL;              /* will be MAP_SIZE when intialized */
+/*
+    The bitmap is sized at mount from the superblock (see cs1550super.c):
+    one bit for every block of the image, read from and written back to
+    the bitmap blocks the superblock points at.
+*/
+static int map_size = 0;                /* number of blocks (bits) the bitmap covers */
+static long map_indices = 0;            /* number of bytes of the bitmap kept on disk */
+static int map_words = 0;               /* number of 64-bit words the bitmap spans */
+static int summary_words = 0;           /* number of 64-bit words in the summary */
+static int map_first = 1;               /* first block the allocator may hand out */
+static int map_end = 0;                 /* one past the last block the allocator may hand out */
+
+static bitmap *map = NULL;              /* map_words 64-bit words, when intialized */
+static uint64_t *map_full = NULL;       /* summary of map: bit w is set when word w of map is completely USED */
+static int alloc_cursor = 1;            /* next-fit: where the next search for a free block starts */
+static long map_used = 0;               /* USED blocks in [map_first, map_end), kept by set_bit() and clear_bit() */
+static unsigned char *map_dirty = NULL; /* one flag per bitmap block: changed since it was last written */
+static long map_dirty_blocks = 0;       /* how many of those flags are set (atomic, read by bitmap_dirty()) */
+static long map_blocks = 0;             /* number of blocks the bitmap takes on disk */
+static unsigned long bitmap_writes = 0; /* bitmap blocks written back so far */
+static int map_holding = 0;             /* hold released runs back until the transaction commits? (with a journal) */
+static long *map_held = NULL;           /* those runs, as (first block, count) pairs */
+static long map_held_runs = 0;          /* number of runs in map_held */
+static long map_held_room = 0;          /* number of runs map_held has room for */
+static long map_held_blocks = 0;        /* blocks in them (atomic, read by bitmap_held()) */
+static long *map_freed = NULL;          /* runs release_held() made FREE, to punch out of '.disk' once committed */
+static long map_freed_runs = 0;         /* number of runs in map_freed */
+static long map_freed_room = 0;         /* number of runs map_freed has room for */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;   /* held by every allocation, release and write of the bitmap */
 
 void clear_bit(int index);              /* clears the bit at a given disk file index */
 int find_free_block(void);              /* finds a free block by looking at the bitmap */
+int find_free_run(int want, int *got);  /* reserves a run of contiguous free blocks */
+void release_block(int index);          /* gives a block back to the allocator */
+void release_run(long index, long count);   /* gives a run back once the running transaction commits */
+void release_held(void);                /* makes the runs held back FREE (at commit) */
+void bitmap_punch_freed(int punch);     /* punches them out of '.disk' once the commit is durable */
+void bitmap_hold(int on);               /* holds released runs back until commit, or stops */
+long bitmap_held(void);                 /* blocks released but held back */
+int bitmap_held_any(int (*test)(long index, long count));  /* does test hold for any run held back? */
+int find_clear_bit(int from, int to);   /* finds the first clear bit in [from, to) */
 int get_bit(int index);                 /* gets the bit at the given disk file index */
-void init_bitmap(void);                 /* initializes the bitmap by zero'ing and setting defaults */
+int init_bitmap(void);                  /* initializes the bitmap by zero'ing and setting defaults */
+void bitmap_reset(int used);            /* marks every block the allocator hands out USED, or FREE */
 void set_bit(int index);                /* sets the bit at the given disk file index */
-void write_bitmap(void);                /* writes out the bitmap to the very end of the disk file */
-
-const char *byte_to_binary(int x);      /* used to debug and output the bit-state of a bitmap's index */
+void write_bitmap(void);                /* writes out the bitmap blocks that changed */
+long bitmap_free(void);                 /* number of blocks the allocator can still hand out */
+long bitmap_dirty(void);                /* number of bitmap blocks the next write_bitmap() writes */
 
 
 /*
-    Initializes the bitmap by associating it with the defined disk file. Performs
-        default operations on the bitmap to mark the root and location of the bitmap
-        within the file as occupied. The following disk index locations are marked,
-        assuming a 5M disk file that the bitmap will be associated with:
+    Loads the 64 bits of the bitmap starting at the given word so that bit
+    n of the result is bit (word * 64 + n) of the bitmap, whatever the byte
+    order of the machine.
+*/
+static inline uint64_t load_word(int word) {
 
-        0           root struct
-        (MAX-2)     bitmap struct
-        (MAX-1)     bitmap struct
-        (MAX)       bitmap struct
+    uint64_t bits;
+    memcpy(&bits, map + (word * (BITS_PER_WORD / SIZEOF_BITMAP)), sizeof(bits));
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    bits = __builtin_bswap64(bits);                             // byte 0 holds bits 0..7
+#endif
+
+    return bits;
+}
+
+/*
+    Notes that the bitmap block holding the given block's bit has to be
+    written back.
 */
-void init_bitmap(void) {
+static inline void mark_dirty(int index) {
+
+    if (map_dirty == NULL) { return; }                          // not loaded yet: nothing to write
 
-    FILE *disk = fopen(DISK, "rb");                 // open disk file with respect to binary mode
+    unsigned char *flag = &map_dirty[GET_BM_INDEX(index) / block_size];
+    if (!*flag) {
+        *flag = 1;
+        __atomic_add_fetch(&map_dirty_blocks, 1, __ATOMIC_RELAXED);   // read without map_lock by bitmap_dirty()
+    }
 
-    if (disk == NULL) {
-        //return -ENOENT;                           // ERROR: file not opened successfully
+}
 
+/*
+    Brings the summary bit of the given word of the bitmap up to date.
+*/
+static inline void update_summary(int word) {
+
+    if (map_full == NULL) { return; }                           // summary not built yet
+
+    uint64_t bit = ((uint64_t)1) << (word % BITS_PER_WORD);
+    if (load_word(word) == ~((uint64_t)0)) {
+        map_full[word / BITS_PER_WORD] |= bit;                  // every block in this word is USED
     } else {
-        // allocate the needed space for map
-        map = calloc(MAP_SIZE, 1);                  // use defined size, in bytes
-
-        // get the bitmap from the disk file
-        int offset = BLOCK_SIZE * MAP_DISK_BLOCKS_NEEDED;   // bitmap held in last three blocks of file
-    
-        fseek(disk, -(offset), SEEK_END);                   // set position to beginning of bitmap struct
-        fread(map, MAP_SIZE, 1, disk);                      // read the bitmap in from disk
-
-        // set special regions of the bitmap to USED
-        set_bit(0);                                         // reserve this space for the root struct
-
-        // set the needed amount of bits to reserve space for the bitmap
-        int i;
-        for (i=1; i<=MAP_DISK_BLOCKS_NEEDED; i++) {
-            set_bit(MAP_SIZE-i);                            // reserve this space for the bitmap struct
+        map_full[word / BITS_PER_WORD] &= ~bit;                 // at least one FREE block in this word
+    }
+
+}
+
+/*
+    Initializes the bitmap from the geometry in the superblock (super_load()
+    must have run). Performs default operations on the bitmap to mark
+    everything the allocator must never hand out as occupied:
+
+        0 .. nDataBlock-1       superblock, root struct, bitmap blocks
+                                (just block 0, the root, on images without a superblock)
+        nBitmapBlock ...        the bitmap blocks, wherever they are
+        past the last word      the bits that round the bitmap up to whole words
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     disk geometry not loaded
+                -ENOMEM     out of memory (the bitmap stays unloaded)
+*/
+int init_bitmap(void) {
+
+    if (super.nBlocks <= 0) { return -ENOENT; }             // ERROR: disk geometry not loaded
+
+    map_size = super.nBlocks;
+    map_indices = 1 + ((map_size - 1) / SIZEOF_BITMAP);
+    map_words = 1 + ((map_size - 1) / BITS_PER_WORD);
+    summary_words = 1 + ((map_words - 1) / BITS_PER_WORD);
+    map_first = super.nDataBlock;
+    map_end = map_size;
+    if ((super.nBitmapBlock >= map_first) && (super.nBitmapBlock < map_end)) {
+        map_end = super.nBitmapBlock;                       // bitmap sits at the end (images without a superblock)
+    }
+    alloc_cursor = map_first;
+
+    // allocate the needed space for map
+    map = calloc(map_words, sizeof(uint64_t));              // whole 64-bit words
+    map_full = calloc(summary_words, sizeof(uint64_t));     // one bit per 64-bit word of map
+    map_blocks = 1 + ((map_indices - 1) / block_size);
+    free(map_dirty);
+    map_dirty = calloc(map_blocks, 1);                      // all clean: it matches the disk
+    __atomic_store_n(&map_dirty_blocks, 0, __ATOMIC_RELAXED);
+    if ((map == NULL) || (map_full == NULL) || (map_dirty == NULL)) {
+        free(map);
+        free(map_full);
+        free(map_dirty);
+        map = NULL;                                         // tried again at the next allocation
+        map_full = NULL;
+        map_dirty = NULL;
+        return -ENOMEM;                                     // ERROR: out of memory
+    }
+
+    // get the bitmap from the disk file
+    cache_read(map, map_indices, (off_t)super.nBitmapBlock * block_size);
+
+    // set special regions of the bitmap to USED
+    int i;
+    for (i = 0; i < map_first; i++) {
+        map[GET_BM_INDEX(i)] |= (1 << GET_BIT_OFFSET(i));   // reserve the superblock, root and bitmap
+    }
+    for (i = map_end; i < map_words * BITS_PER_WORD; i++) {
+        map[GET_BM_INDEX(i)] |= (1 << GET_BIT_OFFSET(i));   // reserve the bitmap struct and the padding bits
+    }
+
+    // summarize which words of the bitmap are completely used
+    int word;
+    for (word = 0; word < map_words; word++) {
+        update_summary(word);
+    }
+
+    // count the USED blocks once; from now on set_bit() and clear_bit() keep the count
+    long used = 0;
+    for (word = 0; word < map_words; word++) {
+        used += __builtin_popcountll(load_word(word));
+    }
+    used -= map_first + ((long)map_words * BITS_PER_WORD - map_end);    // the reserved bits set above
+    __atomic_store_n(&map_used, used, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+    Marks every block the allocator may hand out USED (used set) or FREE,
+    leaving the reserved ones USED, and every bitmap block dirty so that
+    the next write_bitmap() writes all of it. Used at mount to rebuild the
+    bitmap of an image whose own can not be trusted (see rebuild_bitmap):
+    FREE, and then each block the tree uses is set, or USED when the tree
+    could not be read, so nothing is handed out twice.
+*/
+void bitmap_reset(int used) {
+
+    if ((map == NULL) && (init_bitmap() != 0)) { return; }     // ERROR: no bitmap to reset
+
+    pthread_mutex_lock(&map_lock);
+
+    int i;
+    for (i = map_first; i < map_end; i++) {
+        if (used) {
+            map[GET_BM_INDEX(i)] |= (1 << GET_BIT_OFFSET(i));
+        } else {
+            map[GET_BM_INDEX(i)] &= ~(1 << GET_BIT_OFFSET(i));
         }
-        
-        fclose(disk);                                       // close the disk file
     }
 
+    int word;
+    for (word = 0; word < map_words; word++) {
+        update_summary(word);
+    }
+    __atomic_store_n(&map_used, used ? (long)(map_end - map_first) : 0, __ATOMIC_RELAXED);
+
+    memset(map_dirty, 1, map_blocks);
+    __atomic_store_n(&map_dirty_blocks, map_blocks, __ATOMIC_RELAXED);
+    alloc_cursor = map_first;
+
+    pthread_mutex_unlock(&map_lock);
+
 }
 
 /*
@@ -88,9 +241,14 @@ void init_bitmap(void) {
 */
 void set_bit(int index) {
 
-    if (map == NULL) { init_bitmap(); }  // make sure bitmap is initialized
+    if ((map == NULL) && (init_bitmap() != 0)) { return; }     // ERROR: no bitmap to mark
 
+    if ((index >= map_first) && (index < map_end) && !get_bit(index)) {
+        __atomic_add_fetch(&map_used, 1, __ATOMIC_RELAXED);        // read without map_lock by bitmap_free()
+    }
     map[GET_BM_INDEX(index)] |= (1 << GET_BIT_OFFSET(index));
+    update_summary(index / BITS_PER_WORD);
+    mark_dirty(index);
 
 }
 
@@ -99,9 +257,14 @@ void set_bit(int index) {
 */
 void clear_bit(int index) {
 
-    if (map == NULL) { init_bitmap(); }  // make sure bitmap is initialized
+    if ((map == NULL) && (init_bitmap() != 0)) { return; }     // ERROR: no bitmap to mark
 
+    if ((index >= map_first) && (index < map_end) && get_bit(index)) {
+        __atomic_sub_fetch(&map_used, 1, __ATOMIC_RELAXED);        // read without map_lock by bitmap_free()
+    }
     map[GET_BM_INDEX(index)] &= ~(1 << GET_BIT_OFFSET(index));
+    update_summary(index / BITS_PER_WORD);
+    mark_dirty(index);
 
 }
 
@@ -110,7 +273,7 @@ void clear_bit(int index) {
 */
 int get_bit(int index) {
 
-    if (map == NULL) { init_bitmap(); }  // make sure bitmap is initialized
+    if ((map == NULL) && (init_bitmap() != 0)) { return 1; }   // ERROR: no bitmap, so never FREE
 
     bitmap bit = map[GET_BM_INDEX(index)] & (1 << GET_BIT_OFFSET(index));
 
@@ -119,122 +282,430 @@ int get_bit(int index) {
 }
 
 /*
-    Search for the first block that is empty and return it. Disregard
-    block zero (0) and the last three blocks because it is the root block
-    and the blocks used to store the bitmap, respectively.
+    Returns the first word in [from, last] of the bitmap that still has a
+    FREE block in it, or -1. Works on the summary, so each step rules out
+    64 words (4096 blocks) at once.
+*/
+static int find_open_word(int from, int last) {
+
+    if (from > last) { return -1; }
+
+    int sword = from / BITS_PER_WORD;                           // summary word holding 'from'
+    int last_sword = last / BITS_PER_WORD;
+
+    // first (partial) summary word: treat the words before 'from' as full
+    uint64_t full = map_full[sword] | ((((uint64_t)1) << (from % BITS_PER_WORD)) - 1);
+
+    while (full == ~((uint64_t)0)) {
+        if (++sword > last_sword) { return -1; }                // every word in range is full
+        full = map_full[sword];
+    }
+
+    int word = sword * BITS_PER_WORD + __builtin_ctzll(~full);  // first word that is not full
+
+    return (word <= last) ? word : -1;
+}
+
+/*
+    Returns the index of the first clear (FREE) bit in [from, to), or -1 if
+    every bit in the range is set.
+
+    Instead of testing one bit at a time, the search skips completely used
+    words through the map_full summary, then uses count-trailing-zeros on
+    the inverted 64-bit word to land on the first clear bit. The cost is
+    about one summary word per 4096 blocks, however full the disk is.
+*/
+int find_clear_bit(int from, int to) {
+
+    if (from >= to) { return -1; }
+
+    int word = from / BITS_PER_WORD;                            // word holding the first bit to test
+    int last_word = (to - 1) / BITS_PER_WORD;                   // word holding the last bit to test
+
+    // first (partial) word: treat the bits before 'from' as used
+    uint64_t bits = load_word(word) | ((((uint64_t)1) << (from % BITS_PER_WORD)) - 1);
+
+    if (bits == ~((uint64_t)0)) {
+        word = find_open_word(word + 1, last_word);             // skip the full words
+        if (word < 0) { return -1; }                            // no free bits in range
+        bits = load_word(word);
+    }
+
+    int index = word * BITS_PER_WORD + __builtin_ctzll(~bits);  // first clear bit in this word
+
+    return (index < to) ? index : -1;
+}
+
+/*
+    Search for an empty block and return it. Disregard the blocks before
+    map_first and from map_end on, because they hold the superblock, the
+    root and the bitmap.
+
+    The search is next-fit: it starts where the previous one left off and
+    wraps around to block 1, so the used-up front of the disk is not
+    rescanned on every allocation.
 */
 int find_free_block(void) {
 
-    if (map == NULL) { init_bitmap(); }                         // make sure bitmap is initialized
+    pthread_mutex_lock(&map_lock);
+
+    if ((map == NULL) && (init_bitmap() != 0)) {
+        pthread_mutex_unlock(&map_lock);
+        return -1;                                              // ERROR: no bitmap to allocate from
+    }
+
+    if ((alloc_cursor < map_first) || (alloc_cursor >= map_end)) {
+        alloc_cursor = map_first;                               // skip the superblock, ROOT and MAP
+    }
+
+    int index = find_clear_bit(alloc_cursor, map_end);          // from the cursor to the end ...
+    if (index < 0) {
+        index = find_clear_bit(map_first, alloc_cursor);        // ... then wrap around
+    }
+
+    if (index >= 0) {
+        set_bit(index);                                         // mark this free bit as occupied
+        alloc_cursor = index + 1;                               // continue from here next time
+    }
+
+    pthread_mutex_unlock(&map_lock);
+
+    return index;                                               // -1 when no free blocks available
+}
+
+/*
+    Returns the index of the first set (USED) bit in [from, to), or to if
+    every bit in the range is clear. Like find_clear_bit, it tests a whole
+    64-bit word per step.
+*/
+static int find_set_bit(int from, int to) {
+
+    if (from >= to) { return to; }
+
+    int word = from / BITS_PER_WORD;
+    int last_word = (to - 1) / BITS_PER_WORD;
+
+    // first (partial) word: treat the bits before 'from' as free
+    uint64_t bits = load_word(word) & ~((((uint64_t)1) << (from % BITS_PER_WORD)) - 1);
+
+    while (bits == 0) {
+        if (++word > last_word) { return to; }                  // the rest of the range is free
+        bits = load_word(word);
+    }
+
+    int index = word * BITS_PER_WORD + __builtin_ctzll(bits);   // first set bit in this word
+
+    return (index < to) ? index : to;
+}
+
+/*
+    Reserves a run of contiguous free blocks: the first run (searching
+    next-fit from the allocation cursor) that is at least want blocks long,
+    or failing that the longest run there is. Only up to want blocks are
+    taken; got is set to how many were.
+
+    RETURNS:    1+      SUCCESS; the first block of the run
+                -1      no free blocks available
+*/
+int find_free_run(int want, int *got) {
+
+    *got = 0;
+    if (want <= 0) { return -1; }
+
+    pthread_mutex_lock(&map_lock);
 
-    int index = 1;                                              // skip block 0 aka ROOT struct
-    int disk_end = MAP_SIZE - MAP_DISK_BLOCKS_NEEDED;           // skip where MAP struct is stored
-    while (index < disk_end) {
-        int bit = get_bit(index);                               // get next bit
-        if (bit == 0) { 
-            set_bit(index);                                     // mark this free bit as occupied
-            return index;                                       // found a free block
+    if ((map == NULL) && (init_bitmap() != 0)) {
+        pthread_mutex_unlock(&map_lock);
+        return -1;                                              // ERROR: no bitmap to allocate from
+    }
+
+    if ((alloc_cursor < map_first) || (alloc_cursor >= map_end)) {
+        alloc_cursor = map_first;                               // skip the superblock, ROOT and MAP
+    }
+
+    int best_start = -1, best_length = 0;                       // longest run seen so far
+    int pass;
+    for (pass = 0; (pass < 2) && (best_length < want); pass++) {
+        // first from the cursor to the end, then wrap around
+        int from = (pass == 0) ? alloc_cursor : map_first;
+        int to = (pass == 0) ? map_end : alloc_cursor;
+
+        while (from < to) {
+            int start = find_clear_bit(from, to);               // beginning of the next free run
+            if (start < 0) { break; }
+
+            int end = find_set_bit(start, to);                  // first USED block after it
+            if (end - start > best_length) {
+                best_start = start;
+                best_length = end - start;
+                if (best_length >= want) { break; }             // long enough
+            }
+            from = end;
         }
-        index++;
     }
-    return -1;                                                  // no free blocks available
+
+    if (best_start < 0) {
+        pthread_mutex_unlock(&map_lock);
+        return -1;                                              // no free blocks available
+    }
+
+    if (best_length > want) { best_length = want; }
+
+    int i;
+    for (i = 0; i < best_length; i++) {
+        set_bit(best_start + i);                                // mark the run as occupied
+    }
+    alloc_cursor = best_start + best_length;                    // continue from here next time
+
+    pthread_mutex_unlock(&map_lock);
+
+    *got = best_length;
+
+    return best_start;
+}
+
+/*
+    Gives a block back to the allocator by marking it FREE.
+*/
+void release_block(int index) {
+
+    if ((index < map_first) || (index >= map_end)) { return; }  // never free the superblock, ROOT or MAP blocks
+
+    pthread_mutex_lock(&map_lock);
+    clear_bit(index);
+    pthread_mutex_unlock(&map_lock);
+
 }
 
 
 /*
-    Takes the given bitmap and writes it out to the DISK.
+    Gives count blocks from index on back to the allocator. Blocks a
+    delete gives back are still what the last committed transaction says
+    the deleted file (or tail) holds: if they were handed out again and
+    written before the delete commits, a crash would leave that file
+    pointing at someone else's data. So while the journal is in use the
+    run is only noted, and release_held() marks it FREE when the running
+    transaction commits, together with whatever released it. Without a
+    journal there is nothing to wait for, and the run is punched out of
+    '.disk' at once (see disk_punch()). Either way the run's cached copies
+    are forgotten first (see cache_drop()).
+*/
+void release_run(long index, long count) {
+
+    if (index < map_first) { count -= map_first - index; index = map_first; }   // never free the superblock, ROOT or MAP blocks
+    if (index + count > map_end) { count = map_end - index; }
+    if (count <= 0) { return; }
+
+    cache_drop(index, count);                                   // before anyone can be handed the blocks
+
+    pthread_mutex_lock(&map_lock);
+
+    long *last = (map_held_runs > 0) ? &map_held[2 * (map_held_runs - 1)] : NULL;
+
+    if (!map_holding) {
+        disk_punch(index, count, 0);                            // before anyone can write to them
+        long i;
+        for (i = 0; i < count; i++) {
+            clear_bit(index + i);
+        }
+
+    } else if ((last != NULL) && (last[0] + last[1] == index)) {
+        last[1] += count;                                       // carries straight on from the last run
+        __atomic_add_fetch(&map_held_blocks, count, __ATOMIC_RELAXED);
+
+    } else {
+        if (map_held_runs == map_held_room) {
+            long room = (map_held_room == 0) ? 64 : 2 * map_held_room;
+            long *held = (long*)realloc(map_held, room * 2 * sizeof(long));
+            if (held == NULL) {
+                pthread_mutex_unlock(&map_lock);
+                return;                                         // ERROR: out of memory; the run stays USED
+            }
+            map_held = held;
+            map_held_room = room;
+        }
+        map_held[2 * map_held_runs] = index;
+        map_held[2 * map_held_runs + 1] = count;
+        map_held_runs++;
+        __atomic_add_fetch(&map_held_blocks, count, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&map_lock);
+
+}
+
+/*
+    Marks every run held back by release_run() FREE. Called by the journal
+    while it commits, with no request running, just before the bitmap is
+    written into the transaction. The runs are kept for
+    bitmap_punch_freed(): they can only be punched out of '.disk' once the
+    transaction is in the log, as until then a crash would bring back the
+    lists of blocks to free that some of them hold (see cs1550reclaim.c).
+*/
+void release_held(void) {
+
+    pthread_mutex_lock(&map_lock);
+
+    long r, i;
+    for (r = 0; r < map_held_runs; r++) {
+        for (i = 0; i < map_held[2 * r + 1]; i++) {
+            clear_bit(map_held[2 * r] + i);
+        }
+    }
+
+    long *freed = map_freed;                                    // hand the runs over, and take an empty list back
+    long room = map_freed_room;
+    map_freed = map_held;
+    map_freed_room = map_held_room;
+    map_freed_runs = map_held_runs;                             // any not punched before are forgotten
+    map_held = freed;
+    map_held_room = room;
+    map_held_runs = 0;
+    __atomic_store_n(&map_held_blocks, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&map_lock);
+
+}
+
+/*
+    Punches the runs the last release_held() made FREE out of '.disk', if
+    punch is set (the transaction that freed them is in the log), or
+    forgets them (it is not, and they may be handed out again). Called by
+    the journal before any request runs again.
+*/
+void bitmap_punch_freed(int punch) {
+
+    pthread_mutex_lock(&map_lock);
+
+    long r;
+    for (r = 0; punch && (r < map_freed_runs); r++) {
+        disk_punch(map_freed[2 * r], map_freed[2 * r + 1], 0);
+    }
+    map_freed_runs = 0;
+
+    pthread_mutex_unlock(&map_lock);
+
+}
+
+/*
+    Turns holding released runs back on (when the journal comes into use)
+    or off (when it stops; whatever is still held is freed).
+*/
+void bitmap_hold(int on) {
+
+    if (!on) {
+        release_held();
+        bitmap_punch_freed(0);                                  // nothing committed them: leave them be
+    }
+
+    pthread_mutex_lock(&map_lock);
+    map_holding = on;
+    pthread_mutex_unlock(&map_lock);
+
+}
+
+/*
+    Returns how many blocks have been released but are held back until the
+    running transaction commits.
+*/
+long bitmap_held(void) {
+    return __atomic_load_n(&map_held_blocks, __ATOMIC_RELAXED);
+}
+
+/*
+    Asks test about each run held back until the running transaction
+    commits (the journal, about to commit it, wants to know whether it
+    frees a block the log still has an image of).
+
+    RETURNS:    1           test returned nonzero for one of them
+                0           it did not (or nothing is held back)
+*/
+int bitmap_held_any(int (*test)(long index, long count)) {
+
+    int any = 0;
+    long r;
+
+    pthread_mutex_lock(&map_lock);
+    for (r = 0; (r < map_held_runs) && !any; r++) {
+        any = test(map_held[2 * r], map_held[2 * r + 1]);
+    }
+    pthread_mutex_unlock(&map_lock);
+
+    return any;
+}
+
+
+/*
+    Writes the blocks of the bitmap that changed since they were last
+    written back to their place on disk (through the block cache, as
+    metadata: with a journal, they commit with the requests that changed
+    them), each run of neighbouring ones in a single write. Allocations
+    only mark their block dirty; this is called at each journal commit,
+    fsync and unmount and from the background flusher, so a burst of
+    allocations costs one write.
 */
 void write_bitmap(void) {
 
-    if (map == NULL) { init_bitmap(); }         // make sure bitmap is initialized
+    pthread_mutex_lock(&map_lock);              // no allocation half way through the copy
 
-    FILE *disk = fopen(DISK, "r+b");            // open file read/write with respect to binary mode
+    if (map == NULL) { init_bitmap(); }         // make sure bitmap is initialized (checked below)
 
-    if (disk == NULL) {
-        //return -ENOENT;                       // ERROR: file not opened successfully
+    if ((map == NULL) || (map_dirty == NULL)) {
+        // ERROR: disk geometry not loaded
 
     } else {
-        // write the bitmap to the disk file
-        long offset = BLOCK_SIZE * MAP_DISK_BLOCKS_NEEDED;  // bitmap held in last three blocks of file
-        fseek(disk, -(offset), SEEK_END);                   // bitmap held in last three blocks of file
-        fwrite(map, MAP_SIZE, 1, disk);                     // write bitmap to disk
-        fclose(disk);                                       // close the file
-    }
-
-}
-
-
-const char *byte_to_binary(int x)
-{
-    static char b[9];
-    b[0] = '\0';
-
-    int z;
-    for (z = 128; z > 0; z >>= 1)
-    {
-        strcat(b, ((x & z) == z) ? "1" : "0");
-    }
-
-    return b;
-}
-
-
-/*
-    Rebuilds a bitmap, given a disk file. This can be used to sanity check
-    or also used if no bitmap currently exists within the disk file.
-*/
-// void rebuild_bitmap(bitmap *map, FILE *disk) {
-//     // open the disk
-//     //FILE *disk = fopen(DISK, "rb");                             // open with respect to binary mode
-
-//     // make sure success
-//     if (disk == NULL) {
-//         return -ENOENT;
-
-//     } else {
-//         // set certain regions of the bitmap to USED
-//         set_bit(0);                                        // root
-//         set_bit(MAP_BLOCK_SIZE_ON_DISK-3);                               // bitmap start
-//         set_bit(MAP_BLOCK_SIZE_ON_DISK-2);                               // bitmap mid
-//         set_bit(MAP_BLOCK_SIZE_ON_DISK-1);                                 // bitmap end
-
-//         cs1550_root_directory root;                             // pointer to root of disk file
-//         fread(&root, sizeof(cs1550_root_directory), 1, disk);   // put first 512bytes into root struct
-
-//         // loop through each directory to know what
-//         //        blocks are currently being used
-//         long dir_num, file_num;                                 // current dir/file number in list
-//         long file_block_span, block_num, block_loc;             // how many disk blocks the file spans, with count and location
-//         struct cs1550_directory_entry dir_entry;                // the current directory entry structure
-//         struct cs1550_disk_block file_block;                    // the current file entry block structure
-//         for (dir_num = 0; dir_num < root.nDirectories; dir_num++) {
-//             // mark this location of the block as USED in the bitmap
-//             set_bit(root.directories[dir_num].nStartBlock]);
-
-//             // loop through each directory to find what files exist
-//             //      and the blocks they are using
-//             fseek(disk, SEEK_SET, root.directories[dir_num].nStartBlock);   // seek to the starting block of the directory entry
-//             fread(&dir_entry, sizeof(cs1550_directory_entry), 1, disk);     // pull this block as a directory entry
-//             for (file_num = 0; file_num < dir_entry.nFiles; file_num++) {
-//                 /* 
-//                     Get the file information to determine:
-//                         1) the block where the file starts
-//                         2) how many blocks the file spans
-//                         3) traversing of the blocks to find where each one is located
-//                 */
-
-//                 // calculate the number of blocks the file consumes (used for linked-list traversal).
-//                 //      IMPORTANT: the actual storage size of a disk block is BLOCK_SIZE - sizeof(struct)
-//                 file_block_span = (dir_entry.files[file_num].fsize + (BLOCK_SIZE - sizeof(struct cs1550_disk_block)) - 1)
-//                                     / (BLOCK_SIZE - sizeof(struct cs1550_disk_block));
-//                 block_location = root.directories[dir_num].nStartBlock;         // grab starting block location for this file
-//                 for (block_num=0; block_num < file_block_span; block_num++) {
-//                     fseek(disk, SEEK_SET, block_location);                      // seek to the starting block of this file entry
-//                     fread(&file_block, sizeof(cs1550_disk_block), 1, disk);     // pull this block as a block entry
-//                     set_bit(dir_entry.files[file_num].nStartBlock);        // mark the bitmap showing that this block is occupied
-//                     block_location = file_block.nNextBlock;                     // get the next block location for this file
-//                 }
-//             }
-//         }
-//     }
-// }
\ No newline at end of file
+        long b = 0;
+        while (b < map_blocks) {
+            if (!map_dirty[b]) { b++; continue; }
+
+            long first = b;                     // a run of dirty blocks
+            while ((b < map_blocks) && map_dirty[b]) {
+                map_dirty[b++] = 0;
+            }
+            __atomic_sub_fetch(&map_dirty_blocks, b - first, __ATOMIC_RELAXED);
+
+            long start = first * block_size;
+            long end = b * block_size;
+            if (end > map_indices) { end = map_indices; }   // the last block is only partly bitmap
+
+            if (cache_write_meta((char*)map + start, end - start, (off_t)(super.nBitmapBlock + first) * block_size) != 0) {
+                memset(map_dirty + first, 1, b - first);    // ERROR: try again next time
+                __atomic_add_fetch(&map_dirty_blocks, b - first, __ATOMIC_RELAXED);
+            } else {
+                bitmap_writes += b - first;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&map_lock);
+
+}
+
+/*
+    Returns how many blocks the allocator can still hand out. The count of
+    USED blocks is kept up to date by every set_bit() and clear_bit(), so
+    this costs the same however large the disk is, and never waits for
+    map_lock.
+
+    RETURNS:    0+      the number of FREE blocks
+*/
+long bitmap_free(void) {
+
+    if (map_end <= map_first) { return 0; }                     // bitmap not loaded yet
+
+    long free_blocks = (map_end - map_first) - __atomic_load_n(&map_used, __ATOMIC_RELAXED);
+
+    return (free_blocks > 0) ? free_blocks : 0;
+}
+
+/*
+    Returns how many blocks of the bitmap changed since they were last
+    written back: the next write_bitmap() writes (with a journal, pins)
+    that many. Like bitmap_free(), never waits for map_lock.
+
+    RETURNS:    0+      the number of dirty bitmap blocks
+*/
+long bitmap_dirty(void) {
+
+    return __atomic_load_n(&map_dirty_blocks, __ATOMIC_RELAXED);
+}
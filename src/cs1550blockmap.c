@@ -0,0 +1,692 @@
+/*
+    Per-File Block Maps
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Files are stored in one of two on-disk layouts:
+
+        CHAIN       (format 0) the file's nStartBlock is its first data block
+                    and every data block starts with nNextBlock, a pointer
+                    to the next one. Finding the block that holds an offset
+                    means walking the chain.
+
+        EXTENTS     (format 1) the file's nStartBlock is an index block
+                    (cs1550_extent_block) listing the file's data as
+                    (start, length) runs of whole blocks. Data blocks carry
+                    a full block of payload and no pointer. A run that
+                    starts at BLOCK_MAP_HOLE is a hole: blocks of the file
+                    never written (or punched out) that take no space and
+                    read back as zeros. The map may also end before the
+                    file does; what is past it is a hole too.
+
+    Either way, the first time a file is opened its layout is read once and
+    kept in memory as a sorted list of extents, so the lookup offset ->
+    block is a binary search over a handful of runs instead of a walk
+    across the disk. Writes that grow a file append to the list, keeping it
+    in step with the disk (and, for the EXTENTS layout, rewrite the index
+    block that changed).
+
+    Maps are kept in a small hash table keyed by the file's start block,
+    which never changes for the life of the file. Each map counts who holds
+    it (the table, every open of the file, every request working on it), so
+    that when the file is deleted it can be taken out of the table at once
+    (block_map_drop()) and freed by whoever lets go of it last. A deleted
+    file's map is marked dead: requests still holding it find out under
+    its lock, before they touch a block that may already be someone else's.
+
+    Each map also carries the file's data lock: readers of the file hold it
+    shared, writers (which may grow the map) hold it exclusive. It is the
+    first lock taken by read and write, before any directory lock.
+
+    Small appends to a file are held back in the map (see write_file) until
+    there is a run's worth of them; pending_end tells getattr and readers
+    there are some.
+*/
+
+#include <pthread.h>                /* pthread_rwlock_t */
+#include <stdlib.h>                 /* calloc() malloc() realloc() */
+#include <string.h>                 /* memcpy() */
+
+#define BLOCK_MAP_BUCKETS   256     /* number of hash chains for the open block maps */
+
+#define BLOCK_MAP_HOLE      0       /* start of a run that is a hole (block 0 never holds file data) */
+
+#define BLOCK_MAP_DATA_DIRTY    1   /* dirty: the file's data changed since its last fsync */
+#define BLOCK_MAP_META_DIRTY    2   /* dirty: and so did its size, or which blocks it has */
+#define BLOCK_MAP_ALL_DIRTY     (BLOCK_MAP_DATA_DIRTY | BLOCK_MAP_META_DIRTY)
+
+// How many (start, length) runs fit in one index block of the mounted image?
+#define MAX_EXTENTS_IN_BLOCK ((block_size - 2 * sizeof(long)) / (2 * sizeof(long)))
+
+struct cs1550_extent_block
+{
+    long nNextBlock;                        // next index block of this file, 0 if this is the last
+    long nExtents;                          // how many of the runs below are in use
+
+    struct cs1550_extent
+    {
+        long nStartBlock;                   // first disk block of the run
+        long nBlocks;                       // number of blocks in the run
+    } extents[];                            // MAX_EXTENTS_IN_BLOCK of these fill the block
+};
+
+// One run of a file, as kept in memory
+struct cs1550_extent_map
+{
+    long nFileBlock;                        // which block of the file the run starts at
+    long nStartBlock;                       // first disk block of the run
+    long nBlocks;                           // number of blocks in the run
+};
+
+struct cs1550_block_map
+{
+    long nStartBlock;                       // first block (CHAIN) or first index block (EXTENTS) of the file; the key
+    int isExtents;                          // which layout the file uses
+    struct cs1550_extent_map *extents;      // the file's runs, in file order
+    long nExtents;                          // number of valid entries in extents
+    long capacity;                          // number of entries extents has room for
+    long nBlocks;                           // total number of data blocks in the file
+    long *index_blocks;                     // EXTENTS: disk index of every index block, in order
+    long nIndexBlocks;                      // EXTENTS: number of valid entries in index_blocks
+    pthread_rwlock_t lock;                  // the file's data lock: shared to read, exclusive to write
+    int dirty;                              // BLOCK_MAP_*_DIRTY: what changed since its last fsync (atomic; all when built)
+    struct cs1550_pending *pending;         // appends held back, not in the file's blocks yet (NULL: none)
+    size_t pending_end;                     // the file's size counting them (atomic; 0 when there are none)
+    long refs;                              // the table, opens and requests holding the map (under block_maps_lock)
+    int dead;                               // the file was deleted: out of the table, its blocks are gone (atomic)
+    struct cs1550_block_map *next;          // next map in the same hash chain
+};
+
+static struct cs1550_block_map *block_maps[BLOCK_MAP_BUCKETS];  /* hash table of every map built so far */
+static pthread_mutex_t block_maps_lock = PTHREAD_MUTEX_INITIALIZER;    /* guards the hash table */
+
+struct cs1550_block_map *get_block_map(long start_block, int is_extents);   /* finds (or builds) the map for a file, and holds it */
+void block_map_hold(struct cs1550_block_map *bmap);                         /* holds a map once more */
+void put_block_map(struct cs1550_block_map *bmap);                          /* lets go of a map */
+int block_map_append(struct cs1550_block_map *bmap, long index, long count);/* records blocks added to the end of the file */
+long block_map_lookup(struct cs1550_block_map *bmap, long block_num);       /* disk index of block block_num, 0 in a hole, or -1 */
+long block_map_run(struct cs1550_block_map *bmap, long block_num);          /* contiguous blocks from block_num on */
+int block_map_save(struct cs1550_block_map *bmap, long extent);             /* writes out the index block holding an extent */
+long block_map_cut(struct cs1550_block_map *bmap, long nblocks, struct cs1550_extent_map **dropped);    /* shortens the file */
+int block_map_replace(struct cs1550_block_map *bmap, long block_num, long count, long index,
+    struct cs1550_extent_map **dropped, long *ndropped);                    /* maps blocks of the file elsewhere, or to a hole */
+struct cs1550_block_map *block_map_peek(long start_block);                  /* the map for a file if built, held */
+size_t block_map_pending_end(long start_block);                             /* a file's size counting its appends held back */
+struct cs1550_block_map *block_map_drop(long start_block);                  /* takes a deleted file's map out of the table */
+long block_map_pending(struct cs1550_block_map ***maps);                    /* every map holding appends back, held */
+
+
+/*
+    Returns the block map for the file starting at the given disk block,
+    reading the file's chain or index blocks to build it the first time it
+    is asked for. The caller holds it until put_block_map().
+
+    RETURNS:    cs1550_block_map*   the map for this file
+                NULL                out of memory
+*/
+struct cs1550_block_map *get_block_map(long start_block, int is_extents) {
+
+    struct cs1550_block_map **bucket = &block_maps[start_block % BLOCK_MAP_BUCKETS];
+    struct cs1550_block_map *bmap;
+
+    pthread_mutex_lock(&block_maps_lock);           // two opens of the same file must share a map
+
+    for (bmap = *bucket; bmap != NULL; bmap = bmap->next) {
+        if (bmap->nStartBlock == start_block) {     // already built
+            bmap->refs++;
+            pthread_mutex_unlock(&block_maps_lock);
+            return bmap;
+        }
+    }
+
+    bmap = (struct cs1550_block_map*)calloc(1, sizeof(struct cs1550_block_map));
+    if (bmap == NULL) {
+        pthread_mutex_unlock(&block_maps_lock);
+        return NULL;                                // ERROR: out of memory
+    }
+
+    bmap->nStartBlock = start_block;
+    bmap->isExtents = is_extents;
+    bmap->dirty = BLOCK_MAP_ALL_DIRTY;              // whatever made the file may not be on disk yet
+    bmap->refs = 2;                                 // the table's and the caller's
+    pthread_rwlock_init(&bmap->lock, NULL);
+
+    long index = start_block;
+    long steps = 0;
+    long max_steps = disk_size() / block_size;      // guards against a corrupt (looping) chain
+
+    if (is_extents) {
+        // read the list of runs out of the file's index blocks
+        struct cs1550_extent_block *ext = (struct cs1550_extent_block*)malloc(block_size);
+        while ((ext != NULL) && (index > 0) && (steps++ < max_steps)) {
+            if (cache_read_block(index, ext) != 0) { break; }
+
+            long *index_blocks = (long*)realloc(bmap->index_blocks, (bmap->nIndexBlocks + 1) * sizeof(long));
+            if (index_blocks == NULL) { break; }
+            bmap->index_blocks = index_blocks;
+            bmap->index_blocks[bmap->nIndexBlocks++] = index;
+
+            long i;
+            for (i = 0; (i < ext->nExtents) && (i < (long)MAX_EXTENTS_IN_BLOCK); i++) {
+                if (block_map_append(bmap, ext->extents[i].nStartBlock, ext->extents[i].nBlocks) != 0) { break; }
+            }
+            index = ext->nNextBlock;
+        }
+        free(ext);
+
+    } else {
+        // walk the chain once; nNextBlock is the first field of every data block
+        while ((index > 0) && (steps++ < max_steps)) {
+            if (block_map_append(bmap, index, 1) != 0) { break; }
+
+            long next = 0;
+            if (cache_read(&next, sizeof(long), (off_t)index * block_size) != 0) { break; }
+            index = next;
+        }
+    }
+
+    bmap->next = *bucket;
+    *bucket = bmap;
+
+    pthread_mutex_unlock(&block_maps_lock);
+
+    return bmap;
+}
+
+/*
+    Holds a map the caller already holds once more (for an open handle
+    that outlives the request).
+*/
+void block_map_hold(struct cs1550_block_map *bmap) {
+
+    pthread_mutex_lock(&block_maps_lock);
+    bmap->refs++;
+    pthread_mutex_unlock(&block_maps_lock);
+
+}
+
+/*
+    Lets go of a map obtained from get_block_map(), block_map_hold(),
+    block_map_peek(), block_map_drop() or block_map_pending(). A map that
+    is no longer in the table is freed once nobody holds it; by then its
+    file was deleted, which dropped any appends it held back.
+*/
+void put_block_map(struct cs1550_block_map *bmap) {
+
+    if (bmap == NULL) { return; }
+
+    pthread_mutex_lock(&block_maps_lock);
+    long refs = --bmap->refs;
+    pthread_mutex_unlock(&block_maps_lock);
+
+    if (refs > 0) { return; }
+
+    pthread_rwlock_destroy(&bmap->lock);
+    free(bmap->extents);
+    free(bmap->index_blocks);
+    free(bmap);
+
+}
+
+/*
+    Can run b be merged onto the end of run a? Either both are holes, or b
+    carries on from a on disk.
+*/
+static int block_map_joins(const struct cs1550_extent_map *a, const struct cs1550_extent_map *b) {
+
+    if ((a->nStartBlock == BLOCK_MAP_HOLE) || (b->nStartBlock == BLOCK_MAP_HOLE)) {
+        return (a->nStartBlock == BLOCK_MAP_HOLE) && (b->nStartBlock == BLOCK_MAP_HOLE);
+    }
+
+    return a->nStartBlock + a->nBlocks == b->nStartBlock;
+}
+
+/*
+    Records count disk blocks, starting at index (or a hole of count
+    blocks, if index is BLOCK_MAP_HOLE), as the new last blocks of the
+    file. Blocks that continue the last run on disk just lengthen it.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     the map could not grow
+*/
+int block_map_append(struct cs1550_block_map *bmap, long index, long count) {
+
+    if (count <= 0) { return 0; }
+
+    struct cs1550_extent_map *last = (bmap->nExtents > 0) ? &bmap->extents[bmap->nExtents - 1] : NULL;
+    struct cs1550_extent_map run = { bmap->nBlocks, index, count };
+
+    if ((last != NULL) && block_map_joins(last, &run)) {
+        last->nBlocks += count;                     // continues the last run
+        bmap->nBlocks += count;
+        return 0;
+    }
+
+    if (bmap->nExtents == bmap->capacity) {
+        long capacity = (bmap->capacity == 0) ? 4 : bmap->capacity * 2;
+        struct cs1550_extent_map *extents = (struct cs1550_extent_map*)realloc(bmap->extents, capacity * sizeof(struct cs1550_extent_map));
+        if (extents == NULL) { return -ENOMEM; }    // ERROR: out of memory
+
+        bmap->extents = extents;
+        bmap->capacity = capacity;
+    }
+
+    struct cs1550_extent_map *extent = &bmap->extents[bmap->nExtents++];
+    extent->nFileBlock = bmap->nBlocks;
+    extent->nStartBlock = index;
+    extent->nBlocks = count;
+    bmap->nBlocks += count;
+
+    return 0;
+}
+
+/*
+    Binary searches the file's runs for the one holding the given (0-based)
+    block of the file.
+
+    RETURNS:    0+          position of the run in bmap->extents
+                -1          the file is not that long
+*/
+static long block_map_find(struct cs1550_block_map *bmap, long block_num) {
+
+    if ((block_num < 0) || (block_num >= bmap->nBlocks)) { return -1; }
+
+    long low = 0, high = bmap->nExtents - 1;
+    while (low < high) {
+        long mid = (low + high + 1) / 2;
+        if (bmap->extents[mid].nFileBlock <= block_num) {
+            low = mid;                              // run starts at or before the block
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    return low;
+}
+
+/*
+    Returns the disk index of the given (0-based) block of the file, 0 if
+    it is in a hole, or -1 if the map is not that long.
+*/
+long block_map_lookup(struct cs1550_block_map *bmap, long block_num) {
+
+    long found = block_map_find(bmap, block_num);
+    if (found < 0) { return -1; }
+
+    struct cs1550_extent_map *extent = &bmap->extents[found];
+    if (extent->nStartBlock == BLOCK_MAP_HOLE) { return 0; }
+
+    return extent->nStartBlock + (block_num - extent->nFileBlock);
+}
+
+/*
+    Returns how many blocks, starting at the given block of the file, sit
+    next to each other on disk, or are in the same hole (0 if the map is
+    not that long).
+*/
+long block_map_run(struct cs1550_block_map *bmap, long block_num) {
+
+    long found = block_map_find(bmap, block_num);
+    if (found < 0) { return 0; }
+
+    struct cs1550_extent_map *extent = &bmap->extents[found];
+
+    return extent->nBlocks - (block_num - extent->nFileBlock);
+}
+
+/*
+    EXTENTS layout only: writes out the index block that holds the given
+    run of the file, adding (and linking in) a new index block first when
+    the run is the first one that does not fit in the existing ones.
+
+    RETURNS:    0           SUCCESS
+                -ENOSPC     no free block for a new index block
+                -ENOMEM     out of memory
+                -errno      the write failed
+*/
+int block_map_save(struct cs1550_block_map *bmap, long extent) {
+
+    long which = extent / MAX_EXTENTS_IN_BLOCK;     // index block holding this run
+
+    while (bmap->nIndexBlocks <= which) {
+        long index = find_free_block();             // need another index block
+        if (index < 0) { return -ENOSPC; }          // ERROR: no space left
+
+        long *index_blocks = (long*)realloc(bmap->index_blocks, (bmap->nIndexBlocks + 1) * sizeof(long));
+        if (index_blocks == NULL) { release_block(index); return -ENOMEM; }
+        bmap->index_blocks = index_blocks;
+        bmap->index_blocks[bmap->nIndexBlocks++] = index;
+
+        // link it from the previous index block (whose runs are all in memory)
+        if (bmap->nIndexBlocks > 1) {
+            long previous = bmap->nIndexBlocks - 2;
+            int result = block_map_save(bmap, previous * MAX_EXTENTS_IN_BLOCK);
+            if (result != 0) { return result; }
+        }
+    }
+
+    // rebuild the whole index block from the runs in memory
+    struct cs1550_extent_block *ext = (struct cs1550_extent_block*)calloc(1, block_size);
+    if (ext == NULL) { return -ENOMEM; }            // ERROR: out of memory
+
+    long first = which * MAX_EXTENTS_IN_BLOCK;
+    long i;
+    for (i = 0; (i < (long)MAX_EXTENTS_IN_BLOCK) && (first + i < bmap->nExtents); i++) {
+        ext->extents[i].nStartBlock = bmap->extents[first + i].nStartBlock;
+        ext->extents[i].nBlocks = bmap->extents[first + i].nBlocks;
+    }
+    ext->nExtents = i;
+    ext->nNextBlock = (which + 1 < bmap->nIndexBlocks) ? bmap->index_blocks[which + 1] : 0;
+
+    int status = cache_write_meta_block(bmap->index_blocks[which], ext);
+    free(ext);
+
+    return status;
+}
+
+/*
+    Shortens the file to its first nblocks blocks (nothing happens if it
+    is no longer than that). The runs it no longer needs, and in the
+    EXTENTS layout the index blocks it no longer needs (as runs of one
+    block, at the end), are handed back in a new array *dropped, to be
+    freed by the caller. A run that straddles the cut is split. The caller
+    holds the file's data lock exclusively, and writes out whatever ends
+    the file on disk now.
+
+    RETURNS:    0+          the number of runs in *dropped
+                -ENOMEM     out of memory (the map is left as it was)
+*/
+long block_map_cut(struct cs1550_block_map *bmap, long nblocks, struct cs1550_extent_map **dropped) {
+
+    *dropped = NULL;
+
+    long found = block_map_find(bmap, nblocks);     // the run holding the first block to go
+    if (found < 0) { return 0; }                    // nothing past nblocks
+
+    struct cs1550_extent_map *cut = &bmap->extents[found];
+    long split = nblocks - cut->nFileBlock;         // blocks of that run that stay
+    long kept = found + ((split > 0) ? 1 : 0);      // runs that stay
+
+    long kept_index = bmap->nIndexBlocks;
+    if (bmap->isExtents) {
+        kept_index = (kept + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK;
+        if (kept_index < 1) { kept_index = 1; }     // the first is the file's start block
+        if (kept_index > bmap->nIndexBlocks) { kept_index = bmap->nIndexBlocks; }
+    }
+
+    long count = (bmap->nExtents - found) + (bmap->nIndexBlocks - kept_index);
+    struct cs1550_extent_map *runs = (struct cs1550_extent_map*)malloc(count * sizeof(struct cs1550_extent_map));
+    if (runs == NULL) { return -ENOMEM; }           // ERROR: out of memory
+
+    long i, n = 0;
+    runs[n].nFileBlock = nblocks;                   // the part of the straddling run that goes ...
+    runs[n].nStartBlock = (cut->nStartBlock != BLOCK_MAP_HOLE) ? cut->nStartBlock + split : BLOCK_MAP_HOLE;
+    runs[n].nBlocks = cut->nBlocks - split;
+    n++;
+    for (i = found + 1; i < bmap->nExtents; i++) {  // ... every run after it ...
+        runs[n++] = bmap->extents[i];
+    }
+    for (i = kept_index; i < bmap->nIndexBlocks; i++) {
+        runs[n].nFileBlock = -1;                    // ... and the index blocks listing nothing now
+        runs[n].nStartBlock = bmap->index_blocks[i];
+        runs[n].nBlocks = 1;
+        n++;
+    }
+
+    cut->nBlocks = split;
+    bmap->nExtents = kept;
+    bmap->nBlocks = nblocks;
+    bmap->nIndexBlocks = kept_index;
+
+    *dropped = runs;
+
+    return n;
+}
+
+/*
+    EXTENTS layout only: maps the count blocks of the file from block_num
+    on (all within the map) to the disk blocks from index on, or makes
+    them a hole if index is BLOCK_MAP_HOLE, and writes out the index
+    blocks that changed. Runs that end up next to each other on disk (or
+    holes next to holes) are merged. What those blocks were mapped to is
+    handed back in a new array *dropped, holes included, followed by the
+    index blocks the file no longer needs (as runs of one block, with
+    nFileBlock -1), *ndropped runs in all, to be freed by the caller. The
+    caller holds the file's data lock exclusively.
+
+    *dropped is set whenever the map changed, even if writing it out then
+    failed: the map no longer names those blocks, so they must be freed
+    either way.
+
+    RETURNS:    0           SUCCESS
+                -ENOSPC     no free block for another index block (the map is left as it was)
+                -ENOMEM     out of memory (likewise)
+                -errno      an index block could not be written (the map has changed all the same)
+*/
+int block_map_replace(struct cs1550_block_map *bmap, long block_num, long count, long index,
+    struct cs1550_extent_map **dropped, long *ndropped) {
+
+    *dropped = NULL;
+    *ndropped = 0;
+
+    long end = block_num + count;
+    if ((count <= 0) || (block_num < 0) || (end > bmap->nBlocks)) { return 0; }
+
+    long first = block_map_find(bmap, block_num);   // the runs holding the first and the last block
+    long last = block_map_find(bmap, end - 1);
+    struct cs1550_extent_map *a = &bmap->extents[first];
+    struct cs1550_extent_map *z = &bmap->extents[last];
+
+    // what takes the place of runs first to last: what is left of them on either side, and the new run
+    struct cs1550_extent_map middle[3];
+    long n = 0;
+    if (block_num > a->nFileBlock) {
+        middle[n].nFileBlock = a->nFileBlock;
+        middle[n].nStartBlock = a->nStartBlock;
+        middle[n].nBlocks = block_num - a->nFileBlock;
+        n++;
+    }
+    middle[n].nFileBlock = block_num;
+    middle[n].nStartBlock = index;
+    middle[n].nBlocks = count;
+    n++;
+    if (end < z->nFileBlock + z->nBlocks) {
+        middle[n].nFileBlock = end;
+        middle[n].nStartBlock = (z->nStartBlock != BLOCK_MAP_HOLE) ? z->nStartBlock + (end - z->nFileBlock) : BLOCK_MAP_HOLE;
+        middle[n].nBlocks = z->nFileBlock + z->nBlocks - end;
+        n++;
+    }
+
+    long capacity = bmap->nExtents + 2;
+    struct cs1550_extent_map *extents = (struct cs1550_extent_map*)malloc(capacity * sizeof(struct cs1550_extent_map));
+    struct cs1550_extent_map *runs = (struct cs1550_extent_map*)malloc((last - first + 1 + bmap->nIndexBlocks) * sizeof(struct cs1550_extent_map));
+    if ((extents == NULL) || (runs == NULL)) {
+        free(extents);
+        free(runs);
+        return -ENOMEM;                             // ERROR: out of memory
+    }
+
+    // the new list: the runs before first as they are, then the rest, each merged onto the one before it if it can be
+    long i, kept = first;
+    memcpy(extents, bmap->extents, first * sizeof(struct cs1550_extent_map));
+    for (i = 0; i < n + (bmap->nExtents - last - 1); i++) {
+        struct cs1550_extent_map *run = (i < n) ? &middle[i] : &bmap->extents[last + 1 + i - n];
+        if ((kept > 0) && block_map_joins(&extents[kept - 1], run)) {
+            extents[kept - 1].nBlocks += run->nBlocks;
+        } else {
+            extents[kept++] = *run;
+        }
+    }
+
+    // the index blocks that list them: any more are taken now, before anything changes
+    long needed = (kept + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK;
+    if (needed < 1) { needed = 1; }                 // the first is the file's start block
+    if (needed > bmap->nIndexBlocks) {
+        long *index_blocks = (long*)realloc(bmap->index_blocks, needed * sizeof(long));
+        if (index_blocks == NULL) {
+            free(extents);
+            free(runs);
+            return -ENOMEM;                         // ERROR: out of memory
+        }
+        bmap->index_blocks = index_blocks;
+
+        for (i = bmap->nIndexBlocks; i < needed; i++) {
+            long block = find_free_block();
+            if (block < 0) {
+                while (--i >= bmap->nIndexBlocks) { release_block(bmap->index_blocks[i]); }
+                free(extents);
+                free(runs);
+                return -ENOSPC;                     // ERROR: no space left
+            }
+            bmap->index_blocks[i] = block;
+        }
+    }
+
+    // what the blocks were mapped to, and the index blocks no longer needed
+    long count_dropped = 0;
+    for (i = first; i <= last; i++) {
+        struct cs1550_extent_map *run = &bmap->extents[i];
+        long from = (run->nFileBlock > block_num) ? run->nFileBlock : block_num;
+        long to = (run->nFileBlock + run->nBlocks < end) ? run->nFileBlock + run->nBlocks : end;
+        runs[count_dropped].nFileBlock = from;
+        runs[count_dropped].nStartBlock = (run->nStartBlock != BLOCK_MAP_HOLE) ? run->nStartBlock + (from - run->nFileBlock) : BLOCK_MAP_HOLE;
+        runs[count_dropped].nBlocks = to - from;
+        count_dropped++;
+    }
+    for (i = needed; i < bmap->nIndexBlocks; i++) {
+        runs[count_dropped].nFileBlock = -1;
+        runs[count_dropped].nStartBlock = bmap->index_blocks[i];
+        runs[count_dropped].nBlocks = 1;
+        count_dropped++;
+    }
+
+    long changed = ((first > 0) ? first - 1 : 0) / MAX_EXTENTS_IN_BLOCK;    // the first index block that changed
+    free(bmap->extents);
+    bmap->extents = extents;
+    bmap->capacity = capacity;
+    bmap->nExtents = kept;
+    bmap->nIndexBlocks = needed;
+
+    int status = 0;
+    for (i = changed; (i < needed) && (status == 0); i++) {
+        status = block_map_save(bmap, i * MAX_EXTENTS_IN_BLOCK);
+    }
+
+    *dropped = runs;
+    *ndropped = count_dropped;
+
+    return status;
+}
+
+/*
+    Returns the map for the file starting at the given disk block if one
+    has been built, without building it, held until put_block_map(); NULL
+    if there is none.
+*/
+struct cs1550_block_map *block_map_peek(long start_block) {
+
+    struct cs1550_block_map *bmap;
+
+    pthread_mutex_lock(&block_maps_lock);
+    for (bmap = block_maps[start_block % BLOCK_MAP_BUCKETS]; bmap != NULL; bmap = bmap->next) {
+        if (bmap->nStartBlock == start_block) { break; }
+    }
+    if (bmap != NULL) { bmap->refs++; }
+    pthread_mutex_unlock(&block_maps_lock);
+
+    return bmap;
+}
+
+/*
+    Returns the size of the file starting at the given disk block counting
+    the appends held back for it, or 0 if there are none (or no map), for
+    getattr.
+*/
+size_t block_map_pending_end(long start_block) {
+
+    struct cs1550_block_map *bmap;
+    size_t pending_end = 0;
+
+    pthread_mutex_lock(&block_maps_lock);
+    for (bmap = block_maps[start_block % BLOCK_MAP_BUCKETS]; bmap != NULL; bmap = bmap->next) {
+        if (bmap->nStartBlock == start_block) {
+            pending_end = __atomic_load_n(&bmap->pending_end, __ATOMIC_ACQUIRE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&block_maps_lock);
+
+    return pending_end;
+}
+
+/*
+    Takes the map of a file that has been deleted out of the table and
+    marks it dead, so that nothing finds it again, not even a new file
+    that is given the same start block. The table's hold on it passes to
+    the caller, who lets go of it with put_block_map().
+
+    RETURNS:    cs1550_block_map*   the map, now dead
+                NULL                there was none
+*/
+struct cs1550_block_map *block_map_drop(long start_block) {
+
+    struct cs1550_block_map **link = &block_maps[start_block % BLOCK_MAP_BUCKETS];
+    struct cs1550_block_map *bmap;
+
+    pthread_mutex_lock(&block_maps_lock);
+    while ((*link != NULL) && ((*link)->nStartBlock != start_block)) { link = &(*link)->next; }
+    bmap = *link;
+    if (bmap != NULL) {
+        *link = bmap->next;
+        bmap->next = NULL;
+        __atomic_store_n(&bmap->dead, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&block_maps_lock);
+
+    return bmap;
+}
+
+/*
+    Lists every map that is holding appends back, in a new array (to be
+    freed by the caller, after letting go of each map in it). The list is
+    only a snapshot: the caller takes each map's lock to find out what is
+    still pending.
+
+    RETURNS:    0+          the number of maps in *maps
+                -ENOMEM     out of memory
+*/
+long block_map_pending(struct cs1550_block_map ***maps) {
+
+    struct cs1550_block_map *bmap;
+    long count = 0, room = 0, i;
+
+    *maps = NULL;
+
+    pthread_mutex_lock(&block_maps_lock);
+
+    for (i = 0; i < BLOCK_MAP_BUCKETS; i++) {
+        for (bmap = block_maps[i]; bmap != NULL; bmap = bmap->next) {
+            if (__atomic_load_n(&bmap->pending_end, __ATOMIC_ACQUIRE) == 0) { continue; }
+
+            if (count == room) {
+                room = (room == 0) ? 16 : 2 * room;
+                struct cs1550_block_map **grown = (struct cs1550_block_map**)realloc(*maps, room * sizeof(*grown));
+                if (grown == NULL) {
+                    while (count > 0) { (*maps)[--count]->refs--; }     // still in the table: nothing to free
+                    pthread_mutex_unlock(&block_maps_lock);
+                    free(*maps);
+                    *maps = NULL;
+                    return -ENOMEM;                 // ERROR: out of memory
+                }
+                *maps = grown;
+            }
+            (*maps)[count++] = bmap;
+            bmap->refs++;
+        }
+    }
+
+    pthread_mutex_unlock(&block_maps_lock);
+
+    return count;
+}
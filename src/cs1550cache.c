@@ -0,0 +1,857 @@
+/*
+    Block Cache
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    A fixed number of block-sized buffers, keyed by disk block index, that
+    sits between the filesystem and the disk layer. Every block read and
+    write goes through it:
+
+        - reads are served from the cache when the block is there (a hit),
+          otherwise the block is read in and kept (a miss). Runs of missing
+          whole blocks are read with a single transfer.
+        - writes only update the cached copy and mark it dirty; nothing
+          reaches '.disk' until the block is evicted or the cache is
+          flushed (by the flusher, at fsync and at unmount).
+        - when the cache is full, the least recently used block is evicted,
+          being written back first if it is dirty (together with the dirty
+          blocks cached next to it on disk, in one write).
+        - blocks can be read in ahead of time (cache_prefetch(), from the
+          read-ahead thread, see cs1550readahead.c) without holding the
+          cache up while the disk is read; they count as read-ahead hits
+          when used, and as wasted when evicted unused.
+
+    When the image has a journal (see cs1550journal.c), metadata is written
+    with cache_write_meta() instead. Such blocks are pinned: they are neither
+    evicted nor flushed until the journal has committed them to its log and
+    unpins them, so that no change reaches its home block before it is safe
+    in the log. Should every entry be pinned, other blocks are read and
+    written around the cache, and metadata writes fail rather than evict.
+
+    The size is set at mount with '-o cache_blocks=N' (by default, as many
+    blocks as fit in CACHE_DEFAULT_BYTES); 0 turns the cache off
+    and every call goes straight to the disk layer (as it also does when the
+    disk is mapped with '-o mmap', where the mapping already is the cache).
+
+    One mutex guards the whole cache; it is only ever held for the copy in
+    or out (plus the disk transfer on a miss or write-back), never across
+    calls, so it is always the last lock taken.
+*/
+
+#include <errno.h>                  /* ENOBUFS */
+#include <pthread.h>                /* pthread_mutex_lock() */
+#include <stdlib.h>                 /* calloc() free() qsort() */
+#include <string.h>                 /* memcpy() memset() */
+
+#define CACHE_DEFAULT_BYTES     524288  /* cached when no '-o cache_blocks=N' is given (1024 blocks of 512) */
+#define CACHE_MIN_BLOCKS        64      /* ... but never fewer blocks than this */
+#define MAX_FLUSH_BYTES         1048576 /* most neighbouring dirty data written back in one go */
+
+struct cs1550_cache_entry
+{
+    long index;                                 // disk block held here (-1 when unused)
+    int dirty;                                  // changed since it was read from / written to disk?
+    int pinned;                                 // metadata changed since the last journal commit: keep off the disk
+    int prefetched;                             // read in ahead of time and not used yet?
+    char *data;                                 // block_size bytes of the block
+    struct cs1550_cache_entry *hash_next;       // next entry in the same hash chain
+    struct cs1550_cache_entry *newer;           // LRU list: more recently used neighbour
+    struct cs1550_cache_entry *older;           // LRU list: less recently used neighbour
+};
+
+static struct cs1550_cache_entry *cache_entries = NULL;    /* every entry (cache_capacity of them) */
+static struct cs1550_cache_entry **cache_hash = NULL;      /* hash table of the entries in use */
+static char *cache_data = NULL;                             /* the blocks themselves, one allocation */
+static long cache_capacity = 0;                             /* number of entries; 0 means no cache */
+static long cache_hash_size = 0;                            /* number of hash chains (a power of two) */
+static long cache_used = 0;                                 /* number of entries in use */
+static struct cs1550_cache_entry *cache_newest = NULL;      /* head of the LRU list */
+static struct cs1550_cache_entry *cache_oldest = NULL;      /* tail of the LRU list; evicted first */
+static long cache_pinned = 0;                               /* number of pinned entries */
+static int cache_pinning = 0;                               /* pin metadata writes? (only while a journal is in use) */
+static char *cache_run = NULL;                              /* MAX_FLUSH_BYTES to gather a write-back in (allocated on first use) */
+static unsigned long cache_generation = 0;                  /* bumped whenever cached blocks go to disk or are forgotten */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;  /* guards everything above */
+
+static unsigned long cache_hits = 0;            /* blocks found in the cache */
+static unsigned long cache_misses = 0;          /* blocks that had to be read from disk */
+static unsigned long cache_evictions = 0;       /* blocks pushed out to make room */
+static unsigned long cache_writebacks = 0;      /* dirty blocks written to disk */
+static unsigned long cache_prefetched = 0;      /* blocks read in ahead of time */
+static unsigned long cache_prefetch_hits = 0;   /* ... and then used */
+static unsigned long cache_prefetch_wasted = 0; /* ... and evicted without being used */
+
+int cache_init(long nblocks);                                   /* sets up a cache of nblocks blocks (-1: the default) */
+void cache_destroy(void);                                       /* flushes and frees the cache */
+int cache_flush(void);                                          /* writes every dirty block back to disk */
+int cache_read(void *buf, size_t size, off_t offset);           /* disk_read() through the cache */
+int cache_write(const void *buf, size_t size, off_t offset);    /* disk_write() through the cache */
+int cache_read_block(long index, void *block);                  /* reads one block through the cache */
+int cache_write_block(long index, const void *block);           /* writes one block through the cache */
+int cache_write_meta(const void *buf, size_t size, off_t offset);  /* cache_write() of metadata: pinned until committed */
+int cache_write_meta_block(long index, const void *block);      /* cache_write_block() of metadata */
+long cache_copy_pinned(long *indices, char *blocks, long max);  /* copies out the pinned blocks, for the journal */
+int cache_is_pinned(long index);                                /* is this block pinned? */
+int cache_clean(long index, long count);                        /* writes back a range, so it can be read from '.disk' directly */
+int cache_discard(long index, long count);                      /* forgets a range about to be overwritten on '.disk' directly */
+void cache_drop(long index, long count);                        /* forgets a range just freed, pinned or not */
+long cache_prefetch(long index, long count);                    /* reads a range in ahead of time */
+long cache_count_pinned(void);                                  /* how many blocks are pinned */
+void cache_unpin_all(void);                                     /* lets the pinned blocks go to disk again */
+
+
+/*
+    Sets up a cache holding nblocks blocks of the mounted image's
+    block_size, or CACHE_DEFAULT_BYTES worth of them if nblocks is -1. A
+    size of 0 leaves the cache off, so that every call goes straight to the
+    disk layer.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory (the cache is left off)
+*/
+int cache_init(long nblocks) {
+
+    if (nblocks < 0) {
+        nblocks = CACHE_DEFAULT_BYTES / block_size;
+        if (nblocks < CACHE_MIN_BLOCKS) { nblocks = CACHE_MIN_BLOCKS; }
+    }
+    if (nblocks == 0) { return 0; }                 // no cache
+
+    long hash_size = 1;
+    while (hash_size < 2 * nblocks) { hash_size <<= 1; }
+
+    cache_entries = (struct cs1550_cache_entry*)calloc(nblocks, sizeof(struct cs1550_cache_entry));
+    cache_hash = (struct cs1550_cache_entry**)calloc(hash_size, sizeof(struct cs1550_cache_entry*));
+    cache_data = (char*)malloc((size_t)nblocks * block_size);
+
+    if ((cache_entries == NULL) || (cache_hash == NULL) || (cache_data == NULL)) {
+        free(cache_entries); free(cache_hash); free(cache_data);
+        cache_entries = NULL; cache_hash = NULL; cache_data = NULL;
+        return -ENOMEM;                             // ERROR: out of memory
+    }
+
+    long i;
+    for (i = 0; i < nblocks; i++) {
+        cache_entries[i].index = -1;
+        cache_entries[i].data = cache_data + (size_t)i * block_size;
+    }
+
+    cache_capacity = nblocks;
+    cache_hash_size = hash_size;
+
+    return 0;
+}
+
+/*
+    Writes back every dirty block and frees the cache.
+*/
+void cache_destroy(void) {
+
+    cache_flush();
+
+    free(cache_entries); free(cache_hash); free(cache_data); free(cache_run);
+    cache_entries = NULL; cache_hash = NULL; cache_data = NULL; cache_run = NULL;
+    cache_capacity = cache_hash_size = cache_used = cache_pinned = 0;
+    cache_pinning = 0;
+    cache_newest = cache_oldest = NULL;
+
+}
+
+/*
+    Returns the hash chain a disk block belongs to.
+*/
+static inline struct cs1550_cache_entry **cache_bucket(long index) {
+    return &cache_hash[(unsigned long)index & (cache_hash_size - 1)];
+}
+
+/*
+    Takes an entry out of the LRU list.
+*/
+static void cache_unlink(struct cs1550_cache_entry *entry) {
+
+    if (entry->newer != NULL) { entry->newer->older = entry->older; } else { cache_newest = entry->older; }
+    if (entry->older != NULL) { entry->older->newer = entry->newer; } else { cache_oldest = entry->newer; }
+    entry->newer = entry->older = NULL;
+
+}
+
+/*
+    Puts an entry at the head (most recently used end) of the LRU list.
+*/
+static void cache_touch(struct cs1550_cache_entry *entry) {
+
+    if (cache_newest == entry) { return; }          // already the newest
+
+    if ((entry->newer != NULL) || (entry->older != NULL) || (cache_oldest == entry)) {
+        cache_unlink(entry);
+    }
+
+    entry->older = cache_newest;
+    if (cache_newest != NULL) { cache_newest->newer = entry; }
+    cache_newest = entry;
+    if (cache_oldest == NULL) { cache_oldest = entry; }
+
+}
+
+/*
+    Returns the entry holding the given disk block, or NULL if it is not
+    cached.
+*/
+static struct cs1550_cache_entry *cache_lookup(long index) {
+
+    struct cs1550_cache_entry *entry;
+    for (entry = *cache_bucket(index); entry != NULL; entry = entry->hash_next) {
+        if (entry->index == index) { return entry; }
+    }
+
+    return NULL;
+}
+
+/*
+    Writes a dirty entry back to its block on disk.
+*/
+static int cache_writeback(struct cs1550_cache_entry *entry) {
+
+    if (!entry->dirty || entry->pinned) { return 0; }
+
+    int result = disk_write(entry->data, block_size, (off_t)entry->index * block_size);
+    if (result == 0) {
+        entry->dirty = 0;
+        cache_writebacks++;
+    }
+    cache_generation++;
+
+    return result;
+}
+
+/*
+    Writes a dirty entry back together with the dirty blocks that are not
+    pinned and are cached right before and after it on disk, in one write,
+    so that evicting a file written a block at a time costs one transfer
+    instead of one per block.
+*/
+static int cache_writeback_cluster(struct cs1550_cache_entry *entry) {
+
+    if (!entry->dirty || entry->pinned) { return 0; }
+
+    long max_run = MAX_FLUSH_BYTES / block_size;    // most blocks in one write
+    if (cache_run == NULL) { cache_run = (char*)malloc((size_t)max_run * block_size); }
+    if ((cache_run == NULL) || (max_run < 2)) { return cache_writeback(entry); }   // one block, then
+
+    struct cs1550_cache_entry *neighbour;
+    long first = entry->index, count = 1;
+    while ((count < max_run) && (first > 0) &&
+           ((neighbour = cache_lookup(first - 1)) != NULL) && neighbour->dirty && !neighbour->pinned) {
+        first--;
+        count++;
+    }
+    while ((count < max_run) &&
+           ((neighbour = cache_lookup(first + count)) != NULL) && neighbour->dirty && !neighbour->pinned) {
+        count++;
+    }
+
+    long i;
+    for (i = 0; i < count; i++) {
+        memcpy(cache_run + (size_t)i * block_size, cache_lookup(first + i)->data, block_size);
+    }
+
+    int result = disk_write(cache_run, (size_t)count * block_size, (off_t)first * block_size);
+    if (result == 0) {
+        for (i = 0; i < count; i++) { cache_lookup(first + i)->dirty = 0; }
+        cache_writebacks += count;
+    }
+    cache_generation++;
+
+    return result;
+}
+
+/*
+    Returns an entry for the given disk block that is not yet filled in:
+    an unused one if there is one, otherwise the least recently used one
+    that is not pinned (written back first if dirty). The entry is hashed
+    under index and put at the head of the LRU list. A pinned block is
+    never evicted, as it would reach its home block before the log: when
+    every entry is pinned, there is no entry to be had.
+
+    RETURNS:    the entry, or NULL when every entry is pinned
+*/
+static struct cs1550_cache_entry *cache_claim(long index) {
+
+    struct cs1550_cache_entry *entry;
+
+    if (cache_used < cache_capacity) {
+        entry = &cache_entries[cache_used++];       // never used yet
+
+    } else {
+        entry = cache_oldest;                       // evict the least recently used block
+        while ((entry != NULL) && entry->pinned) { entry = entry->newer; }
+
+        if (entry == NULL) { return NULL; }         // everything is pinned (see journal_full())
+
+        if (entry->index >= 0) {                    // (one cache_discard() emptied is free already)
+            cache_writeback_cluster(entry);
+            cache_evictions++;
+            if (entry->prefetched) { cache_prefetch_wasted++; }
+
+            struct cs1550_cache_entry **link = cache_bucket(entry->index);
+            while (*link != entry) { link = &(*link)->hash_next; }
+            *link = entry->hash_next;               // out of its old hash chain
+        }
+        cache_unlink(entry);
+    }
+
+    entry->index = index;
+    entry->dirty = 0;
+    entry->prefetched = 0;
+    entry->hash_next = *cache_bucket(index);
+    *cache_bucket(index) = entry;
+    cache_touch(entry);
+
+    return entry;
+}
+
+/*
+    Counts a hit on a cached entry (a read-ahead hit too, the first time a
+    prefetched block is used) and makes it the most recently used.
+*/
+static void cache_hit(struct cs1550_cache_entry *entry) {
+
+    cache_hits++;
+    if (entry->prefetched) {
+        entry->prefetched = 0;
+        cache_prefetch_hits++;
+    }
+    cache_touch(entry);
+
+}
+
+/*
+    Returns the entry for the given disk block, reading the block in from
+    disk if it is not cached.
+
+    RETURNS:    the entry, or NULL when it is not cached and every entry is pinned
+*/
+static struct cs1550_cache_entry *cache_get(long index) {
+
+    struct cs1550_cache_entry *entry = cache_lookup(index);
+
+    if (entry != NULL) {
+        cache_hit(entry);
+        return entry;
+    }
+
+    cache_misses++;
+    entry = cache_claim(index);
+    if (entry == NULL) { return NULL; }             // no room: the caller goes to the disk itself
+    if (disk_read(entry->data, block_size, (off_t)index * block_size) != 0) {
+        memset(entry->data, 0, block_size);         // ERROR: unreadable, treat as empty
+    }
+
+    return entry;
+}
+
+/*
+    Reads size bytes starting at the given byte offset, the same as
+    disk_read(), but through the cache. A stretch of whole blocks that are
+    all missing from the cache is read from disk with one transfer.
+*/
+int cache_read(void *buf, size_t size, off_t offset) {
+
+    if (cache_capacity == 0) { return disk_read(buf, size, offset); }   // no cache
+
+    pthread_mutex_lock(&cache_lock);
+
+    char *pos = (char*)buf;
+    while (size > 0) {
+        long index = offset / block_size;                   // block holding this offset
+        size_t in_block = offset % block_size;              // where in the block it is
+        size_t chunk = block_size - in_block;
+        if (size < chunk) { chunk = size; }
+
+        struct cs1550_cache_entry *entry = cache_lookup(index);
+
+        if ((entry == NULL) && (chunk == (size_t)block_size)) {
+            // whole block missing: take the neighbours that are missing too in one read
+            long count = 1;
+            while (((size_t)(count + 1) * block_size <= size) && (count < cache_capacity) &&
+                   (cache_lookup(index + count) == NULL)) {
+                count++;
+            }
+
+            int result = disk_read(pos, (size_t)count * block_size, offset);
+            if (result != 0) {
+                pthread_mutex_unlock(&cache_lock);
+                return result;                              // ERROR: read failed
+            }
+
+            long i;
+            for (i = 0; i < count; i++) {
+                struct cs1550_cache_entry *claimed = cache_claim(index + i);
+                if (claimed == NULL) { break; }             // every entry is pinned: only read, not kept
+                memcpy(claimed->data, pos + (size_t)i * block_size, block_size);
+            }
+            cache_misses += count;
+            chunk = (size_t)count * block_size;
+
+        } else {
+            if (entry == NULL) {
+                entry = cache_get(index);                   // partial block: read it in whole
+            } else {
+                cache_hit(entry);
+            }
+
+            if (entry != NULL) {
+                memcpy(pos, entry->data + in_block, chunk);
+            } else {
+                int result = disk_read(pos, chunk, offset);     // every entry is pinned: not cached, so '.disk' has it
+                if (result != 0) {
+                    pthread_mutex_unlock(&cache_lock);
+                    return result;                          // ERROR: read failed
+                }
+            }
+        }
+
+        pos += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+/*
+    Writes size bytes starting at the given byte offset into the cache,
+    pinning the blocks when meta is set (and pinning is on). A block that
+    is not cached while every entry is pinned goes straight to disk, unless
+    it is metadata: that would reach its home block unlogged.
+
+    RETURNS:    0           SUCCESS
+                -ENOBUFS    metadata, and every entry is pinned (the blocks before it were written)
+                -errno      a write straight to disk failed
+*/
+static int cache_store(const void *buf, size_t size, off_t offset, int meta) {
+
+    if (cache_capacity == 0) { return disk_write(buf, size, offset); }  // no cache
+
+    pthread_mutex_lock(&cache_lock);
+
+    const char *pos = (const char*)buf;
+    while (size > 0) {
+        long index = offset / block_size;                   // block holding this offset
+        size_t in_block = offset % block_size;              // where in the block it is
+        size_t chunk = block_size - in_block;
+        if (size < chunk) { chunk = size; }
+
+        struct cs1550_cache_entry *entry;
+        if (chunk == (size_t)block_size) {
+            entry = cache_lookup(index);                    // old contents don't matter
+            if (entry == NULL) {
+                entry = cache_claim(index);
+            } else {
+                cache_touch(entry);
+            }
+        } else {
+            entry = cache_get(index);                       // keep the rest of the block
+        }
+
+        if (entry == NULL) {
+            int result = (meta && cache_pinning) ? -ENOBUFS : disk_write(pos, chunk, offset);
+            if (result != 0) {
+                pthread_mutex_unlock(&cache_lock);
+                return result;                              // ERROR: no room to pin it, or write failed
+            }
+            pos += chunk;
+            offset += chunk;
+            size -= chunk;
+            continue;                                       // not cached: written through
+        }
+
+        memcpy(entry->data + in_block, pos, chunk);
+        entry->dirty = 1;
+        if (meta && cache_pinning && !entry->pinned) {
+            entry->pinned = 1;
+            cache_pinned++;
+        }
+
+        pos += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+/*
+    Writes size bytes starting at the given byte offset, the same as
+    disk_write(), but into the cache. Whole blocks are simply replaced;
+    partly written blocks are read in first. The blocks are marked dirty
+    and reach the disk when evicted or flushed.
+*/
+int cache_write(const void *buf, size_t size, off_t offset) {
+
+    return cache_store(buf, size, offset, 0);
+}
+
+/*
+    Writes metadata the same as cache_write(), except that while a journal
+    is in use the blocks stay pinned in the cache until the journal has
+    committed them (see cache_unpin_all()).
+*/
+int cache_write_meta(const void *buf, size_t size, off_t offset) {
+
+    return cache_store(buf, size, offset, 1);
+}
+
+/*
+    Reads the block at the given disk block index through the cache.
+*/
+int cache_read_block(long index, void *block) {
+
+    return cache_read(block, block_size, (off_t)index * block_size);
+}
+
+/*
+    Writes one block at the given disk block index through the cache.
+*/
+int cache_write_block(long index, const void *block) {
+
+    return cache_write(block, block_size, (off_t)index * block_size);
+}
+
+/*
+    Writes one block of metadata at the given disk block index through the
+    cache (see cache_write_meta()).
+*/
+int cache_write_meta_block(long index, const void *block) {
+
+    return cache_write_meta(block, block_size, (off_t)index * block_size);
+}
+
+/*
+    Copies every pinned block, at most max of them, into blocks (one after
+    the other) and their disk indices into indices, leaving them pinned.
+
+    RETURNS:    0+      the number of blocks copied
+*/
+long cache_copy_pinned(long *indices, char *blocks, long max) {
+
+    long count = 0, i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (i = 0; (i < cache_used) && (count < max); i++) {
+        if (cache_entries[i].pinned) {
+            indices[count] = cache_entries[i].index;
+            memcpy(blocks + (size_t)count * block_size, cache_entries[i].data, block_size);
+            count++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return count;
+}
+
+/*
+    Returns 1 if the given disk block is pinned in the cache, 0 otherwise.
+*/
+int cache_is_pinned(long index) {
+
+    if (cache_capacity == 0) { return 0; }          // no cache
+
+    pthread_mutex_lock(&cache_lock);
+    struct cs1550_cache_entry *entry = cache_lookup(index);
+    int pinned = (entry != NULL) && entry->pinned;
+    pthread_mutex_unlock(&cache_lock);
+
+    return pinned;
+}
+
+/*
+    Makes sure '.disk' holds the current contents of count blocks from
+    index on, so that they can be read from the file directly instead of
+    through the cache: the dirty cached ones are written back.
+
+    RETURNS:    1           SUCCESS; the blocks on disk are current
+                0           some are pinned (only the cache has them as they
+                            are now), or could not be written back
+*/
+int cache_clean(long index, long count) {
+
+    if (cache_capacity == 0) { return 1; }          // no cache: everything goes straight to disk
+
+    int clean = 1;
+    long i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (i = 0; (i < count) && clean; i++) {
+        struct cs1550_cache_entry *entry = cache_lookup(index + i);
+        if ((entry != NULL) && entry->dirty) {
+            clean = !entry->pinned && (cache_writeback_cluster(entry) == 0);
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return clean;
+}
+
+/*
+    Forgets a cached block: out of its hash chain, and to the oldest end of
+    the LRU list, to be the first used again. The caller holds cache_lock.
+*/
+static void cache_forget(struct cs1550_cache_entry *entry) {
+
+    struct cs1550_cache_entry **link = cache_bucket(entry->index);
+    while (*link != entry) { link = &(*link)->hash_next; }
+    *link = entry->hash_next;                       // out of its hash chain
+
+    cache_unlink(entry);                            // to the oldest end of the LRU list
+    entry->newer = cache_oldest;
+    if (cache_oldest != NULL) { cache_oldest->older = entry; } else { cache_newest = entry; }
+    cache_oldest = entry;
+
+    if (entry->pinned) { cache_pinned--; }
+    entry->index = -1;
+    entry->dirty = 0;
+    entry->pinned = 0;
+
+}
+
+/*
+    Forgets the cached copies of count blocks from index on, which the
+    caller is about to overwrite on '.disk' directly; what they held,
+    written back or not, would only be stale. Their entries are the first
+    to be used again. Nothing is forgotten if one of them is pinned.
+
+    RETURNS:    1           SUCCESS
+                0           one of the blocks is pinned (and must be written through the cache)
+*/
+int cache_discard(long index, long count) {
+
+    if (cache_capacity == 0) { return 1; }          // no cache
+
+    long i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (i = 0; i < count; i++) {
+        struct cs1550_cache_entry *entry = cache_lookup(index + i);
+        if ((entry != NULL) && entry->pinned) {
+            pthread_mutex_unlock(&cache_lock);
+            return 0;                               // ERROR: metadata in the range
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        struct cs1550_cache_entry *entry = cache_lookup(index + i);
+        if (entry != NULL) { cache_forget(entry); }
+    }
+    cache_generation++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return 1;
+}
+
+/*
+    Forgets the cached copies of count blocks from index on, which a
+    delete has just given back (see release_run()): nothing reads them
+    again before they are handed out anew, so neither writing them back
+    nor logging the metadata they held would be of any use. Unlike
+    cache_discard(), pinned blocks are forgotten too.
+*/
+void cache_drop(long index, long count) {
+
+    if (cache_capacity == 0) { return; }            // no cache
+
+    long i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    if (count > cache_used) {
+        for (i = 0; i < cache_used; i++) {          // fewer entries than blocks: look at each entry
+            struct cs1550_cache_entry *entry = &cache_entries[i];
+            if ((entry->index >= index) && (entry->index < index + count)) { cache_forget(entry); }
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            struct cs1550_cache_entry *entry = cache_lookup(index + i);
+            if (entry != NULL) { cache_forget(entry); }
+        }
+    }
+    cache_generation++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+}
+
+/*
+    Reads count blocks from index on into the cache for a reader expected
+    to ask for them soon, leaving the ones already cached as they are. The
+    disk is read without holding the cache lock, so other requests go on
+    meanwhile; if any cached block reaches '.disk' (or is forgotten) in the
+    meantime, what was read may be older than what the cache held, and the
+    rest of it is thrown away.
+
+    RETURNS:    0+      the number of blocks read in
+*/
+long cache_prefetch(long index, long count) {
+
+    if (cache_capacity == 0) { return 0; }          // no cache
+
+    long max_run = MAX_FLUSH_BYTES / block_size;    // most blocks in one read
+    if (count > max_run) { count = max_run; }
+
+    pthread_mutex_lock(&cache_lock);
+    while ((count > 0) && (cache_lookup(index) != NULL)) { index++; count--; }          // trim what is cached
+    while ((count > 0) && (cache_lookup(index + count - 1) != NULL)) { count--; }
+    unsigned long generation = cache_generation;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (count == 0) { return 0; }                   // all there already
+
+    char *run = (char*)malloc((size_t)count * block_size);
+    if (run == NULL) { return 0; }                  // ERROR: out of memory; it is only a hint
+    if (disk_read(run, (size_t)count * block_size, (off_t)index * block_size) != 0) {
+        free(run);
+        return 0;                                   // ERROR: read failed; the reader will see it
+    }
+
+    long added = 0, i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    // stop as soon as anything went to disk, evictions made for these blocks included
+    for (i = 0; (i < count) && (cache_generation == generation); i++) {
+        if (cache_lookup(index + i) != NULL) { continue; }          // read (or written) since
+
+        struct cs1550_cache_entry *entry = cache_claim(index + i);
+        if (entry == NULL) { break; }               // every entry is pinned: it is only a hint
+        memcpy(entry->data, run + (size_t)i * block_size, block_size);
+        entry->prefetched = 1;
+        added++;
+    }
+    cache_prefetched += added;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    free(run);
+
+    return added;
+}
+
+/*
+    Returns the number of pinned blocks.
+*/
+long cache_count_pinned(void) {
+
+    pthread_mutex_lock(&cache_lock);
+    long pinned = cache_pinned;
+    pthread_mutex_unlock(&cache_lock);
+
+    return pinned;
+}
+
+/*
+    Unpins every pinned block, once the journal has them safely in its
+    log. They stay dirty, and go to their home blocks like any other.
+*/
+void cache_unpin_all(void) {
+
+    long i;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for (i = 0; i < cache_used; i++) {
+        cache_entries[i].pinned = 0;
+    }
+    cache_pinned = 0;
+
+    pthread_mutex_unlock(&cache_lock);
+
+}
+
+/*
+    qsort() comparison: orders cache entries by disk block index.
+*/
+static int cache_compare(const void *a, const void *b) {
+
+    long x = (*(struct cs1550_cache_entry* const*)a)->index;
+    long y = (*(struct cs1550_cache_entry* const*)b)->index;
+
+    return (x > y) - (x < y);
+}
+
+/*
+    Writes every dirty block that is not pinned back to disk, in block
+    order, combining neighbouring dirty blocks into a single write.
+
+    RETURNS:    0           SUCCESS
+                -errno      a write failed (the blocks that failed stay dirty)
+*/
+int cache_flush(void) {
+
+    if (cache_capacity == 0) { return 0; }          // no cache
+
+    pthread_mutex_lock(&cache_lock);
+
+    struct cs1550_cache_entry **dirty = (struct cs1550_cache_entry**)malloc(cache_used * sizeof(*dirty));
+    long max_run = MAX_FLUSH_BYTES / block_size;    // most blocks in one write
+    char *run = (char*)malloc((size_t)max_run * block_size);
+    long ndirty = 0, i;
+    int status = 0;
+
+    if ((dirty == NULL) || (run == NULL)) {
+        // out of memory: fall back to one write per block
+        for (i = 0; i < cache_used; i++) {
+            int result = cache_writeback(&cache_entries[i]);
+            if (result != 0) { status = result; }
+        }
+        free(dirty); free(run);
+        cache_generation++;
+        pthread_mutex_unlock(&cache_lock);
+        return status;
+    }
+
+    for (i = 0; i < cache_used; i++) {
+        if (cache_entries[i].dirty && !cache_entries[i].pinned) { dirty[ndirty++] = &cache_entries[i]; }
+    }
+    qsort(dirty, ndirty, sizeof(*dirty), cache_compare);
+
+    for (i = 0; i < ndirty; ) {
+        long count = 1;                             // neighbouring dirty blocks go out together
+        while ((i + count < ndirty) && (count < max_run) &&
+               (dirty[i + count]->index == dirty[i]->index + count)) {
+            count++;
+        }
+
+        long j;
+        for (j = 0; j < count; j++) {
+            memcpy(run + (size_t)j * block_size, dirty[i + j]->data, block_size);
+        }
+
+        int result = disk_write(run, (size_t)count * block_size, (off_t)dirty[i]->index * block_size);
+        if (result != 0) {
+            status = result;                        // ERROR: leave these dirty
+        } else {
+            for (j = 0; j < count; j++) { dirty[i + j]->dirty = 0; }
+            cache_writebacks += count;
+        }
+
+        i += count;
+    }
+
+    free(dirty); free(run);
+    cache_generation++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return status;
+}
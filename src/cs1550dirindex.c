@@ -0,0 +1,363 @@
+/*
+    Directory Index
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Every directory and file name on the disk, kept in memory in a hash
+    table so that resolving a path never scans the root or a directory
+    block, and never reads the disk. Each entry is keyed by
+
+        (parent, name, extension)
+
+    where parent is DIR_INDEX_ROOT for the directories in the root, and the
+    directory's first block for the files inside it. It holds
+
+        block   the start block of the directory (or of the file)
+        home    the block of the parent's list the entry sits in
+        slot    where the entry sits in that block
+
+    A directory's list of files may take several blocks, chained from its
+    first block. The index also remembers every block of each list, in
+    order, under the otherwise unused empty name: the last one is where new
+    names go, and the one before it becomes the last when a removal empties
+    it (the blocks only link forward on disk).
+
+    The index is built once at mount by reading the root and every
+    directory block, and kept up to date by mkdir, mknod, rmdir and unlink.
+    It also counts the directories and files it holds, for statfs.
+*/
+
+#include <pthread.h>                /* pthread_rwlock_t */
+#include <stdint.h>                 /* uint32_t */
+#include <stdlib.h>                 /* calloc() free() */
+#include <string.h>                 /* strncpy() strcmp() */
+
+#define DIR_INDEX_ROOT          0       /* parent of the directories in the root */
+#define DIR_INDEX_NAME_MAX      9       /* longest name (8 characters) plus NUL */
+#define DIR_INDEX_EXT_MAX       4       /* longest extension (3 characters) plus NUL */
+#define DIR_INDEX_MIN_BUCKETS   256     /* hash chains in an empty index */
+
+struct cs1550_index_entry
+{
+    long nParent;                               // DIR_INDEX_ROOT, or the block of the directory holding the file
+    char name[DIR_INDEX_NAME_MAX];              // directory or file name
+    char ext[DIR_INDEX_EXT_MAX];                // file extension ("" for directories)
+    long nBlock;                                // start block of the directory or file
+    long nHome;                                 // block of the parent's list holding the entry
+    int nSlot;                                  // position in that block
+    long *blocks;                               // a list's record (empty name): every block of the list, in order
+    long nBlocks;                               // ... how many (-1: not known, out of memory)
+    struct cs1550_index_entry *next;            // next entry in the same hash chain
+};
+
+static struct cs1550_index_entry **dir_index = NULL;        /* the hash chains */
+static long dir_index_buckets = 0;                          /* number of hash chains (a power of two) */
+static long dir_index_entries = 0;                          /* number of names in the index */
+static long dir_index_dirs = 0;                             /* of which directories in the root */
+static long dir_index_files = 0;                            /* and files in the directories */
+static pthread_rwlock_t dir_index_lock = PTHREAD_RWLOCK_INITIALIZER;   /* shared to look up, exclusive to change */
+
+int dir_index_insert(long parent, const char *name, const char *ext, long block, long home, int slot);   /* adds (or updates) a name */
+long dir_index_find(long parent, const char *name, const char *ext, long *home, int *slot);             /* start block of a name, or -1 */
+int dir_index_remove(long parent, const char *name, const char *ext);                                   /* forgets a name */
+int dir_index_set_last(long parent, long block);                                                        /* records a new last block of a list */
+long dir_index_last(long parent);                                                                       /* last block of a list, or -1 */
+long dir_index_drop_last(long parent);                                                                  /* takes the last block off a list */
+void dir_index_clear(void);                                                                             /* forgets every name */
+void dir_index_count(long *dirs, long *files);                                                          /* how many directories and files there are */
+
+
+/*
+    Hashes a key (FNV-1a over the parent and both names).
+*/
+static uint32_t dir_index_hash(long parent, const char *name, const char *ext) {
+
+    uint32_t hash = 2166136261u;
+    unsigned long p = (unsigned long)parent;
+    size_t i;
+
+    for (i = 0; i < sizeof(p); i++) {
+        hash = (hash ^ ((p >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    for (; *name != '\0'; name++) { hash = (hash ^ (unsigned char)*name) * 16777619u; }
+    hash = (hash ^ '.') * 16777619u;
+    for (; *ext != '\0'; ext++) { hash = (hash ^ (unsigned char)*ext) * 16777619u; }
+
+    return hash;
+}
+
+/*
+    Returns the entry with the given key, or NULL. The caller holds
+    dir_index_lock.
+*/
+static struct cs1550_index_entry *dir_index_get(long parent, const char *name, const char *ext) {
+
+    if (dir_index == NULL) { return NULL; }
+
+    struct cs1550_index_entry *entry = dir_index[dir_index_hash(parent, name, ext) & (dir_index_buckets - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if ((entry->nParent == parent) && (strcmp(entry->name, name) == 0) && (strcmp(entry->ext, ext) == 0)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Doubles the number of hash chains (or creates the first ones) and moves
+    every entry over. The caller holds dir_index_lock exclusively.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory (the index is left as it was)
+*/
+static int dir_index_grow(void) {
+
+    long buckets = (dir_index_buckets == 0) ? DIR_INDEX_MIN_BUCKETS : dir_index_buckets * 2;
+    struct cs1550_index_entry **table = (struct cs1550_index_entry**)calloc(buckets, sizeof(*table));
+    if (table == NULL) { return -ENOMEM; }          // ERROR: out of memory
+
+    long i;
+    for (i = 0; i < dir_index_buckets; i++) {
+        struct cs1550_index_entry *entry = dir_index[i];
+        while (entry != NULL) {
+            struct cs1550_index_entry *next = entry->next;
+            uint32_t bucket = dir_index_hash(entry->nParent, entry->name, entry->ext) & (buckets - 1);
+            entry->next = table[bucket];
+            table[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(dir_index);
+    dir_index = table;
+    dir_index_buckets = buckets;
+
+    return 0;
+}
+
+/*
+    Adds a name to the index, or updates where it points if it is already
+    there. The caller holds dir_index_lock exclusively.
+
+    RETURNS:    cs1550_index_entry*     SUCCESS; the name's entry
+                NULL                    out of memory
+*/
+static struct cs1550_index_entry *dir_index_add(long parent, const char *name, const char *ext, long block, long home, int slot) {
+
+    struct cs1550_index_entry *entry = dir_index_get(parent, name, ext);
+    if (entry == NULL) {
+        if ((dir_index_entries >= dir_index_buckets) && (dir_index_grow() != 0) && (dir_index == NULL)) {
+            return NULL;                            // ERROR: out of memory
+        }
+
+        entry = (struct cs1550_index_entry*)calloc(1, sizeof(struct cs1550_index_entry));
+        if (entry == NULL) { return NULL; }         // ERROR: out of memory
+
+        entry->nParent = parent;
+        strncpy(entry->name, name, DIR_INDEX_NAME_MAX - 1);
+        strncpy(entry->ext, ext, DIR_INDEX_EXT_MAX - 1);
+
+        uint32_t bucket = dir_index_hash(parent, entry->name, entry->ext) & (dir_index_buckets - 1);
+        entry->next = dir_index[bucket];
+        dir_index[bucket] = entry;
+        dir_index_entries++;
+        if (entry->name[0] != '\0') {              // not the record of a list
+            if (parent == DIR_INDEX_ROOT) { dir_index_dirs++; } else { dir_index_files++; }
+        }
+    }
+
+    entry->nBlock = block;
+    entry->nHome = home;
+    entry->nSlot = slot;
+
+    return entry;
+}
+
+/*
+    Adds a name to the index, or updates where it points if it is already
+    there.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+*/
+int dir_index_insert(long parent, const char *name, const char *ext, long block, long home, int slot) {
+
+    pthread_rwlock_wrlock(&dir_index_lock);
+    struct cs1550_index_entry *entry = dir_index_add(parent, name, ext, block, home, slot);
+    pthread_rwlock_unlock(&dir_index_lock);
+
+    return (entry != NULL) ? 0 : -ENOMEM;
+}
+
+/*
+    Forgets a name: a directory taken out of the root, or a file out of its
+    directory. For a directory, forget its list's record as well.
+
+    RETURNS:    0           SUCCESS
+                -1          no such name
+*/
+int dir_index_remove(long parent, const char *name, const char *ext) {
+
+    int status = -1;
+
+    pthread_rwlock_wrlock(&dir_index_lock);
+
+    if (dir_index != NULL) {
+        struct cs1550_index_entry **link = &dir_index[dir_index_hash(parent, name, ext) & (dir_index_buckets - 1)];
+        while ((*link != NULL) &&
+               (((*link)->nParent != parent) || (strcmp((*link)->name, name) != 0) || (strcmp((*link)->ext, ext) != 0))) {
+            link = &(*link)->next;
+        }
+
+        struct cs1550_index_entry *entry = *link;
+        if (entry != NULL) {
+            *link = entry->next;
+            dir_index_entries--;
+            if (entry->name[0] != '\0') {
+                if (parent == DIR_INDEX_ROOT) { dir_index_dirs--; } else { dir_index_files--; }
+            }
+            free(entry->blocks);
+            free(entry);
+            status = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&dir_index_lock);
+
+    return status;
+}
+
+/*
+    Looks a name up in the index.
+
+    RETURNS:    0+          SUCCESS; the start block of the directory or file (*home and *slot are set)
+                -1          no such name
+*/
+long dir_index_find(long parent, const char *name, const char *ext, long *home, int *slot) {
+
+    long block = -1;
+
+    pthread_rwlock_rdlock(&dir_index_lock);
+
+    struct cs1550_index_entry *entry = dir_index_get(parent, name, ext);
+    if (entry != NULL) {
+        block = entry->nBlock;
+        if (home != NULL) { *home = entry->nHome; }
+        if (slot != NULL) { *slot = entry->nSlot; }
+    }
+
+    pthread_rwlock_unlock(&dir_index_lock);
+
+    return block;
+}
+
+/*
+    Records the block new names of the given parent's list go into: the
+    list's first block, or one just linked onto its end.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+*/
+int dir_index_set_last(long parent, long block) {
+
+    pthread_rwlock_wrlock(&dir_index_lock);
+
+    struct cs1550_index_entry *entry = dir_index_get(parent, "", "");
+    long last = (entry != NULL) ? entry->nBlock : -1;
+
+    entry = dir_index_add(parent, "", "", block, block, 0);
+    if ((entry != NULL) && (entry->nBlocks >= 0) && (block != last)) {
+        long *blocks = (long*)realloc(entry->blocks, (entry->nBlocks + 1) * sizeof(long));
+        if (blocks == NULL) {
+            free(entry->blocks);
+            entry->blocks = NULL;
+            entry->nBlocks = -1;                    // ERROR: out of memory; the list only grows from now on
+        } else {
+            entry->blocks = blocks;
+            entry->blocks[entry->nBlocks++] = block;
+        }
+    }
+
+    pthread_rwlock_unlock(&dir_index_lock);
+
+    return (entry != NULL) ? 0 : -ENOMEM;
+}
+
+/*
+    Returns the last block of the given parent's list.
+
+    RETURNS:    0+          SUCCESS; the block new names go into
+                -1          not recorded
+*/
+long dir_index_last(long parent) {
+    return dir_index_find(parent, "", "", NULL, NULL);
+}
+
+/*
+    Takes the last block off the given parent's list, once a removal has
+    emptied it, so that the one before it is the last again. The caller
+    unlinks it on disk.
+
+    RETURNS:    0+          SUCCESS; the new last block
+                -1          it is the list's first block (or the one before it is not known)
+*/
+long dir_index_drop_last(long parent) {
+
+    long last = -1;
+
+    pthread_rwlock_wrlock(&dir_index_lock);
+
+    struct cs1550_index_entry *entry = dir_index_get(parent, "", "");
+    if ((entry != NULL) && (entry->nBlocks > 1)) {
+        entry->nBlocks--;
+        last = entry->blocks[entry->nBlocks - 1];
+        entry->nBlock = entry->nHome = last;
+    }
+
+    pthread_rwlock_unlock(&dir_index_lock);
+
+    return last;
+}
+
+/*
+    Forgets every name (at unmount).
+*/
+void dir_index_clear(void) {
+
+    pthread_rwlock_wrlock(&dir_index_lock);
+
+    long i;
+    for (i = 0; i < dir_index_buckets; i++) {
+        struct cs1550_index_entry *entry = dir_index[i];
+        while (entry != NULL) {
+            struct cs1550_index_entry *next = entry->next;
+            free(entry->blocks);
+            free(entry);
+            entry = next;
+        }
+    }
+
+    free(dir_index);
+    dir_index = NULL;
+    dir_index_buckets = 0;
+    dir_index_entries = 0;
+    dir_index_dirs = 0;
+    dir_index_files = 0;
+
+    pthread_rwlock_unlock(&dir_index_lock);
+
+}
+
+/*
+    Counts the directories and files in the index, without walking it.
+*/
+void dir_index_count(long *dirs, long *files) {
+
+    pthread_rwlock_rdlock(&dir_index_lock);
+    *dirs = dir_index_dirs;
+    *files = dir_index_files;
+    pthread_rwlock_unlock(&dir_index_lock);
+
+}
@@ -0,0 +1,367 @@
+/*
+    Disk Device Layer
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    The '.disk' file is opened exactly once when the filesystem is mounted
+    and kept open until it is unmounted. Every transfer is a positioned
+    pread()/pwrite() against that single descriptor, so no call depends on
+    (or moves) a shared file offset and concurrent requests cannot step on
+    each other's seeks.
+
+    When mounted with '-o mmap' the whole image is additionally mapped into
+    memory. Reads and writes then become plain memory copies, and callers
+    can ask for a pointer straight into the mapping (disk_block_ptr) to work
+    on the on-disk structs in place. Changes reach '.disk' through msync()
+    at fsync and unmount.
+
+    disk_sync() only goes to the kernel when something was written since
+    the last one, so an fsync with nothing new to make durable costs nothing.
+
+    Blocks that are freed, or must read back as zeros, are punched out of
+    '.disk' (disk_punch), so the image only takes space on the host for
+    the blocks in use.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                 /* fallocate() FALLOC_FL_PUNCH_HOLE */
+#endif
+
+#include <errno.h>                  /* EIO EBADF EOPNOTSUPP */
+#include <fcntl.h>                  /* open() O_RDWR fallocate() */
+#include <limits.h>                 /* PATH_MAX */
+#include <stdlib.h>                 /* realpath() calloc() free() */
+#include <string.h>                 /* memset() strncpy() */
+#include <sys/mman.h>               /* mmap() msync() munmap() */
+#include <sys/stat.h>               /* fstat() */
+#include <sys/types.h>              /* off_t ssize_t */
+#include <unistd.h>                 /* pread() pwrite() close() */
+
+#define DISK        ".disk"         /* keep reference to the physical '.disk' file */
+#define BLOCK_SIZE      512         /* smallest block size (and the only one before the superblock), in bytes */
+#define MAX_BLOCK_SIZE  65536       /* largest block size cs1550mkfs will lay out */
+
+static int disk_fd = -1;                    /* descriptor of the open '.disk' file (-1 when not mounted) */
+static char disk_path[PATH_MAX] = DISK;     /* absolute location of the '.disk' file */
+static char *disk_image = NULL;             /* the whole disk file, when mapped with '-o mmap' */
+static size_t disk_image_size = 0;          /* size, in bytes, of disk_image */
+static long block_size = BLOCK_SIZE;        /* block size of the open image, from its superblock */
+static int disk_dirty = 0;                  /* written to since the last fdatasync()? (atomic) */
+static unsigned long disk_syncs = 0;        /* fdatasync()s and msync()s actually issued (atomic) */
+static int disk_can_punch = 1;              /* does the host file system punch holes? (atomic) */
+static unsigned long disk_punched = 0;      /* blocks punched out of the disk file (atomic) */
+
+void disk_resolve_path(void);                               /* pins down where '.disk' lives before FUSE changes directory */
+int disk_open(void);                                        /* opens the disk file for the lifetime of the mount */
+void disk_close(void);                                      /* closes (and unmaps) the disk file */
+int disk_map(void);                                         /* maps the whole disk file into memory */
+int disk_sync(void);                                        /* forces everything written so far out to the disk file */
+void *disk_block_ptr(long index);                           /* pointer to a block inside the mapping, or NULL */
+int disk_owns(const void *ptr);                             /* is this pointer inside the mapping? */
+off_t disk_size(void);                                      /* size, in bytes, of the disk file */
+int disk_read(void *buf, size_t size, off_t offset);        /* reads size bytes at the given byte offset */
+int disk_write(const void *buf, size_t size, off_t offset); /* writes size bytes at the given byte offset */
+int disk_read_block(long index, void *block);               /* reads one block_size block */
+int disk_write_block(long index, const void *block);        /* writes one block_size block */
+int disk_punch(long index, long count, int zero);           /* gives blocks back to the host file system */
+int disk_descriptor(void);                                  /* the open disk file, for transfers that bypass disk_write() */
+void disk_written(void);                                    /* such a transfer wrote to the disk file */
+
+
+/*
+    FUSE changes the working directory to '/' when it daemonizes, so the
+    relative DISK name has to be turned into an absolute path while we are
+    still sitting in the directory it was launched from.
+*/
+void disk_resolve_path(void) {
+
+    char resolved[PATH_MAX];
+
+    if (realpath(DISK, resolved) != NULL) {
+        strncpy(disk_path, resolved, sizeof(disk_path) - 1);
+        disk_path[sizeof(disk_path) - 1] = '\0';
+    }
+
+}
+
+/*
+    Opens the disk file for reading and writing. Called once at mount time.
+
+    RETURNS:    0           SUCCESS
+                -errno      the disk file could not be opened
+*/
+int disk_open(void) {
+
+    if (disk_fd >= 0) { return 0; }                 // already open
+
+    disk_fd = open(disk_path, O_RDWR);
+
+    return (disk_fd < 0) ? -errno : 0;
+}
+
+/*
+    Closes the disk file. Called once at unmount time.
+*/
+void disk_close(void) {
+
+    if (disk_image != NULL) {
+        msync(disk_image, disk_image_size, MS_SYNC);
+        munmap(disk_image, disk_image_size);
+        disk_image = NULL;
+        disk_image_size = 0;
+    }
+
+    if (disk_fd >= 0) {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+
+}
+
+/*
+    Maps the whole (already open) disk file into memory. Once mapped, every
+    disk_read()/disk_write() is served from the mapping.
+
+    RETURNS:    0           SUCCESS
+                -errno      the disk file could not be mapped
+*/
+int disk_map(void) {
+
+    off_t size = disk_size();
+
+    if (size <= 0) { return -EINVAL; }              // ERROR: nothing to map
+
+    void *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (image == MAP_FAILED) { return -errno; }     // ERROR: mapping failed
+
+    disk_image = (char*)image;
+    disk_image_size = size;
+
+    return 0;
+}
+
+/*
+    Forces everything written so far out to the disk file: msync() of the
+    mapping when mapped, otherwise fdatasync() of the descriptor, skipped
+    when nothing was written since the last one. (The mapping is always
+    msync'ed: blocks are changed in place there, without disk_write.)
+
+    RETURNS:    0           SUCCESS
+                -errno      the sync failed
+*/
+int disk_sync(void) {
+
+    if (disk_fd < 0) { return -EBADF; }             // ERROR: disk is not mounted
+
+    if (disk_image == NULL) {
+        // cleared first: anything written from here on needs the next sync
+        if (!__atomic_exchange_n(&disk_dirty, 0, __ATOMIC_ACQ_REL)) { return 0; }    // nothing new
+    }
+
+    __atomic_add_fetch(&disk_syncs, 1, __ATOMIC_RELAXED);
+    int result = (disk_image != NULL) ? msync(disk_image, disk_image_size, MS_SYNC)
+                                      : fdatasync(disk_fd);
+    if (result != 0) {
+        result = -errno;
+        __atomic_store_n(&disk_dirty, 1, __ATOMIC_RELEASE);    // still not on disk
+    }
+
+    return result;
+}
+
+/*
+    Returns a pointer to the given block inside the mapping, so that the
+    on-disk struct can be read and modified in place. Returns NULL when the
+    disk is not mapped (or the block is out of range); callers then fall
+    back to copying the block with disk_read_block().
+*/
+void *disk_block_ptr(long index) {
+
+    if ((disk_image == NULL) || (index < 0) ||
+        ((size_t)(index + 1) * block_size > disk_image_size)) {
+        return NULL;
+    }
+
+    return disk_image + (size_t)index * block_size;
+}
+
+/*
+    Returns 1 if the pointer points inside the mapping, 0 otherwise. Used to
+    tell zero-copy views apart from blocks that were allocated and copied.
+*/
+int disk_owns(const void *ptr) {
+
+    const char *pos = (const char*)ptr;
+
+    return (disk_image != NULL) && (pos >= disk_image) && (pos < disk_image + disk_image_size);
+}
+
+/*
+    Returns the size, in bytes, of the disk file, or -1 if it is not open.
+*/
+off_t disk_size(void) {
+
+    struct stat st;
+
+    if ((disk_fd < 0) || (fstat(disk_fd, &st) != 0)) { return -1; }
+
+    return st.st_size;
+}
+
+/*
+    Reads size bytes starting at the given byte offset of the disk file. Any
+    part of the request that lies beyond the end of the file reads back as
+    zeros, the same as a freshly dd'ed image.
+
+    RETURNS:    0           SUCCESS
+                -errno      the read failed
+*/
+int disk_read(void *buf, size_t size, off_t offset) {
+
+    if (disk_fd < 0) { return -EBADF; }             // ERROR: disk is not mounted
+
+    if ((disk_image != NULL) && (offset >= 0) && ((size_t)offset + size <= disk_image_size)) {
+        memmove(buf, disk_image + offset, size);    // served from the mapping
+        return 0;
+    }
+
+    char *pos = (char*)buf;
+    while (size > 0) {
+        ssize_t got = pread(disk_fd, pos, size, offset);
+        if (got < 0) {
+            if (errno == EINTR) { continue; }       // interrupted, try again
+            return -errno;                          // ERROR: read failed
+        }
+        if (got == 0) {
+            memset(pos, 0, size);                   // past end of disk, pad with ZERO
+            break;
+        }
+        pos += got;
+        size -= got;
+        offset += got;
+    }
+
+    return 0;
+}
+
+/*
+    Writes size bytes starting at the given byte offset of the disk file.
+
+    RETURNS:    0           SUCCESS
+                -errno      the write failed
+*/
+int disk_write(const void *buf, size_t size, off_t offset) {
+
+    if (disk_fd < 0) { return -EBADF; }             // ERROR: disk is not mounted
+
+    if ((disk_image != NULL) && (offset >= 0) && ((size_t)offset + size <= disk_image_size)) {
+        if (disk_image + offset != buf) {           // already in place when given a mapped block
+            memmove(disk_image + offset, buf, size);
+        }
+        return 0;
+    }
+
+    const char *pos = (const char*)buf;
+    while (size > 0) {
+        ssize_t put = pwrite(disk_fd, pos, size, offset);
+        if (put < 0) {
+            if (errno == EINTR) { continue; }       // interrupted, try again
+            return -errno;                          // ERROR: write failed
+        }
+        if (put == 0) { return -EIO; }             // ERROR: nothing could be written
+        pos += put;
+        size -= put;
+        offset += put;
+    }
+
+    __atomic_store_n(&disk_dirty, 1, __ATOMIC_RELEASE);    // for the next disk_sync()
+
+    return 0;
+}
+
+/*
+    Reads the block at the given disk block index into block, which must
+    be able to hold block_size bytes.
+*/
+int disk_read_block(long index, void *block) {
+
+    return disk_read(block, block_size, (off_t)index * block_size);
+}
+
+/*
+    Writes block_size bytes from block out to the given disk block index.
+*/
+int disk_write_block(long index, const void *block) {
+
+    return disk_write(block, block_size, (off_t)index * block_size);
+}
+
+/*
+    Returns the descriptor of the open disk file (-1 when not mounted), for
+    transfers that move data between it and another file without going
+    through disk_read()/disk_write(), such as splice().
+*/
+int disk_descriptor(void) {
+
+    return disk_fd;
+}
+
+/*
+    Tells the disk layer a transfer that went around disk_write() wrote to
+    the disk file, so that the next disk_sync() does not skip it.
+*/
+void disk_written(void) {
+
+    __atomic_store_n(&disk_dirty, 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Gives count blocks from index on back to the file system '.disk' lives
+    on (fallocate() with FALLOC_FL_PUNCH_HOLE), so that the image takes no
+    space for them; they read back as zeros. On a file system that can not
+    punch holes, zero says whether they must read back as zeros anyway:
+    they are then written with zeros, otherwise left as they are. Nothing
+    may hold a cached copy of them.
+
+    RETURNS:    0           SUCCESS
+                -errno      they had to be zero'ed and could not be
+*/
+int disk_punch(long index, long count, int zero) {
+
+    if (disk_fd < 0) { return -EBADF; }             // ERROR: disk is not mounted
+    if (count <= 0) { return 0; }
+
+    off_t offset = (off_t)index * block_size;
+    off_t length = (off_t)count * block_size;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (__atomic_load_n(&disk_can_punch, __ATOMIC_RELAXED)) {
+        if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+            __atomic_add_fetch(&disk_punched, count, __ATOMIC_RELAXED);
+            __atomic_store_n(&disk_dirty, 1, __ATOMIC_RELEASE);    // for the next disk_sync()
+            return 0;
+        }
+        if ((errno == EOPNOTSUPP) || (errno == ENOSYS)) {
+            __atomic_store_n(&disk_can_punch, 0, __ATOMIC_RELAXED);   // not here: stop asking
+        }
+    }
+#endif
+
+    if (!zero) { return 0; }
+
+    size_t room = (length < MAX_BLOCK_SIZE * 16) ? (size_t)length : MAX_BLOCK_SIZE * 16;
+    char *zeros = (char*)calloc(1, room);
+    if (zeros == NULL) { return -ENOMEM; }          // ERROR: out of memory
+
+    int status = 0;
+    while ((status == 0) && (length > 0)) {
+        size_t chunk = (length < (off_t)room) ? (size_t)length : room;
+        status = disk_write(zeros, chunk, offset);
+        offset += chunk;
+        length -= chunk;
+    }
+    free(zeros);
+
+    return status;
+}
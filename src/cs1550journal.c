@@ -0,0 +1,712 @@
+/*
+    Metadata Journal
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    A mkdir or mknod changes several blocks at once: the new directory, the
+    root (or directory) block listing it, the bitmap. Written one at a time,
+    a crash part way through leaves an image whose bitmap, root and
+    directories disagree. So metadata goes through a write-ahead log kept in
+    the blocks the superblock gives it (see cs1550super.c):
+
+        block nJournalBlock             header: where in the log the first
+                                        transaction is, and its number
+        the other nJournalBlocks - 1    the log, used as a circle
+
+    Every request that changes metadata runs inside the running transaction
+    (journal_begin() ... journal_end()). Its metadata writes go into the
+    block cache as usual, but pinned there (cache_write_meta()): they cannot
+    reach their home blocks yet. Any number of requests share a transaction.
+    journal_commit() waits for the requests in it to finish, holds new ones
+    off, and writes every pinned block to the log in one sequential write:
+
+        descriptor  JOURNAL_DESCRIPTOR_MAGIC, transaction, count, home block of each image
+        images      the blocks, as they are in the cache
+        ...         more descriptors and images, for a big transaction
+        commit      JOURNAL_COMMIT_MAGIC, transaction, count, checksum of all of the above
+
+    followed by one fdatasync(). Only then are the blocks unpinned, to be
+    written home whenever the cache gets to them. File data is not logged,
+    but it is ordered: a commit first writes back (and syncs) the data the
+    cache holds, so a committed size or block list never points at data
+    that is not on disk yet. Commits happen when the
+    background flusher ticks, on fsync, at unmount, and whenever a
+    transaction gets big; however many requests ran in between, they cost
+    one write and one sync together.
+
+    When the log has no room for the next transaction, it is checkpointed:
+    what it holds is written to its home blocks and synced, and the header
+    is moved past it.
+
+    A block that is freed (see release_run()) may still have an image in
+    the log, from when it was a directory, an index block or a link in a
+    chain. Once it holds someone else's data, replaying that image would
+    overwrite it. So the journal keeps track of which blocks the log holds
+    images of, and a commit that frees one of them checkpoints the log
+    first. (A freed block's changes in the running transaction are dropped
+    from the cache, so they never reach the log at all.)
+
+    At mount, journal_replay() writes every complete transaction in the log
+    to its home blocks, oldest first, so the image is as it was after the
+    last commit. The first transaction that is cut short (no commit block,
+    or a checksum that does not match) ends the replay: it never happened.
+    Transaction numbers only grow, so blocks left over from an earlier lap
+    around the log never pass for the next transaction; a new image's
+    journal is all zeros, which is an empty log.
+
+    In the chain layout the pointers at the head of the data blocks are
+    metadata too. A run of new blocks is chained together as data (nothing
+    points at it until it is linked on), and the one pointer that links it
+    onto the end of the file is logged with the rest.
+
+    The journal needs the block cache to hold metadata back: with '-o mmap'
+    or 'cache_blocks=0' it is replayed at mount but not used.
+*/
+
+#include <errno.h>                  /* EIO ENOMEM ENOSPC */
+#include <pthread.h>                /* pthread_mutex_lock() pthread_cond_wait() */
+#include <stdint.h>                 /* uint64_t */
+#include <stdlib.h>                 /* calloc() malloc() realloc() free() */
+#include <string.h>                 /* memcpy() */
+
+#define JOURNAL_HEADER_MAGIC        0x484a303535315343L     /* "CS1550JH" */
+#define JOURNAL_DESCRIPTOR_MAGIC    0x444a303535315343L     /* "CS1550JD" */
+#define JOURNAL_COMMIT_MAGIC        0x434a303535315343L     /* "CS1550JC" */
+#define JOURNAL_CHECKSUM_SEED       14695981039346656037ULL /* FNV-1a offset basis */
+#define JOURNAL_CHECKSUM_PRIME      1099511628211ULL        /* FNV-1a prime */
+#define JOURNAL_CREDITS             16                      /* blocks one request (or one step of one) may pin */
+
+// How many home block numbers fit in one descriptor block of the mounted image?
+#define JOURNAL_TAGS ((long)((block_size - 3 * sizeof(long)) / sizeof(long)))
+
+struct cs1550_journal_header
+{
+    long nMagic;                            // JOURNAL_HEADER_MAGIC; zeros mean a log never used
+    long nStart;                            // position in the log of the first transaction to replay
+    long nTransaction;                      // number of that transaction
+};
+
+struct cs1550_journal_descriptor
+{
+    long nMagic;                            // JOURNAL_DESCRIPTOR_MAGIC
+    long nTransaction;                      // transaction the images belong to
+    long nBlocks;                           // number of images right after this block
+    long nHome[];                           // home block of each image; JOURNAL_TAGS fill the block
+};
+
+struct cs1550_journal_commit
+{
+    long nMagic;                            // JOURNAL_COMMIT_MAGIC
+    long nTransaction;                      // transaction this completes
+    long nBlocks;                           // images in the whole transaction
+    uint64_t nChecksum;                     // of its descriptors and images, in log order
+};
+
+static int journal_active = 0;              /* logging metadata? (the image has a journal, and blocks are cached) */
+static long journal_size = 0;               /* blocks in the log: the journal less its header */
+static long journal_start = 0;              /* position of the first transaction not yet checkpointed */
+static long journal_first = 1;              /* ... and its number */
+static long journal_head = 0;               /* position the next transaction goes to */
+static long journal_used = 0;               /* blocks from journal_start up to journal_head */
+static long journal_transaction = 1;        /* number of the running transaction */
+static long journal_max_pins = 0;           /* blocks a transaction may collect before it is committed */
+static long journal_limit = 0;              /* blocks it may never go past: what the cache and the log hold */
+
+static long journal_users = 0;              /* requests in the running transaction right now */
+static int journal_closing = 0;             /* a commit is waiting for (or writing) the running transaction */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;   /* guards the two above */
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;     /* signalled when either changes */
+
+static long *journal_logged = NULL;         /* home blocks the log holds images of, sorted, each once */
+static long journal_logged_count = 0;       /* how many */
+static long journal_logged_room = 0;        /* how many journal_logged has room for */
+static int journal_logged_lost = 0;         /* out of memory: every block counts as logged until the next checkpoint */
+
+static unsigned long journal_requests = 0;      /* requests run inside a transaction */
+static unsigned long journal_commits = 0;       /* transactions written to the log */
+static unsigned long journal_blocks = 0;        /* blocks of metadata written to the log */
+static unsigned long journal_checkpoints = 0;   /* times the log was emptied to make room */
+static unsigned long journal_replayed = 0;      /* transactions replayed at mount */
+
+int journal_replay(void);           /* at mount: brings the image up to its last commit */
+void journal_enable(void);          /* starts logging metadata, once the cache is set up */
+void journal_begin(void);           /* joins the running transaction */
+void journal_end(void);             /* leaves it */
+int journal_full(void);             /* should a long request end its step here? */
+int journal_commit(void);           /* writes the running transaction to the log */
+void journal_close(void);           /* at unmount: commits, and leaves the log empty */
+
+
+/*
+    Returns the byte offset of the given position of the log.
+*/
+static off_t journal_offset(long pos) {
+    return (off_t)(super.nJournalBlock + 1 + (pos % journal_size)) * block_size;
+}
+
+/*
+    Adds size bytes of data to a running FNV-1a checksum.
+*/
+static uint64_t journal_checksum(uint64_t sum, const void *data, size_t size) {
+
+    const unsigned char *bytes = (const unsigned char*)data;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        sum = (sum ^ bytes[i]) * JOURNAL_CHECKSUM_PRIME;
+    }
+
+    return sum;
+}
+
+/*
+    Records in the header where the log now starts (the caller syncs).
+*/
+static int journal_write_header(long start, long transaction) {
+
+    struct cs1550_journal_header header;
+    header.nMagic = JOURNAL_HEADER_MAGIC;
+    header.nStart = start;
+    header.nTransaction = transaction;
+
+    return disk_write(&header, sizeof(header), (off_t)super.nJournalBlock * block_size);
+}
+
+/*
+    Is the given block one a transaction may have changed? (Anything but
+    the journal itself. The superblock is, since it holds the heads of the
+    orphan lists: see cs1550reclaim.c.)
+*/
+static int journal_home_ok(long home) {
+    return (home >= 0) && (home < super.nBlocks) &&
+           ((home < super.nJournalBlock) || (home >= super.nJournalBlock + super.nJournalBlocks));
+}
+
+/*
+    qsort() comparison: orders block numbers.
+*/
+static int journal_compare(const void *a, const void *b) {
+
+    long x = *(const long*)a, y = *(const long*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+    Notes that the log now holds images of the count blocks in homes
+    (which it sorts).
+*/
+static void journal_note_logged(long *homes, long count) {
+
+    if (journal_logged_lost || (count == 0)) { return; }
+
+    if (journal_logged_count + count > journal_logged_room) {
+        long room = (journal_logged_room == 0) ? 1024 : journal_logged_room;
+        while (room < journal_logged_count + count) { room *= 2; }
+        long *grown = (long*)realloc(journal_logged, room * sizeof(long));
+        if (grown == NULL) {
+            journal_logged_lost = 1;                // ERROR: out of memory; assume the worst
+            return;
+        }
+        journal_logged = grown;
+        journal_logged_room = room;
+    }
+
+    // merge the two sorted lists from the back, dropping repeats at the end
+    qsort(homes, count, sizeof(long), journal_compare);
+    long i = journal_logged_count - 1, j = count - 1, k = journal_logged_count + count;
+    while (j >= 0) {
+        long home = ((i >= 0) && (journal_logged[i] > homes[j])) ? journal_logged[i--] : homes[j--];
+        if ((k == journal_logged_count + count) || (journal_logged[k] != home)) {
+            journal_logged[--k] = home;
+        }
+    }
+
+    // the rest of the old list is already in place below k: close the gap
+    if ((i >= 0) && (k < journal_logged_count + count) && (journal_logged[i] == journal_logged[k])) { k++; }
+    long kept = i + 1, merged = journal_logged_count + count - k;
+    memmove(journal_logged + kept, journal_logged + k, merged * sizeof(long));
+    journal_logged_count = kept + merged;
+
+}
+
+/*
+    Does the log hold an image of any of the count blocks from index on?
+*/
+static int journal_logs(long index, long count) {
+
+    if (journal_logged_lost) { return 1; }
+
+    long low = 0, high = journal_logged_count;      // first logged block >= index
+    while (low < high) {
+        long mid = low + (high - low) / 2;
+        if (journal_logged[mid] < index) { low = mid + 1; } else { high = mid; }
+    }
+
+    return (low < journal_logged_count) && (journal_logged[low] < index + count);
+}
+
+/*
+    Forgets the blocks the log held images of, once it is empty.
+*/
+static void journal_forget_logged(void) {
+    journal_logged_count = 0;
+    journal_logged_lost = 0;
+}
+
+/*
+    Walks the log from position start, where transaction number transaction
+    should begin, writing the images of each complete transaction to their
+    home blocks; when pinned_only is set, only the images of blocks that are
+    pinned in the cache. Stops at the first position that does not hold the
+    next complete transaction.
+
+    RETURNS:    0+          the number of transactions walked; *end and *next are
+                            the position it stopped at and the transaction expected there
+                -ENOMEM     out of memory
+                -errno      a read or write failed
+*/
+static long journal_apply(long start, long transaction, int pinned_only, long *end, long *next) {
+
+    char *block = (char*)malloc(block_size);
+    char *image = (char*)malloc(block_size);
+    long *homes = NULL;                             // home of every image of the transaction
+    long capacity = 0;
+    long applied = 0;
+    long pos = start;
+    long status = 0;
+
+    if ((block == NULL) || (image == NULL)) {
+        free(block);
+        free(image);
+        return -ENOMEM;                             // ERROR: out of memory
+    }
+
+    while (status == 0) {
+        // read one transaction through to its commit block, checking it as we go
+        struct cs1550_journal_descriptor *desc = (struct cs1550_journal_descriptor*)block;
+        struct cs1550_journal_commit *commit = (struct cs1550_journal_commit*)block;
+        uint64_t sum = JOURNAL_CHECKSUM_SEED;
+        long count = 0;
+        long p = pos;
+        int complete = 0;
+
+        while ((p - pos < journal_size) && (disk_read(block, block_size, journal_offset(p)) == 0)) {
+            if (desc->nTransaction != transaction) { break; }   // not (or no longer) this transaction
+
+            if (commit->nMagic == JOURNAL_COMMIT_MAGIC) {
+                complete = (commit->nBlocks == count) && (commit->nChecksum == sum);
+                p++;
+                break;
+            }
+            if ((desc->nMagic != JOURNAL_DESCRIPTOR_MAGIC) || (desc->nBlocks <= 0) || (desc->nBlocks > JOURNAL_TAGS)) {
+                break;                                          // not a descriptor: damaged
+            }
+
+            long n = desc->nBlocks, i;
+            if (count + n > capacity) {
+                long *grown = (long*)realloc(homes, (count + n) * sizeof(long));
+                if (grown == NULL) { status = -ENOMEM; break; } // ERROR: out of memory
+                homes = grown;
+                capacity = count + n;
+            }
+            for (i = 0; i < n; i++) {
+                homes[count + i] = desc->nHome[i];
+            }
+            sum = journal_checksum(sum, block, block_size);
+
+            for (i = 0; i < n; i++) {
+                if (!journal_home_ok(homes[count + i])) { break; }
+                if (disk_read(block, block_size, journal_offset(p + 1 + i)) != 0) { break; }
+                sum = journal_checksum(sum, block, block_size);
+            }
+            if (i < n) { break; }                               // damaged (or unreadable)
+
+            count += n;
+            p += 1 + n;
+        }
+
+        if (!complete) { break; }
+
+        // it is all there: write it home, image by image (later ones win)
+        long q = pos, i = 0;
+        while ((status == 0) && (i < count)) {
+            if (disk_read(block, block_size, journal_offset(q)) != 0) { status = -EIO; break; }
+            long n = desc->nBlocks, j;                          // q is at a descriptor
+            for (j = 0; (j < n) && (status == 0); j++, i++) {
+                if (pinned_only && !cache_is_pinned(homes[i])) { continue; }
+
+                status = disk_read(image, block_size, journal_offset(q + 1 + j));
+                if (status == 0) { status = disk_write(image, block_size, (off_t)homes[i] * block_size); }
+            }
+            q += 1 + n;
+        }
+        if (status != 0) { break; }                             // ERROR: could not write it home
+
+        applied++;
+        pos = p;
+        transaction++;
+    }
+
+    free(block);
+    free(image);
+    free(homes);
+
+    *end = pos % journal_size;
+    *next = transaction;
+
+    return (status != 0) ? status : applied;
+}
+
+/*
+    Called once at mount, before anything else reads metadata: writes every
+    complete transaction left in the log to its home blocks, then empties
+    the log. Does nothing on images without a journal.
+
+    RETURNS:    0           SUCCESS
+                -EIO        the header is damaged
+                -ENOMEM     out of memory
+                -errno      a read, write or sync failed
+*/
+int journal_replay(void) {
+
+    if (super.nJournalBlocks <= 0) { return 0; }    // no journal
+
+    journal_size = super.nJournalBlocks - 1;
+
+    struct cs1550_journal_header header;
+    int status = disk_read(&header, sizeof(header), (off_t)super.nJournalBlock * block_size);
+    if (status != 0) { return status; }             // ERROR: could not read the header
+
+    if (header.nMagic != JOURNAL_HEADER_MAGIC) {
+        header.nStart = 0;                          // never used: an empty log
+        header.nTransaction = 1;
+    } else if ((header.nStart < 0) || (header.nStart >= journal_size) || (header.nTransaction < 1)) {
+        return -EIO;                                // ERROR: damaged header
+    }
+
+    long end, next;
+    long applied = journal_apply(header.nStart, header.nTransaction, 0, &end, &next);
+    if (applied < 0) { return (int)applied; }       // ERROR: could not replay
+
+    status = disk_sync();                           // home blocks first ...
+    if (status == 0) { status = journal_write_header(end, next); }
+    if (status == 0) { status = disk_sync(); }      // ... then the log is empty
+    if ((status == 0) && (applied > 0)) { status = super_load(); }     // the superblock may have been one of them
+
+    journal_replayed = applied;
+    journal_start = journal_head = end;
+    journal_first = journal_transaction = next;
+    journal_used = 0;
+
+    return status;
+}
+
+/*
+    Returns how many blocks the running transaction will log so far: the
+    ones pinned in the cache, and the bitmap blocks write_bitmap() pins
+    when it commits.
+*/
+static long journal_pins(void) {
+    return cache_count_pinned() + bitmap_dirty();
+}
+
+/*
+    Turns the journal on, if the image has one and blocks are cached.
+    Called once at mount, after journal_replay() and cache_init(). A
+    transaction is committed once it has half the log's worth of blocks,
+    or half the cache's, whichever is less: the rest is headroom for the
+    requests still running in it. It must never get past what the whole
+    log, or the whole cache, holds (see journal_begin).
+*/
+void journal_enable(void) {
+
+    if ((super.nJournalBlocks <= 0) || (cache_capacity == 0)) { return; }
+
+    long half = journal_size / 2;
+    journal_max_pins = (half - 1) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);     // the images, their descriptors and the commit fit in half
+    if (journal_max_pins > cache_capacity / 2) { journal_max_pins = cache_capacity / 2; }
+    journal_limit = (journal_size - 1) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);   // ... and in all of it
+    if (journal_limit > cache_capacity) { journal_limit = cache_capacity; }
+
+    cache_pinning = 1;
+    journal_active = 1;
+    bitmap_hold(1);                                 // freed blocks wait for their commit (see release_run)
+
+}
+
+/*
+    Joins the running transaction; every request that changes metadata
+    calls this first, before taking any other lock, and journal_end() when
+    done. Waits while a commit is writing the transaction before it, and
+    commits first when the running one is already big, or has no room
+    left for JOURNAL_CREDITS more blocks from each request in it, this one
+    included: a pinned block can neither be evicted nor logged but with
+    the rest of its transaction, so it must fit in the cache and the log
+    together with them. Only a request alone in an empty transaction
+    joins it regardless.
+*/
+void journal_begin(void) {
+
+    if (!journal_active) { return; }
+
+    pthread_mutex_lock(&journal_lock);
+
+    for (;;) {
+        while (journal_closing) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+
+        long pins = journal_pins();
+        int room = (pins < journal_max_pins) &&
+                   (((journal_users == 0) && (pins == 0)) || (pins + (journal_users + 1) * JOURNAL_CREDITS <= journal_limit));
+        if (room) { break; }
+
+        pthread_mutex_unlock(&journal_lock);
+        int status = journal_commit();              // full: make room before joining
+        pthread_mutex_lock(&journal_lock);
+        if (status != 0) { break; }                 // ERROR: could not; join anyway
+    }
+
+    journal_users++;
+    journal_requests++;
+
+    pthread_mutex_unlock(&journal_lock);
+
+}
+
+/*
+    Leaves the running transaction.
+*/
+void journal_end(void) {
+
+    if (!journal_active) { return; }
+
+    pthread_mutex_lock(&journal_lock);
+    if (--journal_users == 0) {
+        pthread_cond_broadcast(&journal_cond);      // a commit may be waiting for us
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+}
+
+/*
+    Returns 1 once the running transaction is as big as a transaction gets
+    before it is committed, or has used up the room journal_begin() left
+    for the requests in it, 0 otherwise (and always without a journal). A
+    request that allocates a lot of blocks (see grow_step in cs1550.c)
+    checks this between runs, and ends its step there: it leaves the
+    transaction and joins the next one, so that no single request can pin
+    more blocks than the cache and the log have room for.
+*/
+int journal_full(void) {
+
+    if (!journal_active) { return 0; }
+
+    pthread_mutex_lock(&journal_lock);
+    long users = journal_users;
+    pthread_mutex_unlock(&journal_lock);
+
+    long pins = journal_pins();
+
+    return (pins >= journal_max_pins) || (pins + users * JOURNAL_CREDITS > journal_limit);
+}
+
+/*
+    Empties the log: the cache writes home everything it is not holding
+    back, the pinned blocks get their last committed image from the log,
+    and once that is synced the header moves up to the head.
+*/
+static int journal_checkpoint(void) {
+
+    int status = cache_flush();
+
+    if (status == 0) {
+        long end, next;
+        long applied = journal_apply(journal_start, journal_first, 1, &end, &next);
+        if (applied < 0) { status = (int)applied; }
+    }
+    if (status == 0) { status = disk_sync(); }
+    if (status == 0) { status = journal_write_header(journal_head, journal_transaction); }
+    if (status == 0) { status = disk_sync(); }
+
+    if (status == 0) {
+        journal_start = journal_head;
+        journal_first = journal_transaction;
+        journal_used = 0;
+        journal_checkpoints++;
+        journal_forget_logged();
+    }
+
+    return status;
+}
+
+/*
+    Writes the running transaction, every block pinned in the cache, to
+    the log, syncs it, and unpins the blocks. The data written meanwhile
+    goes to disk first. No request may be running.
+*/
+static int journal_write_transaction(void) {
+
+    if ((journal_used > 0) && bitmap_held_any(journal_logs)) {
+        int status = journal_checkpoint();          // it frees a block the log has an image of: empty the log first
+        if (status != 0) { return status; }         // ERROR: could not (the blocks stay held)
+    }
+
+    release_held();                                 // blocks it freed are FREE once it commits ...
+    write_bitmap();                                 // ... and that goes with it, as do its allocations
+
+    long count = cache_count_pinned();
+    if (count == 0) {
+        bitmap_punch_freed(1);
+        return 0;                                   // nothing changed
+    }
+
+    long tags = JOURNAL_TAGS;
+    long descriptors = (count + tags - 1) / tags;
+    long total = count + descriptors + 1;           // blocks it takes in the log
+    int status = cache_flush();                     // the data first ...
+    if (status == 0) { status = disk_sync(); }
+    if (status != 0) {
+        bitmap_punch_freed(0);
+        return status;                              // ERROR: could not write back the data
+    }
+
+    if (total > journal_size) {
+        // the requests in it went too far past journal_max_pins, each only
+        // a little: it can not be logged, and must not go home unlogged
+        bitmap_punch_freed(0);
+        return -ENOSPC;                             // ERROR: the log is too small (still pinned)
+    }
+
+    char *log = (char*)calloc(total, block_size);
+    char *images = (char*)malloc((size_t)count * block_size);
+    long *homes = (long*)malloc(count * sizeof(long));
+
+    if ((log == NULL) || (images == NULL) || (homes == NULL)) {
+        status = -ENOMEM;                           // ERROR: out of memory (still pinned, try again later)
+    } else {
+        count = cache_copy_pinned(homes, images, count);
+    }
+
+    if ((status == 0) && (journal_used + total > journal_size)) {
+        status = journal_checkpoint();              // no room: empty the log first
+    }
+
+    if (status == 0) {
+        // lay it out: descriptor, its images, ..., commit
+        uint64_t sum = JOURNAL_CHECKSUM_SEED;
+        long pos = 0, i = 0;
+        while (i < count) {
+            struct cs1550_journal_descriptor *desc = (struct cs1550_journal_descriptor*)(log + (size_t)pos * block_size);
+            long n = (count - i < tags) ? count - i : tags, j;
+            desc->nMagic = JOURNAL_DESCRIPTOR_MAGIC;
+            desc->nTransaction = journal_transaction;
+            desc->nBlocks = n;
+            for (j = 0; j < n; j++) {
+                desc->nHome[j] = homes[i + j];
+            }
+            memcpy(log + (size_t)(pos + 1) * block_size, images + (size_t)i * block_size, (size_t)n * block_size);
+            sum = journal_checksum(sum, desc, (size_t)(n + 1) * block_size);
+            pos += 1 + n;
+            i += n;
+        }
+
+        struct cs1550_journal_commit *commit = (struct cs1550_journal_commit*)(log + (size_t)pos * block_size);
+        commit->nMagic = JOURNAL_COMMIT_MAGIC;
+        commit->nTransaction = journal_transaction;
+        commit->nBlocks = count;
+        commit->nChecksum = sum;
+        total = pos + 1;
+
+        // one write (two when it wraps around the end of the log), one sync
+        long first = journal_head % journal_size;
+        long before_end = (total < journal_size - first) ? total : journal_size - first;
+        status = disk_write(log, (size_t)before_end * block_size, journal_offset(first));
+        if ((status == 0) && (before_end < total)) {
+            status = disk_write(log + (size_t)before_end * block_size, (size_t)(total - before_end) * block_size, journal_offset(0));
+        }
+        if (status == 0) { status = disk_sync(); }
+    }
+
+    if (status == 0) {
+        journal_head = (journal_head + total) % journal_size;
+        journal_used += total;
+        journal_transaction++;
+        journal_commits++;
+        journal_blocks += count;
+        cache_unpin_all();                          // safe in the log: free to go home
+        journal_note_logged(homes, count);
+    }
+    bitmap_punch_freed(status == 0);                // what it freed leaves '.disk' once it is in the log
+
+    free(log);
+    free(images);
+    free(homes);
+
+    return status;
+}
+
+/*
+    Commits the running transaction: waits for the requests in it to
+    finish, keeps new ones out, and writes it to the log with one write and
+    one sync. A commit already under way is waited for first, and what is
+    left after it committed next.
+
+    RETURNS:    0           SUCCESS (also when there is no journal)
+                -ENOSPC     the transaction is bigger than the log; the blocks stay pinned
+                -errno      the log could not be written; the blocks stay pinned
+*/
+int journal_commit(void) {
+
+    if (!journal_active) { return 0; }
+
+    pthread_mutex_lock(&journal_lock);
+    while (journal_closing) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    journal_closing = 1;                            // no new requests from here ...
+    while (journal_users > 0) {
+        pthread_cond_wait(&journal_cond, &journal_lock);    // ... and the running ones finish
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    int status = journal_write_transaction();
+
+    pthread_mutex_lock(&journal_lock);
+    journal_closing = 0;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    return status;
+}
+
+/*
+    Called once at unmount: commits what is left, writes everything home,
+    and empties the log, so the next mount has nothing to replay.
+*/
+void journal_close(void) {
+
+    if (!journal_active) { return; }
+
+    int status = journal_commit();
+    if (status == 0) { status = cache_flush(); }
+    if (status == 0) { status = disk_sync(); }
+    if (status == 0) { status = journal_write_header(journal_head, journal_transaction); }
+    if (status == 0) { status = disk_sync(); }
+
+    if (status == 0) {
+        journal_start = journal_head;
+        journal_first = journal_transaction;
+        journal_used = 0;
+    }
+
+    journal_active = 0;
+    journal_forget_logged();
+    free(journal_logged);
+    journal_logged = NULL;
+    journal_logged_room = 0;
+    cache_pinning = 0;
+    bitmap_hold(0);
+
+}
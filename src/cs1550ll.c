@@ -0,0 +1,1172 @@
+/*
+    Low-Level Front End
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    The same filesystem as cs1550.c, served through libfuse's low-level
+    API instead of its path-based one:
+
+        ./cs1550ll [-o options] testmount
+
+    The path-based API hands every request a full path, which each
+    handler in cs1550.c breaks up with sscanf() and resolves from the root
+    down. Here the kernel names directories and files by inode numbers
+    instead, handed out by lookup, so a getattr (which comes with nearly
+    every system call) goes through the directory index straight to the
+    block and slot holding the entry. Entries move when others are
+    deleted (see shrink_list), but their first block never changes, so
+    the inode number is made from that:
+
+        (generation << NODE_GEN_SHIFT) | (FUSE_ROOT_ID + start)
+
+    No two directories or files have the same first block, so none of
+    them share a number, and none of them is FUSE_ROOT_ID. Once one is
+    deleted its first block may be handed out again while the kernel
+    still remembers the old one; the new one then gets the next
+    generation not in use, so the kernel never takes it for the old one.
+
+    Every inode the kernel has been told about is kept in a hash table
+    (the node table), hashed by first block, until the kernel forgets it,
+    with what the handlers need to find it again without searching: its
+    names, its first block and that of its directory. Reads, writes and
+    the rest go to the same code as the path-based front end, given the
+    names directly. A node whose directory or file is deleted through it
+    stays in the table, marked gone, until the kernel forgets it.
+
+    The kernel may keep names, "no such name" and attributes for
+    cache_timeout seconds. It drops them itself when it sends a mkdir,
+    mknod, unlink, rmdir, write, setattr or fallocate that changes them,
+    since every change comes through it. The one change that does not is the loss of
+    appends held back for a file (see write_pending), which shrinks it:
+    the kernel is told to drop what it has of the file then, by a
+    background thread, since the loss may be found in the middle of a
+    request on that file.
+
+    Takes the same '-o' options as cs1550. The node table's lock is taken
+    last, after any of cs1550.c's.
+*/
+
+#define     CS1550_LOWLEVEL             // cs1550.c leaves out its own main() and its handlers by path
+
+#include    "cs1550.c"
+
+#include    <fuse_lowlevel.h>
+
+#define     NODE_GEN_SHIFT      48      // inode numbers keep the generation above the first block
+#define     NODE_MIN_BUCKETS    256     // hash chains in an empty node table
+#define     NOTIFY_QUEUE        64      // inodes waiting for the kernel to be told they changed
+
+// A directory or file the kernel knows by its inode number
+struct cs1550_node
+{
+    fuse_ino_t ino;                         // the key (see node_ino)
+    unsigned long nlookup;                  // lookups the kernel has not forgotten yet
+    int isDir;                              // a directory (in the root) or a file (in a directory)?
+    int gone;                               // deleted: every request on it fails with ENOENT
+    long parent;                            // DIR_INDEX_ROOT, or the first block of the file's directory
+    long start;                             // first block of the directory or of the file
+    char dir[MAX_FILENAME + 1];             // the directory's name (the file's directory, for a file)
+    char name[MAX_FILENAME + 1];            // file name ("" for a directory)
+    char ext[MAX_EXTENSION + 1];            // file extension
+    struct cs1550_node *next;               // next node in the same hash chain
+};
+
+static struct cs1550_node **nodes = NULL;                   /* the hash chains */
+static long node_buckets = 0;                               /* number of hash chains (a power of two) */
+static long node_count = 0;                                 /* number of nodes in the table */
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;   /* guards the table */
+
+static struct fuse_chan *notify_chan = NULL;                /* where to tell the kernel (set by main) */
+static fuse_ino_t notify_queue[NOTIFY_QUEUE];               /* ring of inodes to tell it about */
+static long notify_head = 0;                                /* next one to tell */
+static long notify_queued = 0;                              /* inodes in the ring */
+static pthread_t notify_thread;                             /* the background thread, when notify_running */
+static int notify_running = 0;
+static int notify_stopping = 0;                             /* set by notify_stop() */
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER; /* guards everything above */
+static pthread_cond_t notify_wake = PTHREAD_COND_INITIALIZER;
+
+// A directory listing made by ll_opendir, handed out by ll_readdir
+struct cs1550_listing
+{
+    fuse_req_t req;                         // the opendir it is made for
+    char *buf;                              // the entries, as fuse_add_direntry() lays them out
+    size_t size;                            // bytes of buf in use
+    size_t room;                            // bytes buf has room for
+    mode_t mode;                            // type of the entries: S_IFDIR in the root, S_IFREG in a directory
+    int failed;                             // ran out of memory
+};
+
+
+/*
+    Returns the inode number of the given generation of the entry whose
+    first block is start.
+*/
+static fuse_ino_t node_ino(long start, unsigned long generation) {
+    return ((fuse_ino_t)generation << NODE_GEN_SHIFT) | (fuse_ino_t)(FUSE_ROOT_ID + start);
+}
+
+/*
+    Returns the hash chain (of buckets) the nodes of the entries whose
+    first block is start go in: every generation goes in the same one.
+*/
+static long node_bucket(long start, long buckets) {
+    return (long)((unsigned long)start & (unsigned long)(buckets - 1));
+}
+
+/*
+    Returns the node with the given inode number, or NULL. The caller holds
+    node_lock.
+*/
+static struct cs1550_node *node_find(fuse_ino_t ino) {
+
+    if (nodes == NULL) { return NULL; }
+
+    long start = (long)(ino & (((fuse_ino_t)1 << NODE_GEN_SHIFT) - 1)) - FUSE_ROOT_ID;
+    struct cs1550_node *node = nodes[node_bucket(start, node_buckets)];
+    while ((node != NULL) && (node->ino != ino)) { node = node->next; }
+
+    return node;
+}
+
+/*
+    Returns the live node (not gone) of the entry whose first block is
+    start, or NULL. The caller holds node_lock.
+*/
+static struct cs1550_node *node_live(long start, int isDir) {
+
+    if (nodes == NULL) { return NULL; }
+
+    struct cs1550_node *node = nodes[node_bucket(start, node_buckets)];
+    while ((node != NULL) && ((node->start != start) || (node->isDir != isDir) || node->gone)) { node = node->next; }
+
+    return node;
+}
+
+/*
+    Doubles the number of hash chains (or creates the first ones) and moves
+    every node over. The caller holds node_lock.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory (the table is left as it was)
+*/
+static int node_grow(void) {
+
+    long buckets = (node_buckets == 0) ? NODE_MIN_BUCKETS : node_buckets * 2;
+    struct cs1550_node **table = (struct cs1550_node**)calloc(buckets, sizeof(*table));
+    if (table == NULL) { return -ENOMEM; }          // ERROR: out of memory
+
+    long i;
+    for (i = 0; i < node_buckets; i++) {
+        struct cs1550_node *node = nodes[i];
+        while (node != NULL) {
+            struct cs1550_node *next = node->next;
+            long bucket = node_bucket(node->start, buckets);
+            node->next = table[bucket];
+            table[bucket] = node;
+            node = next;
+        }
+    }
+
+    free(nodes);
+    nodes = table;
+    node_buckets = buckets;
+
+    return 0;
+}
+
+/*
+    Copies out the node with the given inode number.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     the kernel has forgotten it (or never knew it)
+*/
+static int node_get(fuse_ino_t ino, struct cs1550_node *node) {
+
+    pthread_mutex_lock(&node_lock);
+    struct cs1550_node *found = node_find(ino);
+    if (found != NULL) { *node = *found; }
+    pthread_mutex_unlock(&node_lock);
+
+    return (found != NULL) ? 0 : -ENOENT;
+}
+
+/*
+    Counts one more lookup of the given node, adding it to the table the
+    first time, and sets its inode number: that of the live node of the
+    same entry, or else the first generation not in use.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory
+*/
+static int node_add(struct cs1550_node *node) {
+
+    int status = 0;
+
+    pthread_mutex_lock(&node_lock);
+
+    struct cs1550_node *found = node_live(node->start, node->isDir);
+    if ((found != NULL) && ((found->parent != node->parent) || (strcmp(found->dir, node->dir) != 0) ||
+        (strcmp(found->name, node->name) != 0) || (strcmp(found->ext, node->ext) != 0))) {
+        found->gone = 1;                            // deleted by the other front end, and the block used again
+        found = NULL;
+    }
+
+    if (found != NULL) {
+        found->nlookup++;
+        node->ino = found->ino;
+
+    } else if ((node_count >= node_buckets) && (node_grow() != 0) && (nodes == NULL)) {
+        status = -ENOMEM;                           // ERROR: no table at all (a full one only gets slower)
+
+    } else if ((found = (struct cs1550_node*)malloc(sizeof(struct cs1550_node))) == NULL) {
+        status = -ENOMEM;                           // ERROR: out of memory
+
+    } else {
+        unsigned long generation = 0;
+        while (node_find(node_ino(node->start, generation)) != NULL) { generation++; }
+
+        long bucket = node_bucket(node->start, node_buckets);
+        node->ino = node_ino(node->start, generation);
+        *found = *node;
+        found->nlookup = 1;
+        found->next = nodes[bucket];
+        nodes[bucket] = found;
+        node_count++;
+    }
+
+    pthread_mutex_unlock(&node_lock);
+
+    return status;
+}
+
+/*
+    Takes nlookup lookups of the given node back, and drops it from the
+    table once the kernel has forgotten them all.
+*/
+static void node_forget(fuse_ino_t ino, unsigned long nlookup) {
+
+    pthread_mutex_lock(&node_lock);
+
+    struct cs1550_node *found = node_find(ino);
+    if (found != NULL) {
+        struct cs1550_node **link = &nodes[node_bucket(found->start, node_buckets)];
+        while (*link != found) { link = &(*link)->next; }
+
+        found->nlookup = (found->nlookup > nlookup) ? found->nlookup - nlookup : 0;
+        if (found->nlookup == 0) {
+            *link = found->next;
+            free(found);
+            node_count--;
+        }
+    }
+
+    pthread_mutex_unlock(&node_lock);
+}
+
+/*
+    Marks the node of the directory or file whose first block is start
+    gone, once it has been deleted.
+*/
+static void node_gone(long start, int isDir) {
+
+    pthread_mutex_lock(&node_lock);
+
+    struct cs1550_node *node = node_live(start, isDir);
+    if (node != NULL) { node->gone = 1; }
+
+    pthread_mutex_unlock(&node_lock);
+}
+
+/*
+    Forgets every node. Called at unmount.
+*/
+static void node_clear(void) {
+
+    pthread_mutex_lock(&node_lock);
+
+    long i;
+    for (i = 0; i < node_buckets; i++) {
+        while (nodes[i] != NULL) {
+            struct cs1550_node *next = nodes[i]->next;
+            free(nodes[i]);
+            nodes[i] = next;
+        }
+    }
+    free(nodes);
+    nodes = NULL;
+    node_buckets = 0;
+    node_count = 0;
+
+    pthread_mutex_unlock(&node_lock);
+}
+
+
+/*
+    Breaks a file's name up into filename and extension, the way the
+    path-based front end does: the extension is whatever follows the
+    first '.', and may be empty.
+
+    RETURNS:    0               SUCCESS
+                -ENOENT         no name before the '.'
+                -ENAMETOOLONG   the name is beyond 8.3 characters
+*/
+static int split_name(const char *name, char *filename, char *ext) {
+
+    size_t length = strcspn(name, ".");
+    const char *dot = name + length;
+
+    if (length == 0) { return -ENOENT; }                                        // ERROR: no file name
+    if ((length > MAX_FILENAME) || ((*dot != '\0') && (strlen(dot + 1) > MAX_EXTENSION))) {
+        return -ENAMETOOLONG;                                                   // ERROR: too long for 8.3
+    }
+
+    memcpy(filename, name, length);
+    filename[length] = '\0';
+    strcpy(ext, (*dot != '\0') ? dot + 1 : "");
+
+    return 0;
+}
+
+/*
+    Fills in the attributes of a directory.
+*/
+static void dir_attr(fuse_ino_t ino, struct stat *stbuf) {
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    stbuf->st_mode = S_IFDIR | 0755;        // file type and mode
+    stbuf->st_nlink = 2;                    // number of hard links
+}
+
+/*
+    Fills in the attributes of a file, reading its size from the slot of
+    the directory block that holds it, as cs1550_getattr does once it has
+    found it. The entry may have moved since the lookup (see shrink_list),
+    so it is found again through the directory index.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     the file is gone
+                -EIO        its directory could not be read
+*/
+static int file_attr(const struct cs1550_node *node, struct stat *stbuf) {
+
+    int status = -ENOENT;
+    long home = 0;
+    int slot = 0;
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    pthread_rwlock_rdlock(dir_lock(node->parent));
+    if (dir_index_find(node->parent, node->name, node->ext, &home, &slot) != node->start) {
+        pthread_rwlock_unlock(dir_lock(node->parent));
+        return -ENOENT;                                                         // ERROR: deleted, or another file by now
+    }
+
+    cs1550_directory_entry *dir_entry = get_directory(home);
+
+    if (dir_entry == NULL) {
+        status = -EIO;                                                          // ERROR: could not read the directory
+
+    } else if ((slot < dir_entry->nFiles) && (dir_entry->files[slot].nStartBlock == node->start)) {
+        cs1550_file_directory *file = &dir_entry->files[slot];
+
+        stbuf->st_ino = node->ino;
+        stbuf->st_mode = S_IFREG | 0666;    // file type and mode
+        stbuf->st_nlink = 1;                // number of hard links
+        stbuf->st_size = file->fsize;       // total file size, in bytes
+
+        // ... counting the appends held back (see write_file)
+        size_t pending_end = block_map_pending_end(file->nStartBlock);
+        if (pending_end > file->fsize) { stbuf->st_size = pending_end; }
+
+        status = 0;
+    }
+
+    put_block(dir_entry);
+    pthread_rwlock_unlock(dir_lock(node->parent));
+
+    return status;
+}
+
+/*
+    Fills in the attributes of any node.
+*/
+static int node_attr(const struct cs1550_node *node, struct stat *stbuf) {
+
+    if (node->gone) { return -ENOENT; }                                         // ERROR: deleted
+    if (node->isDir) {
+        dir_attr(node->ino, stbuf);
+        return 0;
+    }
+
+    return file_attr(node, stbuf);
+}
+
+/*
+    Finds the entry called name in the directory parent (FUSE_ROOT_ID for
+    the root) through the directory index, and fills in a node for it.
+
+    RETURNS:    0           SUCCESS
+                -ENOENT     no such entry
+                -ENOTDIR    parent is a file
+*/
+static int find_node(fuse_ino_t parent, const char *name, struct cs1550_node *node) {
+
+    memset(node, 0, sizeof(struct cs1550_node));
+
+    if (parent == FUSE_ROOT_ID) {
+        if (strlen(name) > MAX_FILENAME) { return -ENOENT; }                    // ERROR: no directory can have that name
+
+        node->start = dir_index_find(DIR_INDEX_ROOT, name, "", NULL, NULL);
+        if (node->start < 0) { return -ENOENT; }                                // ERROR: directory not found
+
+        node->isDir = 1;
+        node->parent = DIR_INDEX_ROOT;
+        strcpy(node->dir, name);
+
+    } else {
+        struct cs1550_node dir;
+        if ((node_get(parent, &dir) != 0) || dir.gone) { return -ENOENT; }     // ERROR: directory forgotten or deleted
+        if (!dir.isDir) { return -ENOTDIR; }                                    // ERROR: files hold no names
+
+        if (split_name(name, node->name, node->ext) != 0) { return -ENOENT; }  // ERROR: no file can have that name
+
+        node->start = dir_index_find(dir.start, node->name, node->ext, NULL, NULL);
+        if (node->start < 0) { return -ENOENT; }                                // ERROR: file not found
+
+        node->isDir = 0;
+        node->parent = dir.start;
+        strcpy(node->dir, dir.dir);
+    }
+
+    return 0;
+}
+
+/*
+    Answers a lookup (or a mkdir or mknod) with the entry called name in
+    parent, counting the lookup in the node table. A name that is not
+    there is answered with inode number 0, which lets the kernel remember
+    that for cache_timeout seconds too.
+*/
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+    struct cs1550_node node;
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+
+    int status = find_node(parent, name, &node);
+    if (status == 0) { status = node_add(&node); }                              // sets node.ino
+    if (status == 0) {
+        status = node_attr(&node, &e.attr);
+        if (status != 0) { node_forget(node.ino, 1); }
+    }
+
+    e.attr_timeout = options.cache_timeout;
+    e.entry_timeout = options.cache_timeout;
+
+    if ((status == -ENOENT) && (options.cache_timeout > 0)) {
+        fuse_reply_entry(req, &e);                  // no such name (e.ino is 0)
+        return;
+    }
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    e.ino = node.ino;
+    if (fuse_reply_entry(req, &e) != 0) {
+        node_forget(node.ino, 1);                   // the kernel never got it
+    }
+}
+
+/*
+    Frees a reply made by read_file_buf(), once libfuse has sent it.
+*/
+static void free_bufvec(struct fuse_bufvec *bufv) {
+
+    size_t i;
+    for (i = 0; i < bufv->count; i++) {
+        if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) { free(bufv->buf[i].mem); }
+    }
+    free(bufv);
+}
+
+
+/*
+    The background thread: tells the kernel to drop the attributes and data
+    it has of each queued inode, until notify_stop() is called.
+*/
+static void *notify_main(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&notify_lock);
+    while (!notify_stopping) {
+        if (notify_queued == 0) {
+            pthread_cond_wait(&notify_wake, &notify_lock);
+            continue;                               // check whether to stop
+        }
+
+        fuse_ino_t ino = notify_queue[notify_head];
+        notify_head = (notify_head + 1) % NOTIFY_QUEUE;
+        notify_queued--;
+
+        pthread_mutex_unlock(&notify_lock);         // never held while the kernel works on it
+        fuse_lowlevel_notify_inval_inode(notify_chan, ino, 0, 0);
+        pthread_mutex_lock(&notify_lock);
+    }
+    pthread_mutex_unlock(&notify_lock);
+
+    return NULL;
+}
+
+/*
+    Set as pending_lost: queues the file starting at start_block, if the
+    kernel knows it, for the background thread. When the queue is full the
+    kernel still finds out once the file's attributes time out.
+*/
+static void notify_lost(long start_block)
+{
+    fuse_ino_t ino = 0;
+
+    pthread_mutex_lock(&node_lock);
+    struct cs1550_node *node = node_live(start_block, 0);
+    if (node != NULL) { ino = node->ino; }
+    pthread_mutex_unlock(&node_lock);
+
+    if (ino == 0) { return; }                       // the kernel has nothing of it
+
+    pthread_mutex_lock(&notify_lock);
+    if (notify_running && (notify_queued < NOTIFY_QUEUE)) {
+        notify_queue[(notify_head + notify_queued) % NOTIFY_QUEUE] = ino;
+        notify_queued++;
+        pthread_cond_signal(&notify_wake);
+    }
+    pthread_mutex_unlock(&notify_lock);
+}
+
+/*
+    Starts the background thread, unless there is nothing to tell (no
+    channel, or the kernel keeps nothing).
+*/
+static void notify_start(void)
+{
+    if ((notify_chan == NULL) || (options.cache_timeout <= 0)) { return; }
+
+    notify_stopping = 0;
+    if (pthread_create(&notify_thread, NULL, notify_main, NULL) == 0) {
+        notify_running = 1;
+        pending_lost = notify_lost;
+    } else {
+        fprintf(stderr, "cs1550: could not start the notify thread\n");  // ERROR: the kernel finds out when its cache times out
+    }
+}
+
+/*
+    Stops the background thread, dropping what is still queued.
+*/
+static void notify_stop(void)
+{
+    if (!notify_running) { return; }
+
+    pending_lost = NULL;
+
+    pthread_mutex_lock(&notify_lock);
+    notify_stopping = 1;
+    notify_running = 0;
+    notify_queued = 0;
+    pthread_cond_signal(&notify_wake);
+    pthread_mutex_unlock(&notify_lock);
+
+    pthread_join(notify_thread, NULL);
+}
+
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+
+    cs1550_init(conn);
+    notify_start();
+}
+
+
+static void ll_destroy(void *userdata)
+{
+    notify_stop();                                  // the kernel is done with the mount
+    cs1550_destroy(userdata);
+    node_clear();
+}
+
+
+/*
+    Looks up the entry called name in parent (see find_node).
+*/
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    reply_entry(req, parent, name);
+}
+
+
+/*
+    The kernel has dropped nlookup of its references to ino.
+*/
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    node_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+
+/*
+    Returns the attributes of ino, without resolving any name (see
+    node_attr).
+*/
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    struct stat stbuf;
+    struct cs1550_node node;
+    int status = 0;
+
+    if (ino == FUSE_ROOT_ID) {
+        dir_attr(ino, &stbuf);
+    } else if ((status = node_get(ino, &node)) == 0) {
+        status = node_attr(&node, &stbuf);
+    }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+    } else {
+        fuse_reply_attr(req, &stbuf, options.cache_timeout);
+    }
+}
+
+
+/*
+    A file's size can be changed (see truncate_file); nothing else about a
+    directory or file can, so otherwise this only returns the attributes.
+*/
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+    int status = 0;
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        status = node_get(ino, &node);
+        if ((status == 0) && node.gone) { status = -ENOENT; }                  // ERROR: deleted
+        if ((status == 0) && node.isDir) { status = -EISDIR; }                 // ERROR: directories have no size
+        if (status == 0) { status = truncate_file(node.dir, node.name, node.ext, attr->st_size); }
+    }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    ll_getattr(req, ino, fi);
+}
+
+
+/*
+    Adds the entry name, with the given inode number and type, to the end
+    of a listing.
+*/
+static void add_entry(struct cs1550_listing *listing, const char *name, fuse_ino_t ino, mode_t mode)
+{
+    struct stat stbuf;
+
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = ino;
+    stbuf.st_mode = mode;
+
+    size_t length = fuse_add_direntry(listing->req, NULL, 0, name, NULL, 0);
+    if (listing->size + length > listing->room) {
+        size_t room = 2 * (listing->size + length);
+        char *buf = (char*)realloc(listing->buf, room);
+        if (buf == NULL) { listing->failed = 1; return; }   // ERROR: out of memory
+        listing->buf = buf;
+        listing->room = room;
+    }
+
+    fuse_add_direntry(listing->req, listing->buf + listing->size, listing->room - listing->size,
+        name, &stbuf, listing->size + length);          // the next entry starts where this one ends
+    listing->size += length;
+}
+
+static void fill_listing(void *ctx, const char *name, long start)
+{
+    struct cs1550_listing *listing = (struct cs1550_listing*)ctx;
+
+    if (listing->failed) { return; }
+
+    // the number the kernel knows the entry by, if it has looked it up
+    fuse_ino_t ino = node_ino(start, 0);
+    pthread_mutex_lock(&node_lock);
+    struct cs1550_node *node = node_live(start, listing->mode == S_IFDIR);
+    if (node != NULL) { ino = node->ino; }
+    pthread_mutex_unlock(&node_lock);
+
+    add_entry(listing, name, ino, listing->mode);
+}
+
+
+/*
+    Lists the directory ino (the root, or a directory in it) once, into a
+    listing handed to ll_readdir through fi->fh. A listing with many
+    entries is read by several readdirs, which then only copy their part
+    of it out.
+*/
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+    int status = 0;
+
+    if ((ino != FUSE_ROOT_ID) && ((status = node_get(ino, &node)) == 0) && !node.isDir) {
+        status = -ENOTDIR;                          // ERROR: not a directory
+    }
+
+    struct cs1550_listing *listing = NULL;
+    if ((status == 0) && ((listing = (struct cs1550_listing*)calloc(1, sizeof(struct cs1550_listing))) == NULL)) {
+        status = -ENOMEM;                           // ERROR: out of memory
+    }
+
+    if (status == 0) {
+        listing->req = req;
+        listing->mode = (ino == FUSE_ROOT_ID) ? S_IFDIR : S_IFREG;
+
+        add_entry(listing, ".", ino, S_IFDIR);
+        add_entry(listing, "..", FUSE_ROOT_ID, S_IFDIR);
+        status = list_directory((ino == FUSE_ROOT_ID) ? NULL : node.dir, fill_listing, listing);
+        if ((status == 0) && listing->failed) { status = -ENOMEM; }     // ERROR: out of memory
+        if (status == -EIO) { status = 0; }         // could not read disk: an empty listing, as cs1550_readdir
+    }
+
+    if (status != 0) {
+        if (listing != NULL) { free(listing->buf); }
+        free(listing);
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    fi->fh = (uintptr_t)listing;
+    if (fuse_reply_open(req, fi) != 0) {            // the kernel never got it
+        free(listing->buf);
+        free(listing);
+    }
+}
+
+
+/*
+    Hands out the part of the listing made by ll_opendir that starts at
+    offset off.
+*/
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    struct cs1550_listing *listing = (struct cs1550_listing*)(uintptr_t)fi->fh;
+
+    if ((off_t)listing->size <= off) {
+        fuse_reply_buf(req, NULL, 0);               // past the last entry
+    } else {
+        if (size > listing->size - off) { size = listing->size - off; }
+        fuse_reply_buf(req, listing->buf + off, size);
+    }
+}
+
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    struct cs1550_listing *listing = (struct cs1550_listing*)(uintptr_t)fi->fh;
+    free(listing->buf);
+    free(listing);
+
+    fuse_reply_err(req, 0);
+}
+
+
+/*
+    Creates the directory name, which must be in the root (see
+    make_directory).
+*/
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    (void) mode;
+
+    char dir_name[MAX_LENGTH];
+    int status = 0;
+
+    if (parent != FUSE_ROOT_ID) {
+        status = -EPERM;                            // ERROR: can ONLY create dir within '/' root
+    } else if (strlen(name) > MAX_FILENAME) {
+        status = -ENAMETOOLONG;                     // ERROR: directory name too long
+    } else {
+        strcpy(dir_name, name);
+        status = make_directory(dir_name);
+    }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+    } else {
+        reply_entry(req, parent, name);
+    }
+}
+
+
+/*
+    Creates the file name in the directory parent (see make_file). Mode
+    and rdev can be ignored.
+*/
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    (void) mode;
+    (void) rdev;
+
+    struct cs1550_node dir;
+    char filename[MAX_LENGTH];
+    char ext[MAX_LENGTH];
+    int status = 0;
+
+    if (parent == FUSE_ROOT_ID) {
+        status = -EPERM;                            // ERROR: file cannot be created in root dir
+    } else if ((status = node_get(parent, &dir)) != 0) {
+        // ERROR: directory forgotten
+    } else if (!dir.isDir) {
+        status = -ENOTDIR;                          // ERROR: files hold no names
+    } else if ((status = split_name(name, filename, ext)) == 0) {
+        status = make_file(dir.dir, filename, ext);
+    }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+    } else {
+        reply_entry(req, parent, name);
+    }
+}
+
+
+/*
+    Deletes the file name from the directory parent (see remove_file). A
+    node the kernel still holds for it is marked gone.
+*/
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct cs1550_node dir;
+    char filename[MAX_LENGTH];
+    char ext[MAX_LENGTH];
+    long start = -1;
+    int status = 0;
+
+    if (parent == FUSE_ROOT_ID) {
+        status = -EISDIR;                           // ERROR: the root holds only directories
+    } else if ((status = node_get(parent, &dir)) != 0) {
+        // ERROR: directory forgotten
+    } else if (!dir.isDir) {
+        status = -ENOTDIR;                          // ERROR: files hold no names
+    } else if ((status = split_name(name, filename, ext)) != 0) {
+        status = -ENOENT;                           // ERROR: no file can have that name
+    } else {
+        status = remove_file(dir.dir, filename, ext, &start);
+    }
+
+    if (status == 0) { node_gone(start, 0); }
+
+    fuse_reply_err(req, -status);
+}
+
+
+/*
+    Deletes the empty directory name from the root (see remove_directory).
+    A node the kernel still holds for it is marked gone.
+*/
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char dir_name[MAX_LENGTH];
+    long start = -1;
+    int status = 0;
+
+    if (parent != FUSE_ROOT_ID) {
+        status = -ENOTDIR;                          // ERROR: directories hold only files
+    } else if (strlen(name) > MAX_FILENAME) {
+        status = -ENOENT;                           // ERROR: no directory can have that name
+    } else {
+        strcpy(dir_name, name);
+        status = remove_directory(dir_name, &start);
+    }
+
+    if (status == 0) { node_gone(start, 1); }
+
+    fuse_reply_err(req, -status);
+}
+
+
+/*
+    Opens the file ino: its block map (built the first time the file is
+    opened) goes to read and write through fi->fh, as cs1550_open does.
+*/
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+    struct cs1550_block_map *bmap = NULL;
+    int status = (ino == FUSE_ROOT_ID) ? -EISDIR : node_get(ino, &node);
+
+    if ((status == 0) && node.isDir) {
+        status = -EISDIR;                           // ERROR: not a file
+    }
+    if ((status == 0) && node.gone) {
+        status = -ENOENT;                           // ERROR: deleted
+    }
+    if (status == 0) {
+        status = get_file_map(node.dir, node.name, node.ext, NULL, &bmap);
+    }
+    if ((status == 0) && (bmap->nStartBlock != node.start)) {
+        put_block_map(bmap);
+        status = -ENOENT;                           // ERROR: deleted, and the name used again
+    }
+    if (status == 0) {
+        status = open_handle(bmap, fi);
+        if (status != 0) { put_block_map(bmap); }
+    }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+    } else if (fuse_reply_open(req, fi) != 0) {
+        cs1550_release(NULL, fi);                   // the kernel never got it
+    }
+}
+
+
+/*
+    Reads size bytes of the file ino from offset off, handing libfuse
+    where they sit in '.disk' when it can splice them (see read_file_buf).
+*/
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+    struct fuse_bufvec *bufv = NULL;
+
+    int status = node_get(ino, &node);
+    if (status == 0) { status = read_file_buf(node.dir, node.name, node.ext, &bufv, size, off, fi); }
+
+    if (status != 0) {
+        fuse_reply_err(req, -status);
+    } else {
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        free_bufvec(bufv);
+    }
+}
+
+
+/*
+    Writes the data in bufv into the file ino at offset off, taking it the
+    way libfuse received it (see write_file).
+*/
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+    struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+
+    int status = node_get(ino, &node);
+    if (status == 0) { status = write_file(node.dir, node.name, node.ext, bufv, off, fi); }
+
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+    } else {
+        fuse_reply_write(req, status);
+    }
+}
+
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void*)buf;
+
+    ll_write_buf(req, ino, &src, off, fi);
+}
+
+
+/*
+    Allocates space for the file ino, or punches a hole in it (see
+    fallocate_file).
+*/
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+    struct fuse_file_info *fi)
+{
+    struct cs1550_node node;
+
+    (void) fi;
+
+    int status = node_get(ino, &node);
+    if ((status == 0) && node.gone) { status = -ENOENT; }                      // ERROR: deleted
+    if ((status == 0) && node.isDir) { status = -EISDIR; }                     // ERROR: not a file
+    if (status == 0) { status = fallocate_file(node.dir, node.name, node.ext, mode, offset, length); }
+
+    fuse_reply_err(req, -status);
+}
+
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    fuse_reply_err(req, -cs1550_flush(NULL, fi));
+}
+
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    fuse_reply_err(req, -cs1550_release(NULL, fi));
+}
+
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    fuse_reply_err(req, -cs1550_fsync(NULL, datasync, fi));
+}
+
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void) ino;
+
+    fuse_reply_err(req, -cs1550_fsyncdir(NULL, datasync, fi));
+}
+
+
+/*
+    Reports the blocks and names used and free (see cs1550_statfs).
+*/
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    (void) ino;
+
+    struct statvfs stbuf;
+    cs1550_statfs(NULL, &stbuf);
+    fuse_reply_statfs(req, &stbuf);
+}
+
+
+/*
+    Reads an extended attribute: only the root has one (see
+    cs1550_getxattr).
+*/
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    char *value = NULL;
+    int length = -ENODATA;                          // ERROR: no such attribute
+
+    if ((size > 0) && ((value = (char*)malloc(size)) == NULL)) {
+        length = -ENOMEM;                           // ERROR: out of memory
+    } else if (ino == FUSE_ROOT_ID) {
+        length = cs1550_getxattr("/", name, value, size);
+    }
+
+    if (length < 0) {
+        fuse_reply_err(req, -length);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, length);              // caller only wants the size
+    } else {
+        fuse_reply_buf(req, value, length);
+    }
+    free(value);
+}
+
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char *list = NULL;
+    int length = 0;                                 // no attributes
+
+    if ((size > 0) && ((list = (char*)malloc(size)) == NULL)) {
+        length = -ENOMEM;                           // ERROR: out of memory
+    } else if (ino == FUSE_ROOT_ID) {
+        length = cs1550_listxattr("/", list, size);
+    }
+
+    if (length < 0) {
+        fuse_reply_err(req, -length);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, length);              // caller only wants the size
+    } else {
+        fuse_reply_buf(req, list, length);
+    }
+    free(list);
+}
+
+
+// register our functions as the implementations of the requests
+static struct fuse_lowlevel_ops lowlevel_oper = {
+    .init       = ll_init,
+    .destroy    = ll_destroy,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .mknod      = ll_mknod,
+    .mkdir      = ll_mkdir,
+    .unlink     = ll_unlink,
+    .rmdir      = ll_rmdir,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write      = ll_write,
+    .write_buf  = ll_write_buf,
+    .fallocate  = ll_fallocate,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_releasedir,
+    .fsyncdir   = ll_fsyncdir,
+    .statfs     = ll_statfs,
+    .getxattr   = ll_getxattr,
+    .listxattr  = ll_listxattr,
+};
+
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *chan;
+    char *mountpoint = NULL;
+    int multithreaded, foreground;
+    int result = 1;
+
+    if ((cs1550_setup(&args) == 0) &&
+        (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) &&
+        ((chan = fuse_mount(mountpoint, &args)) != NULL))
+    {
+        struct fuse_session *session = fuse_lowlevel_new(&args, &lowlevel_oper, sizeof(lowlevel_oper), NULL);
+
+        if (session != NULL) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                fuse_session_add_chan(session, chan);
+                notify_chan = chan;
+                fuse_daemonize(foreground);
+                result = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+            fuse_session_destroy(session);          // calls ll_destroy
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+
+    return (result != 0) ? 1 : 0;
+}
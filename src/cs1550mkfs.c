@@ -0,0 +1,149 @@
+/*
+    Disk Formatter
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Creates (or resizes) a disk image and lays out an empty filesystem on
+    it: superblock, root, a bitmap sized for the whole image, and a
+    metadata journal.
+
+        ./cs1550mkfs [-s size] [-b block_size] [-j journal_size] [-f chain|extents] [image]
+
+    size takes a K, M or G suffix (default: the image's current size, or
+    5M for a new image); block_size is a power of two from 512 to 64K
+    (default 512); journal_size takes the same suffixes (default 4M, or a
+    sixteenth of the image if that is less; 0 for no journal); image
+    defaults to '.disk'. Anything already in the image is lost.
+*/
+
+#include    "cs1550disk.c"
+#include    "cs1550super.c"
+
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <unistd.h>
+
+#define     DEFAULT_IMAGE_SIZE  5242880     // 5M, what run.sh always used
+
+
+/*
+    Turns "5M", "512K", "20G" or a plain byte count into bytes.
+
+    RETURNS:    1+      SUCCESS; the size in bytes
+                -1      not a size
+*/
+static long long parse_size(const char *text) {
+    char *end;
+    long long size = strtoll(text, &end, 10);
+
+    if ((end == text) || (size <= 0)) { return -1; }
+
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+        default: break;
+    }
+
+    return (*end == '\0') ? size : -1;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s size] [-b block_size] [-j journal_size] [-f chain|extents] [image]\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+    long long size = -1;                            // keep the image's size unless told otherwise
+    long long bsize = BLOCK_SIZE;
+    long long jsize = -1;                           // journal size in bytes (-1: the default)
+    int format = CS1550_FORMAT_CURRENT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:j:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                if ((size = parse_size(optarg)) < 0) { usage(argv[0]); return 1; }
+                break;
+            case 'b':
+                bsize = parse_size(optarg);
+                if (!super_block_size_ok(bsize)) {
+                    fprintf(stderr, "%s: block size must be a power of two from %d to %d\n",
+                        argv[0], BLOCK_SIZE, MAX_BLOCK_SIZE);
+                    return 1;
+                }
+                break;
+            case 'j':
+                if (strcmp(optarg, "0") == 0) {
+                    jsize = 0;                      // no journal
+                } else if ((jsize = parse_size(optarg)) < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "chain") == 0) {
+                    format = CS1550_FORMAT_CHAIN;
+                } else if (strcmp(optarg, "extents") == 0) {
+                    format = CS1550_FORMAT_EXTENTS;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc - 1) { usage(argv[0]); return 1; }
+
+    if (optind < argc) {
+        strncpy(disk_path, argv[optind], sizeof(disk_path) - 1);
+        disk_path[sizeof(disk_path) - 1] = '\0';
+    }
+
+    // create the image if needed, and give it its size
+    int fd = open(disk_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(disk_path);
+        return 1;
+    }
+
+    if (size < 0) {
+        off_t current = lseek(fd, 0, SEEK_END);
+        size = (current > 0) ? current : DEFAULT_IMAGE_SIZE;
+    }
+    size -= size % bsize;                           // whole blocks only
+
+    if (ftruncate(fd, size) != 0) {
+        perror(disk_path);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    int status = disk_open();
+    if (status == 0) {
+        long jblocks = (jsize < 0) ? -1 : (long)((jsize + bsize - 1) / bsize);
+        status = super_format(size / bsize, bsize, format, jblocks);
+        if (status == 0) { status = disk_sync(); }
+        if (status == 0) { status = super_load(); }    // read it back, as a mount would
+        disk_close();
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "%s: can not format %s: %s\n", argv[0], disk_path, strerror(-status));
+        return 1;
+    }
+
+    printf("%s: %ld blocks of %ld bytes, root at %ld, bitmap at %ld (%ld blocks), journal at %ld (%ld blocks), data from %ld, %s layout\n",
+        disk_path, super.nBlocks, super.nBlockSize, super.nRootBlock, super.nBitmapBlock, super.nBitmapBlocks,
+        super.nJournalBlock, super.nJournalBlocks, super.nDataBlock, (super.nFormat == CS1550_FORMAT_CHAIN) ? "chain" : "extents");
+
+    return 0;
+}
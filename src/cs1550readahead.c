@@ -0,0 +1,297 @@
+/*
+    Read-Ahead
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Every open file keeps track of how it is being read. While each read
+    carries on where the previous one stopped, the file is taken to be read
+    sequentially, and the blocks a window past the reader are fetched before
+    they are asked for. They are found through the file's block map, so
+    they follow its chain or its extents wherever they sit on disk, which
+    the kernel's own read-ahead on '.disk' can not know.
+
+    The window starts at four times the size of the read (but at least
+    READAHEAD_MIN_BYTES), doubles each time it is moved on, up to
+    READAHEAD_MAX_BYTES (and never more than a quarter of the block cache),
+    and is dropped at the first read that is not sequential. A new window
+    is asked for as soon as the reader is half way into the last one, so
+    the reader should never have to wait for it.
+
+    Reads that go through the block cache have their windows read into it
+    by a background thread (cache_prefetch()). Reads that do not (no cache,
+    '-o mmap', or data spliced straight from '.disk' by read_buf) ask the
+    kernel to read the window into its page cache instead, with
+    posix_fadvise(POSIX_FADV_WILLNEED). When the thread's queue is full, a
+    window is dropped: it is only a hint. So is a run the reader has already
+    gone past by the time the thread gets to it, which would only push
+    blocks out of the cache that are still to be read.
+*/
+
+#include <fcntl.h>                  /* posix_fadvise() */
+#include <pthread.h>                /* pthread_create() pthread_mutex_lock() */
+#include <stdio.h>                  /* fprintf() */
+
+#define READAHEAD_MIN_BYTES     65536       /* smallest window */
+#define READAHEAD_MAX_BYTES     2097152     /* largest window */
+#define READAHEAD_QUEUE         64          /* runs waiting for the background thread */
+
+// How one open file is being read
+struct cs1550_readahead
+{
+    pthread_mutex_t lock;               // reads of the same open file may run side by side
+    off_t next;                         // where the next read starts if the file is read sequentially
+    long read;                          // last block of the file read so far (atomic, for the background thread)
+    long window;                        // blocks kept fetched ahead of the reader (0: not sequential)
+    long ahead;                         // first block of the file not fetched yet
+};
+
+// A run of disk blocks for the background thread to read into the cache
+struct cs1550_readahead_run
+{
+    struct cs1550_readahead *ra;        // the open file it is for
+    long block;                         // first block of the file
+    long index;                         // first disk block
+    long count;                         // number of blocks
+};
+
+static struct cs1550_readahead_run readahead_queue[READAHEAD_QUEUE];   /* ring of runs to read */
+static long readahead_head = 0;                             /* next run to read */
+static long readahead_queued = 0;                           /* runs in the ring */
+static struct cs1550_readahead *readahead_busy = NULL;     /* whose run the thread is reading right now */
+static pthread_t readahead_thread;                          /* the background thread, when readahead_running */
+static int readahead_running = 0;
+static int readahead_stopping = 0;                          /* set by readahead_stop() */
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;     /* guards everything above and below */
+static pthread_cond_t readahead_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t readahead_done = PTHREAD_COND_INITIALIZER;        /* signalled when readahead_busy is cleared */
+
+static unsigned long readahead_windows = 0;     /* windows asked for */
+static unsigned long readahead_blocks = 0;      /* blocks in them */
+static unsigned long readahead_dropped = 0;     /* blocks dropped: the queue was full, or the reader got there first */
+
+void readahead_init(struct cs1550_readahead *ra);          /* sets up the state of a newly opened file */
+void readahead_destroy(struct cs1550_readahead *ra);       /* frees it once the file is closed */
+void readahead_read(struct cs1550_readahead *ra, struct cs1550_block_map *bmap, off_t offset, size_t size,
+    size_t fsize, long payload, int cached);               /* notes a read, and reads ahead of it if sequential */
+void readahead_start(void);                                /* starts the background thread */
+void readahead_stop(void);                                 /* stops it */
+
+
+/*
+    Sets up the read-ahead state of a newly opened file: nothing read yet,
+    so a first read from the start counts as sequential.
+*/
+void readahead_init(struct cs1550_readahead *ra) {
+
+    pthread_mutex_init(&ra->lock, NULL);
+    ra->next = 0;
+    ra->read = -1;
+    ra->window = 0;
+    ra->ahead = 0;
+
+}
+
+/*
+    Frees the read-ahead state of a file that has been closed, once the
+    background thread is done with it: its queued runs are dropped, and the
+    one being read (if any) is waited for.
+*/
+void readahead_destroy(struct cs1550_readahead *ra) {
+
+    pthread_mutex_lock(&readahead_lock);
+
+    long i, kept = 0;
+    for (i = 0; i < readahead_queued; i++) {
+        struct cs1550_readahead_run run = readahead_queue[(readahead_head + i) % READAHEAD_QUEUE];
+        if (run.ra != ra) { readahead_queue[(readahead_head + kept++) % READAHEAD_QUEUE] = run; }
+    }
+    readahead_queued = kept;
+
+    while (readahead_busy == ra) { pthread_cond_wait(&readahead_done, &readahead_lock); }
+
+    pthread_mutex_unlock(&readahead_lock);
+
+    pthread_mutex_destroy(&ra->lock);
+
+}
+
+/*
+    Fetches count blocks of the file from block_num on (holes aside), one
+    contiguous run of disk blocks at a time: into the cache by the
+    background thread if cached is set and the thread is running, into the
+    kernel's page cache otherwise. Called with the file's data lock held,
+    so the map can not change meanwhile.
+*/
+static void readahead_fetch(struct cs1550_readahead *ra, struct cs1550_block_map *bmap, long block_num, long count, int cached) {
+
+    long max_run = MAX_FLUSH_BYTES / block_size;    // most the thread reads in one go
+
+    pthread_mutex_lock(&readahead_lock);
+    readahead_windows++;
+
+    while (count > 0) {
+        long index = block_map_lookup(bmap, block_num);
+        long run = block_map_run(bmap, block_num);
+        if ((index < 0) || (run <= 0)) { break; }   // past the end of the file
+        if (run > count) { run = count; }
+        if (index == BLOCK_MAP_HOLE) {              // a hole: nothing on disk to fetch
+            block_num += run;
+            count -= run;
+            continue;
+        }
+        if (run > max_run) { run = max_run; }
+
+        if (cached && readahead_running) {
+            if (readahead_queued < READAHEAD_QUEUE) {
+                struct cs1550_readahead_run *slot = &readahead_queue[(readahead_head + readahead_queued) % READAHEAD_QUEUE];
+                slot->ra = ra;
+                slot->block = block_num;
+                slot->index = index;
+                slot->count = run;
+                readahead_queued++;
+                pthread_cond_signal(&readahead_wake);
+            } else {
+                readahead_dropped += run;           // the thread is behind: let this one go
+            }
+        } else {
+            posix_fadvise(disk_descriptor(), (off_t)index * block_size, (off_t)run * block_size, POSIX_FADV_WILLNEED);
+        }
+        readahead_blocks += run;
+
+        block_num += run;
+        count -= run;
+    }
+
+    pthread_mutex_unlock(&readahead_lock);
+
+}
+
+/*
+    Notes a read of size bytes at offset from a file of fsize bytes, each
+    of its blocks holding payload bytes, and if the file is being read
+    sequentially makes sure the blocks a window past it are being fetched.
+    cached says whether the caller reads the file through the block cache.
+    Called with the file's data lock held (shared is enough).
+*/
+void readahead_read(struct cs1550_readahead *ra, struct cs1550_block_map *bmap, off_t offset, size_t size,
+    size_t fsize, long payload, int cached) {
+
+    if ((size == 0) || (offset >= (off_t)fsize)) { return; }     // nothing read
+    if (size > fsize - offset) { size = fsize - offset; }
+
+    long last = (offset + size - 1) / payload;                  // last block read
+    long end = (fsize + payload - 1) / payload;                 // blocks in the file
+    long from = 0, count = 0;                                   // what to fetch, if anything
+
+    long max_window = READAHEAD_MAX_BYTES / payload;
+    if (cached && (cache_capacity > 0) && (max_window > cache_capacity / 4)) {
+        max_window = cache_capacity / 4;                        // no point pushing out what is about to be read
+    }
+    if (max_window < 1) { max_window = 1; }
+
+    pthread_mutex_lock(&ra->lock);
+
+    // several reads of the same file may arrive out of order: allow for one request's worth
+    if ((offset + (off_t)size < ra->next) || (offset > ra->next + (off_t)size)) {
+        ra->window = 0;                                         // random access: stop reading ahead
+        ra->ahead = 0;
+    } else if (ra->ahead - (last + 1) <= ra->window / 2) {
+        // within half a window of what has been fetched (or just started): move the window on
+        long window = (ra->window == 0) ? 4 * (long)((size + payload - 1) / payload) : 2 * ra->window;
+        if (window < READAHEAD_MIN_BYTES / payload) { window = READAHEAD_MIN_BYTES / payload; }
+        if (window > max_window) { window = max_window; }
+
+        from = (ra->ahead > last + 1) ? ra->ahead : last + 1;   // never fetch a block twice
+        count = last + 1 + window - from;
+        if (from + count > end) { count = end - from; }
+
+        ra->window = window;
+        ra->ahead = from + ((count > 0) ? count : 0);
+    }
+
+    if (offset + (off_t)size > ra->next) { ra->next = offset + size; }
+    if (last > ra->read) { __atomic_store_n(&ra->read, last, __ATOMIC_RELAXED); }
+
+    pthread_mutex_unlock(&ra->lock);
+
+    if (count > 0) { readahead_fetch(ra, bmap, from, count, cached); }
+
+}
+
+/*
+    The background thread: reads the queued runs into the block cache, one
+    at a time, until readahead_stop() is called. The blocks of a run the
+    reader has meanwhile read (or gone past) are left out.
+*/
+static void *readahead_main(void *arg) {
+
+    (void) arg;
+
+    pthread_mutex_lock(&readahead_lock);
+    while (!readahead_stopping) {
+        if (readahead_queued == 0) {
+            pthread_cond_wait(&readahead_wake, &readahead_lock);
+            continue;                               // check whether to stop
+        }
+
+        struct cs1550_readahead_run run = readahead_queue[readahead_head];
+        readahead_head = (readahead_head + 1) % READAHEAD_QUEUE;
+        readahead_queued--;
+
+        long late = __atomic_load_n(&run.ra->read, __ATOMIC_RELAXED) + 1 - run.block;
+        if (late > 0) {                             // the reader got there first
+            if (late > run.count) { late = run.count; }
+            readahead_dropped += late;
+            run.index += late;
+            run.count -= late;
+        }
+        if (run.count == 0) { continue; }
+
+        readahead_busy = run.ra;                    // readahead_destroy() waits for it
+        pthread_mutex_unlock(&readahead_lock);      // never held across the read
+        cache_prefetch(run.index, run.count);
+        pthread_mutex_lock(&readahead_lock);
+        readahead_busy = NULL;
+        pthread_cond_broadcast(&readahead_done);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+
+    return NULL;
+}
+
+/*
+    Starts the background thread; without it (or without a cache) every
+    window goes to posix_fadvise().
+*/
+void readahead_start(void) {
+
+    if (cache_capacity == 0) { return; }            // nothing to read into
+
+    readahead_stopping = 0;
+    if (pthread_create(&readahead_thread, NULL, readahead_main, NULL) == 0) {
+        readahead_running = 1;
+    } else {
+        fprintf(stderr, "cs1550: could not start the read-ahead thread\n");    // ERROR: only the kernel reads ahead
+    }
+
+}
+
+/*
+    Stops the background thread, dropping the runs still queued, and waits
+    for it to finish the one it is reading.
+*/
+void readahead_stop(void) {
+
+    if (!readahead_running) { return; }
+
+    pthread_mutex_lock(&readahead_lock);
+    readahead_stopping = 1;
+    readahead_running = 0;                          // from now on, nothing is queued
+    readahead_queued = 0;
+    pthread_cond_signal(&readahead_wake);
+    pthread_mutex_unlock(&readahead_lock);
+
+    pthread_join(readahead_thread, NULL);
+
+}
@@ -0,0 +1,443 @@
+/*
+    Block Reclamation
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Deleting a file (or cutting off the tail of one) must not cost time in
+    proportion to its size: walking a gigabyte of chained blocks to clear
+    their bits would keep the unlink waiting for seconds. Instead, whatever
+    was deleted is put on a list in a few writes, and a background thread
+    frees it a batch at a time:
+
+        nOrphanBlock    (superblock) what was deleted since the thread last
+                        looked: unlink and truncate put things here
+        nReclaimBlock   (superblock) what the thread is freeing now: when
+                        it runs dry, it takes over the whole other list
+
+    In the CHAIN layout the lists are made of chains: the first block of
+    each one keeps the next chain on the list ORPHAN_NEXT_AT bytes in (its
+    data is of no use any more), and its own nNextBlock still leads through
+    the rest of it. Each step frees up to RECLAIM_BATCH blocks from the
+    front of the first chain; if some are left, the first of those takes
+    its place on the list.
+
+    In the EXTENTS layout the lists are made of index blocks, linked by
+    their nNextBlock: a deleted file's index blocks are linked in as they
+    are, and the tail cut off by a truncate gets index blocks of its own,
+    taken from the tail itself. Each step frees up to RECLAIM_BATCH blocks
+    from the runs at the end of the first index block, and the index block
+    itself once it lists nothing.
+
+    The heads live in the superblock and change through the journal like
+    any metadata, each step in a transaction of its own, so a crash leaves
+    every deleted block either still on a list or free; the next mount
+    carries on where the thread stopped. The blocks a step frees are only
+    FREE once its transaction commits (see release_run()). Images without
+    a superblock keep the heads in memory only, and the lists are emptied
+    before unmount.
+
+    A request that needs more space than is free first frees what it can
+    itself (reclaim_space()), rather than fail while the thread is behind.
+*/
+
+#include <pthread.h>                /* pthread_create() pthread_cond_wait() */
+#include <stdlib.h>                 /* malloc() free() */
+#include <string.h>                 /* memcpy() memset() */
+
+#define RECLAIM_BATCH       8192    /* most blocks one step frees (one transaction) */
+#define RECLAIM_READ        64      /* blocks of a chain read at a time, to find where it goes next */
+
+// CHAIN layout: where in the first block of an orphaned chain the next one on the list is kept
+#define ORPHAN_NEXT_AT      sizeof(long)
+
+static int reclaim_extents = 0;                 /* the lists are of index blocks (EXTENTS), not chains */
+static pthread_t reclaim_thread;                /* the background thread, when reclaim_running */
+static int reclaim_running = 0;
+static int reclaim_stopping = 0;                /* set by reclaim_stop() */
+static int reclaim_kicked = 0;                  /* something was put on a list since the thread last looked */
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;        /* guards the heads in super, and their writes */
+static pthread_mutex_t reclaim_step_lock = PTHREAD_MUTEX_INITIALIZER;   /* one step at a time: the thread's, or a request's */
+static pthread_mutex_t reclaim_wake_lock = PTHREAD_MUTEX_INITIALIZER;   /* guards the three flags above */
+static pthread_cond_t reclaim_wake = PTHREAD_COND_INITIALIZER;          /* signalled when one of them is set */
+
+static unsigned long reclaim_orphans = 0;       /* files and tails put on the lists (atomic) */
+static unsigned long reclaim_steps = 0;         /* batches freed (atomic) */
+static unsigned long reclaim_blocks = 0;        /* blocks in them (atomic) */
+
+void reclaim_chain(long first);                                     /* puts a chain of blocks on the list to free */
+void reclaim_index(long first, long last);                          /* puts a file's index blocks (and so its data) on it */
+int reclaim_runs(struct cs1550_extent_map *runs, long count);       /* puts runs of blocks on it */
+long reclaim_step(void);                                            /* frees one batch */
+void reclaim_space(long want);                                      /* frees what was deleted until want blocks are free */
+void reclaim_start(int is_extents);                                 /* starts the background thread */
+void reclaim_stop(void);                                            /* stops it */
+
+
+/*
+    Writes the heads of the lists back to the superblock, as metadata. The
+    caller holds reclaim_lock.
+*/
+static void reclaim_save_heads(void) {
+
+    if (super.nMagic != CS1550_MAGIC) { return; }   // no superblock: the heads live in memory only
+
+    cache_write_meta(&super, sizeof(super), 0);
+
+}
+
+/*
+    Is this a block the lists may lead to?
+*/
+static int reclaim_block_ok(long index) {
+    return (index >= super.nDataBlock) && (index < super.nBlocks);
+}
+
+/*
+    Wakes the background thread: there is something to free.
+*/
+static void reclaim_kick(void) {
+
+    pthread_mutex_lock(&reclaim_wake_lock);
+    reclaim_kicked = 1;
+    pthread_cond_signal(&reclaim_wake);
+    pthread_mutex_unlock(&reclaim_wake_lock);
+
+}
+
+/*
+    CHAIN layout: puts the chain of blocks starting at first (a deleted
+    file, or the tail cut off one) on the list of blocks to free. Nothing
+    may point at it any more. The caller holds a journal handle.
+*/
+void reclaim_chain(long first) {
+
+    pthread_mutex_lock(&reclaim_lock);
+
+    long next = super.nOrphanBlock;
+    cache_write_meta(&next, sizeof(long), (off_t)first * block_size + ORPHAN_NEXT_AT);
+    super.nOrphanBlock = first;
+    reclaim_save_heads();
+    __atomic_add_fetch(&reclaim_orphans, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&reclaim_lock);
+
+    reclaim_kick();
+
+}
+
+/*
+    EXTENTS layout: puts the index blocks of a deleted file, first to last
+    (already linked to each other), and with them every run they list, on
+    the list of blocks to free. The caller holds a journal handle.
+*/
+void reclaim_index(long first, long last) {
+
+    pthread_mutex_lock(&reclaim_lock);
+
+    long next = super.nOrphanBlock;
+    cache_write_meta(&next, sizeof(long), (off_t)last * block_size);   // its nNextBlock
+    super.nOrphanBlock = first;
+    reclaim_save_heads();
+    __atomic_add_fetch(&reclaim_orphans, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&reclaim_lock);
+
+    reclaim_kick();
+
+}
+
+/*
+    EXTENTS layout: puts count runs of blocks (the tail cut off a file, see
+    block_map_cut()) on the list of blocks to free. They get index blocks
+    of their own, taken from the front of the runs themselves, so this
+    never needs a free block. Holes among them are passed over. Changes
+    the runs. The caller holds a journal
+    handle.
+
+    RETURNS:    0           SUCCESS
+                -ENOMEM     out of memory (nothing was put on the list)
+*/
+int reclaim_runs(struct cs1550_extent_map *runs, long count) {
+
+    struct cs1550_extent_block *block = (struct cs1550_extent_block*)malloc(block_size);
+    if (block == NULL) { return -ENOMEM; }          // ERROR: out of memory
+
+    long first = 0, last = 0, r = 0;
+    while (r < count) {
+        if ((runs[r].nBlocks <= 0) || (runs[r].nStartBlock == BLOCK_MAP_HOLE)) { r++; continue; }
+
+        long index = runs[r].nStartBlock++;         // the next index block: the first block left of this run
+        runs[r].nBlocks--;
+
+        memset(block, 0, block_size);
+        for (; (r < count) && (block->nExtents < (long)MAX_EXTENTS_IN_BLOCK); r++) {
+            if ((runs[r].nBlocks <= 0) || (runs[r].nStartBlock == BLOCK_MAP_HOLE)) { continue; }
+            block->extents[block->nExtents].nStartBlock = runs[r].nStartBlock;
+            block->extents[block->nExtents].nBlocks = runs[r].nBlocks;
+            block->nExtents++;
+        }
+        cache_write_meta_block(index, block);
+
+        if (last != 0) {
+            cache_write_meta(&index, sizeof(long), (off_t)last * block_size);     // link it from the one before
+        } else {
+            first = index;
+        }
+        last = index;
+    }
+
+    free(block);
+
+    if (first != 0) { reclaim_index(first, last); }
+
+    return 0;
+}
+
+/*
+    CHAIN layout: frees up to RECLAIM_BATCH blocks from the front of the
+    chain starting at head. *next is set to what takes its place on the
+    list: the rest of the chain (which then leads on to the chain after
+    this one), or the chain after this one.
+
+    RETURNS:    1+          the number of blocks freed
+                -ENOMEM     out of memory
+*/
+static long reclaim_chain_step(long head, long *next) {
+
+    char *run = (char*)malloc((size_t)RECLAIM_READ * block_size);
+    if (run == NULL) { return -ENOMEM; }            // ERROR: out of memory
+
+    long after = 0;                                 // the chain after this one
+    cache_read(&after, sizeof(long), (off_t)head * block_size + ORPHAN_NEXT_AT);
+
+    long freed = 0;
+    long from = head, count = 0;                    // blocks walked, not freed yet: a run on disk
+    long block = head;
+    long first = 0, read = 0;                       // blocks of the chain in run, from first on
+
+    while ((block != 0) && (freed + count < RECLAIM_BATCH)) {
+        if ((block < first) || (block >= first + read)) {
+            // read the blocks from here on in one go (chains are mostly contiguous), unless
+            // '.disk' is mapped: then there is nothing to save, and the blocks past this one
+            // may be another file's, being written
+            read = (disk_block_ptr(block) != NULL) ? 1 : RECLAIM_READ;
+            if (read > RECLAIM_BATCH - freed - count) { read = RECLAIM_BATCH - freed - count; }
+            if (read > super.nBlocks - block) { read = super.nBlocks - block; }
+            first = block;
+            size_t size = (size_t)read * block_size;
+            off_t offset = (off_t)first * block_size;
+            int status = cache_clean(first, read) ? disk_read(run, size, offset) : cache_read(run, size, offset);
+            if (status != 0) { read = 0; break; }   // ERROR: could not read it; leave the rest of the chain be
+        }
+
+        if (block != from + count) {                // not next to the ones before it: free those
+            release_run(from, count);
+            freed += count;
+            from = block;
+            count = 0;
+        }
+        count++;
+
+        long link;                                  // its nNextBlock
+        memcpy(&link, run + (size_t)(block - first) * block_size, sizeof(long));
+        block = reclaim_block_ok(link) ? link : 0;  // a chain that leads outside the data ends there
+    }
+    release_run(from, count);
+    freed += count;
+
+    if (block != 0) {
+        cache_write_meta(&after, sizeof(long), (off_t)block * block_size + ORPHAN_NEXT_AT);
+        *next = block;                              // the rest of it, leading on to the next chain
+    } else {
+        *next = reclaim_block_ok(after) ? after : 0;
+    }
+
+    free(run);
+
+    return freed;
+}
+
+/*
+    EXTENTS layout: frees up to RECLAIM_BATCH blocks from the runs at the
+    end of the index block head, or once it lists nothing the index block
+    itself. *next is set to what is first on the list after that.
+
+    RETURNS:    1+          the number of blocks freed
+                -ENOMEM     out of memory
+                -errno      the index block could not be read
+*/
+static long reclaim_index_step(long head, long *next) {
+
+    struct cs1550_extent_block *ext = (struct cs1550_extent_block*)malloc(block_size);
+    if (ext == NULL) { return -ENOMEM; }            // ERROR: out of memory
+
+    int status = cache_read_block(head, ext);
+    if (status != 0) {
+        free(ext);
+        return status;                              // ERROR: could not read it
+    }
+
+    long freed = 0;
+    if ((ext->nExtents < 0) || (ext->nExtents > (long)MAX_EXTENTS_IN_BLOCK)) { ext->nExtents = 0; }   // damaged: free just the block
+
+    while ((ext->nExtents > 0) && (freed < RECLAIM_BATCH)) {
+        struct cs1550_extent *last = &ext->extents[ext->nExtents - 1];
+        long take = (last->nBlocks < RECLAIM_BATCH - freed) ? last->nBlocks : RECLAIM_BATCH - freed;
+        if (!reclaim_block_ok(last->nStartBlock)) {
+            take = last->nBlocks;                   // a hole (or damage): nothing to free, all at once
+        } else if (take > 0) {
+            release_run(last->nStartBlock + last->nBlocks - take, take);
+            freed += take;
+        }
+        last->nBlocks -= take;
+        if (last->nBlocks <= 0) { ext->nExtents--; }
+    }
+
+    if (freed > 0) {
+        cache_write_meta_block(head, ext);          // what is left of it
+        *next = head;
+    } else {
+        *next = reclaim_block_ok(ext->nNextBlock) ? ext->nNextBlock : 0;
+        release_run(head, 1);                       // lists nothing: the block itself goes
+        freed = 1;
+    }
+
+    free(ext);
+
+    return freed;
+}
+
+/*
+    Frees one batch of the blocks on the lists, in a transaction of its
+    own. The caller holds no lock, nor a journal handle.
+
+    RETURNS:    1+          the number of blocks freed (only FREE once the
+                            transaction commits, with a journal)
+                0           there was nothing left to free
+                -errno      it could not be done
+*/
+long reclaim_step(void) {
+
+    long freed = 0;
+
+    pthread_mutex_lock(&reclaim_step_lock);
+    journal_begin();
+
+    pthread_mutex_lock(&reclaim_lock);
+    if ((super.nReclaimBlock == 0) && (super.nOrphanBlock != 0)) {
+        super.nReclaimBlock = super.nOrphanBlock;   // take over everything deleted so far
+        super.nOrphanBlock = 0;
+        reclaim_save_heads();
+    }
+    long head = super.nReclaimBlock;
+    pthread_mutex_unlock(&reclaim_lock);
+
+    if (head != 0) {
+        long next = 0;                              // only this thread changes nReclaimBlock
+        freed = reclaim_extents ? reclaim_index_step(head, &next) : reclaim_chain_step(head, &next);
+
+        if (freed > 0) {
+            pthread_mutex_lock(&reclaim_lock);
+            super.nReclaimBlock = next;
+            reclaim_save_heads();
+            pthread_mutex_unlock(&reclaim_lock);
+
+            __atomic_add_fetch(&reclaim_steps, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&reclaim_blocks, freed, __ATOMIC_RELAXED);
+        }
+    }
+
+    journal_end();
+    pthread_mutex_unlock(&reclaim_step_lock);
+
+    return freed;
+}
+
+/*
+    Called before a request that needs want blocks: while fewer are free,
+    frees what was deleted, committing the running transaction so that
+    the blocks held back until then become FREE. The caller holds no lock,
+    nor a journal handle. Gives up quietly; the request finds out whether
+    there is room.
+*/
+void reclaim_space(long want) {
+
+    while (bitmap_free() < want) {
+        if (reclaim_step() > 0) { continue; }       // some more, held back until the commit
+
+        if ((bitmap_held() == 0) || (journal_commit() != 0)) { break; }  // nothing left to free (or the commit failed)
+    }
+
+}
+
+/*
+    The background thread: frees one batch after another whenever there is
+    something on the lists, until reclaim_stop() is called.
+*/
+static void *reclaim_main(void *arg) {
+
+    (void) arg;
+
+    pthread_mutex_lock(&reclaim_wake_lock);
+    while (!reclaim_stopping) {
+        if (!reclaim_kicked) {
+            pthread_cond_wait(&reclaim_wake, &reclaim_wake_lock);
+            continue;                               // check whether to stop
+        }
+        reclaim_kicked = 0;
+
+        while (!reclaim_stopping) {
+            pthread_mutex_unlock(&reclaim_wake_lock);   // never held across a step
+            long freed = reclaim_step();
+            pthread_mutex_lock(&reclaim_wake_lock);
+            if (freed <= 0) { break; }              // nothing left (or it failed: wait for the next delete)
+        }
+    }
+    pthread_mutex_unlock(&reclaim_wake_lock);
+
+    return NULL;
+}
+
+/*
+    Starts the background thread, which first carries on with whatever
+    the lists held at mount. Called once, after the journal is enabled;
+    is_extents gives the layout the lists are in.
+*/
+void reclaim_start(int is_extents) {
+
+    reclaim_extents = is_extents;
+    reclaim_stopping = 0;
+    reclaim_kicked = 1;                             // whatever was left from the last mount
+
+    if (pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) == 0) {
+        reclaim_running = 1;
+    } else {
+        fprintf(stderr, "cs1550: could not start the reclaim thread\n");      // ERROR: space comes back through reclaim_space() only
+    }
+
+}
+
+/*
+    Stops the background thread, waiting for the step it is in the middle
+    of. What is left on the lists stays there for the next mount, except
+    on images without a superblock, where nothing would remember it: those
+    are emptied here.
+*/
+void reclaim_stop(void) {
+
+    if (reclaim_running) {
+        pthread_mutex_lock(&reclaim_wake_lock);
+        reclaim_stopping = 1;
+        pthread_cond_signal(&reclaim_wake);
+        pthread_mutex_unlock(&reclaim_wake_lock);
+
+        pthread_join(reclaim_thread, NULL);
+        reclaim_running = 0;
+    }
+
+    if (super.nMagic != CS1550_MAGIC) {
+        while (reclaim_step() > 0) { }              // no superblock to keep the lists in
+    }
+
+}
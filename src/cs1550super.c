@@ -0,0 +1,273 @@
+/*
+    Superblock
+
+    Joe Meszar (jwm54@pitt.edu)
+    CS1550 Project 4 (FALL 2016)
+
+    Block 0 of an image made by cs1550mkfs (or formatted at first mount)
+    describes the rest of it, so nothing about the disk's size has to be
+    known at compile time:
+
+        block 0                         superblock
+        block nRootBlock (1)            root directory
+        blocks nBitmapBlock ...         the bitmap, one bit per block of the image
+        blocks nJournalBlock ...        the metadata journal (see cs1550journal.c), if any
+        blocks nDataBlock ...           directories, files, index blocks
+
+    The superblock also holds the heads of the two lists of blocks deleted
+    files and truncated tails leave behind (nOrphanBlock, nReclaimBlock;
+    see cs1550reclaim.c). They are the only fields that change after the
+    image is made, and they change through the journal like any metadata.
+
+    The superblock itself always takes the first BLOCK_SIZE bytes; every
+    block of the image, block 0 included, is nBlockSize bytes, a power of
+    two from BLOCK_SIZE up to MAX_BLOCK_SIZE chosen by cs1550mkfs.
+
+    Images from before the superblock have no magic number in block 0;
+    block 0 is their root, and they are always the 5 MB images run.sh made
+    with dd, 512-byte blocks, with the bitmap in the last three blocks. super_load() fills
+    in that same geometry for them, so the rest of the filesystem never has
+    to tell the two apart.
+*/
+
+#include <errno.h>                  /* EIO EINVAL EPROTONOSUPPORT */
+#include <limits.h>                 /* INT_MAX */
+#include <stdlib.h>                 /* calloc() free() */
+#include <string.h>                 /* memset() */
+
+#define CS1550_MAGIC            0x4653303535315343L     /* "CS1550FS" */
+#define CS1550_SUPER_VERSION    4                       /* layout of struct cs1550_superblock, and files may have holes */
+#define CS1550_SUPER_VERSION_3  3                       /* ... before holes in EXTENTS files (upgraded at mount) */
+#define CS1550_SUPER_VERSION_2  2                       /* ... before the orphan lists (upgraded at mount) */
+#define CS1550_SUPER_VERSION_1  1                       /* ... before the journal fields (still mounts, without a journal) */
+
+// On-disk layouts of file data (see cs1550blockmap.c)
+#define CS1550_FORMAT_CHAIN     0       // every data block starts with nNextBlock
+#define CS1550_FORMAT_EXTENTS   1       // files point at index blocks of (start, length) runs
+#define CS1550_FORMAT_CURRENT   CS1550_FORMAT_EXTENTS   // layout given to new images
+
+#define LEGACY_BLOCKS           10240   /* blocks in an image from before the superblock (5 MB) */
+#define LEGACY_BITMAP_BLOCKS    3       /* ... whose bitmap is in its last three blocks (from the 5 MB mark back) */
+#define MIN_BLOCKS              16      /* smallest image worth formatting */
+
+#define JOURNAL_MIN_BLOCKS      256     /* smallest journal worth having */
+#define JOURNAL_DEFAULT_BYTES   4194304 /* journal given to new images (4M), if they are at least 16 times that */
+
+struct cs1550_superblock
+{
+    long nMagic;                        // CS1550_MAGIC; anything else means an image from before the superblock
+    long nVersion;                      // CS1550_SUPER_VERSION
+    long nBlockSize;                    // bytes per block
+    long nBlocks;                       // blocks in the image
+    long nRootBlock;                    // where the root directory is
+    long nBitmapBlock;                  // first block of the bitmap
+    long nBitmapBlocks;                 // number of blocks the bitmap takes
+    long nDataBlock;                    // first block the allocator may hand out
+    long nFormat;                       // layout of file data (CS1550_FORMAT_*)
+    long nJournalBlock;                 // first block of the journal (0: no journal)
+    long nJournalBlocks;                // number of blocks the journal takes
+    long nOrphanBlock;                  // first of the blocks deleted since the reclaimer last took them (0: none)
+    long nReclaimBlock;                 // first of the blocks the reclaimer is freeing (0: none)
+
+    // This is some space to get this to be exactly the size of the smallest disk block.
+    // Don't use it for anything.
+    char padding[BLOCK_SIZE - 13 * sizeof(long)];
+};
+
+static struct cs1550_superblock super;  /* geometry of the mounted image (made up for images without a superblock) */
+
+int super_load(void);                                       /* reads the geometry of the open disk */
+int super_format(long nblocks, long bsize, int format, long jblocks);   /* lays out a new, empty filesystem on the open disk */
+int super_upgrade(int allow);                               /* brings an older superblock up to this version, if allowed */
+
+
+/*
+    Returns 1 if bsize is a block size an image can have, 0 otherwise.
+*/
+static int super_block_size_ok(long bsize) {
+    return (bsize >= BLOCK_SIZE) && (bsize <= MAX_BLOCK_SIZE) && ((bsize & (bsize - 1)) == 0);
+}
+
+/*
+    Reads the superblock of the open disk, fills in super and sets
+    block_size for the rest of the mount. Images without a
+    superblock get the fixed geometry of the 5 MB images of old, with
+    nMagic left 0 and nFormat -1: their layout is recorded in their root,
+    which the caller reads from block 0.
+
+    RETURNS:    0                   SUCCESS
+                -EIO                block 0 could not be read, or the superblock does not add up
+                -EPROTONOSUPPORT    the image was made by a newer version, or with a block size this build can not use
+*/
+int super_load(void) {
+
+    struct cs1550_superblock sb;
+
+    if (disk_read(&sb, sizeof(sb), 0) != 0) { return -EIO; }       // ERROR: could not read block 0
+
+    if (sb.nMagic != CS1550_MAGIC) {
+        // no superblock: root in block 0, bitmap in the last three blocks
+        block_size = BLOCK_SIZE;
+        memset(&super, 0, sizeof(super));
+        super.nBlockSize = BLOCK_SIZE;
+        super.nBlocks = LEGACY_BLOCKS;
+        super.nRootBlock = 0;
+        super.nBitmapBlock = LEGACY_BLOCKS - LEGACY_BITMAP_BLOCKS;  // where the first write put it (see rebuild_bitmap)
+        super.nBitmapBlocks = LEGACY_BITMAP_BLOCKS;
+        super.nDataBlock = 1;
+        super.nFormat = -1;
+        return 0;
+    }
+
+    if (sb.nVersion == CS1550_SUPER_VERSION_1) {
+        sb.nJournalBlock = sb.nJournalBlocks = 0;                   // padding back then, and always zero
+    }
+    if ((sb.nVersion == CS1550_SUPER_VERSION_1) || (sb.nVersion == CS1550_SUPER_VERSION_2)) {
+        sb.nOrphanBlock = sb.nReclaimBlock = 0;                     // likewise: nothing was ever freed
+    }
+
+    if (((sb.nVersion != CS1550_SUPER_VERSION) && (sb.nVersion != CS1550_SUPER_VERSION_3) &&
+         (sb.nVersion != CS1550_SUPER_VERSION_2) && (sb.nVersion != CS1550_SUPER_VERSION_1)) ||
+        !super_block_size_ok(sb.nBlockSize) ||
+        (sb.nFormat < CS1550_FORMAT_CHAIN) || (sb.nFormat > CS1550_FORMAT_CURRENT)) {
+        return -EPROTONOSUPPORT;                                    // ERROR: not something this build can mount
+    }
+
+    if ((sb.nBlocks < MIN_BLOCKS) || (sb.nBlocks > INT_MAX) ||
+        (sb.nBlocks > disk_size() / sb.nBlockSize) ||               // image was cut short
+        (sb.nRootBlock < 1) || (sb.nRootBlock >= sb.nDataBlock) ||
+        (sb.nBitmapBlock < 1) || (sb.nBitmapBlock + sb.nBitmapBlocks > sb.nDataBlock) ||
+        (sb.nBitmapBlocks * sb.nBlockSize * 8 < sb.nBlocks) ||      // bitmap too small to cover the image
+        (sb.nDataBlock >= sb.nBlocks)) {
+        return -EIO;                                                // ERROR: corrupt superblock
+    }
+
+    if ((sb.nJournalBlocks != 0) &&
+        ((sb.nJournalBlocks < JOURNAL_MIN_BLOCKS) ||
+         (sb.nJournalBlock < sb.nBitmapBlock + sb.nBitmapBlocks) ||
+         (sb.nJournalBlock + sb.nJournalBlocks > sb.nDataBlock))) {
+        return -EIO;                                                // ERROR: journal overlaps something
+    }
+
+    if ((sb.nOrphanBlock != 0) && ((sb.nOrphanBlock < sb.nDataBlock) || (sb.nOrphanBlock >= sb.nBlocks))) {
+        return -EIO;                                                // ERROR: orphan list points outside the data
+    }
+    if ((sb.nReclaimBlock != 0) && ((sb.nReclaimBlock < sb.nDataBlock) || (sb.nReclaimBlock >= sb.nBlocks))) {
+        return -EIO;                                                // ERROR: likewise
+    }
+
+    super = sb;
+    block_size = sb.nBlockSize;
+
+    return 0;
+}
+
+/*
+    Returns the number of journal blocks a new image of nblocks blocks of
+    bsize bytes gets when none is asked for: JOURNAL_DEFAULT_BYTES, or a
+    sixteenth of the image if that is less, or none at all if that is less
+    than JOURNAL_MIN_BLOCKS.
+*/
+static long super_default_journal(long nblocks, long bsize) {
+
+    long jblocks = JOURNAL_DEFAULT_BYTES / bsize;
+    if (jblocks > nblocks / 16) { jblocks = nblocks / 16; }
+
+    return (jblocks < JOURNAL_MIN_BLOCKS) ? 0 : jblocks;
+}
+
+/*
+    Lays out a new, empty filesystem of nblocks blocks of bsize bytes on the open disk:
+    the superblock, an empty root, a bitmap with everything before the
+    first data block marked USED, and an empty journal of jblocks blocks
+    (-1: the default size, 0: no journal). Used by cs1550mkfs, and at mount on a
+    freshly dd'ed image. Writes go straight to the disk, so nothing may be
+    cached yet.
+
+    RETURNS:    0           SUCCESS
+                -EINVAL     nblocks is too small or too large, bsize is not a block size,
+                            or jblocks is too small (or leaves no room for data)
+                -ENOMEM     out of memory
+                -errno      a write failed
+*/
+int super_format(long nblocks, long bsize, int format, long jblocks) {
+
+    if ((nblocks < MIN_BLOCKS) || (nblocks > INT_MAX)) { return -EINVAL; }     // ERROR: no room, or too many blocks
+    if (!super_block_size_ok(bsize)) { return -EINVAL; }                        // ERROR: not a block size
+
+    if (jblocks < 0) { jblocks = super_default_journal(nblocks, bsize); }
+    if ((jblocks != 0) && (jblocks < JOURNAL_MIN_BLOCKS)) { return -EINVAL; }   // ERROR: journal too small
+
+    struct cs1550_superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.nMagic = CS1550_MAGIC;
+    sb.nVersion = CS1550_SUPER_VERSION;
+    sb.nBlockSize = bsize;
+    sb.nBlocks = nblocks;
+    sb.nRootBlock = 1;
+    sb.nBitmapBlock = 2;
+    sb.nBitmapBlocks = 1 + ((nblocks / 8) / bsize);                // one bit per block, rounded up
+    sb.nJournalBlock = (jblocks > 0) ? sb.nBitmapBlock + sb.nBitmapBlocks : 0;
+    sb.nJournalBlocks = jblocks;
+    sb.nDataBlock = sb.nBitmapBlock + sb.nBitmapBlocks + jblocks;
+    sb.nFormat = format;
+
+    if (sb.nDataBlock >= nblocks) { return -EINVAL; }               // ERROR: no room left for data
+
+    // the bitmap: superblock, root and the bitmap itself are USED
+    char *bitmap = (char*)calloc(sb.nBitmapBlocks, bsize);
+    char *root = (char*)calloc(1, bsize);                           // no directories yet
+    char *journal = (char*)calloc(jblocks + 1, bsize);              // all zeros: an empty log (see cs1550journal.c)
+    if ((bitmap == NULL) || (root == NULL) || (journal == NULL)) {
+        free(bitmap);
+        free(root);
+        free(journal);
+        return -ENOMEM;                                             // ERROR: out of memory
+    }
+
+    long i;
+    for (i = 0; i < sb.nDataBlock; i++) {
+        bitmap[i / 8] |= (1 << (i % 8));
+    }
+
+    int status = disk_write(bitmap, sb.nBitmapBlocks * bsize, (off_t)sb.nBitmapBlock * bsize);
+    if (status == 0) { status = disk_write(root, bsize, (off_t)sb.nRootBlock * bsize); }
+    if ((status == 0) && (jblocks > 0)) {
+        status = disk_write(journal, jblocks * bsize, (off_t)sb.nJournalBlock * bsize);
+    }
+    if (status == 0) { status = disk_write(&sb, sizeof(sb), 0); }  // last: the image is only valid once this is there
+
+    free(bitmap);
+    free(root);
+    free(journal);
+
+    return status;
+}
+
+/*
+    Rewrites the superblock of an image made before this version in this
+    version's layout: the fields added since are zero either way. Done at
+    mount, before the journal is in use, so that a build which would not
+    know what to make of the orphan lists (or of a journal that logs the
+    superblock, or of a hole in a file) refuses the image instead of
+    leaking its blocks, or writing into block 0 for a hole. Since that
+    locks older builds out, it is only done when allow is set (the mount
+    asked for it with '-o upgrade'); otherwise the image is refused.
+    Images without a superblock are left alone.
+
+    RETURNS:    0                   SUCCESS (or nothing to do)
+                -EPROTONOSUPPORT    an older superblock, and allow is not set
+                -errno              the write or the sync failed
+*/
+int super_upgrade(int allow) {
+
+    if ((super.nMagic != CS1550_MAGIC) || (super.nVersion == CS1550_SUPER_VERSION)) { return 0; }
+    if (!allow) { return -EPROTONOSUPPORT; }                        // ERROR: not without being asked to
+
+    super.nVersion = CS1550_SUPER_VERSION;
+
+    int status = disk_write(&super, sizeof(super), 0);
+    if (status == 0) { status = disk_sync(); }
+
+    return status;
+}
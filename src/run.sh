@@ -4,6 +4,6 @@ fusermount -u testmount
 make
 rm .disk
 rm -r testmount
-dd bs=1K count=5K if=/dev/zero of=.disk
+./cs1550mkfs -s 5M .disk
 mkdir testmount
 ./cs1550 -d testmount
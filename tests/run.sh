@@ -0,0 +1,19 @@
+#!/bin/bash
+# Runs the stress test on fresh 64 MB images of both layouts, each with
+# pread/pwrite (with the default cache and a tiny one) and with mmap.
+# Build first with `make`, and cs1550mkfs in ../src (or use `make check`).
+cd "$(dirname "$0")" || exit 1
+tests=$(pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+status=0
+for layout in chain extents; do
+    for run in "pread" "pread 16" "mmap"; do
+        rm -f "$work/.disk"
+        ../src/cs1550mkfs -s 64M -f $layout "$work/.disk" >/dev/null || exit 1
+        (cd "$work" && "$tests/stress" $run) || status=1
+    done
+done
+
+exit $status
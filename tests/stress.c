@@ -0,0 +1,425 @@
+/*
+    Multi-threaded stress test
+
+    Runs the FUSE handlers of cs1550.c straight from several threads, the
+    way libfuse's multi-threaded loop calls them, on the .disk image in the
+    current directory (see run.sh). NTHREADS threads each work in a
+    directory of their own and in one they all share: they create files,
+    append to them in turns with the others while stat'ing and reading
+    across them, and read everything back. NHANDLES more threads do the
+    same through open file handles, as the kernel does for a process that
+    opens a file: each opens its files once and writes and reads through
+    the handles (every other time through write_buf and read_buf, as
+    libfuse does when it splices), and reads the files of another such
+    thread through handles of its own. At the end every thread deletes
+    some of its files and truncates others, a handle thread while the
+    file is still open.
+
+    The image is then remounted, what the deletes left behind is
+    reclaimed, and it is checked:
+
+        - every file reads back what was written to it;
+        - no deleted file is left;
+        - every block belongs to exactly one directory or file, and is
+          marked USED in the bitmap;
+        - no other block is USED.
+
+    USAGE:      stress [pread|mmap] [cache blocks]
+    RETURNS:    0 when the image is consistent, 1 otherwise
+*/
+#define main cs1550_main                /* cs1550.c brings its own main() */
+#include "cs1550.c"
+#undef main
+
+#define NTHREADS    8                   /* threads working by path */
+#define NHANDLES    4                   /* threads working through open handles */
+#define NFILES      10                  /* files in each path thread's directory */
+#define HFILES      4                   /* files in each handle thread's directory */
+#define NSHARED     6                   /* files each path thread makes in /shared */
+#define ROUNDS      30                  /* appends to each file */
+#define CHUNK       1000                /* bytes in each append */
+
+static int failed = 0;                  /* set by any thread that found a problem (atomic) */
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "stress: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+
+/*
+    The byte at offset i of file f of thread t (handle threads count from
+    NTHREADS on).
+*/
+static char pattern(int t, int f, long i) {
+    return (char)(t * 31 + f * 7 + i);
+}
+
+
+/*
+    Is file f of thread t deleted (and its twin in /shared truncated) by
+    the thread before it finishes? For a handle thread, only its first
+    file is, while it is still open.
+*/
+static int deleted(int t, int f) {
+    return (t < NTHREADS) ? (((t + f) % 3) == 0) : (f == 0);
+}
+
+
+/*
+    Checks that got holds the first size bytes of file f of thread t.
+*/
+static int matches(const char *got, int t, int f, long size) {
+
+    long i;
+    for (i = 0; i < size; i++) {
+        if (got[i] != pattern(t, f, i)) { return 0; }
+    }
+
+    return 1;
+}
+
+
+/*
+    Writes the size bytes of buf at offset of path through write_buf, as
+    libfuse does when the request arrives spliced into a pipe: buf goes
+    into the pipe, and the pipe is handed over.
+
+    RETURNS:    what cs1550_write_buf() did
+*/
+static int write_through_pipe(const char *path, const char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    int fds[2];
+    if (pipe(fds) != 0) { return -errno; }
+    int res = -EIO;
+    if (write(fds[1], buf, size) == (ssize_t)size) {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+        src.buf[0].flags = FUSE_BUF_IS_FD;
+        src.buf[0].fd = fds[0];
+        res = cs1550_write_buf(path, &src, offset, fi);
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return res;
+}
+
+
+/*
+    Reads up to size bytes at offset of path into got through read_buf,
+    copying out of whatever buffers (memory or '.disk') it returns.
+
+    RETURNS:    the number of bytes read, or what cs1550_read_buf() failed with
+*/
+static long read_through_buf(const char *path, char *got, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src;
+    int res = cs1550_read_buf(path, &src, size, offset, fi);
+    if (res != 0) { return res; }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = got;
+    long copied = fuse_buf_copy(&dst, src, 0);
+
+    size_t i;
+    for (i = 0; i < src->count; i++) { free(src->buf[i].mem); }
+    free(src);
+
+    return copied;
+}
+
+
+/*
+    One path thread's work; arg is its number.
+*/
+static void *worker(void *arg) {
+
+    int t = (int)(long)arg;
+    char path[64];
+    char buf[CHUNK];
+    static __thread char got[ROUNDS * CHUNK];
+    int f, k;
+    long i;
+
+    snprintf(path, sizeof(path), "/t%d", t);
+    CHECK(cs1550_mkdir(path, 0755) == 0);
+
+    for (f = 0; f < NFILES; f++) {
+        snprintf(path, sizeof(path), "/t%d/f%d", t, f);
+        CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+        if (f < NSHARED) {
+            snprintf(path, sizeof(path), "/shared/t%df%d", t, f);
+            CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+        }
+    }
+
+    // appends in turns with the other threads, with stats and reads of files being written
+    for (k = 0; k < ROUNDS; k++) {
+        for (f = 0; f < NFILES; f++) {
+            for (i = 0; i < CHUNK; i++) { buf[i] = pattern(t, f, (long)k * CHUNK + i); }
+
+            snprintf(path, sizeof(path), "/t%d/f%d", t, f);
+            CHECK(cs1550_write(path, buf, CHUNK, (off_t)k * CHUNK, NULL) == CHUNK);
+
+            if (f < NSHARED) {
+                snprintf(path, sizeof(path), "/shared/t%df%d", t, f);
+                CHECK(cs1550_write(path, buf, 300, (off_t)k * 300, NULL) == 300);
+            }
+
+            struct stat st;
+            CHECK(cs1550_getattr(path, &st) == 0);
+            cs1550_read("/t0/f0", got, 500, 0, NULL);           // thread 0 may still be writing it
+        }
+    }
+
+    for (f = 0; f < NFILES; f++) {
+        snprintf(path, sizeof(path), "/t%d/f%d", t, f);
+        CHECK(cs1550_read(path, got, sizeof(got), 0, NULL) == ROUNDS * CHUNK);
+        CHECK(matches(got, t, f, ROUNDS * CHUNK));
+    }
+
+    // and take some of it away again
+    for (f = 0; f < NFILES; f++) {
+        if (!deleted(t, f)) { continue; }
+        snprintf(path, sizeof(path), "/t%d/f%d", t, f);
+        CHECK(cs1550_truncate(path, CHUNK / 2) == 0);
+        CHECK(cs1550_unlink(path) == 0);
+        if (f < NSHARED) {
+            snprintf(path, sizeof(path), "/shared/t%df%d", t, f);
+            CHECK(cs1550_truncate(path, 0) == 0);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+    One handle thread's work; arg is its number (from NTHREADS on).
+*/
+static void *handle_worker(void *arg) {
+
+    int t = (int)(long)arg;
+    int other = NTHREADS + (t - NTHREADS + 1) % NHANDLES;     // the handle thread whose files it reads
+    char path[64];
+    char buf[CHUNK];
+    static __thread char got[ROUNDS * CHUNK];
+    struct fuse_file_info fi[HFILES], theirs;
+    int f, k;
+    long i;
+
+    snprintf(path, sizeof(path), "/h%d", t);
+    CHECK(cs1550_mkdir(path, 0755) == 0);
+
+    for (f = 0; f < HFILES; f++) {
+        snprintf(path, sizeof(path), "/h%d/f%d", t, f);
+        CHECK(cs1550_mknod(path, S_IFREG | 0644, 0) == 0);
+        memset(&fi[f], 0, sizeof(fi[f]));
+        CHECK(cs1550_open(path, &fi[f]) == 0);
+    }
+
+    // appends through the handles, with reads of the other thread's files through handles of our own
+    for (k = 0; k < ROUNDS; k++) {
+        for (f = 0; f < HFILES; f++) {
+            for (i = 0; i < CHUNK; i++) { buf[i] = pattern(t, f, (long)k * CHUNK + i); }
+
+            // every other round as libfuse does it when it splices
+            snprintf(path, sizeof(path), "/h%d/f%d", t, f);
+            if (k % 2 == 0) {
+                CHECK(cs1550_write(path, buf, CHUNK, (off_t)k * CHUNK, &fi[f]) == CHUNK);
+                CHECK(cs1550_read(path, got, CHUNK, (off_t)k * CHUNK, &fi[f]) == CHUNK);
+            } else {
+                CHECK(write_through_pipe(path, buf, CHUNK, (off_t)k * CHUNK, &fi[f]) == CHUNK);
+                CHECK(read_through_buf(path, got, CHUNK, (off_t)k * CHUNK, &fi[f]) == CHUNK);
+            }
+            CHECK(memcmp(got, buf, CHUNK) == 0);
+
+            snprintf(path, sizeof(path), "/h%d/f%d", other, f);
+            memset(&theirs, 0, sizeof(theirs));
+            if (cs1550_open(path, &theirs) == 0) {                  // it may not have made it yet
+                cs1550_read(path, got, 2 * CHUNK, 0, &theirs);
+                cs1550_flush(path, &theirs);
+                cs1550_release(path, &theirs);
+            }
+        }
+    }
+
+    for (f = 0; f < HFILES; f++) {
+        snprintf(path, sizeof(path), "/h%d/f%d", t, f);
+        CHECK(cs1550_fsync(path, 0, &fi[f]) == 0);
+        CHECK(read_through_buf(path, got, sizeof(got), 0, &fi[f]) == ROUNDS * CHUNK);
+        CHECK(matches(got, t, f, ROUNDS * CHUNK));
+        if (deleted(t, f)) {
+            // the handle outlives the file, but no longer reaches it
+            CHECK(cs1550_unlink(path) == 0);
+            CHECK(cs1550_read(path, got, CHUNK, 0, &fi[f]) == -ENOENT);
+            CHECK(cs1550_write(path, buf, CHUNK, 0, &fi[f]) == -ENOENT);
+        }
+        CHECK(cs1550_flush(path, &fi[f]) == 0);
+        CHECK(cs1550_release(path, &fi[f]) == 0);
+    }
+
+    return NULL;
+}
+
+
+/*
+    Marks block index as owned, failing if something owns it already or
+    the bitmap has it FREE.
+*/
+static void own(char *owner, long index) {
+
+    CHECK((index >= super.nDataBlock) && (index < super.nBlocks));
+    if ((index < super.nDataBlock) || (index >= super.nBlocks)) { return; }
+
+    CHECK(!owner[index]);
+    CHECK(get_bit(index));
+    owner[index] = 1;
+}
+
+
+/*
+    Checks one file found in directory dname of the remounted image: its
+    contents, given how the threads wrote it.
+*/
+static void check_file(const char *dname, cs1550_file_directory *file) {
+
+    static char got[ROUNDS * CHUNK];
+    char path[64];
+    int t, n;
+
+    if ((sscanf(dname, "t%d", &t) == 1) || (sscanf(dname, "h%d", &t) == 1)) {
+        CHECK(sscanf(file->fname, "f%d", &n) == 1);
+        CHECK(!deleted(t, n) && (file->fsize == ROUNDS * CHUNK));
+        snprintf(path, sizeof(path), "/%s/f%d", dname, n);
+        CHECK(cs1550_read(path, got, sizeof(got), 0, NULL) == ROUNDS * CHUNK);
+        CHECK(matches(got, t, n, ROUNDS * CHUNK));
+    } else {
+        CHECK(sscanf(file->fname, "t%df%d", &t, &n) == 2);
+        CHECK(file->fsize == (size_t)(deleted(t, n) ? 0 : ROUNDS * 300));
+    }
+}
+
+
+/*
+    Walks every directory and file of the mounted image, checking that
+    the files hold what the threads left in them and that their blocks
+    account for exactly the USED blocks of the bitmap.
+
+    RETURNS:    the number of files found
+*/
+static int check_image(void) {
+
+    char *owner = (char*)calloc(super.nBlocks, 1);
+    CHECK(owner != NULL);
+    if (owner == NULL) { return 0; }
+
+    int files = 0;
+    long root_block = super.nRootBlock;
+    while (root_block > 0) {
+        cs1550_root_directory *root = get_root_block(root_block);
+        CHECK(root != NULL);
+        if (root == NULL) { break; }
+        if (root_block != super.nRootBlock) { own(owner, root_block); }
+
+        int d;
+        for (d = 0; d < root->nDirectories; d++) {
+            long dir_block = root->directories[d].nStartBlock;
+            while (dir_block > 0) {
+                own(owner, dir_block);
+                cs1550_directory_entry *dir = get_directory(dir_block);
+                CHECK(dir != NULL);
+                if (dir == NULL) { break; }
+
+                int f;
+                for (f = 0; f < dir->nFiles; f++) {
+                    cs1550_file_directory *file = &dir->files[f];
+                    files++;
+
+                    struct cs1550_block_map *bmap = get_block_map(file->nStartBlock, disk_format == CS1550_FORMAT_EXTENTS);
+                    long e, b;
+                    if (bmap->isExtents) {
+                        for (e = 0; e < bmap->nIndexBlocks; e++) { own(owner, bmap->index_blocks[e]); }
+                    }
+                    for (e = 0; e < bmap->nExtents; e++) {
+                        if (bmap->extents[e].nStartBlock == BLOCK_MAP_HOLE) { continue; }
+                        for (b = 0; b < bmap->extents[e].nBlocks; b++) {
+                            own(owner, bmap->extents[e].nStartBlock + b);
+                        }
+                    }
+                    CHECK(bmap->nBlocks >= (long)((file->fsize + block_payload() - 1) / block_payload()));
+                    put_block_map(bmap);
+
+                    check_file(root->directories[d].dname, file);
+                }
+
+                dir_block = DIR_NEXT(dir);
+                put_block(dir);
+            }
+        }
+
+        root_block = ROOT_NEXT(root);
+        put_block(root);
+    }
+
+    // nothing USED that nobody owns: what was deleted has all been freed
+    long index, leaked = 0;
+    for (index = map_first; index < map_end; index++) {
+        if (get_bit(index) && !owner[index]) { leaked++; }
+    }
+    CHECK(leaked == 0);
+    if (leaked != 0) { fprintf(stderr, "stress: %ld blocks USED but owned by nothing\n", leaked); }
+
+    free(owner);
+
+    return files;
+}
+
+
+int main(int argc, char *argv[])
+{
+    options.use_mmap = (argc > 1) && (strcmp(argv[1], "mmap") == 0);
+    if (argc > 2) { options.cache_blocks = atol(argv[2]); }
+
+    cs1550_init(NULL);
+    CHECK(cs1550_mkdir("/shared", 0755) == 0);
+
+    pthread_t threads[NTHREADS + NHANDLES];
+    long t;
+    for (t = 0; t < NTHREADS; t++) {
+        pthread_create(&threads[t], NULL, worker, (void*)t);
+    }
+    for (; t < NTHREADS + NHANDLES; t++) {
+        pthread_create(&threads[t], NULL, handle_worker, (void*)t);
+    }
+    for (t = 0; t < NTHREADS + NHANDLES; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    cs1550_destroy(NULL);
+
+    // remount, as from a fresh process
+    int i;
+    for (i = 0; i < BLOCK_MAP_BUCKETS; i++) { block_maps[i] = NULL; }
+    free(map);
+    map = NULL;
+    cs1550_init(NULL);
+
+    reclaim_space(super.nBlocks);           // free whatever the deletes left on the lists
+    journal_commit();
+    int files = check_image();
+    cs1550_destroy(NULL);
+
+    const char *mode = options.use_mmap ? "mmap" : "pread";
+    const char *layout = (disk_format == CS1550_FORMAT_EXTENTS) ? "extents" : "chain";
+    if (failed) {
+        printf("stress FAILED (%s, %s)\n", mode, layout);
+        return 1;
+    }
+    printf("stress OK (%s, %s) directories=%d files=%d\n", mode, layout, NTHREADS + NHANDLES + 1, files);
+
+    return 0;
+}